@@ -68,5 +68,28 @@ typedef enum {
   CLBufferTypeRead
 } CLBufferType;
 
+// What a buffer holds.  Only used to break down the device memory accounting
+// (see OpenCLContext::getMemoryStats()).
+typedef enum {
+  CLBufferTagOther,        // Untagged
+  CLBufferTagWeights,      // Model parameters
+  CLBufferTagActivations,  // Stage inputs and outputs
+  CLBufferTagScratch,      // Temporaries (ie im2col columns, staging buffers)
+  CLBufferTagCount
+} CLBufferTag;
+
+// How a kernel accesses one of its arguments (parsed from the kernel
+// signature: a "const __global" pointer is read-only).
+typedef enum {
+  CLArgAccessNone,  // Not a memory object (ie a scalar or __local memory)
+  CLArgAccessRead,
+  CLArgAccessReadWrite
+} CLArgAccess;
+
+// A temporary file name next to filename, unique to this process and call.
+// Files are written there and then renamed over filename, so that other
+// processes never see them half written.
+std::string UniqueTempFilename(const std::string& filename);
+
 }  // namespace jcl
 
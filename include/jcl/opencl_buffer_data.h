@@ -5,32 +5,89 @@
 //
 //  class to encapsulate contiguous chunks of OpenCL buffer data.
 //
+//  Buffers allocated through OpenCLContext::allocateBuffer() may come from
+//  (and are returned to) the context's OpenCLBufferPool, in which case the
+//  underlying cl::Buffer can be larger than nelems() (see capacity()).
+//
+//  host_visible buffers are allocated with CL_MEM_ALLOC_HOST_PTR (ie pinned
+//  host memory), which makes mapping them (see OpenCLContext::mapBuffer())
+//  cheap and transfers from them fast.
+//
+//  Every buffer is accounted for in its context's OpenCLMemoryCounters (see
+//  OpenCLContext::getMemoryStats()).  A buffer counts for its capacity()
+//  from construction to destruction, on the device it was allocated for and
+//  under its tag (see setTag()).  Sub-buffers alias their parent, so they
+//  don't count.  Buffers sitting in the pool don't count either (see
+//  OpenCLBufferPoolStats for those).  Images (see opencl_image_data.h) are
+//  counted as buffers.
+//
 
 #pragma once
 
 #include <memory>
 #include <mutex>
+#include <vector>
 
 #include "jcl/cl_include.h"
-
-#if defined(DEBUG) || defined(_DEBUG)
-#define TRACK_ALLOCATIONS
-#endif
+#include "jcl/opencl_buffer_pool.h"
+#include "jcl/opencl_memory_stats.h"
 
 namespace jcl {
 
-class OpenCLBufferData {
+class OpenCLContext;
+
+// Outstanding commands on a buffer.  Only used with out-of-order command
+// queues (see OpenCLContext::init()), where it's used to build the event wait
+// list of the next command that touches the buffer.  Sub-buffers share the
+// events of their parent (ie the whole allocation is tracked as one unit).
+// Several threads may enqueue commands on the same buffer (ie DataParallel
+// replicas reading one input), so the events are guarded by lock.
+struct OpenCLBufferEvents {
+  mutable std::mutex lock;
+  cl::Event last_write;          // Last command that wrote to the buffer
+  std::vector<cl::Event> reads;  // Commands that read it since last_write
+};
+
+class OpenCLBufferData
+    : public std::enable_shared_from_this<OpenCLBufferData> {
  public:
-  OpenCLBufferData(const CLBufferType type, const uint32_t nelems,
-                   cl::Context& context);
+  // The buffer is charged to device_index in counters.
+  OpenCLBufferData(const CLBufferType type, const uint64_t nelems,
+                   cl::Context& context,
+                   const std::shared_ptr<OpenCLMemoryCounters>& counters,
+                   const uint32_t device_index,
+                   const bool host_visible = false,
+                   const CLBufferTag tag = CLBufferTagOther);
+  // Pooled version: reuse a cached buffer of the given capacity if the pool
+  // has one, and hand the buffer back to the pool on destruction (if the pool
+  // is still alive).
+  OpenCLBufferData(const CLBufferType type, const bool host_visible,
+                   const uint64_t nelems, const uint64_t capacity,
+                   cl::Context& context,
+                   const std::shared_ptr<OpenCLBufferPool>& pool,
+                   const std::shared_ptr<OpenCLMemoryCounters>& counters,
+                   const uint32_t device_index,
+                   const CLBufferTag tag = CLBufferTagOther);
   ~OpenCLBufferData();
 
   // nelems_allocated : total allocation of all active buffers.
   cl::Buffer& buffer();
   const cl::Buffer& buffer() const;
   cl_mem& mem();  // Same as buffer() above, but return the underlining c-object
-  uint32_t nelems() const { return nelems_; }
+  uint64_t nelems() const { return nelems_; }
+  // Number of elements actually allocated (>= nelems()).
+  uint64_t capacity() const { return capacity_; }
+  const std::shared_ptr<OpenCLBufferEvents>& events() const { return events_; }
   uint32_t type() const { return type_; }
+  bool host_visible() const { return host_visible_; }
+  // The host pointer while the buffer is mapped, nullptr otherwise.
+  void* mapped_ptr() const { return mapped_ptr_; }
+  CLBufferTag tag() const { return tag_; }
+  // Move the buffer's bytes to another tag in the accounting.
+  void setTag(const CLBufferTag tag);
+
+  // The device the buffer is charged to in the memory accounting.
+  uint32_t device_index() const { return device_index_; }
 
   // Create a buffer object that is a index into a sub-set of the current
   // buffer. This uses clCreateSubBuffer, which is a driver call, so the
@@ -38,20 +95,40 @@ class OpenCLBufferData {
   // fast). I *think* it's OK to call this function a lot, but you should
   // definitely test it to make sure the driver isn't leaking memory or
   // behaving badly.
-  std::shared_ptr<OpenCLBufferData> createSubBuffer(const uint32_t nelems,
-                                                    const uint32_t offset);
+  std::shared_ptr<OpenCLBufferData> createSubBuffer(const uint64_t nelems,
+                                                    const uint64_t offset);
 
  private:
-  const uint32_t nelems_;  // ie width * height * feats
+  const uint64_t nelems_;  // ie width * height * feats
+  const uint64_t capacity_;
   const CLBufferType type_;
+  const bool host_visible_;
   cl::Buffer buffer_;
+  void* mapped_ptr_;
+  bool mapped_for_write_;
+  std::weak_ptr<OpenCLBufferPool> pool_;  // Empty if not pooled
+  // Travels with the cl::Buffer through the pool, so that a recycled buffer
+  // still waits for the commands of its previous owner.
+  std::shared_ptr<OpenCLBufferEvents> events_;
+  // Sub-buffers keep their parent alive, so that the parent storage isn't
+  // recycled by the pool while it is still aliased.
+  std::shared_ptr<OpenCLBufferData> parent_;
+  CLBufferTag tag_;
+  // Memory accounting (counters_ is null for sub-buffers).
+  std::shared_ptr<OpenCLMemoryCounters> counters_;
+  uint32_t device_index_;
+  uint64_t accounted_bytes_;
 
   static cl_mem_flags getFlagsFromBufferType(CLBufferType type);
+  cl_mem_flags allocFlags() const;  // Flags used to create buffer_
+
+  friend class OpenCLContext;  // For the map / unmap bookkeeping.
 
   // Private constructor for wrapping an already created cl::Buffer object.
   // This constructor is used only when creating sub-buffers.
-  OpenCLBufferData(const CLBufferType type, const uint32_t nelems,
-                   cl::Buffer buffer);
+  OpenCLBufferData(const CLBufferType type, const uint64_t nelems,
+                   cl::Buffer buffer,
+                   const std::shared_ptr<OpenCLBufferData>& parent);
 
   // Non-copyable, non-assignable.
   OpenCLBufferData(const OpenCLBufferData&) = delete;
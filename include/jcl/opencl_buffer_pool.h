@@ -0,0 +1,116 @@
+//
+//  opencl_buffer_pool.h
+//
+//  Caching allocator for OpenCL buffers.  This is an internal class used by
+//  OpenCLContext::allocateBuffer() and shouldn't be used directly.
+//
+//  When an OpenCLBufferData that came from the pool is destroyed, its
+//  cl::Buffer is handed back to the pool instead of being released to the
+//  driver, and the next allocation with the same memory flags and size class
+//  reuses it.
+//  Requests are rounded up to a size class (4 classes per power of two, so at
+//  most 25% of the memory is wasted), which lets slightly different tensor
+//  sizes (ie variable resolution inputs) share storage.
+//
+//  Cached buffers are kept per (releasing thread, device the buffer was
+//  allocated for) and are only handed out again for that same pair: a
+//  thread has one in-order queue per device, so any work it still has
+//  pending on the buffer completes before the new owner touches it.  With
+//  out-of-order queues the buffer's OpenCLBufferEvents are recycled along
+//  with it, which gives the same guarantee.  When a thread exits its queues
+//  are finished (see OpenCLContext::ThreadStreams) and its buffers move to a
+//  shared list per device, which any thread can reuse.  Buffers released by
+//  threads that never used the context go to the shared list directly.
+//  This relies on the usual OpenCL rule for sharing a buffer between queues:
+//  a thread that hands a buffer to another one (or lets it release the
+//  buffer) must first wait for its own work on it (ie with sync()).
+//
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include "jcl/cl_include.h"
+
+namespace jcl {
+
+struct OpenCLBufferEvents;
+
+struct OpenCLBufferPoolStats {
+  uint64_t num_allocations;  // Number of buffers created by the driver
+  uint64_t num_reuses;       // Number of allocations served from the cache
+  uint64_t num_cached;       // Buffers currently sitting in the cache
+  uint64_t bytes_allocated;  // Driver memory owned by live + cached buffers
+  uint64_t bytes_cached;     // Driver memory sitting in the cache
+};
+
+class OpenCLBufferPool {
+ public:
+  OpenCLBufferPool();
+  ~OpenCLBufferPool();
+
+  // Look for a cached buffer for device_index with the given memory flags
+  // and capacity (which should be a size class, see sizeClass()), released
+  // by the calling thread or from the shared list.  Returns false on a miss,
+  // in which case the caller is expected to create the buffer itself.  The
+  // buffer's outstanding events are handed back along with it.
+  bool acquire(const uint32_t device_index, const cl_mem_flags flags,
+               const uint64_t capacity, cl::Buffer& buffer,
+               std::shared_ptr<OpenCLBufferEvents>& events);
+  // Hand a buffer back to the pool.  If the pool is disabled the buffer is
+  // released to the driver.
+  void release(const uint32_t device_index, const cl_mem_flags flags,
+               const uint64_t capacity, cl::Buffer& buffer,
+               const std::shared_ptr<OpenCLBufferEvents>& events);
+
+  // A thread (see OpenCLContext::threadId()) got a stream in the context /
+  // exited, after its queues were finished.
+  void addThread(const uint64_t thread_id);
+  void removeThread(const uint64_t thread_id);
+
+  // Release cached buffers back to the driver until at most max_cached_bytes
+  // remain in the cache (largest buffers are released first).
+  void trim(const uint64_t max_cached_bytes);
+
+  void setEnabled(const bool enabled);
+  bool enabled();
+  OpenCLBufferPoolStats stats();
+
+  // Round nelems up to its size class.
+  static uint64_t sizeClass(const uint64_t nelems);
+
+ private:
+  struct Entry {
+    cl::Buffer buffer;
+    std::shared_ptr<OpenCLBufferEvents> events;
+  };
+  // (flags, capacity) -> cached buffers
+  typedef std::map<std::pair<cl_mem_flags, uint64_t>, std::vector<Entry>>
+      FreeList;
+  // The free lists by (thread id, device index).  Thread id 0 holds the
+  // shared lists.
+  typedef std::pair<uint64_t, uint32_t> Owner;
+  static const uint64_t kSharedThread = 0;
+
+  std::mutex lock_;
+  bool enabled_;
+  std::map<Owner, FreeList> free_lists_;
+  std::unordered_set<uint64_t> threads_;  // Threads with a stream
+  OpenCLBufferPoolStats stats_;
+
+  bool acquireFrom(const Owner& owner, const cl_mem_flags flags,
+                   const uint64_t capacity, cl::Buffer& buffer,
+                   std::shared_ptr<OpenCLBufferEvents>& events);
+
+  static uint64_t bytes(const uint64_t capacity);
+
+  // Non-copyable, non-assignable.
+  OpenCLBufferPool(const OpenCLBufferPool&) = delete;
+  OpenCLBufferPool& operator=(const OpenCLBufferPool&) = delete;
+};
+
+};  // namespace jcl
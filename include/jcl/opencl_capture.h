@@ -0,0 +1,76 @@
+//
+//  opencl_capture.h
+//
+//  A recorded sequence of commands (see OpenCLContext::beginCapture()) that
+//  can be replayed with OpenCLContext::replay().
+//
+//  Every kernel launch is recorded into its own OpenCLKernel, with a
+//  snapshot of the arguments that were bound at launch time.  So replaying a
+//  launch is just the enqueue: no program lookups, no clSetKernelArg calls
+//  and none of the host side logic that produced the launch.  Other commands
+//  (ie clBLAS calls and buffer copies) are recorded as closures that repeat
+//  the original call.  Copies get the buffers they use passed back to them on
+//  replay, so those can be rebound too.
+//
+//  The capture holds references to every buffer it uses, so they stay alive
+//  (and out of the buffer pool) until the capture is destroyed.
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "jcl/cl_include.h"
+#include "jcl/opencl_kernel.h"
+
+namespace jcl {
+
+class OpenCLBufferData;
+
+class OpenCLCapture {
+ public:
+  OpenCLCapture();
+  ~OpenCLCapture();
+
+  // False if a command that can't be replayed (a host read, write or map) was
+  // issued while capturing.  Invalid captures can't be replayed.
+  bool valid() const { return valid_; }
+  uint32_t numCommands() const { return (uint32_t)commands_.size(); }
+
+  typedef std::vector<std::shared_ptr<OpenCLBufferData>> Buffers;
+
+  // Bind `to` wherever a recorded command had `from` bound (ie to feed a new
+  // input buffer to a captured model).  The commands must only use the first
+  // used_nelems elements of `from` (all of it if 0), which `to` must hold.
+  // Only the buffers passed to OpenCLContext::captureCommand() are rebound in
+  // its closures (ie clBLAS calls): ones that a closure captured by itself
+  // can't be.
+  void rebindBuffer(const std::shared_ptr<OpenCLBufferData>& from,
+                    const std::shared_ptr<OpenCLBufferData>& to,
+                    const uint64_t used_nelems = 0);
+
+ private:
+  friend class OpenCLContext;
+
+  struct Command {
+    uint32_t device_index;
+    // Kernel launches
+    KernelHandle kernel;
+    cl::NDRange global_work;
+    cl::NDRange local_work;
+    bool blocking;
+    // Everything else
+    Buffers buffers;  // Passed to function on replay
+    std::function<void(const Buffers& buffers)> function;
+  };
+  std::vector<Command> commands_;
+  bool valid_;
+
+  // Non-copyable, non-assignable.
+  OpenCLCapture(const OpenCLCapture&) = delete;
+  OpenCLCapture& operator=(const OpenCLCapture&) = delete;
+};
+
+};  // namespace jcl
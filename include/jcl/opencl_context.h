@@ -21,17 +21,38 @@
 // for (uint32_t i = 0; i < context.getNumDevices(); i++) {
 //   std::cout << i << ": " << context.getDeviceName(i) << std::endl;
 // }
+//
+// THREADING:
+// Each host thread that uses the context gets its own "stream": one command
+// queue per device plus its own copy of the legacy useKernel() state (the
+// current program / kernel and the kernel objects with their argument
+// bindings).  Therefore several threads can enqueue work concurrently
+// (ie on different model instances) without sharing a queue or clobbering
+// each other's kernel arguments.  Programs are compiled once and shared.
+// Note that sync() only waits for the calling thread's queue, and that a
+// KernelHandle should only be used by one thread at a time.
+// A thread's stream is released (after its queues are finished) when the
+// thread exits, so short-lived worker threads don't accumulate queues.
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <thread>
 #include <unordered_map>
 
 #include "jcl/cl_include.h"
 #include "jcl/math/math_types.h"  // for jcl::math::Int2 and Int3
 #include "jcl/opencl_buffer_data.h"
+#include "jcl/opencl_buffer_pool.h"
+#include "jcl/opencl_capture.h"
+#include "jcl/opencl_image_data.h"
 #include "jcl/opencl_kernel.h"
+#include "jcl/opencl_memory_stats.h"
 
 // RASSERT is a pretty hacky macro that will assert
 // on debug and crash on release. Used all throughout
@@ -62,23 +83,99 @@ namespace jcl {
 class OpenCLBufferData;
 class OpenCLProgram;
 
+// Device time of a kernel (from CL_PROFILING_COMMAND_START/END), aggregated
+// over all of its launches.  Times are in milliseconds.
+struct OpenCLKernelProfile {
+  std::string name;
+  uint64_t count;
+  double total;
+  double min;
+  double max;
+  double p99;
+};
+
+// Preprocessor defines used to specialize a program at compile time.  Each
+// entry is passed to the compiler as "-D name=value" (or "-D name" if value
+// is empty).  Ordered, so equal sets of defines name the same program.
+typedef std::map<std::string, std::string> OpenCLDefines;
+
+// A char* program and how it is compiled (see
+// OpenCLContext::buildProgramsCStr()).
+struct OpenCLProgramSource {
+  const char* kernel_c_str;
+  OpenCLDefines defines;
+  bool strict_float;
+};
+
+// How fast a device is expected to be (see OpenCLContext::scoreDevices()).
+struct OpenCLDeviceScore {
+  uint32_t platform_index;  // Index into cl::Platform::get()
+  cl_device_id id;
+  std::string platform_vendor;
+  std::string name;
+  CLDevice type;
+  uint32_t compute_units;  // CL_DEVICE_MAX_COMPUTE_UNITS
+  uint32_t clock_mhz;      // CL_DEVICE_MAX_CLOCK_FREQUENCY
+  uint64_t global_mem_bytes;
+  uint64_t local_mem_bytes;
+  // Measured throughput of the calibration kernel (0 if it wasn't run).
+  double calibration_gflops;
+  // Higher is faster.  Only comparable between scores from the same call.
+  double score;
+};
+
 class OpenCLContext {
  public:
   OpenCLContext();
   ~OpenCLContext();
 
+  // out_of_order: create CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE queues (if
+  // all devices support them) so that independent kernels can overlap.  Each
+  // buffer then tracks its last write (and the reads since) and every
+  // enqueue waits on exactly the events it depends on.  Only buffers bound
+  // as std::shared_ptr<OpenCLBufferData> are tracked.
+  // profiling: create CL_QUEUE_PROFILING_ENABLE queues and record the device
+  // time of every kernel launch (see getKernelProfile()).  This adds an event
+  // per launch, so it is off by default.
   void init(const CLDevice device_type, const CLVendor vendor_type,
-            const bool verbose_startup);
+            const bool verbose_startup, const bool out_of_order = false,
+            const bool profiling = false);
+  // Open a context on the platform of a scored device (see scoreDevices()).
+  // The context holds all of the platform's devices of the same type, use
+  // findDevice() to get the index of the scored device.
+  void init(const OpenCLDeviceScore& device, const bool verbose_startup,
+            const bool out_of_order = false, const bool profiling = false);
   static bool queryDeviceExists(const CLDevice device, const CLVendor vendor);
+  // Score every device of the given type, on every platform from the given
+  // vendor, best first.  Hosts often have several runtimes for the same
+  // hardware (ie pocl and the vendor's CPU runtime) and init() just takes
+  // the first platform that has a matching device.
+  // The score is the device's throughput (compute units x clock, or the
+  // measured GFLOP/s of a short calibration kernel if calibrate is set),
+  // scaled down for devices with too little global or local memory to run
+  // jtorch's kernels well.  Calibrating takes a few ms per device.
+  static std::vector<OpenCLDeviceScore> scoreDevices(
+      const CLDevice device, const CLVendor vendor,
+      const bool calibrate = true);
   // printDevices will print to std::cout all platforms and devices, but also
   // it will return the total number of available devices.
   static uint32_t printDevices();
 
   // Enumerate devices once the context is open
   uint32_t getNumDevices();
+  // The index of the device with this id, or -1 if it isn't in the context.
+  int32_t findDevice(const cl_device_id id) const;
   std::string getDeviceName(const uint32_t device_index);
 
   CLDevice getDeviceType(const uint32_t device_index);
+  // CL_DEVICE_HOST_UNIFIED_MEMORY (ie CPU devices and integrated GPUs).
+  bool hostUnifiedMemory(const uint32_t device_index) const {
+    return devices_host_unified_memory_[device_index];
+  }
+  // True if the device supports images (CL_DEVICE_IMAGE_SUPPORT) of this size
+  // (see allocateImage()).
+  bool supportsImage3D(const uint32_t device_index, const uint32_t width,
+                       const uint32_t height, const uint32_t depth) const;
   uint32_t getMaxWorkgroupSize(const uint32_t device_index);
   uint32_t getMaxWorkitemSize(const uint32_t device_index, const uint32_t dim);
 
@@ -88,24 +185,90 @@ class OpenCLContext {
   // first use, so we don't need to specify a device index when creating the
   // buffer, but we will have to specify it when calling a kernel or reading and
   // writing to the buffer.
-  std::shared_ptr<OpenCLBufferData> allocateBuffer(const CLBufferType type,
-                                                   const uint32_t nelems);
+  // Released buffers are recycled by a caching allocator (see
+  // opencl_buffer_pool.h), so repeatedly allocating tensors of similar size
+  // doesn't hit the driver.  Recycled buffers are NOT zeroed.
+  // host_visible: allocate with CL_MEM_ALLOC_HOST_PTR (pinned memory), for
+  // staging buffers or buffers that are mapped often.
+  // tag, device_index: what the buffer holds and the device it is meant for,
+  // for the memory accounting below.
+  std::shared_ptr<OpenCLBufferData> allocateBuffer(
+      const CLBufferType type, const uint64_t nelems,
+      const bool host_visible = false,
+      const CLBufferTag tag = CLBufferTagOther,
+      const uint32_t device_index = 0);
+  // Disabling the pool also releases all cached buffers.
+  void setBufferPoolEnabled(const bool enabled);
+  OpenCLBufferPoolStats getBufferPoolStats();
+  // Release cached (unused) buffers to the driver until at most
+  // max_cached_bytes remain in the pool.
+  void trimBufferPool(const uint64_t max_cached_bytes = 0);
+  // Device memory held by this context's live buffers and images on
+  // device_index: current and peak bytes, in total and per CLBufferTag (see
+  // opencl_memory_stats.h).  Peaks are tracked since init().  Together with
+  // the pool's bytes_cached (summed over all devices) this is everything
+  // allocated from the driver.  printMemoryStats() dumps the same numbers to
+  // std::cout.
+  OpenCLMemoryStats getMemoryStats(const uint32_t device_index);
+  void printMemoryStats(const uint32_t device_index);
+  // Start tracking the peaks from the current live bytes.
+  void resetPeakMemory(const uint32_t device_index);
   template <typename T>
-  void writeToBuffer(const T* data, const uint32_t data_sz,
+  void writeToBuffer(const T* data, const uint64_t data_sz,
                      const uint32_t device_index,
                      const std::shared_ptr<OpenCLBufferData> buffer,
                      const bool blocking);
   template <typename T>
-  void readFromBuffer(T* data, const uint32_t data_sz,
+  void readFromBuffer(T* data, const uint64_t data_sz,
                       const uint32_t device_index,
                       const std::shared_ptr<OpenCLBufferData> buffer,
                       const bool blocking);
+  // Map nelems elements of the buffer (starting at element offset) into host
+  // memory (blocking) for reading or for writing.  No kernel may use the
+  // buffer until it is unmapped again.  On devices that share memory with the
+  // host (see hostUnifiedMemory()) and for host_visible buffers this is
+  // zero-copy.
+  void* mapBuffer(const uint32_t device_index,
+                  const std::shared_ptr<OpenCLBufferData>& buffer,
+                  const bool write, const uint64_t nelems,
+                  const uint64_t offset = 0);
+  void unmapBuffer(const uint32_t device_index,
+                   const std::shared_ptr<OpenCLBufferData>& buffer);
+  // Copy nelems elements of src (starting at element src_offset) into dst
+  // (starting at element dst_offset).  Non-blocking.
+  void copyBuffer(const uint32_t device_index,
+                  const std::shared_ptr<OpenCLBufferData>& src,
+                  const std::shared_ptr<OpenCLBufferData>& dst,
+                  const uint64_t nelems, const uint64_t src_offset = 0,
+                  const uint64_t dst_offset = 0);
+  // Single channel float 3D images, for kernels that read through the texture
+  // cache (see opencl_image_data.h).  Check supportsImage3D() first.
+  std::shared_ptr<OpenCLImageData> allocateImage(
+      const uint32_t width, const uint32_t height, const uint32_t depth,
+      const CLBufferTag tag = CLBufferTagScratch,
+      const uint32_t device_index = 0);
+  // Copy dst->nelems() elements of src (starting at element src_offset, in
+  // x, y, z order) into dst.  Non-blocking.
+  void copyBufferToImage(const uint32_t device_index,
+                         const std::shared_ptr<OpenCLBufferData>& src,
+                         const uint64_t src_offset,
+                         const std::shared_ptr<OpenCLImageData>& dst);
 
   // Kernel setup and run
+  // useKernel / useKernelCStr select the "current" kernel, which is then used
+  // by setArg() and runKernel() below.  This is convenient for one-off
+  // launches, but every call hashes the kernel source (or filename) to find
+  // the program.
   void useKernel(const char* filename, const char* kernel_name,
                  const bool strict_float = false);
   void useKernelCStr(const char* kernel_c_str, const char* kernel_name,
                      const bool strict_float = false);
+  void useKernel(const char* filename, const char* kernel_name,
+                 const OpenCLDefines& defines,
+                 const bool strict_float = false);
+  void useKernelCStr(const char* kernel_c_str, const char* kernel_name,
+                     const OpenCLDefines& defines,
+                     const bool strict_float = false);
   void setArg(const uint32_t index,
               const std::shared_ptr<OpenCLBufferData>& buf);
   template <typename T>
@@ -121,39 +284,281 @@ class OpenCLContext {
   void runKernel(const uint32_t device_index, const uint32_t dim,
                  const uint32_t* global_work_size, const bool blocking);
 
-  void sync(const uint32_t device_index);  // Blocking until queue is empty
+  // Handle based kernel launch (the fast path).  Resolve the kernel ONCE
+  // (ie in a stage's init()), set its arguments with KernelHandle::setArg()
+  // and launch it with the runKernel overloads below.  Each handle has its own
+  // argument bindings, so two handles to the same kernel don't interfere.
+  // The handle must not outlive this context.
+  KernelHandle getKernel(const char* filename, const char* kernel_name,
+                         const bool strict_float = false);
+  KernelHandle getKernelCStr(const char* kernel_c_str, const char* kernel_name,
+                             const bool strict_float = false);
+  // Shape specialized versions: the program is compiled with the given
+  // defines (so kernels can use them as compile time constants, ie for loop
+  // bounds that should be unrolled).  Every distinct set of defines is
+  // compiled, cached and autotuned as a separate program.
+  KernelHandle getKernel(const char* filename, const char* kernel_name,
+                         const OpenCLDefines& defines,
+                         const bool strict_float = false);
+  KernelHandle getKernelCStr(const char* kernel_c_str, const char* kernel_name,
+                             const OpenCLDefines& defines,
+                             const bool strict_float = false);
+  // Cached kernels, for one-off launches that happen often (ie the tensor
+  // ops).  Reserve a slot per kernel variant once (ie in a function static)
+  // with newKernelSlot().  The first getCachedKernelCStr() with a slot on
+  // each thread resolves the kernel like getKernelCStr(), and later ones
+  // just return it, without hashing the source or taking a lock (the
+  // arguments are then ignored, so a slot must always be used with the same
+  // kernel).  The kernel belongs to the calling thread's stream (so other
+  // threads get their own) and is owned by the context.
+  static uint32_t newKernelSlot();
+  OpenCLKernel* getCachedKernelCStr(const uint32_t slot,
+                                    const char* kernel_c_str,
+                                    const char* kernel_name,
+                                    const OpenCLDefines& defines,
+                                    const bool strict_float = false);
+  // The "-D" compiler options for a set of defines.
+  static std::string definesString(const OpenCLDefines& defines);
+  // Build (or load from the program cache) the given programs ahead of time,
+  // on num_threads worker threads (0: one per hardware thread), so that the
+  // first getKernelCStr() / useKernelCStr() doesn't stall on the compiler.
+  // Programs that are already built are skipped.  Blocks until done.
+  void buildProgramsCStr(const std::vector<OpenCLProgramSource>& programs,
+                         const uint32_t num_threads = 0);
+  void runKernel(OpenCLKernel* kernel, const uint32_t device_index,
+                 const uint32_t dim, const uint32_t* global_work_size,
+                 const uint32_t* local_work_size, const bool blocking);
+  void runKernel(OpenCLKernel* kernel, const uint32_t device_index,
+                 const uint32_t dim, const uint32_t* global_work_size,
+                 const bool blocking);
 
-  // Get a mutable pointer to the command queue.
+  // Autotuned launch: the first time a kernel is launched with a given global
+  // work size on a given device, every legal local work size (plus the driver
+  // default) is benchmarked and the fastest one is used from then on.  The
+  // results are persisted if an autotune file is set (see below).
+  // The kernel is run several times while tuning, so it must produce the same
+  // output when run repeatedly with the same arguments (ie no accumulation
+  // into its output).
+  // default_local_size: the local size to use when autotuning is disabled
+  // (nullptr means the driver default).  If it is set, the driver default is
+  // not a candidate (ie for kernels that need an explicit local size).
+  // local_size_callback: called with every candidate local size before it is
+  // run (and with the final one), to set arguments that depend on it (ie
+  // __local buffers).
+  typedef std::function<void(const uint32_t* local_work_size)>
+      LocalSizeCallback;
+  void runKernelAutotuned(
+      OpenCLKernel* kernel, const uint32_t device_index, const uint32_t dim,
+      const uint32_t* global_work_size, const bool blocking,
+      const uint32_t* default_local_size = nullptr,
+      const LocalSizeCallback& local_size_callback = nullptr);
+  // Enabled by default.
+  void setAutotuneEnabled(const bool enabled) { autotune_enabled_ = enabled; }
+  bool autotuneEnabled() const { return autotune_enabled_; }
+  // Load previous autotune results from filename (if it exists) and save new
+  // results to it.  Entries are keyed by the program, kernel name, global work
+  // size, device name and driver version.  The file is rewritten (atomically)
+  // with one line per key each time a result is added, keeping the entries
+  // other processes saved since.  An empty string (the default) keeps the
+  // results in memory only.
+  void setAutotuneFile(const std::string& filename);
+  const std::string& getAutotuneFile() const { return autotune_file_; }
+  // Number of (kernel, global size, device) combinations benchmarked so far.
+  uint32_t getNumAutotuneRuns() const { return autotune_runs_; }
+
+  // Command capture (for work that is issued identically over and over, ie
+  // the forward pass of a model with a fixed input shape).  Between
+  // beginCapture() and endCapture() the calling thread's commands are
+  // executed as usual AND recorded, and replay() then re-issues the recorded
+  // commands without any of the host work that produced them (see
+  // opencl_capture.h).  Commands that aren't kernel launches or buffer
+  // copies (ie clBLAS calls) must be recorded with captureCommand().  Host
+  // reads, writes and maps can't be replayed and invalidate the capture.
+  void beginCapture();
+  std::unique_ptr<OpenCLCapture> endCapture();
+  bool capturing();
+  // Record a command: replaying it calls command again (on the replaying
+  // thread).  Does nothing if the calling thread isn't capturing.
+  void captureCommand(const uint32_t device_index,
+                      const std::function<void()>& command);
+  // Same, but replaying passes buffers (or the buffers they were rebound to,
+  // see OpenCLCapture::rebindBuffer()) back to command, which should use
+  // them instead of its own references.
+  void captureCommand(
+      const uint32_t device_index, const OpenCLCapture::Buffers& buffers,
+      const std::function<void(const OpenCLCapture::Buffers&)>& command);
+  void replay(OpenCLCapture* capture);
+
+  // Blocking until the calling thread's queue is empty
+  void sync(const uint32_t device_index);
+
+  // Get a mutable pointer to the calling thread's command queue.
   cl::CommandQueue* getQueue(uint32_t device_index) {
-    return &queues_[device_index];
+    return &stream()->queues[device_index];
   }
 
+  // Number of live host threads that have used this context.
+  uint32_t getNumStreams();
+  // A unique id for the calling thread (unlike std::thread::id, ids aren't
+  // reused after a thread exits).  Never 0.
+  static uint64_t threadId() { return thread_streams_.thread_id(); }
+
+  bool outOfOrderQueues() const { return out_of_order_; }
+  bool profilingEnabled() const { return profiling_; }
+  // Whether addEvent() below needs the command's completion event (otherwise
+  // there is no need to ask the driver for one).
+  bool needsEvents() const { return out_of_order_ || profiling_; }
+
+  // For commands that are enqueued on getQueue() outside of jcl (ie clBLAS).
+  // getWaitList() appends the events that a command reading inputs and
+  // writing outputs must wait on, and the command's completion event must
+  // then be passed to addEvent() (which takes ownership of it).  With
+  // in-order queues the wait list is always empty and, unless needsEvents(),
+  // the event may be null.  When profiling, the command's device time is
+  // recorded under profile_name.
+  // A command that may enqueue several kernels (and so returns the event of
+  // the last one) should also call beginProfiledCommand() right before it is
+  // enqueued, and pass the result to addEvent() as start.  When profiling,
+  // this enqueues a marker on the calling thread's queue and makes the wait
+  // list just that marker (which waits on everything the command had to).
+  // The command is then timed from the marker to its completion event, so
+  // every kernel is counted.  Returns null when not profiling.
+  void getWaitList(const std::vector<OpenCLBufferData*>& inputs,
+                   const std::vector<OpenCLBufferData*>& outputs,
+                   std::vector<cl_event>& wait_list);
+  cl_event beginProfiledCommand(const uint32_t device_index,
+                                std::vector<cl_event>& wait_list);
+  void addEvent(const std::vector<OpenCLBufferData*>& inputs,
+                const std::vector<OpenCLBufferData*>& outputs,
+                cl_event event, const char* profile_name = nullptr,
+                cl_event start = nullptr);
+
+  // Kernel profiling (only when the context was created with profiling).
+  // getKernelProfile() waits for all profiled launches (from every thread) to
+  // complete, and returns one entry per kernel name, most expensive (by total
+  // time) first.  printKernelProfile() dumps the same table to std::cout.
+  std::vector<OpenCLKernelProfile> getKernelProfile();
+  void printKernelProfile();
+  void resetKernelProfile();
+
   // devices_max_workgroup_size is the max possible, each kernel might have
   // a specific maximum.  Use this to grab the max size for the compiled
   // kernel.
   uint32_t queryMaxWorkgroupSizeForCurKernel(const uint32_t device_index);
 
+  // Persistent on-disk cache of compiled program binaries.  When a cache
+  // directory is set (it must already exist), programs are loaded with
+  // clCreateProgramWithBinary if a matching entry exists (same source, device
+  // name, driver version and build options), and otherwise they are built
+  // from source and the resulting binaries are written to the directory.
+  // An empty string (the default) disables the cache.  This only affects
+  // programs that haven't been compiled yet.
+  void setProgramCacheDir(const std::string& cache_dir);
+  const std::string& getProgramCacheDir() const { return program_cache_dir_; }
+  // Number of programs that were loaded from the on-disk cache.
+  uint32_t getNumProgramCacheHits() const { return program_cache_hits_; }
+  // Number of programs built (or loaded) so far.
+  uint32_t getNumPrograms();
+
   static std::string CLDeviceToString(const CLDevice device);
   static std::string CLVendorToString(const CLVendor vendor);
+  static std::string CLBufferTagToString(const CLBufferTag tag);
 
   // Get the cl_int error string
   static std::string getErrorString(const signed int err);
 
  private:
+  // Per host thread state.
+  struct Stream {
+    std::vector<cl::CommandQueue> queues;  // One per device
+    // Stored by (filename + kernel)
+    std::unordered_map<std::string, std::unique_ptr<OpenCLKernel>> kernels;
+    OpenCLProgram* cur_program;  // Not owned here
+    OpenCLKernel* cur_kernel;    // Not owned here (owned by kernels)
+    // By slot (see getCachedKernelCStr()), nullptr until first used.
+    std::vector<std::unique_ptr<OpenCLKernel>> cached_kernels;
+    std::unique_ptr<OpenCLCapture> capture;  // Non-null while capturing
+    // Profiling queues for autotune(), one per device, created on first use.
+    std::vector<cl::CommandQueue> tuning_queues;
+  };
+  // The calling thread's streams, by context, so that the common path doesn't
+  // need to take streams_lock_.  A thread rarely uses more than a couple of
+  // contexts, so this is a short list.  Contexts are identified by context_id
+  // and threads by thread_id, which are both unique per instance (unlike
+  // pointers and std::thread::id, which might be reused).  On thread exit the
+  // destructor releases the thread's streams from the contexts that are still
+  // alive.
+  class ThreadStreams {
+   public:
+    ThreadStreams();
+    ~ThreadStreams();
+
+    Stream* find(const uint64_t context_id) const {
+      for (const auto& entry : entries_) {
+        if (entry.first == context_id) {
+          return entry.second;
+        }
+      }
+      return nullptr;
+    }
+    void add(const uint64_t context_id, Stream* stream);
+    uint64_t thread_id() const { return thread_id_; }
+
+   private:
+    const uint64_t thread_id_;
+    std::vector<std::pair<uint64_t, Stream*>> entries_;
+  };
+  static thread_local ThreadStreams thread_streams_;
+  static std::atomic<uint64_t> next_thread_id_;
+  static std::atomic<uint64_t> next_context_id_;
+  static std::atomic<uint32_t> next_kernel_slot_;
+  const uint64_t context_id_;
+
   cl::Context context_;
   std::vector<cl::Device> devices_;
-  std::vector<cl::CommandQueue> queues_;
+  bool out_of_order_;
+  bool profiling_;
+
+  // Profiled launches are queued up until their events are resolved (on sync
+  // and when querying the profile), then their durations (in ms) are stored
+  // by kernel name.
+  struct ProfileEvent {
+    std::string name;
+    cl::Event event;
+    cl::Event start;  // If set, the span from its end to event's end is timed
+  };
+  std::mutex profile_lock_;
+  std::vector<ProfileEvent> profile_events_;
+  std::map<std::string, std::vector<float>> profile_samples_;
+
+  std::shared_ptr<OpenCLBufferPool> buffer_pool_;
+  std::shared_ptr<OpenCLMemoryCounters> memory_counters_;  // Set in init()
+
+  std::mutex streams_lock_;
+  std::unordered_map<uint64_t, std::unique_ptr<Stream>> streams_;  // By thread
 
   // Stored by filename, or in the case of char* kernel, it's 32bit hash.
+  std::mutex programs_lock_;
   std::unordered_map<std::string, std::unique_ptr<OpenCLProgram>> programs_;
-  // Stored by (filename + kernel)
-  std::unordered_map<std::string, std::unique_ptr<OpenCLKernel>> kernels_;
 
   static std::mutex context_lock_;
-  OpenCLProgram* cur_program_;  // Not owned here
-  OpenCLKernel* cur_kernel_;    // Now owned here
   std::vector<int> devices_max_workgroup_size_;
   std::vector<std::unique_ptr<uint32_t[]>> devices_max_workitem_size_;
+  std::vector<bool> devices_host_unified_memory_;
+  // Max image width, height and depth (all 0 without image support).
+  std::vector<std::vector<uint32_t>> devices_image3d_max_size_;
+  std::string program_cache_dir_;
+  uint32_t program_cache_hits_;
+
+  // Autotune results by key (see autotuneKey()).
+  struct AutotuneResult {
+    uint32_t local_work_size[3];  // All zero for the driver default
+  };
+  bool autotune_enabled_;
+  std::mutex autotune_lock_;
+  std::unordered_map<std::string, AutotuneResult> autotune_results_;
+  std::string autotune_file_;
+  std::atomic<uint32_t> autotune_runs_;
 
   static bool getPlatform(const CLDevice device, const CLVendor vendor,
                           cl::Platform& return_platform);
@@ -164,9 +569,65 @@ class OpenCLContext {
                                          const cl_device_type,
                                          std::vector<cl_device_id>& devices);
   void InitDevices(const CLDevice device, const bool verbose_startup);
-  void createCommandQueues(const bool verbose_startup);
-  void createContext(const CLDevice device, const CLVendor vendor,
+  Stream* stream() {
+    Stream* s = thread_streams_.find(context_id_);
+    return s != nullptr ? s : createStream();
+  }
+  Stream* createStream();
+  // Finish and drop the stream of an exiting thread (see ThreadStreams).
+  void releaseStream(const uint64_t thread_id);
+  void createContext(cl::Platform& platform, const CLDevice device,
                      const bool verbose_startup);
+  // init() once the platform is known (context_lock_ must be held).
+  void initPlatform(cl::Platform& platform, const CLDevice device,
+                    const bool verbose_startup, const bool out_of_order,
+                    const bool profiling);
+  OpenCLProgram* addProgram(const std::string& filename,
+                            std::unique_ptr<OpenCLProgram> program);
+  OpenCLProgram* getProgram(const char* filename, const bool strict_float,
+                            const std::string& defines);
+  OpenCLProgram* getProgramCStr(const char* kernel_c_str,
+                                const bool strict_float,
+                                const std::string& defines);
+  void setCurKernel(const char* kernel_name);
+  static void addWaitEvents(const OpenCLBufferEvents* events,
+                            const bool write,
+                            std::vector<cl::Event>& wait_list);
+  static void recordEvent(OpenCLBufferEvents* events, const bool write,
+                          const cl::Event& event);
+  void addProfileEvent(const std::string& name, const cl::Event& event,
+                       const cl::Event& start = cl::Event());
+  // Store the durations of the completed profile events (when wait is true,
+  // wait for all of them first).
+  void resolveProfileEvents(const bool wait);
+  // Add the entries of the autotune file to results (keeping the ones already
+  // there when keep_existing is true).
+  void readAutotuneFile(
+      std::unordered_map<std::string, AutotuneResult>& results,
+      const bool keep_existing);
+  // Rewrite the autotune file from autotune_results_ (autotune_lock_ must be
+  // held).
+  void writeAutotuneFile();
+  std::string autotuneKey(OpenCLKernel* kernel, const uint32_t device_index,
+                          const uint32_t dim,
+                          const uint32_t* global_work_size);
+  AutotuneResult autotune(OpenCLKernel* kernel, const uint32_t device_index,
+                          const uint32_t dim,
+                          const uint32_t* global_work_size,
+                          const uint32_t* default_local_size,
+                          const LocalSizeCallback& local_size_callback);
+  void enqueueKernel(OpenCLKernel* kernel, const uint32_t device_index,
+                     const cl::NDRange& offset, const cl::NDRange& global_work,
+                     const cl::NDRange& local_work, const bool blocking);
+  void recordCommand(
+      Stream* s, const uint32_t device_index,
+      const OpenCLCapture::Buffers& buffers,
+      const std::function<void(const OpenCLCapture::Buffers&)>& function);
+  static void invalidateCapture(Stream* s) {
+    if (s->capture != nullptr) {
+      s->capture->valid_ = false;
+    }
+  }
 
   // Non-copyable, non-assignable.
   OpenCLContext(const OpenCLContext&) = delete;
@@ -175,38 +636,58 @@ class OpenCLContext {
 
 template <typename T>
 void OpenCLContext::setArg(const uint32_t index, const T& val) {
-  RASSERT(cur_kernel_ != nullptr);  // You must call OpenCL::useKernel() first
-  cur_kernel_->setArg(index, val);
+  Stream* s = stream();
+  RASSERT(s->cur_kernel != nullptr);  // You must call OpenCL::useKernel() first
+  s->cur_kernel->setArg(index, val);
 }
 
 template <typename T>
 void OpenCLContext::writeToBuffer(
-    const T* data, const uint32_t data_sz, const uint32_t device_index,
+    const T* data, const uint64_t data_sz, const uint32_t device_index,
     const std::shared_ptr<OpenCLBufferData> buffer, const bool blocking) {
   // This will fail if the data size is not the buffer size.
   RASSERT(data_sz <= buffer->nelems());
-  cl::Event cur_event;
-  CHECK_ERROR(queues_[device_index].enqueueWriteBuffer(
-      buffer->buffer(), blocking ? CL_TRUE : CL_FALSE, 0,
-      data_sz * sizeof(data[0]), data, nullptr, &cur_event));
-  if (blocking) {
-    cur_event.wait();
+  Stream* s = stream();
+  invalidateCapture(s);  // The host data might be different next time.
+  cl::CommandQueue& queue = s->queues[device_index];
+  if (!out_of_order_) {
+    // A blocking enqueue already waits for completion, so no event is needed.
+    CHECK_ERROR(queue.enqueueWriteBuffer(
+        buffer->buffer(), blocking ? CL_TRUE : CL_FALSE, 0,
+        data_sz * sizeof(data[0]), data, nullptr, nullptr));
+    return;
   }
+  std::vector<cl::Event> wait_list;
+  addWaitEvents(buffer->events().get(), true, wait_list);
+  cl::Event event;
+  CHECK_ERROR(queue.enqueueWriteBuffer(
+      buffer->buffer(), blocking ? CL_TRUE : CL_FALSE, 0,
+      data_sz * sizeof(data[0]), data, &wait_list, &event));
+  recordEvent(buffer->events().get(), true, event);
 }
 
 template <typename T>
 void OpenCLContext::readFromBuffer(
-    T* data, const uint32_t data_sz, const uint32_t device_index,
+    T* data, const uint64_t data_sz, const uint32_t device_index,
     const std::shared_ptr<OpenCLBufferData> buffer, const bool blocking) {
   // This will fail if the data size is not the buffer size.
   RASSERT(data_sz <= buffer->nelems());
-  cl::Event cur_event;
-  CHECK_ERROR(queues_[device_index].enqueueReadBuffer(
-      buffer->buffer(), blocking ? CL_TRUE : CL_FALSE, 0,
-      data_sz * sizeof(data[0]), data, nullptr, &cur_event));
-  if (blocking) {
-    cur_event.wait();
+  Stream* s = stream();
+  invalidateCapture(s);
+  cl::CommandQueue& queue = s->queues[device_index];
+  if (!out_of_order_) {
+    CHECK_ERROR(queue.enqueueReadBuffer(
+        buffer->buffer(), blocking ? CL_TRUE : CL_FALSE, 0,
+        data_sz * sizeof(data[0]), data, nullptr, nullptr));
+    return;
   }
+  std::vector<cl::Event> wait_list;
+  addWaitEvents(buffer->events().get(), false, wait_list);
+  cl::Event event;
+  CHECK_ERROR(queue.enqueueReadBuffer(
+      buffer->buffer(), blocking ? CL_TRUE : CL_FALSE, 0,
+      data_sz * sizeof(data[0]), data, &wait_list, &event));
+  recordEvent(buffer->events().get(), false, event);
 }
 
 };  // namespace jcl
@@ -0,0 +1,64 @@
+//
+//  opencl_image_data.h
+//
+//  A single channel float 3D image (width x height x depth), for kernels that
+//  read their input through the texture cache.  A sampler with
+//  CLK_ADDRESS_CLAMP returns zero outside of the image (and one with
+//  CLK_ADDRESS_CLAMP_TO_EDGE the nearest edge texel), so the kernels don't
+//  need any bounds checks.
+//
+//  Images are allocated with OpenCLContext::allocateImage() and filled from a
+//  buffer with OpenCLContext::copyBufferToImage().  Kernels can only read them
+//  (3D image writes are an extension in OpenCL 1.1).
+//
+//  Note: OpenCL 1.1 has no 2D image arrays, and 3D images must be at least 2
+//  texels deep, so depth 1 tensors have to use the buffer path.
+//
+
+#pragma once
+
+#include <memory>
+
+#include "jcl/cl_include.h"
+
+namespace jcl {
+
+struct OpenCLBufferEvents;
+class OpenCLMemoryCounters;
+
+class OpenCLImageData {
+ public:
+  // The image is charged to device_index in counters.
+  OpenCLImageData(const uint32_t width, const uint32_t height,
+                  const uint32_t depth, cl::Context& context,
+                  const std::shared_ptr<OpenCLMemoryCounters>& counters,
+                  const uint32_t device_index,
+                  const CLBufferTag tag = CLBufferTagScratch);
+  ~OpenCLImageData();
+
+  cl::Image3D& image() { return image_; }
+  uint32_t width() const { return width_; }
+  uint32_t height() const { return height_; }
+  uint32_t depth() const { return depth_; }
+  uint64_t nelems() const {
+    return (uint64_t)width_ * height_ * depth_;
+  }
+  // Outstanding commands on the image (see OpenCLBufferEvents).
+  const std::shared_ptr<OpenCLBufferEvents>& events() const { return events_; }
+
+ private:
+  const uint32_t width_;
+  const uint32_t height_;
+  const uint32_t depth_;
+  const CLBufferTag tag_;
+  const std::shared_ptr<OpenCLMemoryCounters> counters_;
+  const uint32_t device_index_;
+  cl::Image3D image_;
+  std::shared_ptr<OpenCLBufferEvents> events_;
+
+  // Non-copyable, non-assignable.
+  OpenCLImageData(const OpenCLImageData&) = delete;
+  OpenCLImageData& operator=(const OpenCLImageData&) = delete;
+};
+
+};  // namespace jcl
@@ -8,6 +8,18 @@
 //
 //  Each kernel is tied to the source file that it comes from (or Program)
 //
+//  An OpenCLKernel owns its own cl::Kernel object (and therefore its own
+//  argument bindings).  OpenCLContext::getKernelCStr() returns one as a
+//  KernelHandle: callers resolve it once and can then set arguments and
+//  launch it without any per-call program lookup.
+//
+//  Buffers (and images) bound with setArg(index, std::shared_ptr<...>) are
+//  remembered (along with whether the kernel reads or writes them), so that
+//  out-of-order queues can derive the event dependencies of each launch.
+//
+//  The raw value of every argument is remembered too, so that the bindings
+//  can be copied to another kernel (see OpenCLCapture).
+//
 
 #pragma once
 
@@ -15,42 +27,119 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "jcl/cl_include.h"
 #include "jcl/math/int_types.h"
 
 namespace jcl {
 
+class OpenCLBufferData;
+class OpenCLImageData;
 class OpenCLProgram;
+struct OpenCLBufferEvents;
 
 struct OpenCLKernel {
  public:
-  OpenCLKernel(const std::string& kernel_name, OpenCLProgram* program);
+  OpenCLKernel(const std::string& kernel_name, OpenCLProgram* program,
+               std::vector<cl::Device>& devices);
   ~OpenCLKernel();
 
   template <typename T>
   void setArg(const uint32_t index, const T& val);
+  void setArg(const uint32_t index,
+              const std::shared_ptr<OpenCLBufferData>& buf);
+  void setArg(const uint32_t index,
+              const std::shared_ptr<OpenCLImageData>& image);
   void setArg(const uint32_t index, const uint32_t size, void* data);
 
+  // Bind the same arguments as src (which must be the same kernel).
+  void copyArgs(const OpenCLKernel& src);
+  // Bind `to` wherever `from` is currently bound.
+  void rebindBuffer(const OpenCLBufferData* from,
+                    const std::shared_ptr<OpenCLBufferData>& to);
+
   const std::string& kernel_name() { return kernel_name_; }
   OpenCLProgram* program() { return program_; }
   cl::Kernel& kernel() { return kernel_; }
 
+  // The buffers currently bound (nullptr for non-buffer arguments) and how
+  // the kernel accesses each argument.
+  const std::vector<std::shared_ptr<OpenCLBufferEvents>>& arg_events() const {
+    return arg_events_;
+  }
+  // A buffer bound to an argument that isn't CLArgAccessRead is treated as
+  // written.
+  CLArgAccess arg_access(const uint32_t index) const {
+    // Assume the worst if the signature couldn't be parsed.
+    return index < arg_access_.size() ? arg_access_[index]
+                                      : CLArgAccessReadWrite;
+  }
+
+  // CL_KERNEL_WORK_GROUP_SIZE for each device (queried once on creation).
+  uint32_t max_workgroup_size(const uint32_t device_index) const {
+    return max_workgroup_size_[device_index];
+  }
+
+  // Autotuned local work sizes, by (device, global work size).  These are
+  // filled in by OpenCLContext::runKernelAutotuned() so that, after the first
+  // launch, the lookup doesn't touch the context at all.  A local size of
+  // zero means "let the driver choose".
+  bool getTunedLocalSize(const uint32_t device_index, const uint32_t dim,
+                         const uint32_t* global_work_size,
+                         uint32_t* local_work_size) const;
+  void setTunedLocalSize(const uint32_t device_index, const uint32_t dim,
+                         const uint32_t* global_work_size,
+                         const uint32_t* local_work_size);
+
  private:
   std::string kernel_name_;
   OpenCLProgram* program_;  // Not owned here
   cl::Kernel kernel_;
+  std::vector<uint32_t> max_workgroup_size_;
+  std::vector<CLArgAccess> arg_access_;
+  std::vector<std::shared_ptr<OpenCLBufferEvents>> arg_events_;
+  struct Arg {
+    std::vector<char> value;  // Empty for __local memory
+    uint32_t size;
+    std::shared_ptr<OpenCLBufferData> buffer;  // For buffer arguments
+    std::shared_ptr<OpenCLImageData> image;    // For image arguments
+  };
+  std::vector<Arg> args_;
+  struct TunedLocalSize {
+    uint32_t device_index;
+    uint32_t dim;
+    uint32_t global_work_size[3];
+    uint32_t local_work_size[3];
+  };
+  std::vector<TunedLocalSize> tuned_local_sizes_;
 
-  void compileKernel();
+  void clearArgEvents(const uint32_t index) {
+    if (index < arg_events_.size()) {
+      arg_events_[index] = nullptr;
+    }
+  }
+  void recordArg(const uint32_t index, const size_t size, const void* data,
+                 const std::shared_ptr<OpenCLBufferData>& buffer);
+
+  void compileKernel(std::vector<cl::Device>& devices);
 
   // Non-copyable, non-assignable.
   OpenCLKernel(const OpenCLKernel&) = delete;
   OpenCLKernel& operator=(const OpenCLKernel&) = delete;
 };
 
+// A resolved kernel that is owned by the caller.
+typedef std::unique_ptr<OpenCLKernel> KernelHandle;
+
 template <typename T>
 void OpenCLKernel::setArg(const uint32_t index, const T& val) {
   CHECK_ERROR(kernel_.setArg<T>(index, val));
+  clearArgEvents(index);  // Raw cl objects aren't tracked
+  // Record exactly what cl::Kernel::setArg passed to clSetKernelArg.
+  T val_copy = val;
+  recordArg(index, cl::detail::KernelArgumentHandler<T>::size(val_copy),
+            cl::detail::KernelArgumentHandler<T>::ptr(val_copy), nullptr);
 }
 
 };  // namespace jcl
@@ -0,0 +1,78 @@
+//
+//  opencl_memory_stats.h
+//
+//  Device memory accounting.  This is an internal class used by
+//  OpenCLContext (see getMemoryStats()) and shouldn't be used directly.
+//
+//  Each context owns one OpenCLMemoryCounters, with a set of counters per
+//  device.  Every buffer and image holds a reference to its context's
+//  counters (so a buffer that outlives its context can still unaccount
+//  itself) and is charged to the device it was allocated for.  Updates are a
+//  few atomic adds, so the accounting is always on.
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+#include "jcl/cl_include.h"
+
+namespace jcl {
+
+// Device memory held by live buffers.
+struct OpenCLMemoryStats {
+  uint64_t live_bytes;       // Held by live buffers right now
+  uint64_t peak_bytes;       // High-water mark of live_bytes
+  uint64_t num_live;         // Live buffers right now
+  uint64_t num_allocations;  // Buffers created so far (including pool reuses)
+  // The same, broken down by CLBufferTag.
+  uint64_t tag_live_bytes[CLBufferTagCount];
+  uint64_t tag_peak_bytes[CLBufferTagCount];
+};
+
+class OpenCLMemoryCounters {
+ public:
+  explicit OpenCLMemoryCounters(const uint32_t num_devices);
+  ~OpenCLMemoryCounters();
+
+  uint32_t numDevices() const { return num_devices_; }
+
+  // A buffer (or image) was created / destroyed.
+  void allocated(const uint32_t device_index, const CLBufferTag tag,
+                 const uint64_t bytes);
+  void released(const uint32_t device_index, const CLBufferTag tag,
+                const uint64_t bytes);
+  // Move bytes between two tags (see OpenCLBufferData::setTag()).
+  void retag(const uint32_t device_index, const CLBufferTag from,
+             const CLBufferTag to, const uint64_t bytes);
+
+  // Thread-safe.  The peaks are tracked since construction, or since the
+  // last resetPeak() (which sets them to the live bytes).
+  OpenCLMemoryStats stats(const uint32_t device_index) const;
+  void resetPeak(const uint32_t device_index);
+
+ private:
+  struct Counters {
+    std::atomic<uint64_t> live_bytes;
+    std::atomic<uint64_t> peak_bytes;
+    std::atomic<uint64_t> num_live;
+    std::atomic<uint64_t> num_allocations;
+    std::atomic<uint64_t> tag_live_bytes[CLBufferTagCount];
+    std::atomic<uint64_t> tag_peak_bytes[CLBufferTagCount];
+  };
+
+  const uint32_t num_devices_;
+  std::unique_ptr<Counters[]> devices_;
+
+  void account(Counters& counters, const CLBufferTag tag,
+               const uint64_t bytes);
+  void unaccount(Counters& counters, const CLBufferTag tag,
+                 const uint64_t bytes);
+
+  // Non-copyable, non-assignable.
+  OpenCLMemoryCounters(const OpenCLMemoryCounters&) = delete;
+  OpenCLMemoryCounters& operator=(const OpenCLMemoryCounters&) = delete;
+};
+
+};  // namespace jcl
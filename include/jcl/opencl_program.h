@@ -9,11 +9,23 @@
 //  An instance is made PER file (since more than one kernel might be in a any
 //  one source file)
 //
+//  If cache_dir is non-empty the compiled program binaries are cached on disk
+//  (one file per device).  The cache key is the source, the device name, the
+//  driver version and the build options (the file is named after its hash,
+//  and the full key is stored in the file and compared on load), so an edit
+//  of the source, a driver update or a change of options results in a cache
+//  miss (and a rebuild from source).
+//
+//  A program may also be compiled with a set of "-D" defines (ie to bake a
+//  stage's filter size into its kernels).  Each set of defines is a separate
+//  program, named by programName().
+//
 
 #pragma once
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "jcl/cl_include.h"
 
@@ -23,26 +35,57 @@ class OpenCLProgram {
  public:
   // This version loads the kernel code from file
   OpenCLProgram(const std::string& kernel_filename, cl::Context& context,
-                std::vector<cl::Device>& devices, const bool strict_float);
+                std::vector<cl::Device>& devices, const bool strict_float,
+                const std::string& cache_dir,
+                const std::string& defines = "");
   // This version copies the kernel code from a c string.  Typical usage is
   // to use the kernel_c_str MD5 as the kernel_name to avoid name clashes.
   OpenCLProgram(const char* kernel_c_str, const std::string& kernel_name,
                 cl::Context& context, std::vector<cl::Device>& devices,
-                const bool strict_float);
+                const bool strict_float, const std::string& cache_dir,
+                const std::string& defines = "");
   ~OpenCLProgram();
 
+  // The name of the program built from source_name with the given defines
+  // (which is what filename() returns).  defines is a string of "-D" options.
+  static std::string programName(const std::string& source_name,
+                                 const std::string& defines);
+
   const std::string& filename() { return filename_; }
   cl::Program& program() { return program_; }
 
+  // True if the program binary was loaded from the on-disk cache.
+  bool loaded_from_cache() const { return loaded_from_cache_; }
+
+  // Parse the signature of kernel_name from the program source and return
+  // how each argument is accessed.  Only the usual spellings of read-only
+  // arguments (ie "const __global float*") are CLArgAccessRead; any argument
+  // that isn't understood is CLArgAccessReadWrite.  Returns an empty vector
+  // if the kernel can't be found, or its signature uses macros other than
+  // type names (in which case callers should assume read-write).
+  std::vector<CLArgAccess> getKernelArgAccess(const std::string& kernel_name);
+
  private:
   std::string filename_;
+  std::string defines_;
   std::unique_ptr<char[]> code_;
   cl::Program program_;
+  bool loaded_from_cache_;
 
   void compileProgram(cl::Context& context, std::vector<cl::Device>& devices,
-                      const bool strict_float);
+                      const bool strict_float, const std::string& cache_dir);
   char* readFileToBuffer(const std::string& filename);
 
+  // Binary cache helpers.
+  static std::string buildOptions(const bool strict_float);
+  std::string cacheKey(cl::Device& device, const std::string& options);
+  static std::string cacheFilename(const std::string& cache_dir,
+                                   const std::string& key);
+  bool loadFromCache(cl::Context& context, std::vector<cl::Device>& devices,
+                     const std::string& options, const std::string& cache_dir);
+  void saveToCache(std::vector<cl::Device>& devices,
+                   const std::string& options, const std::string& cache_dir);
+
   // Non-copyable, non-assignable.
   OpenCLProgram(const OpenCLProgram&) = delete;
   OpenCLProgram& operator=(const OpenCLProgram&) = delete;
@@ -21,6 +21,10 @@ class Concat : public TorchStage {
   TorchStageType type() const override { return CONCAT_STAGE; }
   std::string name() const override { return "Concat"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
+  void calibrate(const bool calibrating) override;
+  void quantize() override;
 
   void add(std::unique_ptr<TorchStage> stage);
   TorchStage* get(const uint32_t i);
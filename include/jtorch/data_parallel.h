@@ -0,0 +1,112 @@
+//
+//  data_parallel.h
+//
+//  Data-parallel inference: the model is loaded once per OpenCL device (so
+//  each device has its own copy of the weights) and forwardProp requests are
+//  distributed round-robin across the replicas.
+//
+//  Each replica has a dedicated worker thread, which has its device on the
+//  runtime set to the replica's device and therefore uses that device's
+//  command queue (see the threading notes in jtorch.h).
+//
+//  USAGE:
+//  jtorch::DataParallel model(model_file);
+//  model.forwardProp(inputs, [&](const uint32_t request, TorchData& output) {
+//    // Called on a worker thread once inputs[request] has been processed.
+//  });
+//  std::cout << model.throughput() << " requests per second" << std::endl;
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "jcl/math/int_types.h"
+#include "jtorch/torch_stage.h"
+
+namespace jcl {
+namespace threading {
+class ThreadPool;
+}
+}
+
+namespace jtorch {
+
+class DataParallel {
+ public:
+  // Called on the worker thread of the replica that processed the request,
+  // once its output is ready.  The output is reused by the replica's next
+  // request, so copy whatever is needed before returning.
+  typedef std::function<void(const uint32_t request, TorchData& output)>
+      OutputCallback;
+
+  // Load one replica of model_file onto every device in the runtime's context
+  // (or onto the first num_devices devices if num_devices > 0).
+  // runtime: nullptr for Runtime::Current().
+  // format: the replicas' storage format (see TorchStage::loadFromFile()).
+  explicit DataParallel(const std::string& model_file,
+                        const uint32_t num_devices = 0,
+                        Runtime* runtime = nullptr,
+                        const StorageFormat format = FLOAT_STORAGE);
+  ~DataParallel();
+
+  // Warm up every replica (see TorchStage::prepare()).  The programs are
+  // shared by all devices, so they are only built once.
+  void prepare(std::shared_ptr<TorchData> sample_input = nullptr);
+
+  // Run forwardProp for every input and block until they are all done.
+  // The inputs must not be modified until this call returns.
+  void forwardProp(const std::vector<std::shared_ptr<TorchData>>& inputs,
+                   const OutputCallback& callback);
+
+  uint32_t numReplicas() const { return (uint32_t)replicas_.size(); }
+  uint32_t replicaDevice(const uint32_t replica) const;
+  TorchStage* replicaModel(const uint32_t replica);
+  uint64_t replicaRequests(const uint32_t replica) const;
+
+  // Aggregate throughput over all forwardProp calls so far (requests per
+  // second of wall clock time spent inside forwardProp).
+  uint64_t numRequests() const { return num_requests_; }
+  double throughput() const;
+  void printStats() const;
+
+ private:
+  struct Replica {
+    uint32_t device;
+    std::unique_ptr<TorchStage> model;
+    std::unique_ptr<jcl::threading::ThreadPool> worker;  // Single thread
+    uint64_t num_requests;
+  };
+  std::vector<std::unique_ptr<Replica>> replicas_;
+  Runtime* runtime_;
+  std::string model_file_;
+  StorageFormat format_;
+  uint32_t next_replica_;  // For round-robin between forwardProp calls.
+  uint64_t num_requests_;
+  double total_time_;  // Seconds
+
+  // The current forwardProp call (only valid while it's running).
+  const std::vector<std::shared_ptr<TorchData>>* inputs_;
+  const OutputCallback* callback_;
+  std::mutex lock_;
+  std::condition_variable done_cv_;
+  uint32_t num_pending_;
+
+  void loadReplica(const uint32_t replica);
+  void prepareReplica(const uint32_t replica,
+                      std::shared_ptr<TorchData> sample_input);
+  void runRequest(const uint32_t replica, const uint32_t request);
+  void taskFinished();
+  void waitForTasks();
+
+  // Non-copyable, non-assignable.
+  DataParallel(const DataParallel&) = delete;
+  DataParallel& operator=(const DataParallel&) = delete;
+};
+
+};  // namespace jtorch
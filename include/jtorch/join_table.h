@@ -15,6 +15,7 @@
 #include <iostream>
 #include <stdint.h>
 
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_stage.h"
 
 namespace jtorch {
@@ -28,6 +29,8 @@ class JoinTable : public TorchStage {
   TorchStageType type() const override { return JOIN_TABLE_STAGE; }
   std::string name() const override { return "JoinTable"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
 
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
@@ -35,7 +38,11 @@ class JoinTable : public TorchStage {
 
  protected:
   void init(std::shared_ptr<TorchData> input);
+  // The jtorch dimension of the join.
+  uint32_t joinDim(const Tensor<float>& t) const;
   uint32_t dimension_;
+  jcl::KernelHandle kernel_;
+  bool index64_;  // kernel_ is the 64-bit index variant
 
   // Non-copyable, non-assignable.
   JoinTable(const JoinTable&) = delete;
@@ -4,8 +4,18 @@
 //  Created by Jonathan Tompson on 5/14/13.
 //
 //  NOTE: YOU MUST CALL jtorch::InitTorch() before using any of these functions
-//  since a valid OpenCL context must exist.  Then you can only use these
-//  functions in the same thread that InitTorch was called.
+//  since a valid OpenCL context must exist.
+//
+//  InitJTorch() creates the default jtorch::Runtime (see runtime.h), and the
+//  globals below (cl_context, deviceid, Sync(), ...) refer to it.  Tensors
+//  and stages can also be bound to other runtimes.
+//
+//  THREADING: each host thread gets its own OpenCL command queue (see
+//  jcl::OpenCLContext), so different model instances can run forwardProp
+//  concurrently on different threads.  A single model instance (and any
+//  Tensor) must only be used by one thread at a time.  Sync() waits for the
+//  work enqueued by the calling thread only.  See data_parallel.h to run
+//  replicas of a model on all devices.
 //
 //  Call ShutdownJTorch() when finished.
 //
@@ -14,31 +24,141 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "jcl/math/int_types.h"
 #include "jcl/opencl_context.h"
+#include "jtorch/runtime.h"
 
 #define USE_OPENCL_LOCAL_SIZES  // Let OpenCL choose worksizes
 
+// 64-bit indexing: kernels take element offsets (and compute flattened
+// indices) as INDEX_T.  Kernel sources start with this prelude, so INDEX_T is
+// int unless the program is compiled with IndexDefines(true).  Stages only
+// pick the 64-bit variant for tensors that need it (see NeedsIndex64()), so
+// smaller tensors keep 32-bit index math.
+// The prelude also defines the storage type of the tensor arguments, and
+// LOAD / STORE to access them: STORAGE_T is float unless the program is
+// compiled with JTORCH_HALF (see KernelDefines()), in which case the elements
+// are fp16 and are converted to and from float by vload_half / vstore_half.
+// All arithmetic stays in float.
+#define JTORCH_INDEX_PRELUDE \
+"    #ifndef INDEX_T\n" \
+"      #define INDEX_T int\n" \
+"    #endif\n" \
+"    #ifdef JTORCH_HALF\n" \
+"      #define STORAGE_T half\n" \
+"      #define LOAD(p, i) vload_half((i), (p))\n" \
+"      #define STORE(v, p, i) vstore_half((v), (i), (p))\n" \
+"    #else\n" \
+"      #define STORAGE_T float\n" \
+"      #define LOAD(p, i) ((p)[i])\n" \
+"      #define STORE(v, p, i) ((p)[i] = (v))\n" \
+"    #endif\n"
+
 namespace jcl {
 class OpenCLContext;
+class OpenCLKernel;
 }
 
 namespace jtorch {
 
+// The element format of a tensor's storage (see Tensor::format()).  Half
+// storage halves the memory traffic of bandwidth bound stages, at fp16
+// precision (kernels still compute in float).  Models pick their format when
+// they are loaded (see TorchStage::loadFromFile()).
+typedef enum {
+  FLOAT_STORAGE = 0,
+  HALF_STORAGE = 1,
+} StorageFormat;
+
 // All these functions are thread-safe.
+// program_cache_dir: if non-empty, compiled OpenCL programs are cached in this
+// (existing) directory so that subsequent runs skip the kernel compilation.
+// The kernel local work size autotune results are also saved there (in
+// autotune.txt).
+// out_of_order_queue: use out-of-order OpenCL queues, so that independent
+// kernels (ie the branches of a ConcatTable) can overlap.  Dependencies are
+// tracked per tensor storage.
+// profile_kernels: record the device time of every kernel launch.  Call
+// cl_context->printKernelProfile() to see where the time goes.
+// select_fastest_device: score every CPU (or GPU) device on every platform
+// (see jcl::OpenCLContext::scoreDevices(), this runs a short calibration
+// kernel on each) and use the best one instead of requested_deviceid on the
+// first platform found.  The scores are then available from DeviceScores().
 void InitJTorch(const bool use_cpu = false,
                 const uint32_t requested_deviceid = 0,
-                const bool verbose_startup = true);
+                const bool verbose_startup = true,
+                const std::string& program_cache_dir = "",
+                const bool out_of_order_queue = false,
+                const bool profile_kernels = false,
+                const bool select_fastest_device = false);
 void ShutdownJTorch();
 void Sync();
+// The device scores computed by InitJTorch() (best first), or an empty vector
+// if select_fastest_device wasn't set.
+const std::vector<jcl::OpenCLDeviceScore>& DeviceScores();
+
+// True if element indices up to end (ie a tensor's offset + nelems) don't fit
+// in an int.
+bool NeedsIndex64(const uint64_t end);
+// The defines for the 64-bit variant of a program (empty otherwise).
+const jcl::OpenCLDefines& IndexDefines(const bool index64);
+// The defines for the variant of a program with the given index width and
+// storage format (IndexDefines() is the FLOAT_STORAGE one).
+const jcl::OpenCLDefines& KernelDefines(const bool index64,
+                                        const StorageFormat format);
+
+// A kernel from a source string (with the JTORCH_INDEX_PRELUDE), with a
+// variant per index width and storage format, which is resolved once per
+// runtime and thread (see jcl::OpenCLContext::getCachedKernelCStr()).  This
+// is for one-off launches that happen often (ie the Tensor ops), which would
+// otherwise look the program up on every launch.  Use one per kernel as a
+// function static:
+//   static const CachedKernel copy_kernel(kCopyKernel, "Copy");
+//   jcl::OpenCLKernel* kernel = copy_kernel.get(runtime, index64, format);
+// defines are added to those of each variant.
+class CachedKernel {
+ public:
+  CachedKernel(const char* kernel_c_str, const char* kernel_name,
+               const jcl::OpenCLDefines& defines = jcl::OpenCLDefines());
+
+  jcl::OpenCLKernel* get(Runtime* runtime, const bool index64,
+                         const StorageFormat format) const;
+
+ private:
+  const char* kernel_c_str_;
+  const char* kernel_name_;
+  // By [index64][format].
+  uint32_t slots_[2][2];
+  jcl::OpenCLDefines defines_[2][2];
+};
+
+// Set an INDEX_T argument of a kernel (or of the context's current kernel).
+void SetIndexArg(jcl::OpenCLKernel* kernel, const uint32_t index,
+                 const uint64_t value, const bool index64);
+void SetIndexArg(jcl::OpenCLContext* context, const uint32_t index,
+                 const uint64_t value, const bool index64);
+
+// Image inputs: SpatialConvolution, SpatialMaxPooling and
+// SpatialUpSamplingNearest can read their (3D) input through an image copy
+// of it instead of the buffer (see jcl/opencl_image_data.h).  The reads then
+// go through the texture cache and the sampler handles the borders, at the
+// cost of one extra pass over the input.  Off by default.  Devices without
+// image support, and inputs that don't fit in an image, use the buffers.
+// These set (and get) the default runtime's setting, see
+// Runtime::setUseImages() for the others.
+void SetUseImages(const bool use_images);
+bool UseImages();
 
-// Some constants and globals for the jtorch instance.
-// Note: cl_context cannot be a unique_ptr because we need to
-// ensure that the context is shutdown last.
-// TODO(tompson): This is ugly, put these in a context class.
-extern std::unique_ptr<jcl::OpenCLContext> cl_context;
+// Some constants and globals for the default runtime.
+// The default runtime's context (owned by the runtime, nullptr before
+// InitJTorch() and after ShutdownJTorch()).
+extern jcl::OpenCLContext* cl_context;
 extern std::string jtorch_path;
-extern uint32_t deviceid;
+// The device used by the calling thread on the default runtime.  Each thread
+// starts out with the device requested in InitJTorch(), but can switch (see
+// DataParallel).
+extern thread_local uint32_t deviceid;
 
 };  // namespace jtorch
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "jcl/math/int_types.h"
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_stage.h"
 
 #define SIMPLE_LINEAR  // Might actually be faster when using the CPU!
@@ -25,9 +26,14 @@ class Linear : public TorchStage {
   TorchStageType type() const override { return LINEAR_STAGE; }
   std::string name() const override { return "Linear"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
+  void calibrate(const bool calibrating) override;
+  void quantize() override;
 
   void setWeights(const float* weights);
   void setBiases(const float* biases);
+  // nullptr once the stage is quantized.
   Tensor<float>* weights() { return weights_.get(); }
   Tensor<float>* biases() { return biases_.get(); }
 
@@ -40,8 +46,36 @@ class Linear : public TorchStage {
   std::unique_ptr<Tensor<float>>
       weights_;  // n_outputs (rows) * n_inputs (columns), stored row major
   std::unique_ptr<Tensor<float>> biases_;  // n_outputs
+  std::unique_ptr<Tensor<float>> ones_;    // batch size, for the bias GEMM
+  // The float GEMM output of a batch, for half storage (which clBLAS can't
+  // write).
+  std::unique_ptr<Tensor<float>> gemm_output_;
+
+  // int8 inference (see TorchStage::quantize()).
+  bool calibrating_;
+  float input_absmax_;  // The calibrated input range
+  bool quantized_;
+  // The int8 weights, in char4s (4 consecutive inputs) stored column major
+  // like weights_ (see Int8Tensor()).
+  std::unique_ptr<Tensor<float>> int8_weights_;
+  std::unique_ptr<Tensor<float>> int8_scales_;  // n_outputs
+  std::unique_ptr<Tensor<float>> int8_input_;   // The quantized input(s)
+  float input_scale_;
+
+  jcl::KernelHandle mat_vec_kernel_;
+  jcl::KernelHandle accum_kernel_;
+  jcl::KernelHandle quantize_kernel_;
+  jcl::KernelHandle int8_mat_vec_kernel_;
+  bool index64_;  // The kernels are the 64-bit index variants
+#ifndef SIMPLE_LINEAR
+  uint32_t global_size_[2];
+  uint32_t local_size_[2];
+#endif
 
   void init(std::shared_ptr<TorchData> input);
+  // The batch version of forwardProp: one clBLAS GEMM.
+  void forwardPropGemm(std::shared_ptr<TorchData> input);
+  void forwardPropInt8(std::shared_ptr<TorchData> input);
 
   // Non-copyable, non-assignable.
   Linear(const Linear&) = delete;
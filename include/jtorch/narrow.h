@@ -31,6 +31,7 @@ class Narrow : public TorchStage {
   int length_;
 
   const Tensor<float>* src_tensor_;
+  bool src_batch_;  // src_tensor_ was a batch (see forwardPropBatch())
 
   // Non-copyable, non-assignable.
   Narrow(const Narrow&) = delete;
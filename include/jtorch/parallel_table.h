@@ -25,6 +25,10 @@ class ParallelTable : public TorchStage {
   TorchStageType type() const override { return PARALLEL_TABLE_STAGE; }
   std::string name() const override { return "ParallelTable"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
+  void calibrate(const bool calibrating) override;
+  void quantize() override;
 
   void add(std::unique_ptr<TorchStage> stage);  // Memory is transferred
   const uint32_t size() const;
@@ -0,0 +1,71 @@
+//
+//  quantization.h
+//
+//  int8 inference support (see TorchStage::quantize()).  Values are quantized
+//  symmetrically: q = clamp(round(x / scale), -127, 127) with
+//  scale = absmax / 127, so that 0 is exact and the int8 products of two
+//  quantized values can be accumulated in int32 and rescaled once by the
+//  product of their scales.  Weights get one scale per output channel, inputs
+//  one per tensor (from the range recorded during calibration).
+//
+//  The jcl buffers are allocated in floats, so int8 data is kept in float
+//  tensors holding 4 values per element (see Int8Tensor()).  Only the int8
+//  kernels can make sense of their contents.
+//
+
+#pragma once
+
+#include <memory>
+
+#include "jcl/math/int_types.h"
+#include "jtorch/jtorch.h"
+
+namespace jtorch {
+
+template <typename T>
+class Tensor;
+
+// Quantizes rows of n elements of a tensor of either storage format into
+// int8 (written as char).  The launch is 2D: dim 0 is the padded row length
+// (the padding is zeroed) and dim 1 the row (ie the sample of a batch).
+static const char* kQuantizeKernel = JTORCH_INDEX_PRELUDE
+"    __kernel void Quantize(\n"
+"      const __global STORAGE_T* input,  /* 0 */\n"
+"      __global char* output,            /* 1 */\n"
+"      const float inv_scale,            /* 2 */\n"
+"      const int n,                      /* 3 */\n"
+"      const INDEX_T input_offset) {     /* 4 */\n"
+"      const int i = get_global_id(0);\n"
+"      const int row = get_global_id(1);\n"
+"      float q = 0.0f;\n"
+"      if (i < n) {\n"
+"        q = clamp(rint(LOAD(input, input_offset + (INDEX_T)row * n + i) *\n"
+"                       inv_scale), -127.0f, 127.0f);\n"
+"      }\n"
+"      output[(INDEX_T)row * get_global_size(0) + i] = (char)q;\n"
+"    }";
+
+// The quantization scale for values in [-absmax, absmax] (1 if absmax is 0,
+// so that all-zero data stays zero).
+float Int8Scale(const float absmax);
+
+// Quantize the rows x cols matrix x (row major) with one scale per row.  The
+// rows of q are padded with zeros to q_stride >= cols values, and scales gets
+// the rows scales.
+void QuantizeRows(const float* x, const uint32_t rows, const uint32_t cols,
+                  const uint32_t q_stride, int8_t* q, float* scales);
+
+// n rounded up to a multiple of 4 (the int8 kernels read char4s).
+inline uint32_t Int8Padded(const uint32_t n) { return (n + 3) & ~3u; }
+
+// An (uninitialized) float tensor on runtime large enough to hold n int8
+// values, packed 4 per element.  If data isn't nullptr, n (a multiple of 4)
+// values are uploaded from it.
+std::unique_ptr<Tensor<float>> Int8Tensor(const uint32_t n, Runtime* runtime,
+                                          const int8_t* data = nullptr);
+
+// The largest absolute value of absmax and the elements of x (this reads the
+// result back, so it is meant for calibration only).
+float CalibrateAbsMax(const Tensor<float>& x, const float absmax);
+
+};  // namespace jtorch
@@ -0,0 +1,139 @@
+//
+//  runtime.h
+//
+//  A jtorch runtime: an OpenCL context (with its devices, queues, programs
+//  and buffer pool) plus the jtorch state that goes with it.  Tensors and
+//  stages are bound to the runtime that created them, so one process can
+//  host several independent runtimes (ie one on a CPU device for small models
+//  and one on a GPU).
+//
+//  Tensors (and stages) use the runtime passed to them, or else the calling
+//  thread's current runtime: the innermost Runtime::Scope, or the default
+//  runtime created by jtorch::InitJTorch().  TorchStage::loadFromFile() and
+//  DataParallel take a runtime and install it for everything they create.
+//
+//  USAGE:
+//  jtorch::RuntimeOptions options;
+//  options.use_cpu = true;
+//  jtorch::Runtime cpu_runtime(options);
+//  std::unique_ptr<jtorch::TorchStage> model =
+//      jtorch::TorchStage::loadFromFile(model_file, &cpu_runtime);
+//
+//  A runtime must outlive its tensors and stages.  The THREADING notes in
+//  jtorch.h apply to each runtime.
+//
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "jcl/math/int_types.h"
+#include "jcl/opencl_context.h"
+
+namespace jcl {
+class OpenCLImageData;
+class OpenCLKernel;
+}
+
+namespace jtorch {
+
+template <typename T>
+class Tensor;
+
+// See InitJTorch() in jtorch.h for a description of each option.
+struct RuntimeOptions {
+  bool use_cpu = false;
+  uint32_t requested_deviceid = 0;
+  bool verbose_startup = true;
+  std::string program_cache_dir;
+  bool out_of_order_queue = false;
+  bool profile_kernels = false;
+  bool select_fastest_device = false;
+};
+
+class Runtime {
+ public:
+  explicit Runtime(const RuntimeOptions& options = RuntimeOptions());
+  ~Runtime();
+
+  // The runtime created by InitJTorch() (nullptr before that).
+  static Runtime* Default();
+  // Create (and destroy) the default runtime.  Use InitJTorch() and
+  // ShutdownJTorch() instead.
+  static void InitDefault(const RuntimeOptions& options);
+  static void ShutdownDefault();
+  // The calling thread's innermost Scope, or Default().
+  static Runtime* Current();
+
+  // Make runtime the calling thread's current runtime until destroyed.
+  class Scope {
+   public:
+    explicit Scope(Runtime* runtime);
+    ~Scope();
+
+   private:
+    Runtime* previous_;
+
+    // Non-copyable, non-assignable.
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+  };
+
+  jcl::OpenCLContext* context() const { return context_.get(); }
+
+  // The device used by the calling thread.  Each thread starts out with the
+  // runtime's default device, but can switch (see DataParallel).
+  uint32_t deviceid() const;
+  void setDeviceid(const uint32_t deviceid);
+  uint32_t defaultDeviceid() const { return default_deviceid_; }
+
+  // Wait for the work enqueued on the calling thread's queue.
+  void sync() const;
+
+  // The device scores computed at startup (best first), or an empty vector if
+  // select_fastest_device wasn't set.
+  const std::vector<jcl::OpenCLDeviceScore>& deviceScores() const {
+    return device_scores_;
+  }
+
+  // Run an elementwise kernel (nullptr: the context's current kernel) over
+  // nelems elements.  Its trailing arguments, from first_offset_arg on, must
+  // be the INDEX_T offsets of its tensors.  Large tensors are processed in
+  // chunks (by advancing the offsets), so the work item index always fits in
+  // an int.  (A kernel that computes its own indices can instead take a single
+  // start index there, with offsets = {0}.)
+  void runElementwiseKernel(jcl::OpenCLKernel* kernel,
+                            const uint32_t first_offset_arg,
+                            const std::vector<uint64_t>& offsets,
+                            const uint64_t nelems, const bool index64) const;
+
+  // Image inputs (see SetUseImages() in jtorch.h).
+  void setUseImages(const bool use_images) { use_images_ = use_images; }
+  bool useImages() const { return use_images_; }
+  // Copy input into *image (reallocating it if the size changed) if image
+  // inputs are enabled and supported for it on the calling thread's device.
+  // Returns false if the stage should read the buffer instead.
+  bool inputToImage(const Tensor<float>& input,
+                    std::shared_ptr<jcl::OpenCLImageData>* image) const;
+
+ private:
+  template <typename T>
+  friend class Tensor;
+
+  std::unique_ptr<jcl::OpenCLContext> context_;
+  uint32_t default_deviceid_;
+  uint64_t serial_;  // Unique per runtime (keys the per-thread devices)
+  std::vector<jcl::OpenCLDeviceScore> device_scores_;
+  std::atomic<bool> use_images_;
+  // Tensors bound to this runtime, which must all be gone before it is.
+  std::atomic<int64_t> num_tensors_;
+
+  // Non-copyable, non-assignable.
+  Runtime(const Runtime&) = delete;
+  Runtime& operator=(const Runtime&) = delete;
+};
+
+};  // namespace jtorch
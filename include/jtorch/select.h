@@ -30,6 +30,7 @@ class Select : public TorchStage {
   int index_;
 
   const Tensor<float>* src_tensor_;
+  bool src_batch_;  // src_tensor_ was a batch (see forwardPropBatch())
 
   // Non-copyable, non-assignable.
   Select(const Select&) = delete;
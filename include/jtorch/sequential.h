@@ -3,6 +3,11 @@
 //
 //  Created by Jonathan Tompson on 4/2/13.
 //
+//  Capture mode (see setCaptureEnabled()) is meant for models that are run
+//  over and over with inputs of a fixed shape: the whole forward pass is
+//  recorded once (see jcl::OpenCLContext::beginCapture()) and then replayed,
+//  which skips all of the per-stage host work.
+//
 
 #pragma once
 
@@ -15,6 +20,11 @@
 #include "jcl/math/int_types.h"
 #include "jtorch/torch_stage.h"
 
+namespace jcl {
+class OpenCLBufferData;
+class OpenCLCapture;
+}
+
 namespace jtorch {
 
 class Sequential : public TorchStage {
@@ -26,16 +36,43 @@ class Sequential : public TorchStage {
   TorchStageType type() const override { return SEQUENTIAL_STAGE; }
   std::string name() const override { return "Sequential"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
+  void calibrate(const bool calibrating) override;
+  void quantize() override;
 
   void add(std::unique_ptr<TorchStage> stage);
   TorchStage* get(const uint32_t i);
   uint32_t size() const;
 
+  // When enabled, the first forwardProp with a new input shape runs as usual
+  // (so that the stages can allocate their outputs), the second one is
+  // captured and every later one with the same shape (and input offset) is a
+  // replay of the capture.  If the input storage changed, it is rebound
+  // first.  Only tensor inputs are captured, and models with stages that
+  // read back to the host (ie SpatialConvolutionMap) keep running normally.
+  // Note: the weights, parameters and structure of the model must not change
+  // while captured (disable and re-enable capture to drop the recording).
+  void setCaptureEnabled(const bool enabled);
+  bool captureEnabled() const { return capture_enabled_; }
+  // True if the next forwardProp with the current input shape is a replay.
+  bool captured() const;
+
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
  protected:
   std::vector<std::unique_ptr<TorchStage>> network_;
 
+  bool capture_enabled_;
+  std::unique_ptr<jcl::OpenCLCapture> capture_;
+  std::vector<uint32_t> capture_size_;  // Input shape of capture_
+  uint64_t capture_offset_;             // Input offset of capture_
+  StorageFormat capture_format_;       // Input format of capture_
+  bool capture_batch_;                 // capture_ is of a forwardPropBatch()
+  std::shared_ptr<jcl::OpenCLBufferData> capture_storage_;  // Bound input
+
+  void forwardPropStages(std::shared_ptr<TorchData> input);
+
   // Non-copyable, non-assignable.
   Sequential(const Sequential&) = delete;
   Sequential& operator=(const Sequential&) = delete;
@@ -8,6 +8,7 @@
 
 #include "jcl/math/int_types.h"
 #include "jcl/math/math_types.h"
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_stage.h"
 
 namespace jtorch {
@@ -26,6 +27,8 @@ class SpatialBatchNormalization : public TorchStage {
   }
   std::string name() const override { return "SpatialBatchNormalization"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
 
   void setWeights(const float* weights);
   void setBiases(const float* biases);
@@ -48,6 +51,9 @@ class SpatialBatchNormalization : public TorchStage {
   std::unique_ptr<Tensor<float>> running_mean_;
   std::unique_ptr<Tensor<float>> running_std_;
 
+  jcl::KernelHandle kernel_;
+  bool index64_;  // kernel_ is the 64-bit index variant
+
   void init(std::shared_ptr<TorchData> input);
 
   // Non-copyable, non-assignable.
@@ -36,6 +36,8 @@ class SpatialContrastiveNormalization : public TorchStage {
     return "SpatialContrastiveNormalization";
   }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
 
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
@@ -8,6 +8,8 @@
 
 #include "jcl/math/int_types.h"
 #include "jcl/math/math_types.h"
+#include "jcl/opencl_image_data.h"
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_stage.h"
 
 namespace jtorch {
@@ -26,6 +28,8 @@ class SpatialConvolution : public TorchStage {
   TorchStageType type() const override { return SPATIAL_CONVOLUTION_STAGE; }
   std::string name() const override { return "SpatialConvolution"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
 
   void setWeights(const float* weights);
   void setBiases(const float* biases);
@@ -44,8 +48,17 @@ class SpatialConvolution : public TorchStage {
   std::unique_ptr<Tensor<float>> weights_;
   std::unique_ptr<Tensor<float>> biases_;
 
+  jcl::KernelHandle kernel_;
+  bool index64_;  // The kernels are the 64-bit index variants
+  // Image input path (see jtorch::SetUseImages()).
+  jcl::KernelHandle image_kernel_;
+  std::shared_ptr<jcl::OpenCLImageData> input_image_;
+
   void init(std::shared_ptr<TorchData> input);
 
+  // The compile time constants of the stage's program.
+  jcl::OpenCLDefines programDefines(const bool index64 = false) const;
+
   // Non-copyable, non-assignable.
   SpatialConvolution(const SpatialConvolution&) = delete;
   SpatialConvolution& operator=(const SpatialConvolution&) = delete;
@@ -8,6 +8,7 @@
 
 #include "jcl/math/int_types.h"
 #include "jcl/math/math_types.h"
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_stage.h"
 
 namespace jtorch {
@@ -26,9 +27,14 @@ class SpatialConvolutionMM : public TorchStage {
   TorchStageType type() const override { return SPATIAL_CONVOLUTION_MM_STAGE; }
   std::string name() const override { return "SpatialConvolutionMM"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
+  void calibrate(const bool calibrating) override;
+  void quantize() override;
 
   void setWeights(const float* weights);
   void setBiases(const float* biases);
+  // nullptr once the stage is quantized.
   Tensor<float>* weights() { return weights_.get(); }
   Tensor<float>* biases() { return biases_.get(); }
 
@@ -48,8 +54,27 @@ class SpatialConvolutionMM : public TorchStage {
   std::unique_ptr<Tensor<float>>
       columns_;  // This is finput in torch.  TODO: Share this!
   std::unique_ptr<Tensor<float>> ones_;  // This is fgradinput in torch
+  // The GEMM output of batches of more than one sample (see forwardProp()).
+  std::unique_ptr<Tensor<float>> gemm_output_;
+
+  // int8 inference (see TorchStage::quantize()).
+  bool calibrating_;
+  float input_absmax_;  // The calibrated input range
+  bool quantized_;
+  // The int8 weights: feats_out_ rows of the filter values (in im2col order)
+  // padded to a multiple of 4 (see Int8Tensor()).
+  std::unique_ptr<Tensor<float>> int8_weights_;
+  std::unique_ptr<Tensor<float>> int8_scales_;   // feats_out_
+  std::unique_ptr<Tensor<float>> int8_columns_;  // The quantized columns_
+  float input_scale_;
+
+  jcl::KernelHandle im2col_kernel_;
+  jcl::KernelHandle int8_im2col_kernel_;
+  jcl::KernelHandle int8_gemm_kernel_;
+  bool index64_;  // The kernels are the 64-bit index variants
 
   void init(std::shared_ptr<TorchData> input);
+  void forwardPropInt8(std::shared_ptr<TorchData> input);
 
   // Non-copyable, non-assignable.
   SpatialConvolutionMM(const SpatialConvolutionMM&) = delete;
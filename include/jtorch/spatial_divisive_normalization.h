@@ -12,6 +12,7 @@
 
 #include "jcl/math/int_types.h"
 #include "jcl/math/math_types.h"
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_stage.h"
 
 namespace jtorch {
@@ -31,6 +32,8 @@ class SpatialDivisiveNormalization : public TorchStage {
   }
   std::string name() const override { return "SpatialDivisiveNormalization"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
 
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
@@ -45,9 +48,19 @@ class SpatialDivisiveNormalization : public TorchStage {
       std_pass2_;  // 3D - Vertical + normalization pass
   float threshold_;
 
+  jcl::KernelHandle horiz_kernel_;      // 1D (separable) filter only
+  jcl::KernelHandle vert_kernel_;       // 1D (separable) filter only
+  jcl::KernelHandle filter_2d_kernel_;  // 2D filter only
+  jcl::KernelHandle accum_div_kernel_;
+  jcl::KernelHandle normalize_kernel_;
+  bool index64_;  // The kernels are the 64-bit index variants
+
   void init(std::shared_ptr<TorchData> input);
   void cleanup();
 
+  // The compile time constants of the stage's program.
+  jcl::OpenCLDefines programDefines(const bool index64 = false) const;
+
   // Non-copyable, non-assignable.
   SpatialDivisiveNormalization(const SpatialDivisiveNormalization&) = delete;
   SpatialDivisiveNormalization& operator=(const SpatialDivisiveNormalization&) =
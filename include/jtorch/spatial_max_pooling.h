@@ -11,6 +11,8 @@
 
 #include "jcl/math/int_types.h"
 #include "jcl/math/math_types.h"
+#include "jcl/opencl_image_data.h"
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_stage.h"
 
 namespace jtorch {
@@ -25,6 +27,8 @@ class SpatialMaxPooling : public TorchStage {
   TorchStageType type() const override { return SPATIAL_MAX_POOLING_STAGE; }
   std::string name() const override { return "SpatialMaxPooling"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
 
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
@@ -39,8 +43,18 @@ class SpatialMaxPooling : public TorchStage {
   uint32_t padh_;
   uint32_t padw_;
 
+  jcl::KernelHandle kernel_;     // For 3D inputs
+  jcl::KernelHandle kernel_2d_;  // For 2D inputs
+  bool index64_;  // The kernels are the 64-bit index variants
+  // Image input path for 3D inputs (see jtorch::SetUseImages()).
+  jcl::KernelHandle image_kernel_;
+  std::shared_ptr<jcl::OpenCLImageData> input_image_;
+
   void init(std::shared_ptr<TorchData> input);
 
+  // The compile time constants of the stage's program.
+  jcl::OpenCLDefines programDefines(const bool index64 = false) const;
+
   // Non-copyable, non-assignable.
   SpatialMaxPooling(const SpatialMaxPooling&) = delete;
   SpatialMaxPooling& operator=(const SpatialMaxPooling&) = delete;
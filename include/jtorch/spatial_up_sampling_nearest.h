@@ -8,6 +8,8 @@
 
 #include "jcl/math/int_types.h"
 #include "jcl/math/math_types.h"
+#include "jcl/opencl_image_data.h"
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_data.h"
 #include "jtorch/torch_stage.h"
 
@@ -27,6 +29,8 @@ class SpatialUpSamplingNearest : public TorchStage {
   }
   std::string name() const override { return "SpatialUpSamplingNearest"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
 
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
@@ -35,6 +39,13 @@ class SpatialUpSamplingNearest : public TorchStage {
   uint32_t out_dim_;
   std::unique_ptr<uint32_t[]> out_size_;
 
+  jcl::KernelHandle kernel_;     // For 3D inputs
+  jcl::KernelHandle kernel_2d_;  // For 2D inputs
+  bool index64_;  // The kernels are the 64-bit index variants
+  // Image input path for 3D inputs (see jtorch::SetUseImages()).
+  jcl::KernelHandle image_kernel_;
+  std::shared_ptr<jcl::OpenCLImageData> input_image_;
+
   void init(std::shared_ptr<TorchData> input);
 
   // Non-copyable, non-assignable.
@@ -8,6 +8,7 @@
 
 #include "jcl/math/int_types.h"
 #include "jcl/math/math_types.h"
+#include "jcl/opencl_kernel.h"
 #include "jtorch/torch_stage.h"
 
 namespace jtorch {
@@ -21,10 +22,15 @@ class Tanh : public TorchStage {
   TorchStageType type() const override { return TANH_STAGE; }
   std::string name() const override { return "Tanh"; }
   void forwardProp(std::shared_ptr<TorchData> input) override;
+  void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const override;
 
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
  protected:
+  jcl::KernelHandle kernel_;
+  bool index64_;  // kernel_ is the 64-bit index variant
+
   void init(std::shared_ptr<TorchData> input);
 
   // Non-copyable, non-assignable.
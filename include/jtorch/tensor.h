@@ -11,12 +11,17 @@
 #pragma once
 
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <limits>
 #include <random>
 #include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "jcl/math/int_types.h"
 #include "jcl/math/math_types.h"
@@ -40,100 +45,418 @@ class ThreadPool;
 
 namespace jtorch {
 
-static const char* kFillKernel =
+// Tensors are views into (possibly shared) storage, so every kernel takes the
+// element offset of each of its tensor arguments as trailing arguments (see
+// Runtime::runElementwiseKernel()).
+static const char* kFillKernel = JTORCH_INDEX_PRELUDE
 "    __kernel void Fill(\n"
-"      __global float* output,  /* 0 */\n"
-"      const float value) {     /* 1 */\n"
+"      __global STORAGE_T* output,    /* 0 */\n"
+"      const float value,             /* 1 */\n"
+"      const INDEX_T output_offset) { /* 2 */\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
-"      output[x_out] = value;\n"
+"      STORE(value, output, x_out);\n"
 "    }";
 
-static const char* kAccumulateKernel =
+static const char* kAccumulateKernel = JTORCH_INDEX_PRELUDE
 "    /* output += input1 */\n"
 "    __kernel void Accumulate(\n"
-"      const __global  float* input1,  /* 0 */\n"
-"      __global  float* output) {      /* 2 */\n"
+"      const __global  STORAGE_T* input1,  /* 0 */\n"
+"      __global  STORAGE_T* output,        /* 1 */\n"
+"      const INDEX_T input1_offset,        /* 2 */\n"
+"      const INDEX_T output_offset) {      /* 3 */\n"
+"      input1 += input1_offset;\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
-"      output[x_out] += input1[x_out];\n"
+"      STORE(LOAD(output, x_out) + LOAD(input1, x_out), output, x_out);\n"
 "    }";
 
-static const char* kAddKernel =
+static const char* kAddKernel = JTORCH_INDEX_PRELUDE
 "    /* output = input1 + input2 */\n"
 "    __kernel void Add(\n"
-"      const __global  float* input1,  /* 0 */\n"
-"      const __global  float* input2,  /* 1 */\n"
-"      __global  float* output) {      /* 2 */\n"
+"      const __global  STORAGE_T* input1,  /* 0 */\n"
+"      const __global  STORAGE_T* input2,  /* 1 */\n"
+"      __global  STORAGE_T* output,        /* 2 */\n"
+"      const INDEX_T input1_offset,        /* 3 */\n"
+"      const INDEX_T input2_offset,        /* 4 */\n"
+"      const INDEX_T output_offset) {      /* 5 */\n"
+"      input1 += input1_offset;\n"
+"      input2 += input2_offset;\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
-"      output[x_out] = input1[x_out] + input2[x_out];\n"
+"      STORE(LOAD(input1, x_out) + LOAD(input2, x_out), output, x_out);\n"
 "    }";
 
-static const char* kSubKernel =
+static const char* kSubKernel = JTORCH_INDEX_PRELUDE
 "    /* output = input1 - input2 */\n"
 "    __kernel void Sub(\n"
-"      const __global  float* input1,  /* 0 */\n"
-"      const __global  float* input2,  /* 1 */\n"
-"      __global  float* output) {      /* 2 */\n"
+"      const __global  STORAGE_T* input1,  /* 0 */\n"
+"      const __global  STORAGE_T* input2,  /* 1 */\n"
+"      __global  STORAGE_T* output,        /* 2 */\n"
+"      const INDEX_T input1_offset,        /* 3 */\n"
+"      const INDEX_T input2_offset,        /* 4 */\n"
+"      const INDEX_T output_offset) {      /* 5 */\n"
+"      input1 += input1_offset;\n"
+"      input2 += input2_offset;\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
-"      output[x_out] = input1[x_out] - input2[x_out];\n"
+"      STORE(LOAD(input1, x_out) - LOAD(input2, x_out), output, x_out);\n"
 "    }";
 
-static const char* kAbsKernel =
+static const char* kAbsKernel = JTORCH_INDEX_PRELUDE
 "    /* output = |input1| */\n"
 "    __kernel void Abs(\n"
-"      __global  float* output) {     /* 0 */\n"
+"      __global  STORAGE_T* output,   /* 0 */\n"
+"      const INDEX_T output_offset) { /* 1 */\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
-"      output[x_out] = fabs(output[x_out]);\n"
+"      STORE(fabs(LOAD(output, x_out)), output, x_out);\n"
 "    }";
 
-static const char* kCopyKernel =
+static const char* kCopyKernel = JTORCH_INDEX_PRELUDE
 "    __kernel void Copy(\n"
-"      const __global float* input,  /* 0 */\n"
-"      __global float* output) {     /* 1 */\n"
+"      const __global STORAGE_T* input,  /* 0 */\n"
+"      __global STORAGE_T* output,       /* 1 */\n"
+"      const INDEX_T input_offset,       /* 2 */\n"
+"      const INDEX_T output_offset) {    /* 3 */\n"
+"      input += input_offset;\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
-"      output[x_out] = input[x_out];\n"
+"      STORE(LOAD(input, x_out), output, x_out);\n"
 "    }";
 
-static const char* kMulKernel =
+// Copies between storage formats (see StorageFormat).  The float side is
+// always float, so these ignore JTORCH_HALF.
+static const char* kConvertKernel = JTORCH_INDEX_PRELUDE
+"    __kernel void FloatToHalf(\n"
+"      const __global float* input,   /* 0 */\n"
+"      __global half* output,         /* 1 */\n"
+"      const INDEX_T input_offset,    /* 2 */\n"
+"      const INDEX_T output_offset) { /* 3 */\n"
+"      input += input_offset;\n"
+"      output += output_offset;\n"
+"      const int x_out = get_global_id(0);\n"
+"      vstore_half(input[x_out], x_out, output);\n"
+"    }\n"
+"\n"
+"    __kernel void HalfToFloat(\n"
+"      const __global half* input,    /* 0 */\n"
+"      __global float* output,        /* 1 */\n"
+"      const INDEX_T input_offset,    /* 2 */\n"
+"      const INDEX_T output_offset) { /* 3 */\n"
+"      input += input_offset;\n"
+"      output += output_offset;\n"
+"      const int x_out = get_global_id(0);\n"
+"      output[x_out] = vload_half(x_out, input);\n"
+"    }";
+
+static const char* kMulKernel = JTORCH_INDEX_PRELUDE
 "    /* output = mul_val * output */\n"
 "    __kernel void Mul(\n"
-"      const  float mul_val,  /* 0 */\n"
-"      __global  float* output) {      /* 1 */\n"
+"      const  float mul_val,           /* 0 */\n"
+"      __global  STORAGE_T* output,    /* 1 */\n"
+"      const INDEX_T output_offset) {  /* 2 */\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
-"      output[x_out] *= mul_val;\n"
+"      STORE(LOAD(output, x_out) * mul_val, output, x_out);\n"
 "    }";
 
-static const char* kAddScalarKernel =
+static const char* kAddScalarKernel = JTORCH_INDEX_PRELUDE
 "    /* output = add_val + output */\n"
 "    __kernel void AddScalarKernel(\n"
-"      const  float add_val,  /* 0 */\n"
-"      __global  float* output) {      /* 1 */\n"
+"      const  float add_val,           /* 0 */\n"
+"      __global  STORAGE_T* output,    /* 1 */\n"
+"      const INDEX_T output_offset) {  /* 2 */\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
-"      output[x_out] += add_val;\n"
+"      STORE(LOAD(output, x_out) + add_val, output, x_out);\n"
+"    }";
+
+// Counter-based random numbers: Philox4x32-10 (Salmon et al., "Parallel
+// Random Numbers: As Easy as 1, 2, 3", SC11).  Element i gets word n & 3 of
+// the Philox block of counter {n >> 2, n >> 34, 0, 0}, with n = counter + i,
+// under the key {seed, seed >> 32}.  So every value depends only on the seed
+// and its counter (not on the launch), and consecutive fills continue the
+// same stream when their counters follow on.  Each work item computes one
+// block and writes its 4 values (the first and last blocks of a fill might
+// be partly outside it).  Uniform values are in [0, 1) (24 bits), normal
+// ones come from Box-Muller on the word pairs (x, y) and (z, w).  start is
+// the block index of the chunk (see Runtime::runElementwiseKernel()).
+static const char* kRandKernel = JTORCH_INDEX_PRELUDE
+"    uint4 Philox4x32_10(uint4 ctr, uint2 key) {\n"
+"      for (int r = 0; r < 10; r++) {\n"
+"        if (r > 0) {\n"
+"          key += (uint2)(0x9E3779B9u, 0xBB67AE85u);\n"
+"        }\n"
+"        const uint hi0 = mul_hi(0xD2511F53u, ctr.x);\n"
+"        const uint lo0 = 0xD2511F53u * ctr.x;\n"
+"        const uint hi1 = mul_hi(0xCD9E8D57u, ctr.z);\n"
+"        const uint lo1 = 0xCD9E8D57u * ctr.z;\n"
+"        ctr = (uint4)(hi1 ^ ctr.y ^ key.x, lo1, hi0 ^ ctr.w ^ key.y, lo0);\n"
+"      }\n"
+"      return ctr;\n"
+"    }\n"
+"\n"
+"    /* The block of this work item, and (in first) the output index of its\n"
+"       first word, which is negative if the fill starts inside the block. */\n"
+"    uint4 RandBlock(const uint seed_lo, const uint seed_hi,\n"
+"                    const uint counter_lo, const uint counter_hi,\n"
+"                    const INDEX_T start, long* first) {\n"
+"      const ulong counter = ((ulong)counter_hi << 32) | counter_lo;\n"
+"      const ulong id = (ulong)start + get_global_id(0);\n"
+"      const ulong block = (counter >> 2) + id;\n"
+"      *first = (long)(id << 2) - (long)(counter & 3);\n"
+"      return Philox4x32_10((uint4)((uint)block, (uint)(block >> 32), 0, 0),\n"
+"                           (uint2)(seed_lo, seed_hi));\n"
+"    }\n"
+"\n"
+"    void StoreRand(__global STORAGE_T* output, const long first,\n"
+"                   const INDEX_T nelems, const float4 values) {\n"
+"      if (first >= 0 && first + 4 <= nelems) {\n"
+"        STORE(values.x, output, (INDEX_T)first);\n"
+"        STORE(values.y, output, (INDEX_T)first + 1);\n"
+"        STORE(values.z, output, (INDEX_T)first + 2);\n"
+"        STORE(values.w, output, (INDEX_T)first + 3);\n"
+"        return;\n"
+"      }\n"
+"      /* The first or last block of the fill. */\n"
+"      const float v[4] = {values.x, values.y, values.z, values.w};\n"
+"      for (int k = 0; k < 4; k++) {\n"
+"        if (first + k >= 0 && first + k < nelems) {\n"
+"          STORE(v[k], output, (INDEX_T)(first + k));\n"
+"        }\n"
+"      }\n"
+"    }\n"
+"\n"
+"    __kernel void RandUniform(\n"
+"      __global STORAGE_T* output,     /* 0 */\n"
+"      const uint seed_lo,             /* 1 */\n"
+"      const uint seed_hi,             /* 2 */\n"
+"      const uint counter_lo,          /* 3 */\n"
+"      const uint counter_hi,          /* 4 */\n"
+"      const INDEX_T output_offset,    /* 5 */\n"
+"      const INDEX_T nelems,           /* 6 */\n"
+"      const INDEX_T start) {          /* 7 */\n"
+"      output += output_offset;\n"
+"      long first;\n"
+"      const uint4 r = RandBlock(seed_lo, seed_hi, counter_lo, counter_hi,\n"
+"                                start, &first);\n"
+"      StoreRand(output, first, nelems,\n"
+"                convert_float4(r >> 8) * (1.0f / 16777216.0f));\n"
+"    }\n"
+"\n"
+"    __kernel void RandNormal(\n"
+"      __global STORAGE_T* output,     /* 0 */\n"
+"      const uint seed_lo,             /* 1 */\n"
+"      const uint seed_hi,             /* 2 */\n"
+"      const uint counter_lo,          /* 3 */\n"
+"      const uint counter_hi,          /* 4 */\n"
+"      const INDEX_T output_offset,    /* 5 */\n"
+"      const INDEX_T nelems,           /* 6 */\n"
+"      const INDEX_T start) {          /* 7 */\n"
+"      output += output_offset;\n"
+"      long first;\n"
+"      const uint4 r = RandBlock(seed_lo, seed_hi, counter_lo, counter_hi,\n"
+"                                start, &first);\n"
+"      /* u.x and u.z are in (0, 1] so that the logs are finite. */\n"
+"      const float4 u = convert_float4((r >> 8) + (uint4)(1, 0, 1, 0)) *\n"
+"          (1.0f / 16777216.0f);\n"
+"      const float2 radius = sqrt(-2.0f * log(u.xz));\n"
+"      const float2 angle = 2.0f * u.yw;\n"
+"      const float2 c = cospi(angle) * radius;\n"
+"      const float2 s = sinpi(angle) * radius;\n"
+"      StoreRand(output, first, nelems, (float4)(c.x, s.x, c.y, s.y));\n"
 "    }";
 
-// Note: This Tensor class DOESN'T support non-contiguous tensors.  Updating
-// it to do so wouldn't be a huge amount of work, but I have not needed to
-// do any select or narrow operations on the inner dimensions, so I have
-// not implemented it.
-// TODO(tompson): Implement non-contiguous support!
+// The elementwise ops above only handle contiguous tensors.  Ops on
+// non-contiguous tensors all go through this kernel instead.  It handles
+// kMaxStridedDims dimensions (after merging the dimensions that are
+// contiguous with each other), and is launched once per outer coordinate
+// for views with more.  Element start + id of the iteration shape (size0 x
+// size1 x size2 x ...) is split into coordinates, and each operand is then
+// addressed with its own offset and strides.  op is uniform, so the switch
+// doesn't diverge.
+static const uint32_t kMaxStridedDims = 4;
+static const char* kStridedKernel = JTORCH_INDEX_PRELUDE
+"    #define STRIDED_COPY 0\n"
+"    #define STRIDED_FILL 1\n"
+"    #define STRIDED_ADD 2\n"
+"    #define STRIDED_SUB 3\n"
+"    #define STRIDED_ACCUMULATE 4\n"
+"    #define STRIDED_ABS 5\n"
+"    #define STRIDED_MUL 6\n"
+"    #define STRIDED_ADD_SCALAR 7\n"
+"    #define STRIDED_INDEX(t) (t##_offset + c0 * t##_stride0 + \\\n"
+"      c1 * t##_stride1 + c2 * t##_stride2 + c3 * t##_stride3)\n"
+"    __kernel void Strided(\n"
+"      const __global STORAGE_T* x,     /* 0 */\n"
+"      const __global STORAGE_T* y,     /* 1 */\n"
+"      __global STORAGE_T* output,      /* 2 */\n"
+"      const int op,                    /* 3 */\n"
+"      const float value,               /* 4 */\n"
+"      const INDEX_T size0,             /* 5 */\n"
+"      const INDEX_T size1,             /* 6 */\n"
+"      const INDEX_T size2,             /* 7 */\n"
+"      const INDEX_T x_offset,          /* 8 */\n"
+"      const INDEX_T x_stride0,         /* 9 */\n"
+"      const INDEX_T x_stride1,         /* 10 */\n"
+"      const INDEX_T x_stride2,         /* 11 */\n"
+"      const INDEX_T x_stride3,         /* 12 */\n"
+"      const INDEX_T y_offset,          /* 13 */\n"
+"      const INDEX_T y_stride0,         /* 14 */\n"
+"      const INDEX_T y_stride1,         /* 15 */\n"
+"      const INDEX_T y_stride2,         /* 16 */\n"
+"      const INDEX_T y_stride3,         /* 17 */\n"
+"      const INDEX_T output_offset,     /* 18 */\n"
+"      const INDEX_T output_stride0,    /* 19 */\n"
+"      const INDEX_T output_stride1,    /* 20 */\n"
+"      const INDEX_T output_stride2,    /* 21 */\n"
+"      const INDEX_T output_stride3,    /* 22 */\n"
+"      const INDEX_T start) {           /* 23 */\n"
+"      INDEX_T i = start + get_global_id(0);\n"
+"      const INDEX_T c0 = i % size0;\n"
+"      i /= size0;\n"
+"      const INDEX_T c1 = i % size1;\n"
+"      i /= size1;\n"
+"      const INDEX_T c2 = i % size2;\n"
+"      const INDEX_T c3 = i / size2;\n"
+"      __global STORAGE_T* out = output + STRIDED_INDEX(output);\n"
+"      switch (op) {\n"
+"        case STRIDED_COPY:\n"
+"          STORE(LOAD(x, STRIDED_INDEX(x)), out, 0);\n"
+"          break;\n"
+"        case STRIDED_FILL:\n"
+"          STORE(value, out, 0);\n"
+"          break;\n"
+"        case STRIDED_ADD:\n"
+"          STORE(LOAD(x, STRIDED_INDEX(x)) + LOAD(y, STRIDED_INDEX(y)), out,\n"
+"                0);\n"
+"          break;\n"
+"        case STRIDED_SUB:\n"
+"          STORE(LOAD(x, STRIDED_INDEX(x)) - LOAD(y, STRIDED_INDEX(y)), out,\n"
+"                0);\n"
+"          break;\n"
+"        case STRIDED_ACCUMULATE:\n"
+"          STORE(LOAD(out, 0) + LOAD(x, STRIDED_INDEX(x)), out, 0);\n"
+"          break;\n"
+"        case STRIDED_ABS:\n"
+"          STORE(fabs(LOAD(out, 0)), out, 0);\n"
+"          break;\n"
+"        case STRIDED_MUL:\n"
+"          STORE(LOAD(out, 0) * value, out, 0);\n"
+"          break;\n"
+"        case STRIDED_ADD_SCALAR:\n"
+"          STORE(LOAD(out, 0) + value, out, 0);\n"
+"          break;\n"
+"      }\n"
+"    }";
+
+// Work-group tree reductions (see Tensor::reduce()).  Each work-group reduces
+// n elements, inner apart, into one output: group g reads
+// input[(g / inner) * n * inner + g % inner + j * inner] for j < n, skipping
+// indices >= end.  The work items first reduce their strided share of the
+// elements, then the partial results are combined in local memory in
+// log2(local size) steps (so the local size must be a power of 2).  The op is
+// a compile time define (sum when undefined).  The input can be in either
+// storage format, but the accumulation and the output are always float.
+static const uint32_t kReduceLocalSize = 256;
+// Whole tensor reductions first reduce into at most this many partial
+// results (each work item handling at least kReduceItemsPerThread elements),
+// which a single work-group then reduces.
+static const uint64_t kMaxReducePartials = 256;
+static const uint64_t kReduceItemsPerThread = 16;
+static const char* kReduceKernel = JTORCH_INDEX_PRELUDE
+"    #ifndef REDUCE_OP\n"
+"      #define REDUCE_OP 0\n"
+"    #endif\n"
+"    #if REDUCE_OP == 0\n"
+"      #define REDUCE(a, b) ((a) + (b))\n"
+"      #define REDUCE_IDENTITY 0.0f\n"
+"    #elif REDUCE_OP == 1\n"
+"      #define REDUCE(a, b) fmax(a, b)\n"
+"      #define REDUCE_IDENTITY (-INFINITY)\n"
+"    #else\n"
+"      #define REDUCE(a, b) fmin(a, b)\n"
+"      #define REDUCE_IDENTITY INFINITY\n"
+"    #endif\n"
+"    __kernel void Reduce(\n"
+"      const __global STORAGE_T* input, /* 0 */\n"
+"      __global float* output,          /* 1 */\n"
+"      __local float* scratch,          /* 2 */\n"
+"      const INDEX_T n,                 /* 3 */\n"
+"      const INDEX_T inner,             /* 4 */\n"
+"      const INDEX_T end,               /* 5 */\n"
+"      const INDEX_T first_group,       /* 6 */\n"
+"      const INDEX_T input_offset,      /* 7 */\n"
+"      const INDEX_T output_offset) {   /* 8 */\n"
+"      const INDEX_T group = first_group + get_group_id(0);\n"
+"      const int lid = get_local_id(0);\n"
+"      const int lsize = get_local_size(0);\n"
+"      const INDEX_T base = (group / inner) * n * inner + group % inner;\n"
+"      input += input_offset;\n"
+"      float acc = REDUCE_IDENTITY;\n"
+"      for (INDEX_T j = lid; j < n; j += lsize) {\n"
+"        const INDEX_T i = base + j * inner;\n"
+"        if (i < end) {\n"
+"          acc = REDUCE(acc, LOAD(input, i));\n"
+"        }\n"
+"      }\n"
+"      scratch[lid] = acc;\n"
+"      barrier(CLK_LOCAL_MEM_FENCE);\n"
+"      for (int s = lsize / 2; s > 0; s >>= 1) {\n"
+"        if (lid < s) {\n"
+"          scratch[lid] = REDUCE(scratch[lid], scratch[lid + s]);\n"
+"        }\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);\n"
+"      }\n"
+"      if (lid == 0) {\n"
+"        output[output_offset + group] = scratch[0];\n"
+"      }\n"
+"    }";
+
+// Tensors are strided views into their storage: element (i0, i1, ...) is at
+// storage()[offset() + i0 * stride()[0] + i1 * stride()[1] + ...].  Tensors
+// allocated by the constructors (and resize) are contiguous.  select, narrow
+// and transpose return O(1) views that generally aren't, so code that
+// addresses a tensor as one block (ie most stage kernels) must first check
+// isContiguous() and otherwise use contiguous() (or
+// TorchStage::contiguousInput()).  The elementwise ops here, copy and
+// getData / setData handle any strides.
 template <typename T>
 class Tensor : public TorchData {
  public:
   // Default constructor that allocates a zero dimension tensor.
-  Tensor();
+  explicit Tensor(Runtime* runtime = nullptr,
+                  const StorageFormat format = FLOAT_STORAGE);
   // Constructor to allocate a tensor of dimension dim. size is an array of
   // sizes for each dimension. size[0] is the lowest (contiguous) dimension.
   // Note that this is opposite to torch, where size(1) is the highest (outer)
   // dimension.
-  Tensor(const uint32_t dim, const uint32_t* size);
+  // runtime: the runtime that owns the tensor (nullptr: Runtime::Current()).
+  // format: the element format of the storage.  T is the host side type, so
+  // the data of HALF_STORAGE tensors is still set and read as floats (they
+  // are converted on the device).
+  Tensor(const uint32_t dim, const uint32_t* size, Runtime* runtime = nullptr,
+         const StorageFormat format = FLOAT_STORAGE);
   ~Tensor() override;
 
   TorchDataType type() const override { return TENSOR_DATA; }
 
   // setData and getData are EXPENSIVE --> They require a CPU to GPU copy
+  // (through pinned staging memory, or directly into the storage when the
+  // device shares memory with the host).
   void setData(const T* data);
   void getData(T* data) const;
 
+  // Map the tensor's storage into host memory, so that it can be filled in
+  // (or read back) without an extra copy.  The contents of a buffer mapped
+  // with mapForWrite() are undefined until written.  unmap() must be called
+  // before the tensor is used by any module.  The tensor must be contiguous
+  // and in FLOAT_STORAGE.
+  T* mapForWrite();
+  const T* mapForRead() const;
+  void unmap() const;
+
   const uint32_t dim() const { return dim_; }
   const uint32_t* size() const { return size_.get(); }
   const bool isSameSizeAs(const Tensor<T>& src) const;
@@ -142,6 +465,7 @@ class Tensor : public TorchData {
   // requested size is smaller than (or equal to) the current size. Otherwise it
   // will allocate a new buffer and copy over the elements. True is returned
   // when the underlining storage changes (i.e. memory was allocated).
+  // Non-contiguous tensors can only be "resized" to their current size.
   bool resize(const uint32_t dim, const uint32_t* size);
 
   // Courtesy function for the above.
@@ -150,7 +474,8 @@ class Tensor : public TorchData {
   // Print --> EXPENSIVE
   void print() override;  // print to std::cout
 
-  // Some simple tensor math operations
+  // Some simple tensor math operations.  The operands of the binary ops can
+  // be in different storage formats (they are converted to dst's).
   // copy: dst = src
   static void copy(Tensor<T>& dst, const Tensor<T>& src);
   // add: dst = x + y
@@ -171,58 +496,156 @@ class Tensor : public TorchData {
   static void zero(Tensor<T>& x);
   // fill: x = vec(value)
   static void fill(Tensor<T>& x, float value);
-  // slowSum - This does a CPU copy because I haven't written a reduction
-  // operator yet
-  static float slowSum(const Tensor<T>& x);
-  // slowMax - This does a CPU copy because I haven't written a reduction
-  // operator yet
-  static float slowMax(const Tensor<T>& x);
-  // slowMin - This does a CPU copy because I haven't written a reduction
-  // operator yet
-  static float slowMin(const Tensor<T>& x);
-  // slowMean - This does a CPU copy because I haven't written a reduction
-  // operator yet
-  static float slowMean(const Tensor<T>& x);
+  // eval: dst = expr, where expr is an elementwise expression of tensors and
+  // scalars (ie abs((x - y) * 0.5f)), in one fused kernel launch.  See
+  // tensor_expr.h, which must be included to build expressions.
+  template <typename E>
+  static void eval(Tensor<T>& dst, const E& expr);
+  // Reductions.  These run on the device (see kReduceKernel), and only the
+  // result is read back.
+  static float sum(const Tensor<T>& x);
+  static float max(const Tensor<T>& x);
+  static float min(const Tensor<T>& x);
+  static float mean(const Tensor<T>& x);
+  // The device versions, which don't read anything back.  With dim < 0 dst is
+  // resized to a single element.  Otherwise the reduction is along dimension
+  // dim: dst is resized to x's size with size[dim] = 1 (as per torch).  dst
+  // must be in FLOAT_STORAGE (the reductions accumulate in float).
+  enum ReduceOp {
+    REDUCE_SUM = 0,  // The values match REDUCE_OP in kReduceKernel.
+    REDUCE_MAX = 1,
+    REDUCE_MIN = 2,
+    REDUCE_MEAN = 3,
+  };
+  static void reduce(Tensor<T>& dst, const Tensor<T>& x, const ReduceOp op,
+                     const int32_t dim = -1);
+  // rand: dst = uniform random values in [0, 1).  randn: dst = standard
+  // normal random values.  Both are generated on the device (see
+  // kRandKernel): element i (in dst's logical order) is a function of seed
+  // and counter + i only, so the results are reproducible, and a tensor
+  // filled in slices with matching counters gets the same values as one
+  // filled at once.
+  static void rand(Tensor<T>& dst, const uint64_t seed,
+                   const uint64_t counter = 0);
+  static void randn(Tensor<T>& dst, const uint64_t seed,
+                    const uint64_t counter = 0);
   // slowRand - This generates random numbers on the CPU then uploads them.
+  // Prefer rand(), which doesn't go through the host.
   static std::shared_ptr<Tensor<T>> slowRand(const uint32_t dim,
-                                             const uint32_t* size);
+                                             const uint32_t* size,
+                                             Runtime* runtime = nullptr);
 
   // Some tensor math operations that return new tensors
   static std::shared_ptr<Tensor<T>> clone(const Tensor<T>& x);
+  // contiguous: x itself (a view of it) if it is contiguous, otherwise a
+  // contiguous clone.
+  static std::shared_ptr<Tensor<T>> contiguous(const Tensor<T>& x);
+  // toFormat: x itself (a view of it) if it is already in format, otherwise
+  // a (contiguous) copy of it in format.
+  static std::shared_ptr<Tensor<T>> toFormat(const Tensor<T>& x,
+                                             const StorageFormat format);
   // for gaussian1D: sigma = size / 2
-  static std::shared_ptr<Tensor<T>> gaussian1D(const int32_t kernel_size);
-  static std::shared_ptr<Tensor<T>> gaussian(const int32_t kernel_size);
-  static std::shared_ptr<Tensor<T>> loadFromFile(const std::string& file);
+  static std::shared_ptr<Tensor<T>> gaussian1D(const int32_t kernel_size,
+                                               Runtime* runtime = nullptr);
+  static std::shared_ptr<Tensor<T>> gaussian(const int32_t kernel_size,
+                                             Runtime* runtime = nullptr);
+  static std::shared_ptr<Tensor<T>> loadFromFile(const std::string& file,
+                                                 Runtime* runtime = nullptr);
   static void saveToFile(const Tensor<T>& tensor, const std::string& file);
 
-  // In selectOuterDim we do not fully support slicing tensors along any
-  // arbitrary dimension, but it is easy enough to select contiguous chunks.
-  // As per torch standard, select reduces dimension by 1.
+  // The following return views that share the source's storage (no
+  // allocation or device work).  Dimensions are in jtorch order (dim 0 is the
+  // lowest dimension).
+  // select: the slice at index i of dimension dim.  As per torch standard,
+  // select reduces dimension by 1.
+  static std::shared_ptr<Tensor<T>> select(const Tensor<T>& src,
+                                           const uint32_t dim,
+                                           const uint32_t i);
+  // narrow: indices [i, i + length) of dimension dim.  As per torch standard,
+  // narrow does not reduce dimension by 1.
+  static std::shared_ptr<Tensor<T>> narrow(const Tensor<T>& src,
+                                           const uint32_t dim,
+                                           const uint32_t i,
+                                           const uint32_t length);
+  // transpose: swap dimensions dim1 and dim2.
+  static std::shared_ptr<Tensor<T>> transpose(const Tensor<T>& src,
+                                              const uint32_t dim1,
+                                              const uint32_t dim2);
+  // The outer dimension versions of select and narrow, which keep contiguous
+  // tensors contiguous.
   static std::shared_ptr<Tensor<T>> selectOuterDim(const Tensor<T>& src,
                                                    const uint32_t i);
-
-  // In narrowOuterDim we do not fully support slicing tensors along any
-  // arbitrary dimension, but it is easy enough to select contiguous chunks.
-  // As per torch standard, narrow does not reduce dimension by 1.
   static std::shared_ptr<Tensor<T>> narrowOuterDim(const Tensor<T>& src,
                                                    const uint32_t i,
                                                    const uint32_t length);
 
   // View returns a new view on the same object.  The caller owns the new
-  // memory (ie, it is transferred).
+  // memory (ie, it is transferred).  src must be contiguous.
   static std::shared_ptr<Tensor<T>> view(const Tensor<T>& src,
                                          const uint32_t dim,
                                          const uint32_t* size);
 
+  // The tensor's elements are in storage() from offset() on, at stride()
+  // (see above).  Views share the source's storage (at a different offset),
+  // so kernels must always be passed both.
   const std::shared_ptr<jcl::OpenCLBufferData> storage() const;
-  inline uint32_t nelems() const;
-  std::unique_ptr<uint32_t[]> calcStride() const;
+  Runtime* runtime() const { return runtime_; }
+  uint64_t offset() const { return offset_; }
+  const uint64_t* stride() const { return stride_.get(); }  // In elements
+  // Kernels reading or writing the storage must be compiled for this format
+  // (see KernelDefines()).
+  StorageFormat format() const { return format_; }
+  inline uint64_t nelems() const;
+  // The strides of a contiguous tensor of this size.
+  std::unique_ptr<uint64_t[]> calcStride() const;
+  // True if the elements are storage()[offset(), offset() + nelems()) in
+  // order.  Dimensions of size 1 don't count.
+  bool isContiguous() const;
+  // True if the tensor's element indices into its storage don't fit in an
+  // int, so kernels must use their 64-bit variant (see NeedsIndex64()).
+  bool index64() const { return NeedsIndex64(offset_ + span()); }
 
  protected:
+  Runtime* runtime_;
   std::shared_ptr<jcl::OpenCLBufferData> storage_;  // Internal data
+  uint64_t offset_;  // In elements
   uint32_t dim_;
   std::unique_ptr<uint32_t[]> size_;  // size_[0] is lowest contiguous dim,
                                       // size_[2] is highest dim
+  std::unique_ptr<uint64_t[]> stride_;
+  StorageFormat format_;
+
+  // The ops of kStridedKernel.
+  enum StridedOp {
+    STRIDED_COPY = 0,
+    STRIDED_FILL = 1,
+    STRIDED_ADD = 2,
+    STRIDED_SUB = 3,
+    STRIDED_ACCUMULATE = 4,
+    STRIDED_ABS = 5,
+    STRIDED_MUL = 6,
+    STRIDED_ADD_SCALAR = 7,
+  };
+  // Run op with kStridedKernel (x and y are nullptr if unused).
+  static void stridedOp(const StridedOp op, const float value, Tensor<T>& dst,
+                        const Tensor<T>* x, const Tensor<T>* y);
+  // Run one kReduceKernel pass of groups work-groups (see kReduceKernel).
+  static void reducePass(const ReduceOp op, Tensor<T>& dst, const Tensor<T>& x,
+                         const uint64_t n, const uint64_t inner,
+                         const uint64_t end, const uint64_t groups);
+  static float reduceToHost(const Tensor<T>& x, const ReduceOp op);
+  // Run kernel (RandUniform or RandNormal of kRandKernel) into dst.
+  static void randFill(const CachedKernel& kernel, Tensor<T>& dst,
+                       const uint64_t seed, const uint64_t counter);
+  // The number of storage elements from offset() to the last element
+  // (inclusive), which is nelems() for contiguous tensors.
+  uint64_t span() const;
+  // A new (empty) header on the same storage.
+  std::shared_ptr<Tensor<T>> header(const uint32_t dim) const;
+  // The storage is allocated in floats (see jcl::OpenCLBufferData), so this
+  // is the size of the buffer holding nelems elements of format.
+  static uint64_t storageNelems(const uint64_t nelems,
+                                const StorageFormat format);
 
   // Non-copyable, non-assignable.
   Tensor(const Tensor&) = delete;
@@ -230,32 +653,44 @@ class Tensor : public TorchData {
 };
 
 template <typename T>
-Tensor<T>::Tensor(const uint32_t dim, const uint32_t* size) {
+Tensor<T>::Tensor(const uint32_t dim, const uint32_t* size, Runtime* runtime,
+                  const StorageFormat format) {
+  runtime_ = runtime != nullptr ? runtime : Runtime::Current();
+  RASSERT(runtime_ != nullptr);
+  runtime_->num_tensors_++;
+  format_ = format;
   this->dim_ = dim;
   this->size_.reset(new uint32_t[dim]);
   memcpy(this->size_.get(), size, sizeof(this->size_[0]) * dim);
-  storage_ = jtorch::cl_context->allocateBuffer(
-      jcl::CLBufferTypeReadWrite,
-      nelems());
+  stride_ = calcStride();
+  // Most tensors are stage inputs and outputs (stages retag the others).
+  storage_ = runtime_->context()->allocateBuffer(
+      jcl::CLBufferTypeReadWrite, storageNelems(nelems(), format_), false,
+      jcl::CLBufferTagActivations, runtime_->deviceid());
+  offset_ = 0;
   zero(*this);
 }
 
 template <typename T>
-Tensor<T>::Tensor() {
+Tensor<T>::Tensor(Runtime* runtime, const StorageFormat format) {
   // Default constructor returns an empty header.  Used internally (ie
   // private).
+  runtime_ = runtime != nullptr ? runtime : Runtime::Current();
+  RASSERT(runtime_ != nullptr);
+  runtime_->num_tensors_++;
+  format_ = format;
   dim_ = 0;
   size_.reset(nullptr);
+  stride_.reset(nullptr);
   storage_ = nullptr;
+  offset_ = 0;
 }
 
 template <typename T>
 Tensor<T>::~Tensor() {
-  // Note: If the following assertions are breaking, it means
-  // that you are not cleaning up your allocated tensors
-  // before shutting down jtorch.
-  RASSERT(jtorch::cl_context != nullptr);
+  // Note: The runtime checks that its tensors are gone before it shuts down.
   storage_ = nullptr;  // decrement ref count
+  runtime_->num_tensors_--;
 }
 
 template <typename T>
@@ -266,28 +701,39 @@ const std::shared_ptr<jcl::OpenCLBufferData> Tensor<T>::storage() const {
 template <typename T>
 bool Tensor<T>::resize(const uint32_t dim, const uint32_t* size) {
   RASSERT(dim > 0);
-  uint32_t new_nelems = size[0];
+  if (dim == dim_ && memcmp(size, size_.get(), sizeof(size[0]) * dim) == 0) {
+    return false;  // Nothing to do (and the strides stay as they are).
+  }
+  RASSERT(isContiguous());
+  uint64_t new_nelems = size[0];
   for (uint32_t i = 1; i < dim; i++) {
     new_nelems *= size[i];
   }
   bool new_alloc = false;
-  if (storage_ == nullptr || storage_->nelems() < new_nelems) {
+  if (storage_ == nullptr ||
+      storage_->nelems() < storageNelems(offset_ + new_nelems, format_)) {
     // The user requested a larger tensor. We need to allocate a larger tensor
     // and copy over what we have.
     std::shared_ptr<jcl::OpenCLBufferData> new_storage =
-        jtorch::cl_context->allocateBuffer(jcl::CLBufferTypeReadWrite,
-                                           new_nelems);
+        runtime_->context()->allocateBuffer(
+            jcl::CLBufferTypeReadWrite, storageNelems(new_nelems, format_),
+            false,
+            storage_ != nullptr ? storage_->tag()
+                                : jcl::CLBufferTagActivations,
+            runtime_->deviceid());
     if (storage_ != nullptr) {
-      cl_context->useKernelCStr(kCopyKernel, "Copy");
-      cl_context->setArg(0, storage_);     // input
-      cl_context->setArg(1, new_storage);  // ouptut
-      uint32_t dim = 1;
+      const bool index64 = this->index64();
+      static const CachedKernel copy_kernel(kCopyKernel, "Copy");
+      jcl::OpenCLKernel* kernel = copy_kernel.get(runtime_, index64, format_);
+      kernel->setArg(0, storage_);     // input
+      kernel->setArg(1, new_storage);  // ouptut
       // The current view might be smaller than the old storage, so avoid
       // copying too much data.
-      uint32_t nelem = nelems();
-      cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+      runtime_->runElementwiseKernel(kernel, 2, {offset_, 0}, nelems(),
+                                     index64);
     }
     storage_ = new_storage;
+    offset_ = 0;
     new_alloc = true;
   } else {
     // Otherwise, the size is smaller than the current storage, so just shrink
@@ -300,6 +746,7 @@ bool Tensor<T>::resize(const uint32_t dim, const uint32_t* size) {
   for (uint32_t i = 0; i < dim_; i++) {
     size_[i] = size[i];
   }
+  stride_ = calcStride();
   return new_alloc;
 }
 
@@ -309,21 +756,63 @@ bool Tensor<T>::resizeAs(const Tensor<T>& src) {
 }
 
 template <typename T>
-std::unique_ptr<uint32_t[]> Tensor<T>::calcStride() const {
-  std::unique_ptr<uint32_t[]> stride(new uint32_t[dim_]);
-  stride[0] = 1;
-  for (uint32_t i = 1; i < dim_; i++) {
-    stride[i] = stride[i - 1] * size_[i - 1];
+std::unique_ptr<uint64_t[]> Tensor<T>::calcStride() const {
+  std::unique_ptr<uint64_t[]> stride(new uint64_t[dim_]);
+  uint64_t cur_stride = 1;
+  for (uint32_t i = 0; i < dim_; i++) {
+    stride[i] = cur_stride;
+    cur_stride *= size_[i];
   }
   return std::move(stride);
 }
 
 template <typename T>
-uint32_t Tensor<T>::nelems() const {
+bool Tensor<T>::isContiguous() const {
+  uint64_t expected_stride = 1;
+  for (uint32_t i = 0; i < dim_; i++) {
+    if (size_[i] != 1 && stride_[i] != expected_stride) {
+      return false;
+    }
+    expected_stride *= size_[i];
+  }
+  return true;
+}
+
+template <typename T>
+uint64_t Tensor<T>::span() const {
+  if (nelems() == 0) {
+    return 0;
+  }
+  uint64_t span = 1;
+  for (uint32_t i = 0; i < dim_; i++) {
+    span += (uint64_t)(size_[i] - 1) * stride_[i];
+  }
+  return span;
+}
+
+template <typename T>
+std::shared_ptr<Tensor<T>> Tensor<T>::header(const uint32_t dim) const {
+  std::shared_ptr<Tensor<T>> ret(new Tensor<T>(runtime_, format_));  // Empty.
+  ret->dim_ = dim;
+  ret->size_.reset(new uint32_t[dim]);
+  ret->stride_.reset(new uint64_t[dim]);
+  ret->storage_ = storage_;  // Incruments ref count.
+  ret->offset_ = offset_;
+  return ret;
+}
+
+template <typename T>
+uint64_t Tensor<T>::storageNelems(const uint64_t nelems,
+                                  const StorageFormat format) {
+  return format == HALF_STORAGE ? (nelems + 1) / 2 : nelems;
+}
+
+template <typename T>
+uint64_t Tensor<T>::nelems() const {
   if (dim_ == 0) {
     return 0;
   }
-  uint32_t nelem = 1;
+  uint64_t nelem = 1;
   for (uint32_t i = 0; i < dim_; i++) {
     nelem *= size_[i];
   }
@@ -352,34 +841,98 @@ std::shared_ptr<Tensor<T>> Tensor<T>::view(const Tensor<T>& src,
                                            const uint32_t dim,
                                            const uint32_t* size) {
   RASSERT(dim != 0);
-  int32_t view_nelem = 1;
+  uint64_t view_nelem = 1;
   for (uint32_t i = 0; i < dim; i++) {
     view_nelem *= size[i];
   }
 
   RASSERT(view_nelem == src.nelems());  // Otherwise size mismatch
+  // Otherwise the new sizes can't be expressed with strides in general (use
+  // contiguous() first).
+  RASSERT(src.isContiguous());
 
-  std::shared_ptr<Tensor<T>> return_header(new Tensor<T>());
-  return_header->dim_ = dim;
-  return_header->size_.reset(new uint32_t[dim]);
+  std::shared_ptr<Tensor<T>> return_header = src.header(dim);
   memcpy(return_header->size_.get(), size,
          sizeof(return_header->size_[0]) * dim);
-  return_header->storage_ = src.storage_;  // Incruments ref count.
+  return_header->stride_ = return_header->calcStride();
   return return_header;
 }
 
 template <typename T>
 void Tensor<T>::setData(const T* data) {
   RASSERT(dim_ != 0);
-  jtorch::cl_context->writeToBuffer(data, nelems(), jtorch::deviceid, storage_,
-                                    true);
+  if (!isContiguous() || format_ != FLOAT_STORAGE) {
+    std::shared_ptr<Tensor<T>> tmp(new Tensor<T>(dim_, size_.get(), runtime_));
+    tmp->setData(data);
+    copy(*this, *tmp);
+    return;
+  }
+  jcl::OpenCLContext* context = runtime_->context();
+  const uint32_t device = runtime_->deviceid();
+  if (context->hostUnifiedMemory(device)) {
+    memcpy(mapForWrite(), data, nelems() * sizeof(T));
+    unmap();
+    return;
+  }
+  // Write into a pinned staging buffer and let the device DMA it over.  The
+  // copy is queued behind the unmap, so there is no need to wait for it here.
+  std::shared_ptr<jcl::OpenCLBufferData> staging =
+      context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems(), true,
+                              jcl::CLBufferTagScratch, device);
+  void* ptr = context->mapBuffer(device, staging, true, nelems());
+  memcpy(ptr, data, nelems() * sizeof(T));
+  context->unmapBuffer(device, staging);
+  context->copyBuffer(device, staging, storage_, nelems(), 0, offset_);
 }
 
 template <typename T>
 void Tensor<T>::getData(T* data) const {
   RASSERT(dim_ != 0);
-  jtorch::cl_context->readFromBuffer(data, nelems(), jtorch::deviceid, storage_,
-                                     true);
+  if (!isContiguous()) {
+    contiguous(*this)->getData(data);
+    return;
+  }
+  if (format_ != FLOAT_STORAGE) {
+    toFormat(*this, FLOAT_STORAGE)->getData(data);
+    return;
+  }
+  jcl::OpenCLContext* context = runtime_->context();
+  const uint32_t device = runtime_->deviceid();
+  if (context->hostUnifiedMemory(device)) {
+    memcpy(data, mapForRead(), nelems() * sizeof(T));
+    unmap();
+    return;
+  }
+  std::shared_ptr<jcl::OpenCLBufferData> staging =
+      context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems(), true,
+                              jcl::CLBufferTagScratch, device);
+  context->copyBuffer(device, storage_, staging, nelems(), offset_, 0);
+  const void* ptr = context->mapBuffer(device, staging, false, nelems());
+  memcpy(data, ptr, nelems() * sizeof(T));
+  context->unmapBuffer(device, staging);
+}
+
+template <typename T>
+T* Tensor<T>::mapForWrite() {
+  RASSERT(dim_ != 0);
+  RASSERT(isContiguous());
+  RASSERT(format_ == FLOAT_STORAGE);
+  return (T*)runtime_->context()->mapBuffer(runtime_->deviceid(), storage_,
+                                            true, nelems(), offset_);
+}
+
+template <typename T>
+const T* Tensor<T>::mapForRead() const {
+  RASSERT(dim_ != 0);
+  RASSERT(isContiguous());
+  RASSERT(format_ == FLOAT_STORAGE);
+  return (const T*)runtime_->context()->mapBuffer(
+      runtime_->deviceid(), storage_, false, nelems(), offset_);
+}
+
+template <typename T>
+void Tensor<T>::unmap() const {
+  runtime_->context()->unmapBuffer(runtime_->deviceid(), storage_);
 }
 
 template <typename T>
@@ -389,7 +942,7 @@ void Tensor<T>::print() {
   T* d = new T[nelems()];
   getData(d);
   T max_val = std::numeric_limits<T>::min();
-  for (uint32_t i = 0; i < nelems(); i++) {
+  for (uint64_t i = 0; i < nelems(); i++) {
     max_val = std::max<T>(max_val, d[i]);
   }
   T scale = (T)pow(10.0, floor(log10((double)max_val + kEpsilon)));
@@ -504,7 +1057,7 @@ void Tensor<T>::print() {
 
   std::cout << "[jtorch.";
   std::cout << jcl::OpenCLContext::CLDeviceToString(
-      jtorch::cl_context->getDeviceType(jtorch::deviceid));
+      runtime_->context()->getDeviceType(runtime_->deviceid()));
   std::cout << " of dimension ";
   for (int32_t i = (int32_t)dim_ - 1; i >= 0; i--) {
     std::cout << size_[i];
@@ -516,9 +1069,10 @@ void Tensor<T>::print() {
 };
 
 template <typename T>
-std::shared_ptr<Tensor<T>> Tensor<T>::gaussian1D(const int32_t kernel_size) {
+std::shared_ptr<Tensor<T>> Tensor<T>::gaussian1D(const int32_t kernel_size,
+                                                 Runtime* runtime) {
   const uint32_t size = kernel_size;
-  std::shared_ptr<Tensor<T>> ret(new Tensor<T>(1, &size));
+  std::shared_ptr<Tensor<T>> ret(new Tensor<T>(1, &size, runtime));
   const float sigma = 0.25f;
   const float amplitude = 1.0f;
   const float center = (float)kernel_size / 2.0f + 0.5f;
@@ -536,9 +1090,10 @@ std::shared_ptr<Tensor<T>> Tensor<T>::gaussian1D(const int32_t kernel_size) {
 }
 
 template <typename T>
-std::shared_ptr<Tensor<T>> Tensor<T>::gaussian(const int32_t kernel_size) {
+std::shared_ptr<Tensor<T>> Tensor<T>::gaussian(const int32_t kernel_size,
+                                               Runtime* runtime) {
   const uint32_t size[2] = {(uint32_t)kernel_size, (uint32_t)kernel_size};
-  std::shared_ptr<Tensor<T>> ret(new Tensor<T>(2, size));
+  std::shared_ptr<Tensor<T>> ret(new Tensor<T>(2, size, runtime));
   const float sigma = 0.25f;
   const float amplitude = 1.0f;
   const float center = (float)kernel_size / 2.0f + 0.5f;
@@ -559,93 +1114,146 @@ std::shared_ptr<Tensor<T>> Tensor<T>::gaussian(const int32_t kernel_size) {
 template <typename T>
   std::shared_ptr<Tensor<T>> Tensor<T>::clone(const Tensor<T>& x) {
   RASSERT(x.dim_ != 0);
-  std::shared_ptr<Tensor<T>> ret(new Tensor<T>(x.dim_, x.size_.get()));
-  cl_context->useKernelCStr(kCopyKernel, "Copy");
-  cl_context->setArg(0, x.storage());  // input
-  cl_context->setArg(1, ret->storage());  // output
-  uint32_t dim = 1;
-  uint32_t nelem = x.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  std::shared_ptr<Tensor<T>> ret(
+      new Tensor<T>(x.dim_, x.size_.get(), x.runtime_, x.format_));
+  copy(*ret, x);
   return ret;
 }
 
 template <typename T>
-std::shared_ptr<Tensor<T>> Tensor<T>::selectOuterDim(const Tensor<T>& src,
-                                                     const uint32_t i) {
+std::shared_ptr<Tensor<T>> Tensor<T>::contiguous(const Tensor<T>& x) {
+  if (!x.isContiguous()) {
+    return clone(x);
+  }
+  return view(x, x.dim_, x.size_.get());
+}
+
+template <typename T>
+std::shared_ptr<Tensor<T>> Tensor<T>::toFormat(const Tensor<T>& x,
+                                               const StorageFormat format) {
+  RASSERT(x.dim_ != 0);
+  if (x.format_ == format) {
+    return narrow(x, 0, 0, x.size_[0]);  // A view with the same strides.
+  }
+  std::shared_ptr<Tensor<T>> ret(
+      new Tensor<T>(x.dim_, x.size_.get(), x.runtime_, format));
+  copy(*ret, x);
+  return ret;
+}
+
+template <typename T>
+std::shared_ptr<Tensor<T>> Tensor<T>::select(const Tensor<T>& src,
+                                             const uint32_t dim,
+                                             const uint32_t i) {
   RASSERT(src.dim_ != 0);  // Can't select on empty tensors.
   // For now, we don't support selecting scalars from vectors.
   RASSERT(src.dim_ > 1);
-  RASSERT(i < src.size_[src.dim_ - 1]);
-
-  std::shared_ptr<Tensor<T>> ret(new Tensor<T>());  // Empty tensor.
-
-  // Calculate the return size.
-  ret->dim_ = src.dim_ - 1;
-  ret->size_.reset(new uint32_t[ret->dim_]);
-
-  // Copy size from dims 0 to (dim - 1).
-  for (uint32_t i = 0; i < ret->dim_; i++) {
-    ret->size_[i] = src.size_[i];
+  RASSERT(dim < src.dim_);
+  RASSERT(i < src.size_[dim]);
+
+  std::shared_ptr<Tensor<T>> ret = src.header(src.dim_ - 1);
+  // Drop dimension dim.
+  for (uint32_t d = 0, src_d = 0; src_d < src.dim_; src_d++) {
+    if (src_d != dim) {
+      ret->size_[d] = src.size_[src_d];
+      ret->stride_[d] = src.stride_[src_d];
+      d++;
+    }
   }
+  ret->offset_ = src.offset_ + src.stride_[dim] * i;
+  return ret;
+}
 
-  // Calculate the offset in memory.
-  std::unique_ptr<uint32_t[]> src_stride = src.calcStride();
-  uint32_t offset = src_stride[src.dim_ - 1] * i;
-
-  // Calculate the new size size.
-  const uint32_t new_nelems = ret->nelems();
-
-  ret->storage_ = src.storage_->createSubBuffer(new_nelems, offset);
+template <typename T>
+std::shared_ptr<Tensor<T>> Tensor<T>::narrow(const Tensor<T>& src,
+                                             const uint32_t dim,
+                                             const uint32_t i,
+                                             const uint32_t length) {
+  RASSERT(length > 0); // Otherwise the output would be empty.
+  RASSERT(src.dim_ != 0);  // Can't narrow on empty tensors.
+  RASSERT(dim < src.dim_);
+  RASSERT(i < src.size_[dim]);  // Make sure the start index fits.
+  // Make sure the whole chunk fits.
+  RASSERT(i + length - 1 < src.size_[dim]);
+
+  std::shared_ptr<Tensor<T>> ret = src.header(src.dim_);
+  memcpy(ret->size_.get(), src.size_.get(), sizeof(ret->size_[0]) * src.dim_);
+  memcpy(ret->stride_.get(), src.stride_.get(),
+         sizeof(ret->stride_[0]) * src.dim_);
+  ret->size_[dim] = length;
+  ret->offset_ = src.offset_ + src.stride_[dim] * i;
+  return ret;
+}
 
+template <typename T>
+std::shared_ptr<Tensor<T>> Tensor<T>::transpose(const Tensor<T>& src,
+                                                const uint32_t dim1,
+                                                const uint32_t dim2) {
+  RASSERT(dim1 < src.dim_ && dim2 < src.dim_);
+
+  std::shared_ptr<Tensor<T>> ret = src.header(src.dim_);
+  memcpy(ret->size_.get(), src.size_.get(), sizeof(ret->size_[0]) * src.dim_);
+  memcpy(ret->stride_.get(), src.stride_.get(),
+         sizeof(ret->stride_[0]) * src.dim_);
+  std::swap(ret->size_[dim1], ret->size_[dim2]);
+  std::swap(ret->stride_[dim1], ret->stride_[dim2]);
   return ret;
 }
 
+template <typename T>
+std::shared_ptr<Tensor<T>> Tensor<T>::selectOuterDim(const Tensor<T>& src,
+                                                     const uint32_t i) {
+  RASSERT(src.dim_ != 0);  // Can't select on empty tensors.
+  return select(src, src.dim_ - 1, i);
+}
+
 template <typename T>
 std::shared_ptr<Tensor<T>> Tensor<T>::narrowOuterDim(const Tensor<T>& src,
                                                      const uint32_t i,
                                                      const uint32_t length) {
-  RASSERT(length > 0); // Otherwise the output would be empty.
   RASSERT(src.dim_ != 0);  // Can't narrow on empty tensors.
   // For now, we don't support narrowing scalars from vectors.
   RASSERT(src.dim_ > 1 || length > 1);
-  RASSERT(i < src.size_[src.dim_ - 1]);  // Make sure the start index fits.
-  // Make sure the whole chunk fits.
-  RASSERT(i + length - 1 < src.size_[src.dim_ - 1]);
-
-  std::shared_ptr<Tensor<T>> ret(new Tensor<T>());  // Empty tensor.
-
-  // Calculate the return size.
-  ret->dim_ = src.dim_;
-  ret->size_.reset(new uint32_t[ret->dim_]);
-
-  // Copy size, and set the outputer dimension to length.
-  for (uint32_t i = 0; i < ret->dim_; i++) {
-    ret->size_[i] = src.size_[i];
-  }
-  ret->size_[ret->dim_ - 1] = length;
-
-  // Calculate the offset in memory.
-  std::unique_ptr<uint32_t[]> src_stride = src.calcStride();
-  uint32_t offset = src_stride[src.dim_ - 1] * i;
-
-  // Calculate the new size size.
-  const uint32_t new_nelems = ret->nelems();
-
-  ret->storage_ = src.storage_->createSubBuffer(new_nelems, offset);
-
-  return ret;
+  return narrow(src, src.dim_ - 1, i, length);
 }
 
 template <typename T>
 void Tensor<T>::copy(Tensor<T>& dst, const Tensor<T>& src) {
   RASSERT(src.dim_ != 0);
   RASSERT(dst.dim_ != 0);
-  cl_context->useKernelCStr(kCopyKernel, "Copy");
-  cl_context->setArg(0, src.storage());  // input
-  cl_context->setArg(1, dst.storage());  // output
-  uint32_t dim = 1;
-  uint32_t nelem = dst.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  RASSERT(src.runtime_ == dst.runtime_);
+  if (src.format_ != dst.format_ &&
+      (!src.isContiguous() || !dst.isContiguous())) {
+    // Only contiguous tensors are converted directly, so either gather src
+    // first or convert into a temporary and scatter that.
+    if (!src.isContiguous()) {
+      copy(dst, *contiguous(src));
+    } else {
+      copy(dst, *toFormat(src, dst.format_));
+    }
+    return;
+  }
+  if (!src.isContiguous() || !dst.isContiguous()) {
+    stridedOp(STRIDED_COPY, 0, dst, &src, nullptr);
+    return;
+  }
+  const bool index64 = src.index64() || dst.index64();
+  static const CachedKernel copy_kernel(kCopyKernel, "Copy");
+  // The conversions are compiled as float (their arguments are typed).
+  static const CachedKernel to_half_kernel(kConvertKernel, "FloatToHalf");
+  static const CachedKernel to_float_kernel(kConvertKernel, "HalfToFloat");
+  jcl::OpenCLKernel* kernel;
+  if (src.format_ == dst.format_) {
+    kernel = copy_kernel.get(dst.runtime_, index64, dst.format_);
+  } else if (src.format_ == FLOAT_STORAGE) {
+    kernel = to_half_kernel.get(dst.runtime_, index64, FLOAT_STORAGE);
+  } else {
+    kernel = to_float_kernel.get(dst.runtime_, index64, FLOAT_STORAGE);
+  }
+  kernel->setArg(0, src.storage());  // input
+  kernel->setArg(1, dst.storage());  // output
+  dst.runtime_->runElementwiseKernel(kernel, 2, {src.offset(), dst.offset()},
+                                     dst.nelems(), index64);
 }
 
 template <typename T>
@@ -653,13 +1261,26 @@ void Tensor<T>::add(Tensor<T>& dst, const Tensor<T>& x, const Tensor<T>& y) {
   RASSERT(dst.dim_ != 0);
   RASSERT(x.dim_ != 0);
   RASSERT(y.dim_ != 0);
-  cl_context->useKernelCStr(kAddKernel, "Add");
-  cl_context->setArg(0, x.storage());
-  cl_context->setArg(1, y.storage());
-  cl_context->setArg(2, dst.storage());
-  uint32_t dim = 1;
-  uint32_t nelem = dst.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  RASSERT(x.runtime_ == dst.runtime_);
+  RASSERT(y.runtime_ == dst.runtime_);
+  if (x.format_ != dst.format_ || y.format_ != dst.format_) {
+    add(dst, *toFormat(x, dst.format_), *toFormat(y, dst.format_));
+    return;
+  }
+  if (!x.isContiguous() || !y.isContiguous() || !dst.isContiguous()) {
+    stridedOp(STRIDED_ADD, 0, dst, &x, &y);
+    return;
+  }
+  const bool index64 = x.index64() || y.index64() || dst.index64();
+  static const CachedKernel add_kernel(kAddKernel, "Add");
+  jcl::OpenCLKernel* kernel =
+      add_kernel.get(dst.runtime_, index64, dst.format_);
+  kernel->setArg(0, x.storage());
+  kernel->setArg(1, y.storage());
+  kernel->setArg(2, dst.storage());
+  dst.runtime_->runElementwiseKernel(kernel, 3,
+                                     {x.offset(), y.offset(), dst.offset()},
+                                     dst.nelems(), index64);
 }
 
 template <typename T>
@@ -667,68 +1288,112 @@ void Tensor<T>::sub(Tensor<T>& dst, const Tensor<T>& x, const Tensor<T>& y) {
   RASSERT(dst.dim_ != 0);
   RASSERT(x.dim_ != 0);
   RASSERT(y.dim_ != 0);
-  cl_context->useKernelCStr(kSubKernel, "Sub");
-  cl_context->setArg(0, x.storage());
-  cl_context->setArg(1, y.storage());
-  cl_context->setArg(2, dst.storage());
-  uint32_t dim = 1;
-  uint32_t nelem = dst.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  RASSERT(x.runtime_ == dst.runtime_);
+  RASSERT(y.runtime_ == dst.runtime_);
+  if (x.format_ != dst.format_ || y.format_ != dst.format_) {
+    sub(dst, *toFormat(x, dst.format_), *toFormat(y, dst.format_));
+    return;
+  }
+  if (!x.isContiguous() || !y.isContiguous() || !dst.isContiguous()) {
+    stridedOp(STRIDED_SUB, 0, dst, &x, &y);
+    return;
+  }
+  const bool index64 = x.index64() || y.index64() || dst.index64();
+  static const CachedKernel sub_kernel(kSubKernel, "Sub");
+  jcl::OpenCLKernel* kernel =
+      sub_kernel.get(dst.runtime_, index64, dst.format_);
+  kernel->setArg(0, x.storage());
+  kernel->setArg(1, y.storage());
+  kernel->setArg(2, dst.storage());
+  dst.runtime_->runElementwiseKernel(kernel, 3,
+                                     {x.offset(), y.offset(), dst.offset()},
+                                     dst.nelems(), index64);
 }
 
 template <typename T>
 void Tensor<T>::abs(Tensor<T>& x) {
   RASSERT(x.dim_ != 0);
-  cl_context->useKernelCStr(kAbsKernel, "Abs");
-  cl_context->setArg(0, x.storage());
-  uint32_t dim = 1;
-  uint32_t nelem = x.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  if (!x.isContiguous()) {
+    stridedOp(STRIDED_ABS, 0, x, nullptr, nullptr);
+    return;
+  }
+  const bool index64 = x.index64();
+  static const CachedKernel abs_kernel(kAbsKernel, "Abs");
+  jcl::OpenCLKernel* kernel = abs_kernel.get(x.runtime_, index64, x.format_);
+  kernel->setArg(0, x.storage());
+  x.runtime_->runElementwiseKernel(kernel, 1, {x.offset()}, x.nelems(),
+                                   index64);
 }
 
 template <typename T>
 void Tensor<T>::mul(Tensor<T>& x, float mul_val) {
   RASSERT(x.dim_ != 0);
-  cl_context->useKernelCStr(kMulKernel, "Mul");
-  cl_context->setArg(0, mul_val);
-  cl_context->setArg(1, x.storage());
-  uint32_t dim = 1;
-  uint32_t nelem = x.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  if (!x.isContiguous()) {
+    stridedOp(STRIDED_MUL, mul_val, x, nullptr, nullptr);
+    return;
+  }
+  const bool index64 = x.index64();
+  static const CachedKernel mul_kernel(kMulKernel, "Mul");
+  jcl::OpenCLKernel* kernel = mul_kernel.get(x.runtime_, index64, x.format_);
+  kernel->setArg(0, mul_val);
+  kernel->setArg(1, x.storage());
+  x.runtime_->runElementwiseKernel(kernel, 2, {x.offset()}, x.nelems(),
+                                   index64);
 }
 
 template <typename T>
 void Tensor<T>::div(Tensor<T>& x, float div_val) {
   RASSERT(x.dim_ != 0);
-  cl_context->useKernelCStr(kMulKernel, "Mul");
-  cl_context->setArg(0, 1.0f / div_val);
-  cl_context->setArg(1, x.storage());
-  uint32_t dim = 1;
-  uint32_t nelem = x.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  if (!x.isContiguous()) {
+    stridedOp(STRIDED_MUL, 1.0f / div_val, x, nullptr, nullptr);
+    return;
+  }
+  const bool index64 = x.index64();
+  static const CachedKernel mul_kernel(kMulKernel, "Mul");
+  jcl::OpenCLKernel* kernel = mul_kernel.get(x.runtime_, index64, x.format_);
+  kernel->setArg(0, 1.0f / div_val);
+  kernel->setArg(1, x.storage());
+  x.runtime_->runElementwiseKernel(kernel, 2, {x.offset()}, x.nelems(),
+                                   index64);
 }
 
 template <typename T>
 void Tensor<T>::add(Tensor<T>& x, float add_val) {
   RASSERT(x.dim_ != 0);
-  cl_context->useKernelCStr(kAddScalarKernel, "AddScalarKernel");
-  cl_context->setArg(0, add_val);
-  cl_context->setArg(1, x.storage());
-  uint32_t dim = 1;
-  uint32_t nelem = x.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  if (!x.isContiguous()) {
+    stridedOp(STRIDED_ADD_SCALAR, add_val, x, nullptr, nullptr);
+    return;
+  }
+  const bool index64 = x.index64();
+  static const CachedKernel add_kernel(kAddScalarKernel, "AddScalarKernel");
+  jcl::OpenCLKernel* kernel = add_kernel.get(x.runtime_, index64, x.format_);
+  kernel->setArg(0, add_val);
+  kernel->setArg(1, x.storage());
+  x.runtime_->runElementwiseKernel(kernel, 2, {x.offset()}, x.nelems(),
+                                   index64);
 }
 
 template <typename T>
 void Tensor<T>::accumulate(Tensor<T>& dst, const Tensor<T>& src) {
   RASSERT(src.dim_ != 0);
   RASSERT(dst.dim_ != 0);
-  cl_context->useKernelCStr(kAccumulateKernel, "Accumulate");
-  cl_context->setArg(0, src.storage());
-  cl_context->setArg(1, dst.storage());
-  uint32_t dim = 1;
-  uint32_t nelem = dst.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  RASSERT(src.runtime_ == dst.runtime_);
+  if (src.format_ != dst.format_) {
+    accumulate(dst, *toFormat(src, dst.format_));
+    return;
+  }
+  if (!src.isContiguous() || !dst.isContiguous()) {
+    stridedOp(STRIDED_ACCUMULATE, 0, dst, &src, nullptr);
+    return;
+  }
+  const bool index64 = src.index64() || dst.index64();
+  static const CachedKernel accumulate_kernel(kAccumulateKernel, "Accumulate");
+  jcl::OpenCLKernel* kernel =
+      accumulate_kernel.get(dst.runtime_, index64, dst.format_);
+  kernel->setArg(0, src.storage());
+  kernel->setArg(1, dst.storage());
+  dst.runtime_->runElementwiseKernel(kernel, 2, {src.offset(), dst.offset()},
+                                     dst.nelems(), index64);
 }
 
 template <typename T>
@@ -739,68 +1404,261 @@ void Tensor<T>::zero(Tensor<T>& dst) {
 template <typename T>
 void Tensor<T>::fill(Tensor<T>& dst, float value) {
   RASSERT(dst.dim_ != 0);
-  cl_context->useKernelCStr(kFillKernel, "Fill");
-  cl_context->setArg(0, dst.storage());
-  cl_context->setArg(1, value);
-  uint32_t dim = 1;
-  uint32_t nelem = dst.nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  if (!dst.isContiguous()) {
+    stridedOp(STRIDED_FILL, value, dst, nullptr, nullptr);
+    return;
+  }
+  const bool index64 = dst.index64();
+  static const CachedKernel fill_kernel(kFillKernel, "Fill");
+  jcl::OpenCLKernel* kernel =
+      fill_kernel.get(dst.runtime_, index64, dst.format_);
+  kernel->setArg(0, dst.storage());
+  kernel->setArg(1, value);
+  dst.runtime_->runElementwiseKernel(kernel, 2, {dst.offset()}, dst.nelems(),
+                                     index64);
 }
 
 template <typename T>
-float Tensor<T>::slowSum(const Tensor<T>& x) {
-  RASSERT(x.dim_ != 0);
-  std::unique_ptr<float[]> temp(new float[x.nelems()]);
-  x.getData(temp.get());
-  float sum = 0.0f;
-  for (uint32_t i = 0; i < x.nelems(); i++) {
-    sum += temp[i];
+void Tensor<T>::stridedOp(const StridedOp op, const float value,
+                          Tensor<T>& dst, const Tensor<T>* x,
+                          const Tensor<T>* y) {
+  const Tensor<T>* operands[3] = {x, y, &dst};  // In kernel argument order
+  // Iterate over the shape of the first non-contiguous operand.  The others
+  // must have the same shape, or else be contiguous with the same number of
+  // elements (they are then indexed as if they had the iteration shape).
+  const Tensor<T>* iter = &dst;
+  for (const Tensor<T>* t : operands) {
+    if (t != nullptr && !t->isContiguous()) {
+      iter = t;
+      break;
+    }
+  }
+  const std::unique_ptr<uint64_t[]> contiguous_stride = iter->calcStride();
+  bool index64 = NeedsIndex64(iter->nelems());
+  for (const Tensor<T>* t : operands) {
+    if (t != nullptr) {
+      RASSERT(t->format_ == dst.format_);  // Converted by the callers.
+      RASSERT(t->nelems() == iter->nelems());
+      RASSERT(t->isContiguous() || t->isSameSizeAs(*iter));
+      index64 = index64 || t->index64();
+    }
   }
-  return sum;
-}
 
-template <typename T>
-float Tensor<T>::slowMax(const Tensor<T>& x) {
-  RASSERT(x.dim_ != 0);
-  std::unique_ptr<float[]> temp(new float[x.nelems()]);
-  x.getData(temp.get());
-  float max = -std::numeric_limits<float>::infinity();
-  for (uint32_t i = 0; i < x.nelems(); i++) {
-    if (max < temp[i]) {
-      max = temp[i];
+  // Drop the dimensions of size 1 and merge each dimension into the previous
+  // one if it is contiguous with it in every operand.
+  std::vector<uint64_t> size;
+  std::vector<uint64_t> stride[3];
+  for (uint32_t d = 0; d < iter->dim_; d++) {
+    if (iter->size_[d] == 1) {
+      continue;
+    }
+    uint64_t cur_stride[3] = {0, 0, 0};
+    bool merge = !size.empty();
+    for (uint32_t k = 0; k < 3; k++) {
+      if (operands[k] != nullptr) {
+        cur_stride[k] = operands[k]->isContiguous() ? contiguous_stride[d]
+                                                    : operands[k]->stride_[d];
+        merge = merge && cur_stride[k] == stride[k].back() * size.back();
+      }
+    }
+    if (merge) {
+      size.back() *= iter->size_[d];
+    } else {
+      size.push_back(iter->size_[d]);
+      for (uint32_t k = 0; k < 3; k++) {
+        stride[k].push_back(cur_stride[k]);
+      }
     }
   }
-  return max;
+  // The kernel covers the inner kMaxStridedDims dimensions.  Any outer ones
+  // left after merging are iterated over here, with one launch per
+  // coordinate (and the operand offsets advanced to it).
+  uint64_t inner_nelems = 1;
+  uint64_t num_launches = 1;
+  for (uint32_t d = 0; d < size.size(); d++) {
+    if (d < kMaxStridedDims) {
+      inner_nelems *= size[d];
+    } else {
+      num_launches *= size[d];
+    }
+  }
+  size.resize(std::max<size_t>(size.size(), kMaxStridedDims), 1);
+
+  static const CachedKernel strided_kernel(kStridedKernel, "Strided");
+  jcl::OpenCLKernel* kernel =
+      strided_kernel.get(dst.runtime_, index64, dst.format_);
+  const Tensor<T>* args[3];
+  for (uint32_t k = 0; k < 3; k++) {
+    // Unused operands alias dst (with zero strides).
+    args[k] = operands[k] != nullptr ? operands[k] : &dst;
+    stride[k].resize(size.size(), 0);
+    kernel->setArg(k, args[k]->storage());
+    for (uint32_t d = 0; d < kMaxStridedDims; d++) {
+      SetIndexArg(kernel, 9 + 5 * k + d, stride[k][d], index64);
+    }
+  }
+  kernel->setArg(3, (int32_t)op);
+  kernel->setArg(4, value);
+  for (uint32_t d = 0; d < kMaxStridedDims - 1; d++) {
+    SetIndexArg(kernel, 5 + d, size[d], index64);
+  }
+  for (uint64_t launch = 0; launch < num_launches; launch++) {
+    uint64_t rest = launch;
+    uint64_t offset[3] = {args[0]->offset_, args[1]->offset_,
+                          args[2]->offset_};
+    for (uint32_t d = kMaxStridedDims; d < size.size(); d++) {
+      const uint64_t c = rest % size[d];
+      rest /= size[d];
+      for (uint32_t k = 0; k < 3; k++) {
+        offset[k] += c * stride[k][d];
+      }
+    }
+    for (uint32_t k = 0; k < 3; k++) {
+      SetIndexArg(kernel, 8 + 5 * k, offset[k], index64);
+    }
+    // The start index is advanced like an offset for large tensors.
+    dst.runtime_->runElementwiseKernel(kernel, 23, {0}, inner_nelems,
+                                       index64);
+  }
 }
 
 template <typename T>
-float Tensor<T>::slowMin(const Tensor<T>& x) {
+void Tensor<T>::reduce(Tensor<T>& dst, const Tensor<T>& x, const ReduceOp op,
+                       const int32_t dim) {
   RASSERT(x.dim_ != 0);
-  std::unique_ptr<float[]> temp(new float[x.nelems()]);
-  x.getData(temp.get());
-  float min = std::numeric_limits<float>::infinity();
-  for (uint32_t i = 0; i < x.nelems(); i++) {
-    if (min > temp[i]) {
-      min = temp[i];
+  RASSERT(x.runtime_ == dst.runtime_);
+  RASSERT(dst.format_ == FLOAT_STORAGE);
+  RASSERT(dim < (int32_t)x.dim_);
+  if (!x.isContiguous()) {
+    reduce(dst, *contiguous(x), op, dim);
+    return;
+  }
+
+  // Each output reduces n elements, inner apart.
+  uint64_t n = x.nelems();
+  uint64_t inner = 1;
+  uint64_t num_outputs = 1;
+  if (dim < 0) {
+    const uint32_t one = 1;
+    dst.resize(1, &one);
+  } else {
+    n = x.size_[dim];
+    std::unique_ptr<uint32_t[]> size(new uint32_t[x.dim_]);
+    for (uint32_t d = 0; d < x.dim_; d++) {
+      size[d] = x.size_[d];
+      if (d < (uint32_t)dim) {
+        inner *= x.size_[d];
+      }
     }
+    size[dim] = 1;
+    dst.resize(x.dim_, size.get());
+    num_outputs = dst.nelems();
+  }
+  RASSERT(dst.isContiguous());
+
+  const ReduceOp kernel_op = op == REDUCE_MEAN ? REDUCE_SUM : op;
+  const uint64_t partials =
+      std::min<uint64_t>(kMaxReducePartials,
+                         n / (kReduceLocalSize * kReduceItemsPerThread));
+  if (dim < 0 && partials > 1) {
+    // Two passes: partials work-groups each reduce a chunk, then one
+    // work-group reduces their results.
+    const uint64_t chunk = (n + partials - 1) / partials;
+    const uint32_t partials_size = (uint32_t)partials;
+    Tensor<T> partial(1, &partials_size, x.runtime_);
+    partial.storage()->setTag(jcl::CLBufferTagScratch);
+    reducePass(kernel_op, partial, x, chunk, 1, n, partials);
+    reducePass(kernel_op, dst, partial, partials, 1, partials, 1);
+  } else {
+    reducePass(kernel_op, dst, x, n, inner, x.nelems(), num_outputs);
+  }
+  if (op == REDUCE_MEAN) {
+    div(dst, (float)n);
   }
-  return min;
 }
 
 template <typename T>
-float Tensor<T>::slowMean(const Tensor<T>& x) {
-  RASSERT(x.dim_ != 0);
-  std::unique_ptr<float[]> temp(new float[x.nelems()]);
-  x.getData(temp.get());
-  float mean = 0;
-  for (uint32_t i = 0; i < x.nelems(); i++) {
-    mean += temp[i];
+void Tensor<T>::reducePass(const ReduceOp op, Tensor<T>& dst,
+                           const Tensor<T>& x, const uint64_t n,
+                           const uint64_t inner, const uint64_t end,
+                           const uint64_t groups) {
+  const bool index64 =
+      x.index64() || dst.index64() || NeedsIndex64(end + n * inner);
+  // By op.  Sums use the default (so TorchStage::prepare() builds them).
+  static const CachedKernel reduce_kernels[] = {
+      CachedKernel(kReduceKernel, "Reduce"),
+      CachedKernel(kReduceKernel, "Reduce",
+                   {{"REDUCE_OP", std::to_string((int32_t)REDUCE_MAX)}}),
+      CachedKernel(kReduceKernel, "Reduce",
+                   {{"REDUCE_OP", std::to_string((int32_t)REDUCE_MIN)}}),
+  };
+  RASSERT(op != REDUCE_MEAN);  // Reduced as a sum.
+  Runtime* runtime = x.runtime_;
+  jcl::OpenCLContext* context = runtime->context();
+  const uint32_t device = runtime->deviceid();
+  jcl::OpenCLKernel* kernel =
+      reduce_kernels[op].get(runtime, index64, x.format_);
+
+  // The largest power of 2 local size the kernel allows, but no more work
+  // items than elements per output.
+  const uint32_t max_local_size = std::min<uint32_t>(
+      kReduceLocalSize, kernel->max_workgroup_size(device));
+  uint32_t local_size = 1;
+  while (local_size * 2 <= max_local_size && local_size < n) {
+    local_size *= 2;
+  }
+
+  kernel->setArg(0, x.storage());
+  kernel->setArg(1, dst.storage());
+  // nullptr --> Local memory allocation (per work-group).
+  kernel->setArg(2, (uint32_t)(sizeof(float) * local_size), nullptr);
+  SetIndexArg(kernel, 3, n, index64);
+  SetIndexArg(kernel, 4, inner, index64);
+  SetIndexArg(kernel, 5, end, index64);
+  SetIndexArg(kernel, 7, x.offset_, index64);
+  SetIndexArg(kernel, 8, dst.offset_, index64);
+  // Keep each launch's global size within a uint32_t.
+  const uint64_t max_groups = ((uint64_t)1 << 31) / local_size;
+  for (uint64_t first = 0; first < groups; first += max_groups) {
+    SetIndexArg(kernel, 6, first, index64);
+    const uint32_t global_size =
+        (uint32_t)std::min<uint64_t>(groups - first, max_groups) * local_size;
+    context->runKernel(kernel, device, 1, &global_size, &local_size, false);
   }
-  return mean / static_cast<float>(x.nelems());
 }
 
 template <typename T>
-std::shared_ptr<Tensor<T>> Tensor<T>::loadFromFile(const std::string& file) {
+float Tensor<T>::reduceToHost(const Tensor<T>& x, const ReduceOp op) {
+  Tensor<T> result(x.runtime_);
+  reduce(result, x, op);
+  float value;
+  result.getData(&value);
+  return value;
+}
+
+template <typename T>
+float Tensor<T>::sum(const Tensor<T>& x) {
+  return reduceToHost(x, REDUCE_SUM);
+}
+
+template <typename T>
+float Tensor<T>::max(const Tensor<T>& x) {
+  return reduceToHost(x, REDUCE_MAX);
+}
+
+template <typename T>
+float Tensor<T>::min(const Tensor<T>& x) {
+  return reduceToHost(x, REDUCE_MIN);
+}
+
+template <typename T>
+float Tensor<T>::mean(const Tensor<T>& x) {
+  return reduceToHost(x, REDUCE_MEAN);
+}
+
+template <typename T>
+std::shared_ptr<Tensor<T>> Tensor<T>::loadFromFile(const std::string& file,
+                                                   Runtime* runtime) {
   std::shared_ptr<Tensor<T>> new_tensor = nullptr;
   std::ifstream ifile(file.c_str(), std::ios::in | std::ios::binary);
   if (ifile.is_open()) {
@@ -814,7 +1672,8 @@ std::shared_ptr<Tensor<T>> Tensor<T>::loadFromFile(const std::string& file) {
       ifile.read((char*)(&cur_size), sizeof(cur_size));
       size[dim - i - 1] = (uint32_t)cur_size;
     }
-    new_tensor = std::shared_ptr<Tensor<T>>(new Tensor<T>(dim, size));
+    new_tensor =
+        std::shared_ptr<Tensor<T>>(new Tensor<T>(dim, size, runtime));
 
     T* data = new T[new_tensor->nelems()];
     ifile.read((char*)(data), sizeof(data[0]) * new_tensor->nelems());
@@ -854,19 +1713,61 @@ void Tensor<T>::saveToFile(const Tensor<T>& tensor, const std::string& file) {
   }
 }
 
+template <typename T>
+void Tensor<T>::rand(Tensor<T>& dst, const uint64_t seed,
+                     const uint64_t counter) {
+  static const CachedKernel kernel(kRandKernel, "RandUniform");
+  randFill(kernel, dst, seed, counter);
+}
+
+template <typename T>
+void Tensor<T>::randn(Tensor<T>& dst, const uint64_t seed,
+                      const uint64_t counter) {
+  static const CachedKernel kernel(kRandKernel, "RandNormal");
+  randFill(kernel, dst, seed, counter);
+}
+
+template <typename T>
+void Tensor<T>::randFill(const CachedKernel& kernel, Tensor<T>& dst,
+                         const uint64_t seed, const uint64_t counter) {
+  RASSERT(dst.dim_ != 0);
+  if (!dst.isContiguous()) {
+    // The values follow the logical element order, so generate them
+    // contiguously and scatter them.
+    Tensor<T> tmp(dst.dim_, dst.size_.get(), dst.runtime_, dst.format_);
+    randFill(kernel, tmp, seed, counter);
+    copy(dst, tmp);
+    return;
+  }
+  const bool index64 = dst.index64() || NeedsIndex64(dst.nelems());
+  jcl::OpenCLKernel* rand_kernel =
+      kernel.get(dst.runtime_, index64, dst.format_);
+  rand_kernel->setArg(0, dst.storage());
+  rand_kernel->setArg(1, (uint32_t)seed);
+  rand_kernel->setArg(2, (uint32_t)(seed >> 32));
+  rand_kernel->setArg(3, (uint32_t)counter);
+  rand_kernel->setArg(4, (uint32_t)(counter >> 32));
+  SetIndexArg(rand_kernel, 5, dst.offset(), index64);
+  SetIndexArg(rand_kernel, 6, dst.nelems(), index64);
+  // One work item per Philox block (of 4 values) that overlaps dst.
+  const uint64_t nblocks = ((counter & 3) + dst.nelems() + 3) / 4;
+  dst.runtime_->runElementwiseKernel(rand_kernel, 7, {0}, nblocks, index64);
+}
+
 template <typename T>
 std::shared_ptr<Tensor<T>> Tensor<T>::slowRand(const uint32_t dim,
-                                               const uint32_t* size) {
+                                               const uint32_t* size,
+                                               Runtime* runtime) {
   RASSERT(dim > 0);
 
-  std::shared_ptr<Tensor<T>> ret(new Tensor<T>(dim, size));
-  const uint32_t nelems = ret->nelems();
+  std::shared_ptr<Tensor<T>> ret(new Tensor<T>(dim, size, runtime));
+  const uint64_t nelems = ret->nelems();
 
   // Allocate the tensor on the CPU first.
   std::default_random_engine generator;
   std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
   std::unique_ptr<float[]> ret_cpu(new float[nelems]);
-  for (uint32_t i = 0; i < nelems; i++) {
+  for (uint64_t i = 0; i < nelems; i++) {
     ret_cpu[i] = distribution(generator);
   }
 
@@ -0,0 +1,349 @@
+//
+//  tensor_expr.h
+//
+//  Lazy elementwise tensor expressions.  Each of the Tensor ops (add, sub,
+//  mul, abs, ...) is a kernel launch and a full pass over memory, so chaining
+//  them reads and writes every element once per op.  Instead, the operators
+//  and functions below build an expression tree (without doing any work),
+//  which Tensor::eval() turns into a single kernel:
+//
+//    Tensor<float>::eval(dst, abs((x - y) * 0.5f));
+//
+//  The kernel source is generated from the expression's type, ie its shape,
+//  once per shape, and the kernel is resolved once per runtime and thread
+//  (see CachedKernel), so evaluations don't look the program up.  The
+//  tensors and scalars are bound as kernel arguments, so the same kernel
+//  serves every evaluation with the same shape.
+//
+//  Note that abs, sqrt, exp, log, tanh, fmax and fmin below hide the
+//  standard functions from unqualified calls inside namespace jtorch, so
+//  code there should call std::abs (etc) for scalars.
+//
+//  The operands must have dst's size (there is no broadcasting).  Operands
+//  in the other storage format, and strided ones, are first copied into
+//  contiguous tensors in dst's format.  Arithmetic is in float.  Expressions
+//  hold references to their tensors, so they should be evaluated in the
+//  statement that builds them.
+//
+
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "jtorch/jtorch.h"
+#include "jtorch/tensor.h"
+
+namespace jtorch {
+
+// A tensor operand.  The kernel's tensor arguments are t0, t1, ... in the
+// order they appear in the expression, already offset to the first element.
+template <typename T>
+class TensorExpr {
+ public:
+  explicit TensorExpr(const Tensor<T>& x) : x_(x) {}
+  static std::string code(uint32_t* tensor, uint32_t* scalar) {
+    return "LOAD(t" + std::to_string((*tensor)++) + ", i)";
+  }
+  template <typename U>
+  void bind(std::vector<const Tensor<U>*>* tensors,
+            std::vector<float>* scalars) const {
+    tensors->push_back(&x_);
+  }
+
+ private:
+  const Tensor<T>& x_;
+};
+
+// A scalar operand (kernel arguments s0, s1, ...).
+class ScalarExpr {
+ public:
+  explicit ScalarExpr(const float value) : value_(value) {}
+  static std::string code(uint32_t* tensor, uint32_t* scalar) {
+    return "s" + std::to_string((*scalar)++);
+  }
+  template <typename U>
+  void bind(std::vector<const Tensor<U>*>* tensors,
+            std::vector<float>* scalars) const {
+    scalars->push_back(value_);
+  }
+
+ private:
+  float value_;
+};
+
+template <typename Op, typename A>
+class UnaryExpr {
+ public:
+  explicit UnaryExpr(const A& a) : a_(a) {}
+  static std::string code(uint32_t* tensor, uint32_t* scalar) {
+    return Op::code(A::code(tensor, scalar));
+  }
+  template <typename U>
+  void bind(std::vector<const Tensor<U>*>* tensors,
+            std::vector<float>* scalars) const {
+    a_.bind(tensors, scalars);
+  }
+
+ private:
+  A a_;
+};
+
+template <typename Op, typename A, typename B>
+class BinaryExpr {
+ public:
+  BinaryExpr(const A& a, const B& b) : a_(a), b_(b) {}
+  static std::string code(uint32_t* tensor, uint32_t* scalar) {
+    // Separate statements: the evaluation order of function arguments is
+    // unspecified, and the operands must be numbered left to right.
+    const std::string a = A::code(tensor, scalar);
+    const std::string b = B::code(tensor, scalar);
+    return Op::code(a, b);
+  }
+  template <typename U>
+  void bind(std::vector<const Tensor<U>*>* tensors,
+            std::vector<float>* scalars) const {
+    a_.bind(tensors, scalars);
+    b_.bind(tensors, scalars);
+  }
+
+ private:
+  A a_;
+  B b_;
+};
+
+// The OpenCL code of each operation.
+#define JTORCH_EXPR_INFIX_OP(Name, op)                                  \
+  struct Name {                                                         \
+    static std::string code(const std::string& a, const std::string& b) { \
+      return "(" + a + " " op " " + b + ")";                            \
+    }                                                                   \
+  };
+#define JTORCH_EXPR_FUNCTION_OP(Name, function)                         \
+  struct Name {                                                         \
+    static std::string code(const std::string& a) {                     \
+      return function "(" + a + ")";                                    \
+    }                                                                   \
+    static std::string code(const std::string& a, const std::string& b) { \
+      return function "(" + a + ", " + b + ")";                         \
+    }                                                                   \
+  };
+JTORCH_EXPR_INFIX_OP(ExprAdd, "+")
+JTORCH_EXPR_INFIX_OP(ExprSub, "-")
+JTORCH_EXPR_INFIX_OP(ExprMul, "*")
+JTORCH_EXPR_INFIX_OP(ExprDiv, "/")
+JTORCH_EXPR_FUNCTION_OP(ExprNeg, "-")
+JTORCH_EXPR_FUNCTION_OP(ExprAbs, "fabs")
+JTORCH_EXPR_FUNCTION_OP(ExprSqrt, "sqrt")
+JTORCH_EXPR_FUNCTION_OP(ExprExp, "exp")
+JTORCH_EXPR_FUNCTION_OP(ExprLog, "log")
+JTORCH_EXPR_FUNCTION_OP(ExprTanh, "tanh")
+JTORCH_EXPR_FUNCTION_OP(ExprMax, "fmax")
+JTORCH_EXPR_FUNCTION_OP(ExprMin, "fmin")
+#undef JTORCH_EXPR_INFIX_OP
+#undef JTORCH_EXPR_FUNCTION_OP
+
+// ExprOperand<E>::type is the expression node for an operand of type E
+// (tensors and numbers get wrapped, expressions are used as is), and there is
+// none for anything else.  IsExpr<E> is true if E is a tensor or an
+// expression: the operators below need at least one of those.
+template <typename E, typename Enable = void>
+struct ExprOperand {};
+template <typename E, typename Enable = void>
+struct IsExpr : std::false_type {};
+
+template <typename E>
+struct ExprOperand<
+    E, typename std::enable_if<std::is_arithmetic<E>::value>::type> {
+  typedef ScalarExpr type;
+  static type wrap(const E value) { return type((float)value); }
+};
+template <typename T>
+struct ExprOperand<Tensor<T>> {
+  typedef TensorExpr<T> type;
+  static type wrap(const Tensor<T>& x) { return type(x); }
+};
+template <typename T>
+struct IsExpr<Tensor<T>> : std::true_type {};
+
+// The expression nodes themselves.
+template <typename E>
+struct ExprNode {
+  typedef E type;
+  static const type& wrap(const type& x) { return x; }
+};
+template <typename T>
+struct ExprOperand<TensorExpr<T>> : ExprNode<TensorExpr<T>> {};
+template <typename Op, typename A>
+struct ExprOperand<UnaryExpr<Op, A>> : ExprNode<UnaryExpr<Op, A>> {};
+template <typename Op, typename A, typename B>
+struct ExprOperand<BinaryExpr<Op, A, B>> : ExprNode<BinaryExpr<Op, A, B>> {};
+template <typename T>
+struct IsExpr<TensorExpr<T>> : std::true_type {};
+template <typename Op, typename A>
+struct IsExpr<UnaryExpr<Op, A>> : std::true_type {};
+template <typename Op, typename A, typename B>
+struct IsExpr<BinaryExpr<Op, A, B>> : std::true_type {};
+
+// The node type of Op applied to operands of type A (and B), if they are
+// operands and at least one of them is a tensor or an expression.
+template <typename E>
+struct IsOperand
+    : std::integral_constant<bool, IsExpr<E>::value ||
+                                       std::is_arithmetic<E>::value> {};
+template <bool Enable, typename Op, typename A, typename B = void>
+struct ExprOf {};
+template <typename Op, typename A>
+struct ExprOf<true, Op, A, void> {
+  typedef UnaryExpr<Op, typename ExprOperand<A>::type> type;
+};
+template <typename Op, typename A, typename B>
+struct ExprOf<true, Op, A, B> {
+  typedef BinaryExpr<Op, typename ExprOperand<A>::type,
+                     typename ExprOperand<B>::type>
+      type;
+};
+template <typename Op, typename A>
+struct UnaryExprOf : ExprOf<IsExpr<A>::value, Op, A> {};
+template <typename Op, typename A, typename B>
+struct BinaryExprOf
+    : ExprOf<(IsExpr<A>::value || IsExpr<B>::value) && IsOperand<A>::value &&
+                 IsOperand<B>::value,
+             Op, A, B> {};
+
+#define JTORCH_EXPR_BINARY(Op, function)                                   \
+  template <typename A, typename B>                                        \
+  typename BinaryExprOf<Op, A, B>::type function(const A& a, const B& b) { \
+    return typename BinaryExprOf<Op, A, B>::type(ExprOperand<A>::wrap(a),  \
+                                                 ExprOperand<B>::wrap(b)); \
+  }
+#define JTORCH_EXPR_UNARY(Op, function)                                  \
+  template <typename A>                                                  \
+  typename UnaryExprOf<Op, A>::type function(const A& a) {               \
+    return typename UnaryExprOf<Op, A>::type(ExprOperand<A>::wrap(a));   \
+  }
+JTORCH_EXPR_BINARY(ExprAdd, operator+)
+JTORCH_EXPR_BINARY(ExprSub, operator-)
+JTORCH_EXPR_BINARY(ExprMul, operator*)
+JTORCH_EXPR_BINARY(ExprDiv, operator/)
+JTORCH_EXPR_BINARY(ExprMax, fmax)
+JTORCH_EXPR_BINARY(ExprMin, fmin)
+JTORCH_EXPR_UNARY(ExprNeg, operator-)
+JTORCH_EXPR_UNARY(ExprAbs, abs)
+JTORCH_EXPR_UNARY(ExprSqrt, sqrt)
+JTORCH_EXPR_UNARY(ExprExp, exp)
+JTORCH_EXPR_UNARY(ExprLog, log)
+JTORCH_EXPR_UNARY(ExprTanh, tanh)
+#undef JTORCH_EXPR_BINARY
+#undef JTORCH_EXPR_UNARY
+
+// The kernel for expressions of type E (which is an expression node):
+//   Eval(out, t0, t1, ..., out_offset, t0_offset, t1_offset, ..., s0, s1, ...)
+template <typename E>
+std::string BuildExprKernel(uint32_t* num_tensors, uint32_t* num_scalars) {
+  *num_tensors = 0;
+  *num_scalars = 0;
+  const std::string code = E::code(num_tensors, num_scalars);
+  std::vector<std::string> args = {"__global STORAGE_T* out"};
+  for (uint32_t k = 0; k < *num_tensors; k++) {
+    args.push_back("const __global STORAGE_T* t" + std::to_string(k));
+  }
+  args.push_back("const INDEX_T out_offset");
+  for (uint32_t k = 0; k < *num_tensors; k++) {
+    args.push_back("const INDEX_T t" + std::to_string(k) + "_offset");
+  }
+  for (uint32_t k = 0; k < *num_scalars; k++) {
+    args.push_back("const float s" + std::to_string(k));
+  }
+  std::string source = JTORCH_INDEX_PRELUDE "    __kernel void Eval(\n";
+  for (uint32_t a = 0; a < args.size(); a++) {
+    source += "      " + args[a] + (a + 1 < args.size() ? ",\n" : ") {\n");
+  }
+  source += "      out += out_offset;\n";
+  for (uint32_t k = 0; k < *num_tensors; k++) {
+    const std::string t = "t" + std::to_string(k);
+    source += "      " + t + " += " + t + "_offset;\n";
+  }
+  source += "      const int i = get_global_id(0);\n";
+  source += "      STORE(" + code + ", out, i);\n";
+  source += "    }";
+  return source;
+}
+
+template <typename E>
+struct ExprKernel {
+  ExprKernel()
+      : source(BuildExprKernel<E>(&num_tensors, &num_scalars)),
+        kernel(source.c_str(), "Eval") {}
+  uint32_t num_tensors;
+  uint32_t num_scalars;
+  std::string source;
+  CachedKernel kernel;  // Resolved once per runtime and thread
+};
+
+template <typename T>
+template <typename E>
+void Tensor<T>::eval(Tensor<T>& dst, const E& expr) {
+  typedef typename ExprOperand<E>::type Expr;
+  static_assert(IsExpr<E>::value, "eval needs a tensor expression");
+  // Generated once per expression shape (and thread-safe in C++11).
+  static const ExprKernel<Expr> expr_kernel;
+
+  RASSERT(dst.dim_ != 0);
+  std::vector<const Tensor<T>*> tensors;
+  std::vector<float> scalars;
+  ExprOperand<E>::wrap(expr).bind(&tensors, &scalars);
+  RASSERT(tensors.size() == expr_kernel.num_tensors);
+  RASSERT(scalars.size() == expr_kernel.num_scalars);
+
+  // The kernel addresses every tensor as one contiguous block in dst's
+  // format, so bring the others into line (the copies are held until the
+  // kernel has been enqueued).
+  std::vector<std::shared_ptr<Tensor<T>>> copies;
+  for (const Tensor<T>*& x : tensors) {
+    RASSERT(x->runtime_ == dst.runtime_);
+    RASSERT(x->isSameSizeAs(dst));
+    if (x->format_ != dst.format_) {
+      copies.push_back(toFormat(*x, dst.format_));
+      x = copies.back().get();
+    } else if (!x->isContiguous()) {
+      copies.push_back(contiguous(*x));
+      x = copies.back().get();
+    }
+  }
+  std::shared_ptr<Tensor<T>> out;
+  if (!dst.isContiguous()) {
+    out.reset(new Tensor<T>(dst.dim_, dst.size_.get(), dst.runtime_,
+                            dst.format_));
+    out->storage()->setTag(jcl::CLBufferTagScratch);
+  }
+  Tensor<T>& result = out != nullptr ? *out : dst;
+
+  bool index64 = result.index64();
+  std::vector<uint64_t> offsets = {result.offset_};
+  for (const Tensor<T>* x : tensors) {
+    index64 = index64 || x->index64();
+    offsets.push_back(x->offset_);
+  }
+  jcl::OpenCLKernel* kernel =
+      expr_kernel.kernel.get(dst.runtime_, index64, dst.format_);
+  kernel->setArg(0, result.storage());
+  const uint32_t n = (uint32_t)tensors.size();
+  for (uint32_t k = 0; k < n; k++) {
+    kernel->setArg(1 + k, tensors[k]->storage());
+  }
+  for (uint32_t k = 0; k < scalars.size(); k++) {
+    kernel->setArg(2 * n + 2 + k, scalars[k]);
+  }
+  dst.runtime_->runElementwiseKernel(kernel, n + 1, offsets, dst.nelems(),
+                                     index64);
+  if (out != nullptr) {
+    copy(dst, *out);
+  }
+}
+
+}  // namespace jtorch
@@ -16,7 +16,11 @@
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <vector>
 
+#include "jcl/opencl_context.h"
+#include "jtorch/jtorch.h"
+#include "jtorch/runtime.h"
 #include "jtorch/torch_data.h"
 
 namespace jtorch {
@@ -37,7 +41,7 @@ typedef enum {
   SPATIAL_DIVISIVE_NORMALIZATION_STAGE = 12,
   SPATIAL_CONTRASTIVE_NORMALIZATION_STAGE = 13,
   JOIN_TABLE_STAGE = 14,
-  TRANSPOSE_STAGE = 15,  // Not actually implemented --> Ignored
+  TRANSPOSE_STAGE = 15,
   IDENTITY_STAGE = 16,
   SELECT_TABLE_STAGE = 17,
   SPATIAL_UP_SAMPLING_NEAREST_STAGE = 18,
@@ -55,7 +59,8 @@ typedef enum {
 
 class TorchStage {
  public:
-  // Constructor / Destructor
+  // Constructor / Destructor.  Stages are bound to Runtime::Current(), and
+  // use FLOAT_STORAGE unless they are created by loadFromFile().
   TorchStage();
   virtual ~TorchStage();
 
@@ -64,15 +69,96 @@ class TorchStage {
   virtual void forwardProp(
       std::shared_ptr<TorchData> input) = 0;  // Pure virtual
 
-  // Top level read-write
-  static std::unique_ptr<TorchStage> loadFromFile(const std::string& file);
+  // Batched forwardProp.  input holds N samples stacked along an extra outer
+  // dimension (ie {width, height, feats, N} for images, {n_inputs, N} for
+  // Linear), and so does the output.  The torch dimensions of the stages (ie
+  // of Narrow, Transpose, JoinTable or View) still refer to one sample.
+  // Linear and SpatialConvolutionMM run the whole batch as one large GEMM,
+  // the planar stages treat it as N times more feature planes, and the rest
+  // (SpatialConvolution, SpatialConvolutionMap, SpatialLPPooling and the
+  // spatial normalizations) process one sample at a time.
+  void forwardPropBatch(std::shared_ptr<TorchData> input);
+
+  // Append the OpenCL programs this stage (and its children) will use.
+  virtual void getPrograms(
+      std::vector<jcl::OpenCLProgramSource>* programs) const;
+
+  // Warm up the model so that the first real forwardProp runs at steady state
+  // speed.  Every program in the stage tree (see getPrograms()) is built on
+  // num_threads worker threads (0: one per hardware thread).  Then, if a
+  // sample_input is given, one forwardProp is run on it and waited for: this
+  // allocates the outputs and makes clBLAS build its GEMM kernels, which it
+  // does on the first call with each shape.  So sample_input should have the
+  // shape of the real inputs (its values don't matter).
+  void prepare(std::shared_ptr<TorchData> sample_input = nullptr,
+               const uint32_t num_threads = 0);
+
+  // Top level read-write.  The stages (and their tensors) are created on
+  // runtime (nullptr: Runtime::Current()).  With HALF_STORAGE, every stage
+  // reads and writes fp16 activations, which roughly halves the memory
+  // traffic.  The weights are fp16 too, except the Linear and
+  // SpatialConvolutionMM ones, which clBLAS reads and which stay float.  Use
+  // getData() to read the (fp16) model output as float.
+  static std::unique_ptr<TorchStage> loadFromFile(
+      const std::string& file, Runtime* runtime = nullptr,
+      const StorageFormat format = FLOAT_STORAGE);
+
+  // int8 inference.  SpatialConvolutionMM and Linear stages can run on int8
+  // weights (quantized per output channel) and int8 inputs, with int32
+  // accumulation, which cuts their weight memory and bandwidth by 4x.  The
+  // input scales come from calibration: call calibrate(true), run forwardProp
+  // on a few representative inputs (the stages record the range of their
+  // inputs, in float), then calibrate(false) and quantize().  quantize()
+  // replaces the float weights, so it can't be undone.  Both recurse into
+  // the children of container stages, and the other stages ignore them.
+  virtual void calibrate(const bool calibrating);
+  virtual void quantize();
+
+  Runtime* runtime() const { return runtime_; }
+  // The storage format the stage was loaded with (see loadFromFile()).
+  StorageFormat format() const { return format_; }
 
   // Everyone must define an output structure
   std::shared_ptr<TorchData> output;
 
  protected:
+  Runtime* runtime_;
+  StorageFormat format_;
+
+  // The runtime's context, and the calling thread's device on it.
+  jcl::OpenCLContext* context() const { return runtime_->context(); }
+  uint32_t deviceid() const { return runtime_->deviceid(); }
+
+  // Stages whose kernels read their input as one contiguous block start their
+  // forwardProp with input = contiguousInput(input).  This returns input
+  // itself unless it is a non-contiguous tensor (ie a Transpose or an inner
+  // dimension Narrow) or isn't in format, in which case it is copied into a
+  // buffer owned by the stage.  Stages that support half storage pass
+  // format_, the others get float.
+  std::shared_ptr<TorchData> contiguousInput(
+      std::shared_ptr<TorchData> input,
+      const StorageFormat format = FLOAT_STORAGE);
+
+  // True while the calling thread is in forwardPropBatch().
+  static bool batchMode();
+  // The number of dimensions of one sample of t (one less in batch mode).
+  static uint32_t sampleDim(const Tensor<float>& t);
+
+  // Stages that only handle single samples of sample_dim dimensions start
+  // their forwardProp with: if (forwardPropSamples(input, 3)) return;  When
+  // input has an extra (batch) dimension, this runs forwardProp on each of
+  // its samples, gathers their outputs into a batch output and returns true.
+  bool forwardPropSamples(std::shared_ptr<TorchData> input,
+                          const uint32_t sample_dim);
+
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
+ private:
+  std::shared_ptr<Tensor<float>> contiguous_input_;
+  // The per sample and batch outputs of forwardPropSamples().
+  std::shared_ptr<TorchData> sample_output_;
+  std::shared_ptr<Tensor<float>> batch_output_;
+
   // Non-copyable, non-assignable.
   TorchStage(const TorchStage&) = delete;
   TorchStage& operator=(const TorchStage&) = delete;
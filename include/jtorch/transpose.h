@@ -3,7 +3,9 @@
 //
 //  Created by Jonathan Tompson on 4/9/13.
 //
-//  NOTE: Transpose is NOT implemented, it just passes the data through
+//  The output is a (generally non-contiguous) view of the input with the
+//  permutations applied, so no data is moved until a stage needs a contiguous
+//  input.
 //
 
 #pragma once
@@ -11,7 +13,10 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <utility>
+#include <vector>
 
+#include "jtorch/tensor.h"
 #include "jtorch/torch_stage.h"
 
 namespace jtorch {
@@ -19,7 +24,9 @@ namespace jtorch {
 class Transpose : public TorchStage {
  public:
   // Constructor / Destructor
-  Transpose();
+  // permutations: the pairs of (torch 1-indexed) dimensions to swap, in order.
+  explicit Transpose(
+      const std::vector<std::pair<int32_t, int32_t>>& permutations);
   ~Transpose() override;
 
   TorchStageType type() const override { return TRANSPOSE_STAGE; }
@@ -29,6 +36,11 @@ class Transpose : public TorchStage {
   static std::unique_ptr<TorchStage> loadFromFile(std::ifstream& file);
 
  protected:
+  std::vector<std::pair<int32_t, int32_t>> permutations_;
+
+  const Tensor<float>* src_tensor_;
+  bool src_batch_;  // src_tensor_ was a batch (see forwardPropBatch())
+
   // Non-copyable, non-assignable.
   Transpose(const Transpose&) = delete;
   Transpose& operator=(const Transpose&) = delete;
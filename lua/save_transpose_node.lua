@@ -1,6 +1,5 @@
 function jtorch._saveTransposeNode(node, ofile)
-  -- The CPP framework wont use transposes, but we'll save the
-  -- permutations anyway
+  -- The CPP framework applies the permutations as a strided view
 
   ofile:writeInt(#node.permutations)
 
@@ -1,6 +1,13 @@
 #include "jcl/cl_include.h"
 
+#if defined(WIN32) || defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+#include <atomic>
 #include <iostream>
+#include <sstream>
 
 namespace cl {
 
@@ -104,3 +111,27 @@ std::string GetCLErrorEnumString(const int32_t err) {
 }
 
 }  // namespace cl
+
+namespace jcl {
+
+namespace {
+
+std::atomic<uint32_t> temp_file_counter(0);
+
+int ProcessId() {
+#if defined(WIN32) || defined(_WIN32)
+  return _getpid();
+#else
+  return getpid();
+#endif
+}
+
+}  // namespace
+
+std::string UniqueTempFilename(const std::string& filename) {
+  std::stringstream ss;
+  ss << filename << "." << ProcessId() << "." << temp_file_counter++ << ".tmp";
+  return ss.str();
+}
+
+}  // namespace jcl
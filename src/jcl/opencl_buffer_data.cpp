@@ -7,22 +7,86 @@
 
 namespace jcl {
 
-OpenCLBufferData::OpenCLBufferData(const CLBufferType type,
-                                   const uint32_t nelems, cl::Context& context)
-    : nelems_(nelems), type_(type) {
+OpenCLBufferData::OpenCLBufferData(
+    const CLBufferType type, const uint64_t nelems, cl::Context& context,
+    const std::shared_ptr<OpenCLMemoryCounters>& counters,
+    const uint32_t device_index, const bool host_visible, const CLBufferTag tag)
+    : nelems_(nelems),
+      capacity_(nelems),
+      type_(type),
+      host_visible_(host_visible),
+      mapped_ptr_(nullptr),
+      mapped_for_write_(false),
+      tag_(tag),
+      counters_(counters),
+      device_index_(device_index),
+      accounted_bytes_((uint64_t)nelems * sizeof(cl_float)) {
   // Zero size buffer cannot be allocated!
   RASSERT(nelems_ > 0);
 
-  cl_mem_flags flags = getFlagsFromBufferType(type_);
+  const cl_mem_flags flags = allocFlags();
   buffer_ = cl::Buffer(context, flags, sizeof(cl_float) * nelems_);
+  events_.reset(new OpenCLBufferEvents());
+  counters_->allocated(device_index_, tag_, accounted_bytes_);
+}
+
+OpenCLBufferData::OpenCLBufferData(
+    const CLBufferType type, const bool host_visible, const uint64_t nelems,
+    const uint64_t capacity, cl::Context& context,
+    const std::shared_ptr<OpenCLBufferPool>& pool,
+    const std::shared_ptr<OpenCLMemoryCounters>& counters,
+    const uint32_t device_index, const CLBufferTag tag)
+    : nelems_(nelems),
+      capacity_(capacity),
+      type_(type),
+      host_visible_(host_visible),
+      mapped_ptr_(nullptr),
+      mapped_for_write_(false),
+      pool_(pool),
+      tag_(tag),
+      counters_(counters),
+      device_index_(device_index),
+      accounted_bytes_((uint64_t)capacity * sizeof(cl_float)) {
+  // Zero size buffer cannot be allocated!
+  RASSERT(nelems_ > 0);
+  RASSERT(capacity_ >= nelems_);
+
+  const cl_mem_flags flags = allocFlags();
+  if (!pool->acquire(device_index_, flags, capacity_, buffer_, events_)) {
+    buffer_ = cl::Buffer(context, flags, sizeof(cl_float) * capacity_);
+    events_.reset(new OpenCLBufferEvents());
+  }
+  counters_->allocated(device_index_, tag_, accounted_bytes_);
 }
 
 // Private constructor.
-OpenCLBufferData::OpenCLBufferData(const CLBufferType type,
-                                   const uint32_t nelems, cl::Buffer buffer)
-    : nelems_(nelems), type_(type), buffer_(buffer) {}
+OpenCLBufferData::OpenCLBufferData(
+    const CLBufferType type, const uint64_t nelems, cl::Buffer buffer,
+    const std::shared_ptr<OpenCLBufferData>& parent)
+    : nelems_(nelems),
+      capacity_(nelems),
+      type_(type),
+      host_visible_(parent->host_visible()),
+      buffer_(buffer),
+      mapped_ptr_(nullptr),
+      mapped_for_write_(false),
+      events_(parent->events()),
+      parent_(parent),
+      tag_(parent->tag()),
+      device_index_(parent->device_index()),
+      accounted_bytes_(0) {}
 
-OpenCLBufferData::~OpenCLBufferData() {}
+OpenCLBufferData::~OpenCLBufferData() {
+  // You must call OpenCLContext::unmapBuffer() first.
+  RASSERT(mapped_ptr_ == nullptr);
+  if (counters_ != nullptr) {
+    counters_->released(device_index_, tag_, accounted_bytes_);
+  }
+  std::shared_ptr<OpenCLBufferPool> pool = pool_.lock();
+  if (pool != nullptr) {
+    pool->release(device_index_, allocFlags(), capacity_, buffer_, events_);
+  }
+}
 
 cl::Buffer& OpenCLBufferData::buffer() { return buffer_; }
 
@@ -31,7 +95,7 @@ const cl::Buffer& OpenCLBufferData::buffer() const { return buffer_; }
 cl_mem& OpenCLBufferData::mem() { return buffer_(); }
 
 std::shared_ptr<OpenCLBufferData> OpenCLBufferData::createSubBuffer(
-    const uint32_t nelems, const uint32_t offset) {
+    const uint64_t nelems, const uint64_t offset) {
   // Make sure the requested memory fits in the current buffer.
   RASSERT(nelems + offset <= nelems_);
 
@@ -45,7 +109,26 @@ std::shared_ptr<OpenCLBufferData> OpenCLBufferData::createSubBuffer(
   CHECK_ERROR(err);
 
   return std::shared_ptr<OpenCLBufferData>(
-      new OpenCLBufferData(type_, nelems, new_buffer));
+      new OpenCLBufferData(type_, nelems, new_buffer, shared_from_this()));
+}
+
+void OpenCLBufferData::setTag(const CLBufferTag tag) {
+  RASSERT(tag < CLBufferTagCount);
+  if (tag == tag_) {
+    return;
+  }
+  if (counters_ != nullptr) {
+    counters_->retag(device_index_, tag_, tag, accounted_bytes_);
+  }
+  tag_ = tag;
+}
+
+cl_mem_flags OpenCLBufferData::allocFlags() const {
+  cl_mem_flags flags = getFlagsFromBufferType(type_);
+  if (host_visible_) {
+    flags |= CL_MEM_ALLOC_HOST_PTR;
+  }
+  return flags;
 }
 
 cl_mem_flags OpenCLBufferData::getFlagsFromBufferType(CLBufferType type) {
@@ -0,0 +1,177 @@
+#include "jcl/opencl_buffer_pool.h"
+
+#include <algorithm>
+#include <tuple>
+
+#include "jcl/opencl_buffer_data.h"
+#include "jcl/opencl_context.h"
+
+namespace jcl {
+
+const uint64_t OpenCLBufferPool::kSharedThread;
+
+OpenCLBufferPool::OpenCLBufferPool() {
+  enabled_ = true;
+  stats_.num_allocations = 0;
+  stats_.num_reuses = 0;
+  stats_.num_cached = 0;
+  stats_.bytes_allocated = 0;
+  stats_.bytes_cached = 0;
+}
+
+OpenCLBufferPool::~OpenCLBufferPool() {}
+
+uint64_t OpenCLBufferPool::bytes(const uint64_t capacity) {
+  return capacity * sizeof(cl_float);
+}
+
+uint64_t OpenCLBufferPool::sizeClass(const uint64_t nelems) {
+  // Small buffers are all rounded up to 64 elements.  Otherwise, split each
+  // power of two into 4 classes.
+  if (nelems <= 64) {
+    return 64;
+  }
+  uint32_t msb = 0;
+  while ((nelems >> msb) > 1) {
+    msb++;
+  }
+  const uint64_t step = (uint64_t)1 << (msb - 2);
+  return ((nelems + step - 1) / step) * step;
+}
+
+bool OpenCLBufferPool::acquire(const uint32_t device_index,
+                               const cl_mem_flags flags,
+                               const uint64_t capacity, cl::Buffer& buffer,
+                               std::shared_ptr<OpenCLBufferEvents>& events) {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (enabled_) {
+    const uint64_t thread_id = OpenCLContext::threadId();
+    if (acquireFrom(Owner(thread_id, device_index), flags, capacity, buffer,
+                    events) ||
+        acquireFrom(Owner(kSharedThread, device_index), flags, capacity,
+                    buffer, events)) {
+      stats_.num_reuses++;
+      stats_.num_cached--;
+      stats_.bytes_cached -= bytes(capacity);
+      return true;
+    }
+  }
+  // The caller will create a new buffer.
+  stats_.num_allocations++;
+  stats_.bytes_allocated += bytes(capacity);
+  return false;
+}
+
+bool OpenCLBufferPool::acquireFrom(
+    const Owner& owner, const cl_mem_flags flags, const uint64_t capacity,
+    cl::Buffer& buffer, std::shared_ptr<OpenCLBufferEvents>& events) {
+  auto free_list = free_lists_.find(owner);
+  if (free_list == free_lists_.end()) {
+    return false;
+  }
+  auto buffers = free_list->second.find(std::make_pair(flags, capacity));
+  if (buffers == free_list->second.end() || buffers->second.empty()) {
+    return false;
+  }
+  buffer = buffers->second.back().buffer;
+  events = buffers->second.back().events;
+  buffers->second.pop_back();
+  return true;
+}
+
+void OpenCLBufferPool::release(
+    const uint32_t device_index, const cl_mem_flags flags,
+    const uint64_t capacity, cl::Buffer& buffer,
+    const std::shared_ptr<OpenCLBufferEvents>& events) {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (!enabled_) {
+    stats_.bytes_allocated -= bytes(capacity);
+    return;  // The caller's reference is the last one.
+  }
+  uint64_t thread_id = OpenCLContext::threadId();
+  if (threads_.count(thread_id) == 0) {
+    thread_id = kSharedThread;  // It has no queues in the context.
+  }
+  Entry entry = {buffer, events};
+  free_lists_[Owner(thread_id, device_index)][std::make_pair(flags, capacity)]
+      .push_back(entry);
+  stats_.num_cached++;
+  stats_.bytes_cached += bytes(capacity);
+}
+
+void OpenCLBufferPool::addThread(const uint64_t thread_id) {
+  std::lock_guard<std::mutex> lock(lock_);
+  threads_.insert(thread_id);
+}
+
+void OpenCLBufferPool::removeThread(const uint64_t thread_id) {
+  std::lock_guard<std::mutex> lock(lock_);
+  threads_.erase(thread_id);
+  // Nothing is pending on the thread's buffers anymore, so any thread can
+  // have them.
+  auto free_list = free_lists_.lower_bound(Owner(thread_id, 0));
+  while (free_list != free_lists_.end() &&
+         free_list->first.first == thread_id) {
+    FreeList& shared = free_lists_[Owner(kSharedThread,
+                                         free_list->first.second)];
+    for (auto& buffers : free_list->second) {
+      std::vector<Entry>& dst = shared[buffers.first];
+      dst.insert(dst.end(), buffers.second.begin(), buffers.second.end());
+    }
+    free_list = free_lists_.erase(free_list);
+  }
+}
+
+void OpenCLBufferPool::trim(const uint64_t max_cached_bytes) {
+  std::lock_guard<std::mutex> lock(lock_);
+  if (stats_.bytes_cached <= max_cached_bytes) {
+    return;
+  }
+  // Sort the non-empty free lists by capacity (largest first).
+  std::vector<std::tuple<uint64_t, std::vector<Entry>*>> lists;
+  for (auto& free_list : free_lists_) {
+    for (auto& buffers : free_list.second) {
+      if (!buffers.second.empty()) {
+        lists.push_back(std::make_tuple(buffers.first.second, &buffers.second));
+      }
+    }
+  }
+  std::sort(lists.begin(), lists.end(),
+            [](const std::tuple<uint64_t, std::vector<Entry>*>& a,
+               const std::tuple<uint64_t, std::vector<Entry>*>& b) {
+              return std::get<0>(a) > std::get<0>(b);
+            });
+  for (uint32_t i = 0;
+       i < lists.size() && stats_.bytes_cached > max_cached_bytes; i++) {
+    const uint64_t capacity = std::get<0>(lists[i]);
+    std::vector<Entry>* buffers = std::get<1>(lists[i]);
+    while (!buffers->empty() && stats_.bytes_cached > max_cached_bytes) {
+      buffers->pop_back();  // Releases the cl_mem
+      stats_.num_cached--;
+      stats_.bytes_cached -= bytes(capacity);
+      stats_.bytes_allocated -= bytes(capacity);
+    }
+  }
+}
+
+void OpenCLBufferPool::setEnabled(const bool enabled) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    enabled_ = enabled;
+  }
+  if (!enabled) {
+    trim(0);
+  }
+}
+
+bool OpenCLBufferPool::enabled() {
+  std::lock_guard<std::mutex> lock(lock_);
+  return enabled_;
+}
+
+OpenCLBufferPoolStats OpenCLBufferPool::stats() {
+  std::lock_guard<std::mutex> lock(lock_);
+  return stats_;
+}
+
+}  // namespace jcl
@@ -0,0 +1,29 @@
+#include "jcl/opencl_capture.h"
+
+#include "jcl/opencl_buffer_data.h"
+#include "jcl/opencl_context.h"
+
+namespace jcl {
+
+OpenCLCapture::OpenCLCapture() { valid_ = true; }
+
+OpenCLCapture::~OpenCLCapture() {}
+
+void OpenCLCapture::rebindBuffer(const std::shared_ptr<OpenCLBufferData>& from,
+                                 const std::shared_ptr<OpenCLBufferData>& to,
+                                 const uint64_t used_nelems) {
+  RASSERT(used_nelems <= from->nelems());
+  RASSERT(to->nelems() >= (used_nelems > 0 ? used_nelems : from->nelems()));
+  for (uint32_t i = 0; i < commands_.size(); i++) {
+    if (commands_[i].kernel != nullptr) {
+      commands_[i].kernel->rebindBuffer(from.get(), to);
+    }
+    for (auto& buffer : commands_[i].buffers) {
+      if (buffer == from) {
+        buffer = to;
+      }
+    }
+  }
+}
+
+}  // namespace jcl
@@ -1,7 +1,19 @@
 #include "jcl/opencl_context.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <set>
 #include <sstream>
+#include <string>
+#include <thread>
 
 #include "jcl/data_str/hash_funcs.h"
 #include "jcl/opencl_buffer_data.h"
@@ -10,29 +22,234 @@
 
 namespace jcl {
 
+namespace {
+
+// Candidates with fewer work items than this are dropped when tuning (unless
+// nothing else is legal): they are never competitive.
+const uint32_t kMinAutotuneGroupSize = 32;
+// Timed launches per candidate (after one warm up launch).
+const uint32_t kAutotuneRuns = 3;
+
+// Device scoring (see OpenCLContext::scoreDevices()).  Devices with less
+// memory than this have their score scaled down proportionally.
+const uint64_t kMinScoreGlobalMemBytes = 256 * 1024 * 1024;
+const uint64_t kMinScoreLocalMemBytes = 16 * 1024;
+// The calibration kernel runs kCalibrationItemsPerUnit work items per compute
+// unit, each doing kCalibrationIters iterations of 4 independent mads.
+const uint32_t kCalibrationItemsPerUnit = 1024;
+const uint32_t kCalibrationIters = 1024;
+const uint32_t kCalibrationRuns = 3;
+
+const char* kCalibrationKernel =
+"    __kernel void Calibrate(\n"
+"      __global float* output,  /* 0 */\n"
+"      const int iters) {       /* 1 */\n"
+"      const int id = get_global_id(0);\n"
+"      float x0 = (float)id * 1e-9f;\n"
+"      float x1 = x0 + 0.1f;\n"
+"      float x2 = x0 + 0.2f;\n"
+"      float x3 = x0 + 0.3f;\n"
+"      for (int i = 0; i < iters; i++) {\n"
+"        x0 = mad(x0, 0.999f, 0.001f);\n"
+"        x1 = mad(x1, 0.999f, 0.001f);\n"
+"        x2 = mad(x2, 0.999f, 0.001f);\n"
+"        x3 = mad(x3, 0.999f, 0.001f);\n"
+"      }\n"
+"      output[id] = x0 + x1 + x2 + x3;\n"
+"    }";
+
+// Run kCalibrationKernel on the device (in its own context) and return the
+// best GFLOP/s over kCalibrationRuns launches, or 0 if the device can't run
+// it.
+double CalibrateDevice(cl::Device& device, const uint32_t compute_units) {
+  std::vector<cl::Device> devices(1, device);
+  cl_int err;
+  cl::Context context(devices, nullptr, nullptr, nullptr, &err);
+  if (err != CL_SUCCESS) {
+    return 0;
+  }
+  cl::Program::Sources source(
+      1, std::make_pair(kCalibrationKernel, strlen(kCalibrationKernel)));
+  cl::Program program(context, source, &err);
+  if (err != CL_SUCCESS || program.build(devices) != CL_SUCCESS) {
+    return 0;
+  }
+  cl::Kernel kernel(program, "Calibrate", &err);
+  if (err != CL_SUCCESS) {
+    return 0;
+  }
+  const uint32_t num_items = std::max<uint32_t>(compute_units, 1) *
+                             kCalibrationItemsPerUnit;
+  cl::Buffer output(context, CL_MEM_WRITE_ONLY, num_items * sizeof(float),
+                    nullptr, &err);
+  if (err != CL_SUCCESS) {
+    return 0;
+  }
+  cl::CommandQueue queue(context, device, 0, &err);
+  if (err != CL_SUCCESS) {
+    return 0;
+  }
+  kernel.setArg(0, output);
+  kernel.setArg(1, (int)kCalibrationIters);
+
+  double best_seconds = std::numeric_limits<double>::infinity();
+  for (uint32_t run = 0; run <= kCalibrationRuns; run++) {
+    const auto start = std::chrono::steady_clock::now();
+    err = queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                                     cl::NDRange(num_items), cl::NullRange);
+    if (err != CL_SUCCESS || queue.finish() != CL_SUCCESS) {
+      return 0;
+    }
+    const std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - start;
+    if (run > 0) {  // The first run is a warm up
+      best_seconds = std::min(best_seconds, seconds.count());
+    }
+  }
+  const double flops = 8.0 * (double)num_items * (double)kCalibrationIters;
+  return flops / std::max(best_seconds, 1e-9) * 1e-9;
+}
+
+cl::NDRange MakeNDRange(const uint32_t dim, const uint32_t* size) {
+  switch (dim) {
+    case 1:
+      return cl::NDRange(size[0]);
+    case 2:
+      return cl::NDRange(size[0], size[1]);
+    default:
+      return cl::NDRange(size[0], size[1], size[2]);
+  }
+}
+
+// The live contexts by id, for OpenCLContext::ThreadStreams.  Never freed, so
+// that contexts (and threads) that go away during static destruction can
+// still use it.
+struct LiveContexts {
+  std::mutex lock;
+  std::unordered_map<uint64_t, OpenCLContext*> contexts;
+};
+
+LiveContexts& GetLiveContexts() {
+  static LiveContexts* live_contexts = new LiveContexts();
+  return *live_contexts;
+}
+
+}  // unnamed namespace
+
 std::mutex OpenCLContext::context_lock_;
+thread_local OpenCLContext::ThreadStreams OpenCLContext::thread_streams_;
+std::atomic<uint64_t> OpenCLContext::next_thread_id_(1);
+std::atomic<uint64_t> OpenCLContext::next_context_id_(1);
+
+OpenCLContext::ThreadStreams::ThreadStreams()
+    : thread_id_(next_thread_id_++) {}
+
+OpenCLContext::ThreadStreams::~ThreadStreams() {
+  // Holding the lock keeps the contexts from being destroyed meanwhile.
+  LiveContexts& live = GetLiveContexts();
+  std::lock_guard<std::mutex> lock(live.lock);
+  for (const auto& entry : entries_) {
+    auto context = live.contexts.find(entry.first);
+    if (context != live.contexts.end()) {
+      context->second->releaseStream(thread_id_);
+    }
+  }
+}
 
-OpenCLContext::OpenCLContext() {
-  cur_program_ = nullptr;
-  cur_kernel_ = nullptr;
+void OpenCLContext::ThreadStreams::add(const uint64_t context_id,
+                                       Stream* stream) {
+  // Drop the entries of contexts that have been destroyed.
+  {
+    LiveContexts& live = GetLiveContexts();
+    std::lock_guard<std::mutex> lock(live.lock);
+    entries_.erase(
+        std::remove_if(entries_.begin(), entries_.end(),
+                       [&live](const std::pair<uint64_t, Stream*>& entry) {
+                         return live.contexts.count(entry.first) == 0;
+                       }),
+        entries_.end());
+  }
+  entries_.push_back(std::make_pair(context_id, stream));
+}
+std::atomic<uint32_t> OpenCLContext::next_kernel_slot_(0);
+
+OpenCLContext::OpenCLContext()
+    : context_id_(next_context_id_++), buffer_pool_(new OpenCLBufferPool()) {
+  out_of_order_ = false;
+  profiling_ = false;
+  program_cache_hits_ = 0;
+  autotune_enabled_ = true;
+  autotune_runs_ = 0;
+  LiveContexts& live = GetLiveContexts();
+  std::lock_guard<std::mutex> lock(live.lock);
+  live.contexts[context_id_] = this;
 }
 
 OpenCLContext::~OpenCLContext() {
+  {
+    // Threads that exit from now on leave this context alone.
+    LiveContexts& live = GetLiveContexts();
+    std::lock_guard<std::mutex> lock(live.lock);
+    live.contexts.erase(context_id_);
+  }
   // Make sure all queues are empty
-  for (uint32_t i = 0; i < queues_.size(); i++) {
-    queues_[i].finish();
+  std::lock_guard<std::mutex> lock(streams_lock_);
+  for (auto& stream : streams_) {
+    for (uint32_t i = 0; i < stream.second->queues.size(); i++) {
+      stream.second->queues[i].finish();
+    }
   }
-  queues_.clear();
+  streams_.clear();
+  // Buffers still in use will be released to the driver when they die.
+  buffer_pool_.reset();
   devices_.clear();
 }
 
 void OpenCLContext::init(const CLDevice device, const CLVendor vendor,
-                         const bool verbose_startup) {
+                         const bool verbose_startup, const bool out_of_order,
+                         const bool profiling) {
   std::lock_guard<std::mutex> lock(context_lock_);
 
-  createContext(device, vendor, verbose_startup);
+  cl::Platform platform;
+  // TODO: We might want to fail more gracefully.
+  RASSERT(getPlatform(device, vendor,
+                      platform));  // Otherwise no OpenCL platforms were found
+  initPlatform(platform, device, verbose_startup, out_of_order, profiling);
+}
+
+void OpenCLContext::init(const OpenCLDeviceScore& device,
+                         const bool verbose_startup, const bool out_of_order,
+                         const bool profiling) {
+  std::lock_guard<std::mutex> lock(context_lock_);
+
+  std::vector<cl::Platform> platforms;
+  CHECK_ERROR(cl::Platform::get(&platforms));
+  RASSERT(device.platform_index < platforms.size());
+  initPlatform(platforms[device.platform_index], device.type, verbose_startup,
+               out_of_order, profiling);
+  RASSERT(findDevice(device.id) >= 0);
+}
+
+void OpenCLContext::initPlatform(cl::Platform& platform, const CLDevice device,
+                                 const bool verbose_startup,
+                                 const bool out_of_order,
+                                 const bool profiling) {
+  createContext(platform, device, verbose_startup);
   InitDevices(device, verbose_startup);
-  createCommandQueues(verbose_startup);  // For each device
+  memory_counters_.reset(new OpenCLMemoryCounters((uint32_t)devices_.size()));
+  out_of_order_ = out_of_order;
+  for (uint32_t i = 0; i < devices_.size() && out_of_order_; i++) {
+    const cl_command_queue_properties props =
+        devices_[i].getInfo<CL_DEVICE_QUEUE_PROPERTIES>();
+    if ((props & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) == 0) {
+      std::cout << "OpenCLContext::init() - WARNING: device " << i
+                << " doesn't support out-of-order queues. Using in-order "
+                << "queues instead." << std::endl;
+      out_of_order_ = false;
+    }
+  }
+  profiling_ = profiling;
+  createStream();  // Command queues for the calling thread
 }
 
 bool OpenCLContext::queryDeviceExists(const CLDevice device,
@@ -45,14 +262,81 @@ bool OpenCLContext::queryDeviceExists(const CLDevice device,
   return exists;
 }
 
-void OpenCLContext::createContext(const CLDevice device, const CLVendor vendor,
-                                  const bool verbose_startup) {
-  cl::Platform platform;
+std::vector<OpenCLDeviceScore> OpenCLContext::scoreDevices(
+    const CLDevice device, const CLVendor vendor, const bool calibrate) {
+  std::lock_guard<std::mutex> lock(context_lock_);
 
-  // TODO: We might want to fail more gracefully.
-  RASSERT(getPlatform(device, vendor,
-                      platform));  // Otherwise no OpenCL platforms were found
+  std::vector<OpenCLDeviceScore> scores;
+  std::vector<cl::Platform> platforms;
+  CHECK_ERROR(cl::Platform::get(&platforms));
+
+  const cl_device_type type_cl = CLDevice2CLDeviceType(device);
+  const std::string find = CLVendor2String(vendor);
+  for (uint32_t p = 0; p < (uint32_t)platforms.size(); p++) {
+    const std::string platform_vendor =
+        platforms[p].getInfo<CL_PLATFORM_VENDOR>();
+    if (vendor != CLVendorAny &&
+        platform_vendor.find(find) == std::string::npos) {
+      continue;
+    }
+    std::vector<cl_device_id> devices;
+    getPlatformDeviceIDsOfType(platforms[p], type_cl, devices);
+    for (uint32_t d = 0; d < (uint32_t)devices.size(); d++) {
+      cl::Device cur_device(devices[d]);
+      cl_int err;
+      OpenCLDeviceScore score;
+      score.platform_index = p;
+      score.id = devices[d];
+      score.platform_vendor = platform_vendor;
+      score.name = cur_device.getInfo<CL_DEVICE_NAME>(&err);
+      CHECK_ERROR(err);
+      score.type =
+          CLDeviceType2CLDevice(cur_device.getInfo<CL_DEVICE_TYPE>(&err));
+      CHECK_ERROR(err);
+      score.compute_units =
+          (uint32_t)cur_device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>(&err);
+      CHECK_ERROR(err);
+      score.clock_mhz =
+          (uint32_t)cur_device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>(&err);
+      CHECK_ERROR(err);
+      score.global_mem_bytes =
+          (uint64_t)cur_device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>(&err);
+      CHECK_ERROR(err);
+      score.local_mem_bytes =
+          (uint64_t)cur_device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>(&err);
+      CHECK_ERROR(err);
+
+      // A device that can't run the calibration kernel scores 0.
+      double throughput;
+      if (calibrate) {
+        score.calibration_gflops =
+            CalibrateDevice(cur_device, score.compute_units);
+        throughput = score.calibration_gflops;
+      } else {
+        score.calibration_gflops = 0;
+        throughput = 1e-3 * (double)score.compute_units * score.clock_mhz;
+      }
+      const double global_mem_scale =
+          std::min(1.0, (double)score.global_mem_bytes /
+                            (double)kMinScoreGlobalMemBytes);
+      const double local_mem_scale =
+          std::min(1.0, (double)score.local_mem_bytes /
+                            (double)kMinScoreLocalMemBytes);
+      score.score = throughput * global_mem_scale * local_mem_scale;
+      scores.push_back(score);
+    }
+  }
 
+  std::stable_sort(scores.begin(), scores.end(),
+                   [](const OpenCLDeviceScore& a, const OpenCLDeviceScore& b) {
+                     return a.score > b.score;
+                   });
+  return scores;
+}
+
+void OpenCLContext::createContext(cl::Platform& platform,
+                                  const CLDevice device,
+                                  const bool verbose_startup) {
   // Use the preferred platform and create a context
   cl_context_properties cps[] = {CL_CONTEXT_PLATFORM,
                                  (cl_context_properties)(platform)(), 0};
@@ -112,6 +396,26 @@ void OpenCLContext::InitDevices(const CLDevice device,
     size_t max_size = devices_[i].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(&err);
     CHECK_ERROR(err);
     devices_max_workgroup_size_.push_back((int)max_size);
+    const cl_bool unified_memory =
+        devices_[i].getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>(&err);
+    CHECK_ERROR(err);
+    devices_host_unified_memory_.push_back(unified_memory == CL_TRUE);
+    const cl_bool image_support =
+        devices_[i].getInfo<CL_DEVICE_IMAGE_SUPPORT>(&err);
+    CHECK_ERROR(err);
+    std::vector<uint32_t> image3d_max_size(3, 0);
+    if (image_support == CL_TRUE) {
+      image3d_max_size[0] =
+          (uint32_t)devices_[i].getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>(&err);
+      CHECK_ERROR(err);
+      image3d_max_size[1] =
+          (uint32_t)devices_[i].getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>(&err);
+      CHECK_ERROR(err);
+      image3d_max_size[2] =
+          (uint32_t)devices_[i].getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>(&err);
+      CHECK_ERROR(err);
+    }
+    devices_image3d_max_size_.push_back(image3d_max_size);
     if (verbose_startup) {
       std::cout << "\t - device " << i << " CL_DEVICE_MAX_WORK_GROUP_SIZE: ";
       std::cout << devices_max_workgroup_size_[i] << std::endl;
@@ -140,16 +444,70 @@ void OpenCLContext::InitDevices(const CLDevice device,
   }
 }
 
-void OpenCLContext::createCommandQueues(const bool verbose_startup) {
-  for (uint32_t i = 0; i < devices_.size(); i++) {
-    cl_int err;
-    queues_.push_back(cl::CommandQueue(context_, devices_[i], 0, &err));
-    CHECK_ERROR(err);
+OpenCLContext::Stream* OpenCLContext::createStream() {
+  std::unique_lock<std::mutex> lock(streams_lock_);
+  RASSERT(!devices_.empty());  // You must call OpenCLContext::init() first
+  std::unique_ptr<Stream>& stream = streams_[thread_streams_.thread_id()];
+  if (stream == nullptr) {
+    stream.reset(new Stream());
+    stream->cur_program = nullptr;
+    stream->cur_kernel = nullptr;
+    cl_command_queue_properties props = 0;
+    if (out_of_order_) {
+      props |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    }
+    if (profiling_) {
+      props |= CL_QUEUE_PROFILING_ENABLE;
+    }
+    for (uint32_t i = 0; i < devices_.size(); i++) {
+      cl_int err;
+      stream->queues.push_back(
+          cl::CommandQueue(context_, devices_[i], props, &err));
+      CHECK_ERROR(err);
+    }
+    buffer_pool_->addThread(thread_streams_.thread_id());
   }
+  Stream* s = stream.get();
+  // ThreadStreams::add() takes the live contexts lock, which is taken before
+  // streams_lock_ on thread exit.
+  lock.unlock();
+  thread_streams_.add(context_id_, s);
+  return s;
+}
+
+void OpenCLContext::releaseStream(const uint64_t thread_id) {
+  std::unique_ptr<Stream> stream;
+  {
+    std::lock_guard<std::mutex> lock(streams_lock_);
+    auto it = streams_.find(thread_id);
+    if (it == streams_.end()) {
+      return;
+    }
+    stream = std::move(it->second);
+    streams_.erase(it);
+  }
+  for (uint32_t i = 0; i < stream->queues.size(); i++) {
+    stream->queues[i].finish();
+  }
+  buffer_pool_->removeThread(thread_id);
+}
+
+uint32_t OpenCLContext::getNumStreams() {
+  std::lock_guard<std::mutex> lock(streams_lock_);
+  return (uint32_t)streams_.size();
 }
 
 uint32_t OpenCLContext::getNumDevices() { return (uint32_t)devices_.size(); }
 
+int32_t OpenCLContext::findDevice(const cl_device_id id) const {
+  for (uint32_t i = 0; i < devices_.size(); i++) {
+    if (devices_[i]() == id) {
+      return (int32_t)i;
+    }
+  }
+  return -1;
+}
+
 uint32_t OpenCLContext::getMaxWorkgroupSize(const uint32_t i) {
   return devices_max_workgroup_size_[i];
 }
@@ -277,94 +635,459 @@ void OpenCLContext::getPlatformDeviceIDsOfType(
 }
 
 std::shared_ptr<OpenCLBufferData> OpenCLContext::allocateBuffer(
-    const CLBufferType type, const uint32_t nelems) {
-  return std::shared_ptr<OpenCLBufferData>(
-      new OpenCLBufferData(type, nelems, context_));
+    const CLBufferType type, const uint64_t nelems, const bool host_visible,
+    const CLBufferTag tag, const uint32_t device_index) {
+  RASSERT(device_index < devices_.size());
+  if (!buffer_pool_->enabled()) {
+    return std::shared_ptr<OpenCLBufferData>(
+        new OpenCLBufferData(type, nelems, context_, memory_counters_,
+                             device_index, host_visible, tag));
+  }
+  return std::shared_ptr<OpenCLBufferData>(new OpenCLBufferData(
+      type, host_visible, nelems, OpenCLBufferPool::sizeClass(nelems),
+      context_, buffer_pool_, memory_counters_, device_index, tag));
 }
 
-void OpenCLContext::useKernel(const char* filename, const char* kernel_name,
-                              const bool strict_float) {
-  // Make sure the program is compiled
-  if (cur_program_ == nullptr || cur_program_->filename() != filename) {
-    if (programs_.find(filename) == programs_.end()) {
-      programs_[filename] = std::unique_ptr<OpenCLProgram>(
-          new OpenCLProgram(filename, context_, devices_, strict_float));
+void* OpenCLContext::mapBuffer(const uint32_t device_index,
+                               const std::shared_ptr<OpenCLBufferData>& buffer,
+                               const bool write, const uint64_t nelems,
+                               const uint64_t offset) {
+  RASSERT(buffer->mapped_ptr_ == nullptr);  // Already mapped!
+  RASSERT((uint64_t)offset + nelems <= buffer->nelems());
+  Stream* s = stream();
+  invalidateCapture(s);
+  cl::CommandQueue& queue = s->queues[device_index];
+  std::vector<cl::Event> wait_list;
+  if (out_of_order_) {
+    addWaitEvents(buffer->events().get(), write, wait_list);
+  }
+  cl_int err;
+  // Blocking, so once this returns every command the map depends on is done.
+  void* ptr = queue.enqueueMapBuffer(
+      buffer->buffer(), CL_TRUE, write ? CL_MAP_WRITE : CL_MAP_READ,
+      offset * sizeof(cl_float), nelems * sizeof(cl_float), &wait_list,
+      nullptr, &err);
+  CHECK_ERROR(err);
+  buffer->mapped_ptr_ = ptr;
+  buffer->mapped_for_write_ = write;
+  return ptr;
+}
+
+void OpenCLContext::unmapBuffer(
+    const uint32_t device_index,
+    const std::shared_ptr<OpenCLBufferData>& buffer) {
+  RASSERT(buffer->mapped_ptr_ != nullptr);  // Not mapped!
+  Stream* s = stream();
+  invalidateCapture(s);
+  cl::CommandQueue& queue = s->queues[device_index];
+  if (!out_of_order_) {
+    CHECK_ERROR(queue.enqueueUnmapMemObject(buffer->buffer(),
+                                            buffer->mapped_ptr_));
+  } else {
+    // Commands that use the buffer next must wait for the unmap.
+    cl::Event event;
+    CHECK_ERROR(queue.enqueueUnmapMemObject(
+        buffer->buffer(), buffer->mapped_ptr_, nullptr, &event));
+    recordEvent(buffer->events().get(), buffer->mapped_for_write_, event);
+  }
+  buffer->mapped_ptr_ = nullptr;
+}
+
+void OpenCLContext::copyBuffer(const uint32_t device_index,
+                               const std::shared_ptr<OpenCLBufferData>& src,
+                               const std::shared_ptr<OpenCLBufferData>& dst,
+                               const uint64_t nelems,
+                               const uint64_t src_offset,
+                               const uint64_t dst_offset) {
+  RASSERT((uint64_t)src_offset + nelems <= src->nelems());
+  RASSERT((uint64_t)dst_offset + nelems <= dst->nelems());
+  Stream* s = stream();
+  if (s->capture != nullptr) {
+    recordCommand(s, device_index, {src, dst},
+                  [this, device_index, nelems, src_offset, dst_offset](
+                      const OpenCLCapture::Buffers& buffers) {
+                    copyBuffer(device_index, buffers[0], buffers[1], nelems,
+                               src_offset, dst_offset);
+                  });
+  }
+  cl::CommandQueue& queue = s->queues[device_index];
+  if (!out_of_order_) {
+    CHECK_ERROR(queue.enqueueCopyBuffer(
+        src->buffer(), dst->buffer(), src_offset * sizeof(cl_float),
+        dst_offset * sizeof(cl_float), nelems * sizeof(cl_float)));
+    return;
+  }
+  std::vector<cl::Event> wait_list;
+  addWaitEvents(src->events().get(), false, wait_list);
+  addWaitEvents(dst->events().get(), true, wait_list);
+  cl::Event event;
+  CHECK_ERROR(queue.enqueueCopyBuffer(
+      src->buffer(), dst->buffer(), src_offset * sizeof(cl_float),
+      dst_offset * sizeof(cl_float), nelems * sizeof(cl_float), &wait_list,
+      &event));
+  recordEvent(src->events().get(), false, event);
+  recordEvent(dst->events().get(), true, event);
+}
+
+bool OpenCLContext::supportsImage3D(const uint32_t device_index,
+                                    const uint32_t width,
+                                    const uint32_t height,
+                                    const uint32_t depth) const {
+  const std::vector<uint32_t>& max_size =
+      devices_image3d_max_size_[device_index];
+  // 3D images must be at least 2 deep.
+  return width > 0 && height > 0 && depth > 1 && width <= max_size[0] &&
+         height <= max_size[1] && depth <= max_size[2];
+}
+
+std::shared_ptr<OpenCLImageData> OpenCLContext::allocateImage(
+    const uint32_t width, const uint32_t height, const uint32_t depth,
+    const CLBufferTag tag, const uint32_t device_index) {
+  RASSERT(device_index < devices_.size());
+  return std::shared_ptr<OpenCLImageData>(new OpenCLImageData(
+      width, height, depth, context_, memory_counters_, device_index, tag));
+}
+
+void OpenCLContext::copyBufferToImage(
+    const uint32_t device_index, const std::shared_ptr<OpenCLBufferData>& src,
+    const uint64_t src_offset, const std::shared_ptr<OpenCLImageData>& dst) {
+  RASSERT((uint64_t)src_offset + dst->nelems() <= src->nelems());
+  Stream* s = stream();
+  if (s->capture != nullptr) {
+    recordCommand(s, device_index, {src},
+                  [this, device_index, src_offset, dst](
+                      const OpenCLCapture::Buffers& buffers) {
+                    copyBufferToImage(device_index, buffers[0], src_offset,
+                                      dst);
+                  });
+  }
+  cl::CommandQueue& queue = s->queues[device_index];
+  cl::size_t<3> origin;
+  origin[0] = 0;
+  origin[1] = 0;
+  origin[2] = 0;
+  cl::size_t<3> region;
+  region[0] = dst->width();
+  region[1] = dst->height();
+  region[2] = dst->depth();
+  if (!out_of_order_) {
+    CHECK_ERROR(queue.enqueueCopyBufferToImage(
+        src->buffer(), dst->image(), src_offset * sizeof(cl_float), origin,
+        region));
+    return;
+  }
+  std::vector<cl::Event> wait_list;
+  addWaitEvents(src->events().get(), false, wait_list);
+  addWaitEvents(dst->events().get(), true, wait_list);
+  cl::Event event;
+  CHECK_ERROR(queue.enqueueCopyBufferToImage(
+      src->buffer(), dst->image(), src_offset * sizeof(cl_float), origin,
+      region, &wait_list, &event));
+  recordEvent(src->events().get(), false, event);
+  recordEvent(dst->events().get(), true, event);
+}
+
+void OpenCLContext::setBufferPoolEnabled(const bool enabled) {
+  buffer_pool_->setEnabled(enabled);
+}
+
+OpenCLBufferPoolStats OpenCLContext::getBufferPoolStats() {
+  return buffer_pool_->stats();
+}
+
+void OpenCLContext::trimBufferPool(const uint64_t max_cached_bytes) {
+  buffer_pool_->trim(max_cached_bytes);
+}
+
+OpenCLMemoryStats OpenCLContext::getMemoryStats(const uint32_t device_index) {
+  return memory_counters_->stats(device_index);
+}
+
+void OpenCLContext::printMemoryStats(const uint32_t device_index) {
+  const OpenCLMemoryStats stats = getMemoryStats(device_index);
+  const OpenCLBufferPoolStats pool_stats = getBufferPoolStats();
+  const double mb = 1024.0 * 1024.0;
+  std::cout << "Device " << device_index << " memory (MB):" << std::endl;
+  std::cout << std::left << std::setw(24) << "tag" << std::right
+            << std::setw(12) << "live" << std::setw(12) << "peak" << std::endl;
+  const std::ios::fmtflags flags = std::cout.flags();
+  const std::streamsize prec = std::cout.precision();
+  std::cout << std::fixed << std::setprecision(3);
+  for (uint32_t i = 0; i < CLBufferTagCount; i++) {
+    std::cout << std::left << std::setw(24)
+              << CLBufferTagToString((CLBufferTag)i) << std::right
+              << std::setw(12) << stats.tag_live_bytes[i] / mb
+              << std::setw(12) << stats.tag_peak_bytes[i] / mb << std::endl;
+  }
+  std::cout << std::left << std::setw(24) << "total" << std::right
+            << std::setw(12) << stats.live_bytes / mb << std::setw(12)
+            << stats.peak_bytes / mb << std::endl;
+  std::cout << std::left << std::setw(24) << "pool cache" << std::right
+            << std::setw(12) << pool_stats.bytes_cached / mb << std::endl;
+  std::cout.flags(flags);
+  std::cout.precision(prec);
+  std::cout << stats.num_live << " live buffers, " << stats.num_allocations
+            << " allocations" << std::endl;
+}
+
+void OpenCLContext::resetPeakMemory(const uint32_t device_index) {
+  memory_counters_->resetPeak(device_index);
+}
+
+std::string OpenCLContext::definesString(const OpenCLDefines& defines) {
+  std::string ret;
+  for (const auto& define : defines) {
+    if (!ret.empty()) {
+      ret += " ";
+    }
+    ret += "-D " + define.first;
+    if (!define.second.empty()) {
+      ret += "=" + define.second;
+    }
+  }
+  return ret;
+}
+
+void OpenCLContext::buildProgramsCStr(
+    const std::vector<OpenCLProgramSource>& programs,
+    const uint32_t num_threads) {
+  // Stages share programs (ie two convolutions of the same shape), so only
+  // build each distinct one once.
+  std::vector<const OpenCLProgramSource*> todo;
+  std::set<std::string> seen;
+  for (const auto& program : programs) {
+    if (seen.insert(definesString(program.defines) + "\n" +
+                    program.kernel_c_str).second) {
+      todo.push_back(&program);
     }
-    cur_program_ = programs_[filename].get();
   }
 
-  // Make sure the Kernel is compiled
-  if (cur_kernel_ == nullptr || cur_kernel_->program() != cur_program_ ||
-      cur_kernel_->kernel_name() != kernel_name) {
-    std::string id = std::string(filename) + kernel_name;
-    if (kernels_.find(id) == kernels_.end()) {
-      kernels_[id] = std::unique_ptr<OpenCLKernel>(
-          new OpenCLKernel(kernel_name, cur_program_));
+  if (todo.empty()) {
+    return;
+  }
+  uint32_t nthreads = num_threads;
+  if (nthreads == 0) {
+    nthreads = std::max<uint32_t>(std::thread::hardware_concurrency(), 1);
+  }
+  nthreads = std::min<uint32_t>(nthreads, (uint32_t)todo.size());
+
+  // getProgramCStr() compiles outside of programs_lock_, so the workers
+  // build in parallel (clBuildProgram is thread-safe).
+  // Each worker pulls the next program until there are none left (the
+  // calling thread is one of the workers).
+  std::atomic<uint32_t> next(0);
+  auto worker = [&]() {
+    for (uint32_t i = next++; i < todo.size(); i = next++) {
+      getProgramCStr(todo[i]->kernel_c_str, todo[i]->strict_float,
+                     definesString(todo[i]->defines));
     }
-    cur_kernel_ = kernels_[id].get();
+  };
+  std::vector<std::thread> threads;
+  for (uint32_t i = 1; i < nthreads; i++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
   }
 }
 
+OpenCLProgram* OpenCLContext::getProgram(const char* filename,
+                                         const bool strict_float,
+                                         const std::string& defines) {
+  const std::string name = OpenCLProgram::programName(filename, defines);
+  {
+    std::lock_guard<std::mutex> lock(programs_lock_);
+    auto program = programs_.find(name);
+    if (program != programs_.end()) {
+      return program->second.get();
+    }
+  }
+  // Compile outside the lock so other threads aren't stalled.
+  return addProgram(name, std::unique_ptr<OpenCLProgram>(new OpenCLProgram(
+                              filename, context_, devices_, strict_float,
+                              program_cache_dir_, defines)));
+}
+
+OpenCLProgram* OpenCLContext::getProgramCStr(const char* kernel_c_str,
+                                             const bool strict_float,
+                                             const std::string& defines) {
+  // Hash the string and use this for the filename.
+  const uint32_t hash = jcl::data_str::HashString(
+      std::numeric_limits<uint32_t>::max(), kernel_c_str);
+  const std::string filename =
+      "char* kernel. StringHash: " + std::to_string(hash);
+  const std::string name = OpenCLProgram::programName(filename, defines);
+
+  {
+    std::lock_guard<std::mutex> lock(programs_lock_);
+    auto program = programs_.find(name);
+    if (program != programs_.end()) {
+      return program->second.get();
+    }
+  }
+  return addProgram(name, std::unique_ptr<OpenCLProgram>(new OpenCLProgram(
+                              kernel_c_str, filename, context_, devices_,
+                              strict_float, program_cache_dir_, defines)));
+}
+
+void OpenCLContext::useKernel(const char* filename, const char* kernel_name,
+                              const bool strict_float) {
+  useKernel(filename, kernel_name, OpenCLDefines(), strict_float);
+}
+
 void OpenCLContext::useKernelCStr(const char* kernel_c_str,
                                   const char* kernel_name,
                                   const bool strict_float) {
-  // Hash the string and use this for the filename.
-  uint32_t hash = jcl::data_str::HashString(
-      std::numeric_limits<uint32_t>::max(), kernel_c_str);
-  std::stringstream filename;
-  filename << "char* kernel. StringHash: " << hash;
+  useKernelCStr(kernel_c_str, kernel_name, OpenCLDefines(), strict_float);
+}
 
+void OpenCLContext::useKernel(const char* filename, const char* kernel_name,
+                              const OpenCLDefines& defines,
+                              const bool strict_float) {
   // Make sure the program is compiled
-  if (cur_program_ == nullptr || cur_program_->filename() != filename.str()) {
-    if (programs_.find(filename.str()) == programs_.end()) {
-      programs_[filename.str()] =
-          std::unique_ptr<OpenCLProgram>(new OpenCLProgram(
-              kernel_c_str, filename.str(), context_, devices_, strict_float));
-    }
-    cur_program_ = programs_[filename.str()].get();
+  Stream* s = stream();
+  const std::string defines_str = definesString(defines);
+  if (s->cur_program == nullptr ||
+      s->cur_program->filename() !=
+          OpenCLProgram::programName(filename, defines_str)) {
+    s->cur_program = getProgram(filename, strict_float, defines_str);
   }
-  // Make sure the Kernel is compiled
-  if (cur_kernel_ == nullptr || cur_kernel_->program() != cur_program_ ||
-      cur_kernel_->kernel_name() != kernel_name) {
-    std::string id = filename.str() + kernel_name;
-    if (kernels_.find(id) == kernels_.end()) {
-      kernels_[id] = std::unique_ptr<OpenCLKernel>(
-          new OpenCLKernel(kernel_name, cur_program_));
+  setCurKernel(kernel_name);
+}
+
+void OpenCLContext::useKernelCStr(const char* kernel_c_str,
+                                  const char* kernel_name,
+                                  const OpenCLDefines& defines,
+                                  const bool strict_float) {
+  stream()->cur_program =
+      getProgramCStr(kernel_c_str, strict_float, definesString(defines));
+  setCurKernel(kernel_name);
+}
+
+void OpenCLContext::setCurKernel(const char* kernel_name) {
+  // Make sure the Kernel is compiled.  Kernel objects are per stream since
+  // they hold the argument bindings.
+  Stream* s = stream();
+  if (s->cur_kernel == nullptr || s->cur_kernel->program() != s->cur_program ||
+      s->cur_kernel->kernel_name() != kernel_name) {
+    const std::string id = s->cur_program->filename() + kernel_name;
+    auto kernel = s->kernels.find(id);
+    if (kernel == s->kernels.end()) {
+      s->cur_kernel = new OpenCLKernel(kernel_name, s->cur_program, devices_);
+      s->kernels[id] = std::unique_ptr<OpenCLKernel>(s->cur_kernel);
+    } else {
+      s->cur_kernel = kernel->second.get();
     }
-    cur_kernel_ = kernels_[id].get();
   }
 }
 
+KernelHandle OpenCLContext::getKernel(const char* filename,
+                                      const char* kernel_name,
+                                      const bool strict_float) {
+  return getKernel(filename, kernel_name, OpenCLDefines(), strict_float);
+}
+
+KernelHandle OpenCLContext::getKernelCStr(const char* kernel_c_str,
+                                          const char* kernel_name,
+                                          const bool strict_float) {
+  return getKernelCStr(kernel_c_str, kernel_name, OpenCLDefines(),
+                       strict_float);
+}
+
+KernelHandle OpenCLContext::getKernel(const char* filename,
+                                      const char* kernel_name,
+                                      const OpenCLDefines& defines,
+                                      const bool strict_float) {
+  OpenCLProgram* program =
+      getProgram(filename, strict_float, definesString(defines));
+  return KernelHandle(new OpenCLKernel(kernel_name, program, devices_));
+}
+
+KernelHandle OpenCLContext::getKernelCStr(const char* kernel_c_str,
+                                          const char* kernel_name,
+                                          const OpenCLDefines& defines,
+                                          const bool strict_float) {
+  OpenCLProgram* program =
+      getProgramCStr(kernel_c_str, strict_float, definesString(defines));
+  return KernelHandle(new OpenCLKernel(kernel_name, program, devices_));
+}
+
+uint32_t OpenCLContext::newKernelSlot() { return next_kernel_slot_++; }
+
+OpenCLKernel* OpenCLContext::getCachedKernelCStr(const uint32_t slot,
+                                                 const char* kernel_c_str,
+                                                 const char* kernel_name,
+                                                 const OpenCLDefines& defines,
+                                                 const bool strict_float) {
+  Stream* s = stream();
+  if (slot >= s->cached_kernels.size()) {
+    s->cached_kernels.resize(slot + 1);
+  }
+  std::unique_ptr<OpenCLKernel>& kernel = s->cached_kernels[slot];
+  if (kernel == nullptr) {
+    kernel = getKernelCStr(kernel_c_str, kernel_name, defines, strict_float);
+  }
+  return kernel.get();
+}
+
+OpenCLProgram* OpenCLContext::addProgram(
+    const std::string& filename, std::unique_ptr<OpenCLProgram> program) {
+  std::lock_guard<std::mutex> lock(programs_lock_);
+  // Another thread might have compiled the same program in the meantime, in
+  // which case we keep the existing one (kernels may already reference it).
+  std::unique_ptr<OpenCLProgram>& existing = programs_[filename];
+  if (existing != nullptr) {
+    return existing.get();
+  }
+  if (program->loaded_from_cache()) {
+    program_cache_hits_++;
+  }
+  existing = std::move(program);
+  return existing.get();
+}
+
+uint32_t OpenCLContext::getNumPrograms() {
+  std::lock_guard<std::mutex> lock(programs_lock_);
+  return (uint32_t)programs_.size();
+}
+
+void OpenCLContext::setProgramCacheDir(const std::string& cache_dir) {
+  program_cache_dir_ = cache_dir;
+}
+
 void OpenCLContext::setArg(const uint32_t index,
                            const std::shared_ptr<OpenCLBufferData>& val) {
   // You must call OpenCL::useKernel() first.
-  RASSERT(cur_kernel_ != nullptr);
-  cur_kernel_->setArg(index, val->buffer());
+  Stream* s = stream();
+  RASSERT(s->cur_kernel != nullptr);
+  s->cur_kernel->setArg(index, val);
 }
 
 void OpenCLContext::setArg(const uint32_t index, const uint32_t size,
                            void* data) {
   // You must call OpenCL::useKernel() first.
-  RASSERT(cur_kernel_ != nullptr);
-  cur_kernel_->setArg(index, size, data);
+  Stream* s = stream();
+  RASSERT(s->cur_kernel != nullptr);
+  s->cur_kernel->setArg(index, size, data);
 }
 
 void OpenCLContext::sync(const uint32_t device_index) {
   RASSERT(device_index < devices_.size());
-  CHECK_ERROR(queues_[device_index].finish());
+  CHECK_ERROR(stream()->queues[device_index].finish());
+  if (profiling_) {
+    // Don't wait on the other threads' launches here.
+    resolveProfileEvents(false);
+  }
 }
 
 uint32_t OpenCLContext::queryMaxWorkgroupSizeForCurKernel(
     const uint32_t device_index) {
   // You must call OpenCL::useKernel() first.
-  RASSERT(cur_kernel_ != nullptr);
+  Stream* s = stream();
+  RASSERT(s->cur_kernel != nullptr);
   RASSERT(device_index < devices_.size());
-
-  size_t max_workgroup_size;
-  cl_int rc = cur_kernel_->kernel().getWorkGroupInfo<size_t>(
-      devices_[device_index], CL_KERNEL_WORK_GROUP_SIZE, &max_workgroup_size);
-  RASSERT(rc == CL_SUCCESS);
-  return (uint32_t)max_workgroup_size;
+  return s->cur_kernel->max_workgroup_size(device_index);
 }
 
 void OpenCLContext::runKernel(const uint32_t device_index, const uint32_t dim,
@@ -372,7 +1095,26 @@ void OpenCLContext::runKernel(const uint32_t device_index, const uint32_t dim,
                               const uint32_t* local_work_size,
                               const bool blocking) {
   // You must call OpenCL::useKernel() first.
-  RASSERT(cur_kernel_ != nullptr);
+  Stream* s = stream();
+  RASSERT(s->cur_kernel != nullptr);
+  runKernel(s->cur_kernel, device_index, dim, global_work_size,
+            local_work_size, blocking);
+}
+
+void OpenCLContext::runKernel(const uint32_t device_index, const uint32_t dim,
+                              const uint32_t* global_work_size,
+                              const bool blocking) {
+  // You must call OpenCL::useKernel() first.
+  Stream* s = stream();
+  RASSERT(s->cur_kernel != nullptr);
+  runKernel(s->cur_kernel, device_index, dim, global_work_size, blocking);
+}
+
+void OpenCLContext::runKernel(OpenCLKernel* kernel,
+                              const uint32_t device_index, const uint32_t dim,
+                              const uint32_t* global_work_size,
+                              const uint32_t* local_work_size,
+                              const bool blocking) {
   RASSERT(device_index < devices_.size());
   RASSERT(dim <= 3);  // OpenCL doesn't support greater than 3 dims!
 
@@ -391,10 +1133,9 @@ void OpenCLContext::runKernel(const uint32_t device_index, const uint32_t dim,
   // CL_DEVICE_MAX_WORK_GROUP_SIZE!
   RASSERT(total_worksize <=
           (uint32_t)devices_max_workgroup_size_[device_index]);
-  uint32_t max_size = queryMaxWorkgroupSizeForCurKernel(device_index);
   // Check that: Local workgroup size is not greater than
   // CL_KERNEL_WORK_GROUP_SIZE!
-  RASSERT(total_worksize <= (uint32_t)max_size);
+  RASSERT(total_worksize <= kernel->max_workgroup_size(device_index));
 
   cl::NDRange offset = cl::NullRange;
   cl::NDRange global_work;
@@ -415,21 +1156,14 @@ void OpenCLContext::runKernel(const uint32_t device_index, const uint32_t dim,
                                local_work_size[2]);
       break;
   }
-  cl::Event cur_event;
-  CHECK_ERROR(queues_[device_index].enqueueNDRangeKernel(
-      cur_kernel_->kernel(), offset, global_work, local_work, nullptr,
-      &cur_event));
-
-  if (blocking) {
-    cur_event.wait();
-  }
+  enqueueKernel(kernel, device_index, offset, global_work, local_work,
+                blocking);
 }
 
-void OpenCLContext::runKernel(const uint32_t device_index, const uint32_t dim,
+void OpenCLContext::runKernel(OpenCLKernel* kernel,
+                              const uint32_t device_index, const uint32_t dim,
                               const uint32_t* global_work_size,
                               const bool blocking) {
-  // You must call OpenCL::useKernel() first.
-  RASSERT(cur_kernel_ != nullptr);
   RASSERT(device_index < devices_.size());
   RASSERT(dim <= 3);  // OpenCL doesn't support greater than 3 dims!
 
@@ -448,16 +1182,621 @@ void OpenCLContext::runKernel(const uint32_t device_index, const uint32_t dim,
                                 global_work_size[2]);
       break;
   }
-  cl::Event cur_event;
-  CHECK_ERROR(queues_[device_index].enqueueNDRangeKernel(
-      cur_kernel_->kernel(), offset, global_work, local_work, nullptr,
-      &cur_event));
+  enqueueKernel(kernel, device_index, offset, global_work, local_work,
+                blocking);
+}
+
+void OpenCLContext::runKernelAutotuned(
+    OpenCLKernel* kernel, const uint32_t device_index, const uint32_t dim,
+    const uint32_t* global_work_size, const bool blocking,
+    const uint32_t* default_local_size,
+    const LocalSizeCallback& local_size_callback) {
+  RASSERT(device_index < devices_.size());
+  RASSERT(dim >= 1 && dim <= 3);
+  // Kernels with local size dependent arguments can't use the driver default.
+  RASSERT(local_size_callback == nullptr || default_local_size != nullptr);
+
+  uint32_t local_work_size[3] = {0, 0, 0};
+  if (!kernel->getTunedLocalSize(device_index, dim, global_work_size,
+                                 local_work_size)) {
+    if (!autotune_enabled_) {
+      for (uint32_t i = 0; i < dim && default_local_size != nullptr; i++) {
+        local_work_size[i] = default_local_size[i];
+      }
+    } else {
+      const std::string key =
+          autotuneKey(kernel, device_index, dim, global_work_size);
+      AutotuneResult result;
+      bool found;
+      {
+        std::lock_guard<std::mutex> lock(autotune_lock_);
+        auto cached = autotune_results_.find(key);
+        found = cached != autotune_results_.end();
+        if (found) {
+          result = cached->second;
+        }
+      }
+      if (!found) {
+        result = autotune(kernel, device_index, dim, global_work_size,
+                          default_local_size, local_size_callback);
+        std::lock_guard<std::mutex> lock(autotune_lock_);
+        autotune_results_[key] = result;
+        if (!autotune_file_.empty()) {
+          writeAutotuneFile();
+        }
+      }
+      kernel->setTunedLocalSize(device_index, dim, global_work_size,
+                                result.local_work_size);
+      for (uint32_t i = 0; i < dim; i++) {
+        local_work_size[i] = result.local_work_size[i];
+      }
+    }
+  }
+
+  if (local_work_size[0] == 0) {
+    runKernel(kernel, device_index, dim, global_work_size, blocking);
+    return;
+  }
+  if (local_size_callback != nullptr) {
+    local_size_callback(local_work_size);
+  }
+  runKernel(kernel, device_index, dim, global_work_size, local_work_size,
+            blocking);
+}
+
+void OpenCLContext::setAutotuneFile(const std::string& filename) {
+  std::lock_guard<std::mutex> lock(autotune_lock_);
+  autotune_file_ = filename;
+  if (!filename.empty()) {
+    readAutotuneFile(autotune_results_, false);
+  }
+}
+
+void OpenCLContext::readAutotuneFile(
+    std::unordered_map<std::string, AutotuneResult>& results,
+    const bool keep_existing) {
+  // Each line is: <local size x> <local size y> <local size z> <key>.  Later
+  // lines win (files written before they were deduplicated have repeats).
+  std::ifstream file(autotune_file_.c_str());
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream ss(line);
+    AutotuneResult result;
+    std::string key;
+    ss >> result.local_work_size[0] >> result.local_work_size[1] >>
+        result.local_work_size[2];
+    ss.get();  // The separator
+    std::getline(ss, key);
+    if (ss.fail() || key.empty()) {
+      continue;
+    }
+    if (keep_existing) {
+      results.insert(std::make_pair(key, result));
+    } else {
+      results[key] = result;
+    }
+  }
+}
+
+void OpenCLContext::writeAutotuneFile() {
+  // Pick up the results other processes saved since the file was loaded, so
+  // that they aren't dropped by the rewrite.
+  readAutotuneFile(autotune_results_, true);
+  const std::string tmp_filename = UniqueTempFilename(autotune_file_);
+  std::ofstream file(tmp_filename.c_str());
+  if (!file.is_open()) {
+    std::cout << "OpenCLContext::writeAutotuneFile() - WARNING: could not "
+              << "open " << tmp_filename << " for writing" << std::endl;
+    return;
+  }
+  for (const auto& entry : autotune_results_) {
+    const AutotuneResult& result = entry.second;
+    file << result.local_work_size[0] << " " << result.local_work_size[1]
+         << " " << result.local_work_size[2] << " " << entry.first << "\n";
+  }
+  file.close();
+  if (!file) {
+    std::remove(tmp_filename.c_str());
+    return;
+  }
+  std::remove(autotune_file_.c_str());  // rename() won't overwrite on Windows.
+  if (std::rename(tmp_filename.c_str(), autotune_file_.c_str()) != 0) {
+    std::remove(tmp_filename.c_str());
+  }
+}
+
+std::string OpenCLContext::autotuneKey(OpenCLKernel* kernel,
+                                       const uint32_t device_index,
+                                       const uint32_t dim,
+                                       const uint32_t* global_work_size) {
+  std::stringstream key;
+  key << kernel->program()->filename() << "|" << kernel->kernel_name() << "|";
+  for (uint32_t i = 0; i < dim; i++) {
+    key << (i > 0 ? "x" : "") << global_work_size[i];
+  }
+  key << "|" << devices_[device_index].getInfo<CL_DEVICE_NAME>() << "|"
+      << devices_[device_index].getInfo<CL_DRIVER_VERSION>();
+  return key.str();
+}
+
+OpenCLContext::AutotuneResult OpenCLContext::autotune(
+    OpenCLKernel* kernel, const uint32_t device_index, const uint32_t dim,
+    const uint32_t* global_work_size, const uint32_t* default_local_size,
+    const LocalSizeCallback& local_size_callback) {
+  autotune_runs_++;
+
+  // Candidates: the default, then every combination of power of two local
+  // sizes (or the full extent) that divide the global size and fit on the
+  // device.
+  std::vector<AutotuneResult> candidates(1);
+  for (uint32_t i = 0; i < 3; i++) {
+    candidates[0].local_work_size[i] =
+        default_local_size != nullptr && i < dim ? default_local_size[i] : 0;
+  }
+  const uint32_t max_group =
+      std::min<uint32_t>(kernel->max_workgroup_size(device_index),
+                         devices_max_workgroup_size_[device_index]);
+  std::vector<uint32_t> sizes[3];
+  for (uint32_t i = 0; i < 3; i++) {
+    if (i >= dim) {
+      sizes[i].push_back(1);
+      continue;
+    }
+    const uint32_t max_size = std::min<uint32_t>(
+        max_group, devices_max_workitem_size_[device_index][i]);
+    for (uint64_t size = 1; size <= max_size; size *= 2) {
+      if (global_work_size[i] % size == 0) {
+        sizes[i].push_back((uint32_t)size);
+      }
+    }
+    if (global_work_size[i] <= max_size &&
+        global_work_size[i] != sizes[i].back()) {
+      sizes[i].push_back(global_work_size[i]);
+    }
+  }
+  std::vector<AutotuneResult> small_candidates;
+  for (const uint32_t x : sizes[0]) {
+    for (const uint32_t y : sizes[1]) {
+      for (const uint32_t z : sizes[2]) {
+        const uint64_t group_size = (uint64_t)x * y * z;
+        if (group_size > max_group) {
+          continue;
+        }
+        const AutotuneResult candidate = {{x, y, z}};
+        if (group_size < kMinAutotuneGroupSize) {
+          small_candidates.push_back(candidate);
+        } else {
+          candidates.push_back(candidate);
+        }
+      }
+    }
+  }
+  if (candidates.size() == 1) {
+    candidates.insert(candidates.end(), small_candidates.begin(),
+                      small_candidates.end());
+  }
+
+  Stream* s = stream();
+  if (s->tuning_queues.empty()) {
+    s->tuning_queues.resize(devices_.size());
+  }
+  cl::CommandQueue& queue = s->tuning_queues[device_index];
+  if (queue() == nullptr) {
+    cl_int err;
+    queue = cl::CommandQueue(context_, devices_[device_index],
+                             CL_QUEUE_PROFILING_ENABLE, &err);
+    CHECK_ERROR(err);
+  }
+  // The arguments might still be being written on this thread's queue: the
+  // first launch waits for everything enqueued there so far.
+  std::vector<cl::Event> ready(1);
+  CHECK_ERROR(s->queues[device_index].enqueueMarker(&ready[0]));
+
+  const cl::NDRange global_work = MakeNDRange(dim, global_work_size);
+  AutotuneResult best = candidates[0];
+  double best_time = std::numeric_limits<double>::infinity();
+  for (const AutotuneResult& candidate : candidates) {
+    cl::NDRange local_work = cl::NullRange;
+    if (candidate.local_work_size[0] != 0) {
+      local_work = MakeNDRange(dim, candidate.local_work_size);
+      if (local_size_callback != nullptr) {
+        local_size_callback(candidate.local_work_size);
+      }
+    }
+    std::vector<cl::Event> events;
+    bool ok = true;
+    for (uint32_t run = 0; run <= kAutotuneRuns && ok; run++) {
+      cl::Event event;
+      // Some candidates might still fail (ie not enough local memory).
+      ok = queue.enqueueNDRangeKernel(kernel->kernel(), cl::NullRange,
+                                      global_work, local_work,
+                                      ready.empty() ? nullptr : &ready,
+                                      &event) == CL_SUCCESS;
+      if (ok) {
+        ready.clear();
+      }
+      if (run > 0) {
+        events.push_back(event);
+      }
+    }
+    CHECK_ERROR(queue.finish());
+    if (!ok) {
+      continue;
+    }
+    double time = std::numeric_limits<double>::infinity();
+    for (uint32_t i = 0; i < events.size(); i++) {
+      const cl_ulong start =
+          events[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      const cl_ulong end =
+          events[i].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+      time = std::min<double>(time, (double)(end - start));
+    }
+    if (time < best_time) {
+      best_time = time;
+      best = candidate;
+    }
+  }
+  return best;
+}
+
+void OpenCLContext::enqueueKernel(OpenCLKernel* kernel,
+                                  const uint32_t device_index,
+                                  const cl::NDRange& offset,
+                                  const cl::NDRange& global_work,
+                                  const cl::NDRange& local_work,
+                                  const bool blocking) {
+  Stream* s = stream();
+  if (s->capture != nullptr) {
+    // Record a copy of the kernel with the arguments bound right now (the
+    // original might be launched again with different ones).
+    OpenCLCapture::Command command;
+    command.device_index = device_index;
+    command.kernel.reset(
+        new OpenCLKernel(kernel->kernel_name(), kernel->program(), devices_));
+    command.kernel->copyArgs(*kernel);
+    command.global_work = global_work;
+    command.local_work = local_work;
+    command.blocking = blocking;
+    s->capture->commands_.push_back(std::move(command));
+  }
+  cl::CommandQueue& queue = s->queues[device_index];
+  if (out_of_order_) {
+    const auto& arg_events = kernel->arg_events();
+    std::vector<cl::Event> wait_list;
+    for (uint32_t i = 0; i < arg_events.size(); i++) {
+      if (arg_events[i] != nullptr) {
+        addWaitEvents(arg_events[i].get(),
+                      kernel->arg_access(i) != CLArgAccessRead,
+                      wait_list);
+      }
+    }
+    cl::Event cur_event;
+    CHECK_ERROR(queue.enqueueNDRangeKernel(kernel->kernel(), offset,
+                                           global_work, local_work,
+                                           &wait_list, &cur_event));
+    for (uint32_t i = 0; i < arg_events.size(); i++) {
+      if (arg_events[i] != nullptr) {
+        recordEvent(arg_events[i].get(),
+                    kernel->arg_access(i) != CLArgAccessRead, cur_event);
+      }
+    }
+    if (profiling_) {
+      addProfileEvent(kernel->kernel_name(), cur_event);
+    }
+    if (blocking) {
+      cur_event.wait();
+    }
+    return;
+  }
+  // Only ask the driver for an event if we actually need it.
+  if (blocking || profiling_) {
+    cl::Event cur_event;
+    CHECK_ERROR(queue.enqueueNDRangeKernel(
+        kernel->kernel(), offset, global_work, local_work, nullptr,
+        &cur_event));
+    if (profiling_) {
+      addProfileEvent(kernel->kernel_name(), cur_event);
+    }
+    if (blocking) {
+      cur_event.wait();
+    }
+  } else {
+    CHECK_ERROR(queue.enqueueNDRangeKernel(
+        kernel->kernel(), offset, global_work, local_work, nullptr, nullptr));
+  }
+}
+
+void OpenCLContext::beginCapture() {
+  Stream* s = stream();
+  RASSERT(s->capture == nullptr);  // Already capturing!
+  s->capture.reset(new OpenCLCapture());
+}
+
+std::unique_ptr<OpenCLCapture> OpenCLContext::endCapture() {
+  Stream* s = stream();
+  RASSERT(s->capture != nullptr);  // Not capturing!
+  return std::move(s->capture);
+}
+
+bool OpenCLContext::capturing() { return stream()->capture != nullptr; }
+
+void OpenCLContext::captureCommand(const uint32_t device_index,
+                                   const std::function<void()>& command) {
+  Stream* s = stream();
+  if (s->capture == nullptr) {
+    return;
+  }
+  recordCommand(s, device_index, OpenCLCapture::Buffers(),
+                [command](const OpenCLCapture::Buffers&) {
+                  command();
+                });
+}
+
+void OpenCLContext::captureCommand(
+    const uint32_t device_index, const OpenCLCapture::Buffers& buffers,
+    const std::function<void(const OpenCLCapture::Buffers&)>& command) {
+  Stream* s = stream();
+  if (s->capture == nullptr) {
+    return;
+  }
+  recordCommand(s, device_index, buffers, command);
+}
 
-  if (blocking) {
-    cur_event.wait();
+void OpenCLContext::recordCommand(
+    Stream* s, const uint32_t device_index,
+    const OpenCLCapture::Buffers& buffers,
+    const std::function<void(const OpenCLCapture::Buffers&)>& function) {
+  OpenCLCapture::Command recorded;
+  recorded.device_index = device_index;
+  recorded.blocking = false;
+  recorded.buffers = buffers;
+  recorded.function = function;
+  s->capture->commands_.push_back(std::move(recorded));
+}
+
+void OpenCLContext::replay(OpenCLCapture* capture) {
+  RASSERT(capture->valid());
+  static const cl::NDRange offset = cl::NullRange;
+  for (OpenCLCapture::Command& command : capture->commands_) {
+    if (command.kernel != nullptr) {
+      enqueueKernel(command.kernel.get(), command.device_index, offset,
+                    command.global_work, command.local_work,
+                    command.blocking);
+    } else {
+      command.function(command.buffers);
+    }
   }
 }
 
+void OpenCLContext::addWaitEvents(const OpenCLBufferEvents* events,
+                                  const bool write,
+                                  std::vector<cl::Event>& wait_list) {
+  // Reads only depend on the last write.  Writes also depend on the reads
+  // since then (they must not clobber data that is still being read).
+  std::lock_guard<std::mutex> lock(events->lock);
+  if (events->last_write() != nullptr) {
+    wait_list.push_back(events->last_write);
+  }
+  if (write) {
+    wait_list.insert(wait_list.end(), events->reads.begin(),
+                     events->reads.end());
+  }
+}
+
+void OpenCLContext::recordEvent(OpenCLBufferEvents* events, const bool write,
+                                const cl::Event& event) {
+  std::lock_guard<std::mutex> lock(events->lock);
+  if (write) {
+    events->last_write = event;
+    events->reads.clear();
+    return;
+  }
+  // Buffers that are only ever read (ie weights) would accumulate events
+  // forever, so drop the ones that have completed every now and then.
+  static const uint32_t kMaxTrackedReads = 32;
+  if (events->reads.size() >= kMaxTrackedReads) {
+    std::vector<cl::Event> pending;
+    for (uint32_t i = 0; i < events->reads.size(); i++) {
+      const cl_int status =
+          events->reads[i].getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+      if (status > CL_COMPLETE) {
+        pending.push_back(events->reads[i]);
+      }
+    }
+    events->reads.swap(pending);
+  }
+  events->reads.push_back(event);
+}
+
+void OpenCLContext::getWaitList(const std::vector<OpenCLBufferData*>& inputs,
+                                const std::vector<OpenCLBufferData*>& outputs,
+                                std::vector<cl_event>& wait_list) {
+  if (!out_of_order_) {
+    return;
+  }
+  std::vector<cl::Event> events;
+  for (uint32_t i = 0; i < inputs.size(); i++) {
+    addWaitEvents(inputs[i]->events().get(), false, events);
+  }
+  for (uint32_t i = 0; i < outputs.size(); i++) {
+    addWaitEvents(outputs[i]->events().get(), true, events);
+  }
+  // The buffers' events keep the cl_event handles alive.
+  for (uint32_t i = 0; i < events.size(); i++) {
+    wait_list.push_back(events[i]());
+  }
+}
+
+cl_event OpenCLContext::beginProfiledCommand(
+    const uint32_t device_index, std::vector<cl_event>& wait_list) {
+  if (!profiling_) {
+    return nullptr;
+  }
+  cl_command_queue queue = stream()->queues[device_index]();
+  cl_event marker = nullptr;
+  if (!wait_list.empty()) {
+    // An OpenCL 1.1 marker waits for everything enqueued before it, so the
+    // wait list has to be waited on first.
+    CHECK_ERROR(clEnqueueWaitForEvents(queue, (cl_uint)wait_list.size(),
+                                       wait_list.data()));
+  }
+  CHECK_ERROR(clEnqueueMarker(queue, &marker));
+  wait_list.assign(1, marker);
+  return marker;
+}
+
+void OpenCLContext::addEvent(const std::vector<OpenCLBufferData*>& inputs,
+                             const std::vector<OpenCLBufferData*>& outputs,
+                             cl_event event, const char* profile_name,
+                             cl_event start) {
+  cl::Event start_obj;
+  start_obj() = start;  // Takes ownership (no retain)
+  if (event == nullptr) {
+    return;
+  }
+  cl::Event cl_event_obj;
+  cl_event_obj() = event;  // Takes ownership (no retain)
+  if (profiling_ && profile_name != nullptr) {
+    addProfileEvent(profile_name, cl_event_obj, start_obj);
+  }
+  if (!out_of_order_) {
+    return;
+  }
+  for (uint32_t i = 0; i < inputs.size(); i++) {
+    recordEvent(inputs[i]->events().get(), false, cl_event_obj);
+  }
+  for (uint32_t i = 0; i < outputs.size(); i++) {
+    recordEvent(outputs[i]->events().get(), true, cl_event_obj);
+  }
+}
+
+void OpenCLContext::addProfileEvent(const std::string& name,
+                                    const cl::Event& event,
+                                    const cl::Event& start) {
+  // Resolve every now and then, so that programs that never sync don't keep
+  // an unbounded number of events alive.
+  static const uint32_t kMaxPendingProfileEvents = 4096;
+  bool resolve;
+  {
+    std::lock_guard<std::mutex> lock(profile_lock_);
+    ProfileEvent profile_event = {name, event, start};
+    profile_events_.push_back(profile_event);
+    resolve = profile_events_.size() >= kMaxPendingProfileEvents;
+  }
+  if (resolve) {
+    resolveProfileEvents(false);
+  }
+}
+
+void OpenCLContext::resolveProfileEvents(const bool wait) {
+  std::vector<ProfileEvent> events;
+  {
+    std::lock_guard<std::mutex> lock(profile_lock_);
+    events.swap(profile_events_);
+  }
+  // Query the events without holding the lock (waiting might take a while).
+  std::vector<ProfileEvent> pending;
+  std::vector<float> durations(events.size(), -1.0f);
+  for (uint32_t i = 0; i < events.size(); i++) {
+    cl_int status =
+        events[i].event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+    if (status > CL_COMPLETE && wait) {
+      events[i].event.wait();
+      status = events[i].event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+    }
+    if (status > CL_COMPLETE) {
+      pending.push_back(events[i]);
+    } else if (status == CL_COMPLETE) {  // Negative status: command failed.
+      cl_ulong start =
+          events[i].event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      if (events[i].start() != nullptr) {
+        // The marker completed before the command started (which waited on
+        // it).  Some drivers don't time markers, then only the last kernel
+        // is counted.
+        cl_int err;
+        const cl_ulong marker_end =
+            events[i].start.getProfilingInfo<CL_PROFILING_COMMAND_END>(&err);
+        if (err == CL_SUCCESS && marker_end > 0 && marker_end < start) {
+          start = marker_end;
+        }
+      }
+      const cl_ulong end =
+          events[i].event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+      durations[i] = (float)((double)(end - start) * 1e-6);
+    }
+  }
+  std::lock_guard<std::mutex> lock(profile_lock_);
+  for (uint32_t i = 0; i < events.size(); i++) {
+    if (durations[i] >= 0) {
+      profile_samples_[events[i].name].push_back(durations[i]);
+    }
+  }
+  profile_events_.insert(profile_events_.end(), pending.begin(),
+                         pending.end());
+}
+
+std::vector<OpenCLKernelProfile> OpenCLContext::getKernelProfile() {
+  resolveProfileEvents(true);
+  std::vector<OpenCLKernelProfile> profile;
+  std::lock_guard<std::mutex> lock(profile_lock_);
+  for (const auto& kernel : profile_samples_) {
+    std::vector<float> samples = kernel.second;
+    std::sort(samples.begin(), samples.end());
+    OpenCLKernelProfile cur;
+    cur.name = kernel.first;
+    cur.count = samples.size();
+    cur.total = 0;
+    for (uint32_t i = 0; i < samples.size(); i++) {
+      cur.total += samples[i];
+    }
+    cur.min = samples.front();
+    cur.max = samples.back();
+    // Nearest rank.
+    const size_t rank = (size_t)std::ceil(0.99 * (double)samples.size());
+    cur.p99 = samples[std::max<size_t>(rank, 1) - 1];
+    profile.push_back(cur);
+  }
+  std::sort(profile.begin(), profile.end(),
+            [](const OpenCLKernelProfile& a, const OpenCLKernelProfile& b) {
+              return a.total > b.total;
+            });
+  return profile;
+}
+
+void OpenCLContext::printKernelProfile() {
+  const std::vector<OpenCLKernelProfile> profile = getKernelProfile();
+  double total = 0;
+  for (uint32_t i = 0; i < profile.size(); i++) {
+    total += profile[i].total;
+  }
+  std::cout << "Kernel profile (device time in ms):" << std::endl;
+  std::cout << std::left << std::setw(32) << "kernel" << std::right
+            << std::setw(10) << "count" << std::setw(12) << "total"
+            << std::setw(8) << "%" << std::setw(10) << "min" << std::setw(10)
+            << "max" << std::setw(10) << "p99" << std::endl;
+  const std::ios::fmtflags flags = std::cout.flags();
+  const std::streamsize prec = std::cout.precision();
+  std::cout << std::fixed << std::setprecision(3);
+  for (uint32_t i = 0; i < profile.size(); i++) {
+    const OpenCLKernelProfile& cur = profile[i];
+    std::cout << std::left << std::setw(32) << cur.name << std::right
+              << std::setw(10) << cur.count << std::setw(12) << cur.total
+              << std::setw(8) << std::setprecision(1)
+              << (total > 0 ? 100.0 * cur.total / total : 0.0)
+              << std::setprecision(3) << std::setw(10) << cur.min
+              << std::setw(10) << cur.max << std::setw(10) << cur.p99
+              << std::endl;
+  }
+  std::cout.flags(flags);
+  std::cout.precision(prec);
+}
+
+void OpenCLContext::resetKernelProfile() {
+  resolveProfileEvents(true);
+  std::lock_guard<std::mutex> lock(profile_lock_);
+  profile_samples_.clear();
+}
+
 std::string OpenCLContext::CLVendor2String(const CLVendor vendor) {
   std::string str;
   switch (vendor) {
@@ -671,4 +2010,21 @@ std::string OpenCLContext::CLVendorToString(const CLVendor vendor) {
   }
 }
 
+std::string OpenCLContext::CLBufferTagToString(const CLBufferTag tag) {
+  switch (tag) {
+    case CLBufferTagOther:
+      return "CLBufferTagOther";
+    case CLBufferTagWeights:
+      return "CLBufferTagWeights";
+    case CLBufferTagActivations:
+      return "CLBufferTagActivations";
+    case CLBufferTagScratch:
+      return "CLBufferTagScratch";
+    default:
+      std::cout << "Bad CLBufferTag" << std::endl;
+      RASSERT(false);
+      return "Bad CLBufferTag";
+  }
+}
+
 }  // namespace jcl
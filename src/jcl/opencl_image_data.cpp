@@ -0,0 +1,34 @@
+#include "jcl/opencl_image_data.h"
+
+#include "jcl/opencl_buffer_data.h"
+#include "jcl/opencl_context.h"
+
+namespace jcl {
+
+OpenCLImageData::OpenCLImageData(
+    const uint32_t width, const uint32_t height, const uint32_t depth,
+    cl::Context& context,
+    const std::shared_ptr<OpenCLMemoryCounters>& counters,
+    const uint32_t device_index, const CLBufferTag tag)
+    : width_(width),
+      height_(height),
+      depth_(depth),
+      tag_(tag),
+      counters_(counters),
+      device_index_(device_index) {
+  RASSERT(width_ > 0 && height_ > 0 && depth_ > 1);
+  cl_int err;
+  image_ = cl::Image3D(context, CL_MEM_READ_ONLY,
+                       cl::ImageFormat(CL_R, CL_FLOAT), width_, height_,
+                       depth_, 0, 0, nullptr, &err);
+  CHECK_ERROR(err);
+  events_.reset(new OpenCLBufferEvents());
+  // Images count in the buffer memory accounting too.
+  counters_->allocated(device_index_, tag_, nelems() * sizeof(cl_float));
+}
+
+OpenCLImageData::~OpenCLImageData() {
+  counters_->released(device_index_, tag_, nelems() * sizeof(cl_float));
+}
+
+}  // namespace jcl
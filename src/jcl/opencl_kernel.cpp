@@ -2,31 +2,152 @@
 
 #include <iostream>
 
+#include "jcl/opencl_buffer_data.h"
 #include "jcl/opencl_context.h"
+#include "jcl/opencl_image_data.h"
 #include "jcl/opencl_program.h"
 
 namespace jcl {
 
   OpenCLKernel::OpenCLKernel(const std::string& kernel_name, 
-    OpenCLProgram* program) {
+    OpenCLProgram* program, std::vector<cl::Device>& devices) {
     kernel_name_ = kernel_name;
     program_ = program;  // Ownership is NOT transferred
-    compileKernel();
+    compileKernel(devices);
+    arg_access_ = program_->getKernelArgAccess(kernel_name_);
+    // The parse only sees the source, so check it against what the compiler
+    // saw (ie if a macro added arguments).
+    cl_uint num_args = 0;
+    if (kernel_.getInfo(CL_KERNEL_NUM_ARGS, &num_args) != CL_SUCCESS ||
+        num_args != arg_access_.size()) {
+      arg_access_.clear();
+    }
   }
 
   OpenCLKernel::~OpenCLKernel() {
     // Nothing to do
   }
 
-  void OpenCLKernel::compileKernel() {
+  void OpenCLKernel::compileKernel(std::vector<cl::Device>& devices) {
     cl_int err;
     kernel_ = cl::Kernel(program_->program(), kernel_name_.c_str(), &err);
     CHECK_ERROR(err);
+
+    // The max workgroup size is a driver query, so do it once here rather
+    // than on every launch.
+    max_workgroup_size_.resize(devices.size());
+    for (uint32_t i = 0; i < devices.size(); i++) {
+      size_t max_size;
+      CHECK_ERROR(kernel_.getWorkGroupInfo<size_t>(
+          devices[i], CL_KERNEL_WORK_GROUP_SIZE, &max_size));
+      max_workgroup_size_[i] = (uint32_t)max_size;
+    }
+  }
+
+  void OpenCLKernel::setArg(const uint32_t index,
+    const std::shared_ptr<OpenCLBufferData>& buf) {
+    CHECK_ERROR(kernel_.setArg(index, buf->buffer()));
+    if (index >= arg_events_.size()) {
+      arg_events_.resize(index + 1);
+    }
+    arg_events_[index] = buf->events();
+    recordArg(index, sizeof(cl_mem), nullptr, buf);
+  }
+
+  void OpenCLKernel::setArg(const uint32_t index,
+    const std::shared_ptr<OpenCLImageData>& image) {
+    CHECK_ERROR(kernel_.setArg(index, image->image()));
+    if (index >= arg_events_.size()) {
+      arg_events_.resize(index + 1);
+    }
+    arg_events_[index] = image->events();
+    recordArg(index, sizeof(cl_mem), nullptr, nullptr);
+    args_[index].image = image;
   }
 
   void OpenCLKernel::setArg(const uint32_t index, const uint32_t size, 
     void* data) {
     CHECK_ERROR(kernel_.setArg(index, size, data));
+    clearArgEvents(index);
+    recordArg(index, size, data, nullptr);
+  }
+
+  void OpenCLKernel::recordArg(const uint32_t index, const size_t size,
+    const void* data, const std::shared_ptr<OpenCLBufferData>& buffer) {
+    if (index >= args_.size()) {
+      args_.resize(index + 1);
+    }
+    Arg& arg = args_[index];
+    arg.size = (uint32_t)size;
+    arg.buffer = buffer;
+    arg.image = nullptr;
+    if (data != nullptr) {
+      const char* bytes = static_cast<const char*>(data);
+      arg.value.assign(bytes, bytes + size);
+    } else {
+      arg.value.clear();
+    }
+  }
+
+  void OpenCLKernel::copyArgs(const OpenCLKernel& src) {
+    for (uint32_t i = 0; i < src.args_.size(); i++) {
+      const Arg& arg = src.args_[i];
+      if (arg.buffer != nullptr) {
+        setArg(i, arg.buffer);
+      } else if (arg.image != nullptr) {
+        setArg(i, arg.image);
+      } else if (arg.size > 0) {
+        // Note: setArg doesn't modify the value (cl.hpp just isn't const
+        // correct).
+        setArg(i, arg.size,
+               arg.value.empty() ? nullptr
+                                 : const_cast<char*>(arg.value.data()));
+      }
+    }
+  }
+
+  void OpenCLKernel::rebindBuffer(const OpenCLBufferData* from,
+    const std::shared_ptr<OpenCLBufferData>& to) {
+    for (uint32_t i = 0; i < args_.size(); i++) {
+      if (args_[i].buffer.get() == from) {
+        setArg(i, to);
+      }
+    }
+  }
+
+  bool OpenCLKernel::getTunedLocalSize(const uint32_t device_index,
+    const uint32_t dim, const uint32_t* global_work_size,
+    uint32_t* local_work_size) const {
+    // There are only ever a handful of entries, so a linear search is fine.
+    for (const TunedLocalSize& tuned : tuned_local_sizes_) {
+      if (tuned.device_index != device_index || tuned.dim != dim) {
+        continue;
+      }
+      bool match = true;
+      for (uint32_t i = 0; i < dim; i++) {
+        match = match && tuned.global_work_size[i] == global_work_size[i];
+      }
+      if (match) {
+        for (uint32_t i = 0; i < dim; i++) {
+          local_work_size[i] = tuned.local_work_size[i];
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void OpenCLKernel::setTunedLocalSize(const uint32_t device_index,
+    const uint32_t dim, const uint32_t* global_work_size,
+    const uint32_t* local_work_size) {
+    TunedLocalSize tuned;
+    tuned.device_index = device_index;
+    tuned.dim = dim;
+    for (uint32_t i = 0; i < 3; i++) {
+      tuned.global_work_size[i] = i < dim ? global_work_size[i] : 1;
+      tuned.local_work_size[i] = i < dim ? local_work_size[i] : 1;
+    }
+    tuned_local_sizes_.push_back(tuned);
   }
 
 }  // namespace jcl
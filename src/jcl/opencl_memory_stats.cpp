@@ -0,0 +1,102 @@
+#include "jcl/opencl_memory_stats.h"
+
+#include "jcl/opencl_context.h"
+
+namespace jcl {
+
+namespace {
+
+void UpdatePeak(std::atomic<uint64_t>& peak, const uint64_t value) {
+  uint64_t cur = peak.load();
+  while (value > cur && !peak.compare_exchange_weak(cur, value)) {
+  }
+}
+
+}  // unnamed namespace
+
+OpenCLMemoryCounters::OpenCLMemoryCounters(const uint32_t num_devices)
+    : num_devices_(num_devices), devices_(new Counters[num_devices]) {
+  RASSERT(num_devices_ > 0);
+  for (uint32_t d = 0; d < num_devices_; d++) {
+    Counters& counters = devices_[d];
+    counters.live_bytes = 0;
+    counters.peak_bytes = 0;
+    counters.num_live = 0;
+    counters.num_allocations = 0;
+    for (uint32_t i = 0; i < CLBufferTagCount; i++) {
+      counters.tag_live_bytes[i] = 0;
+      counters.tag_peak_bytes[i] = 0;
+    }
+  }
+}
+
+OpenCLMemoryCounters::~OpenCLMemoryCounters() {}
+
+void OpenCLMemoryCounters::allocated(const uint32_t device_index,
+                                     const CLBufferTag tag,
+                                     const uint64_t bytes) {
+  RASSERT(device_index < num_devices_);
+  Counters& counters = devices_[device_index];
+  counters.num_allocations++;
+  counters.num_live++;
+  account(counters, tag, bytes);
+}
+
+void OpenCLMemoryCounters::released(const uint32_t device_index,
+                                    const CLBufferTag tag,
+                                    const uint64_t bytes) {
+  RASSERT(device_index < num_devices_);
+  Counters& counters = devices_[device_index];
+  counters.num_live--;
+  unaccount(counters, tag, bytes);
+}
+
+void OpenCLMemoryCounters::retag(const uint32_t device_index,
+                                 const CLBufferTag from, const CLBufferTag to,
+                                 const uint64_t bytes) {
+  RASSERT(device_index < num_devices_);
+  Counters& counters = devices_[device_index];
+  // Add before removing, so the total never dips.
+  account(counters, to, bytes);
+  unaccount(counters, from, bytes);
+}
+
+void OpenCLMemoryCounters::account(Counters& counters, const CLBufferTag tag,
+                                   const uint64_t bytes) {
+  UpdatePeak(counters.peak_bytes, counters.live_bytes += bytes);
+  UpdatePeak(counters.tag_peak_bytes[tag],
+             counters.tag_live_bytes[tag] += bytes);
+}
+
+void OpenCLMemoryCounters::unaccount(Counters& counters, const CLBufferTag tag,
+                                     const uint64_t bytes) {
+  counters.live_bytes -= bytes;
+  counters.tag_live_bytes[tag] -= bytes;
+}
+
+OpenCLMemoryStats OpenCLMemoryCounters::stats(
+    const uint32_t device_index) const {
+  RASSERT(device_index < num_devices_);
+  const Counters& counters = devices_[device_index];
+  OpenCLMemoryStats stats;
+  stats.live_bytes = counters.live_bytes;
+  stats.peak_bytes = counters.peak_bytes;
+  stats.num_live = counters.num_live;
+  stats.num_allocations = counters.num_allocations;
+  for (uint32_t i = 0; i < CLBufferTagCount; i++) {
+    stats.tag_live_bytes[i] = counters.tag_live_bytes[i];
+    stats.tag_peak_bytes[i] = counters.tag_peak_bytes[i];
+  }
+  return stats;
+}
+
+void OpenCLMemoryCounters::resetPeak(const uint32_t device_index) {
+  RASSERT(device_index < num_devices_);
+  Counters& counters = devices_[device_index];
+  counters.peak_bytes = counters.live_bytes.load();
+  for (uint32_t i = 0; i < CLBufferTagCount; i++) {
+    counters.tag_peak_bytes[i] = counters.tag_live_bytes[i].load();
+  }
+}
+
+}  // namespace jcl
@@ -1,34 +1,58 @@
 #include "jcl/opencl_program.h"
 
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <set>
+#include <sstream>
 
+#include "jcl/data_str/hash_funcs.h"
 #include "jcl/opencl_context.h"
 
 namespace jcl {
 
+  // Bump the version string whenever the cache file layout changes.
+  static const char kCacheMagic[] = "JCLPROG2";
+
   OpenCLProgram::OpenCLProgram(const std::string& filename, 
     cl::Context& context, std::vector<cl::Device>& devices, 
-    const bool strict_float) {
-    filename_ = filename;
+    const bool strict_float, const std::string& cache_dir,
+    const std::string& defines) {
+    filename_ = programName(filename, defines);
+    defines_ = defines;
     code_ = nullptr;
+    loaded_from_cache_ = false;
     code_.reset(readFileToBuffer(filename));
-    compileProgram(context, devices, strict_float);
+    compileProgram(context, devices, strict_float, cache_dir);
   }
   
   OpenCLProgram::OpenCLProgram(const char* kernel_c_str, 
     const std::string& kernel_name, cl::Context& context, 
-    std::vector<cl::Device>& devices, const bool strict_float) {
-    filename_ = kernel_name;
+    std::vector<cl::Device>& devices, const bool strict_float,
+    const std::string& cache_dir, const std::string& defines) {
+    filename_ = programName(kernel_name, defines);
+    defines_ = defines;
     code_ = nullptr;
+    loaded_from_cache_ = false;
     uint32_t str_len = (uint32_t)strlen(kernel_c_str);  // TODO: bounds check
     code_.reset(new char[str_len + 1]);
     strcpy(code_.get(), kernel_c_str);
-    compileProgram(context, devices, strict_float);
+    compileProgram(context, devices, strict_float, cache_dir);
   }
 
   OpenCLProgram::~OpenCLProgram() {
   }
 
+  std::string OpenCLProgram::programName(const std::string& source_name,
+    const std::string& defines) {
+    if (defines.empty()) {
+      return source_name;
+    }
+    return source_name + " [" + defines + "]";
+  }
+
   char* OpenCLProgram::readFileToBuffer(const std::string& filename) {
     FILE *fptr;
     long length;
@@ -54,23 +78,285 @@ namespace jcl {
     return buf;
   }
 
-  void OpenCLProgram::compileProgram(cl::Context& context,
-    std::vector<cl::Device>& devices, const bool strict_float) {
-    cl::Program::Sources source(
-        1, std::make_pair(code_.get(), strlen(code_.get())));
-    cl_int err;
-    program_ = cl::Program(context, source, &err);
-    CHECK_ERROR(err);
+  // Remove /* */ and // comments (kernel signatures in this repo are full of
+  // them and they may contain commas).
+  static std::string StripComments(const char* code) {
+    std::string ret;
+    for (const char* c = code; *c != 0; c++) {
+      if (c[0] == '/' && c[1] == '*') {
+        const char* end = strstr(c + 2, "*/");
+        if (end == nullptr) {
+          break;
+        }
+        c = end + 1;
+        ret += ' ';
+      } else if (c[0] == '/' && c[1] == '/') {
+        while (c[1] != 0 && c[1] != '\n') {
+          c++;
+        }
+      } else {
+        ret += *c;
+      }
+    }
+    return ret;
+  }
 
-#if defined(DEBUG) || defined(_DEBUG)
-    std::cout << "\tBuilding program: " << filename_ << std::endl;
-#endif
+  static bool IsIdentifierChar(const char c) {
+    return isalnum(static_cast<unsigned char>(c)) || c == '_';
+  }
+
+  // Return the identifier that ends before pos (skipping whitespace) and move
+  // pos to its start.
+  static std::string PrevWord(const std::string& str, size_t& pos) {
+    size_t end = pos;
+    while (end > 0 && isspace(static_cast<unsigned char>(str[end - 1]))) {
+      end--;
+    }
+    size_t start = end;
+    while (start > 0 && IsIdentifierChar(str[start - 1])) {
+      start--;
+    }
+    pos = start;
+    return str.substr(start, end - start);
+  }
+
+  // Split an argument declaration into identifiers and single punctuation
+  // characters (ie "const __global float* x" -> const, __global, float, *, x).
+  static std::vector<std::string> Tokenize(const std::string& arg) {
+    std::vector<std::string> tokens;
+    size_t i = 0;
+    while (i < arg.length()) {
+      if (isspace(static_cast<unsigned char>(arg[i]))) {
+        i++;
+      } else if (IsIdentifierChar(arg[i])) {
+        const size_t start = i;
+        while (i < arg.length() && IsIdentifierChar(arg[i])) {
+          i++;
+        }
+        tokens.push_back(arg.substr(start, i - start));
+      } else {
+        tokens.push_back(std::string(1, arg[i]));
+        i++;
+      }
+    }
+    return tokens;
+  }
+
+  static bool IsOneOf(const std::string& token, const char* const* words) {
+    for (; *words != nullptr; words++) {
+      if (token == *words) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Built-in scalar types (and, followed by a width, vector types).
+  static bool IsBuiltinType(const std::string& token) {
+    static const char* const kTypes[] = {"bool", "char", "uchar", "short",
+      "ushort", "int", "uint", "long", "ulong", "half", "float", "double",
+      "size_t", "ptrdiff_t", "intptr_t", "uintptr_t", "sampler_t", nullptr};
+    const size_t digits = token.find_last_not_of("0123456789") + 1;
+    return IsOneOf(token.substr(0, digits), kTypes);
+  }
+
+  // Classify one argument.  Only the usual spellings are recognized: a
+  // pointer is read-only if it is "__constant", or "__global" with a const
+  // pointee and nothing but qualifiers and one type name before the '*'.
+  // Anything else that might be a memory object (ie a typedef or a type we
+  // don't know) is read-write, so that an odd signature can only cost some
+  // concurrency.
+  static CLArgAccess ParseArgAccess(const std::string& arg) {
+    static const char* const kPointeeWords[] = {"const", "volatile",
+      "unsigned", "signed", "struct", nullptr};
+    static const char* const kPointerWords[] = {"const", "restrict",
+      "__restrict", nullptr};
+    const std::vector<std::string> tokens = Tokenize(arg);
+    bool is_global = false;
+    bool is_constant = false;
+    bool is_image = false;
+    bool is_const = false;
+    bool write_image = false;
+    uint32_t num_stars = 0;
+    uint32_t num_other = 0;  // Type and argument names
+    bool valid = true;
+    for (const std::string& token : tokens) {
+      if (token == "__local" || token == "local") {
+        return CLArgAccessNone;
+      } else if (token == "__global" || token == "global") {
+        is_global = true;
+      } else if (token == "__constant" || token == "constant") {
+        is_constant = true;
+      } else if (token == "*") {
+        num_stars++;
+      } else if (token.compare(0, 5, "image") == 0 &&
+                 token.length() > 7 &&
+                 token.compare(token.length() - 2, 2, "_t") == 0) {
+        is_image = true;
+      } else if (token == "__write_only" || token == "write_only" ||
+                 token == "__read_write" || token == "read_write") {
+        write_image = true;
+      } else if (token == "__read_only" || token == "read_only") {
+        // The default for images
+      } else if (num_stars == 0 && IsOneOf(token, kPointeeWords)) {
+        is_const = is_const || token == "const";
+      } else if (num_stars > 0 && IsOneOf(token, kPointerWords)) {
+        // Qualifies the pointer itself, not the buffer.
+      } else if (IsIdentifierChar(token[0]) &&
+                 !isdigit(static_cast<unsigned char>(token[0]))) {
+        num_other++;
+      } else {
+        valid = false;  // ie an attribute or an array
+      }
+    }
+    if (is_image) {
+      return write_image ? CLArgAccessReadWrite : CLArgAccessRead;
+    }
+    if (is_constant && num_stars == 1) {
+      return CLArgAccessRead;
+    }
+    if (is_global) {
+      const bool read_only = valid && is_const && num_stars == 1 &&
+                             num_other == 2;
+      return read_only ? CLArgAccessRead : CLArgAccessReadWrite;
+    }
+    // A scalar or vector of a built-in type (passed by value).
+    if (valid && num_stars == 0 && num_other >= 1) {
+      bool builtin = true;
+      for (size_t i = 0; i + 1 < tokens.size(); i++) {
+        if (!IsOneOf(tokens[i], kPointeeWords) && !IsBuiltinType(tokens[i])) {
+          builtin = false;
+        }
+      }
+      if (builtin) {
+        return CLArgAccessNone;
+      }
+    }
+    return CLArgAccessReadWrite;
+  }
+
+  // True if a macro defined as value (ie the text after "#define NAME ")
+  // stands for anything but a single identifier (ie a type name).
+  static bool IsOpaqueMacro(const std::string& value) {
+    const std::vector<std::string> tokens = Tokenize(value);
+    return tokens.size() != 1 || !IsIdentifierChar(tokens[0][0]);
+  }
+
+  // The names of the macros defined in code or by a "-D" option that expand
+  // to more than a single identifier (see IsOpaqueMacro()), or take
+  // arguments.  The arguments of a kernel using them can't be parsed.
+  static std::set<std::string> OpaqueMacroNames(const std::string& code,
+    const std::string& defines) {
+    std::set<std::string> names;
+    size_t pos = code.find('#');
+    while (pos != std::string::npos) {
+      size_t end = code.find('\n', pos);
+      const std::string line = code.substr(pos + 1,
+        end == std::string::npos ? std::string::npos : end - pos - 1);
+      const size_t define = line.find_first_not_of(" \t");
+      if (define != std::string::npos &&
+          line.compare(define, 6, "define") == 0) {
+        const size_t name = line.find_first_not_of(" \t", define + 6);
+        size_t name_end = name;
+        while (name_end < line.length() && IsIdentifierChar(line[name_end])) {
+          name_end++;
+        }
+        if (name_end > name) {
+          const bool function_like =
+            name_end < line.length() && line[name_end] == '(';
+          if (function_like || IsOpaqueMacro(line.substr(name_end))) {
+            names.insert(line.substr(name, name_end - name));
+          }
+        }
+      }
+      pos = code.find('#', pos + 1);
+    }
+    // "-DNAME" defines NAME as 1 and "-DNAME=value" as value.
+    pos = defines.find("-D");
+    while (pos != std::string::npos) {
+      size_t end = pos + 2;
+      while (end < defines.length() && IsIdentifierChar(defines[end])) {
+        end++;
+      }
+      const std::string name = defines.substr(pos + 2, end - pos - 2);
+      if (end < defines.length() && defines[end] == '=') {
+        const size_t value_end = defines.find(' ', end);
+        const std::string value = defines.substr(end + 1,
+          value_end == std::string::npos ? std::string::npos
+                                         : value_end - end - 1);
+        if (IsOpaqueMacro(value)) {
+          names.insert(name);
+        }
+      } else if (end < defines.length() && defines[end] == '(') {
+        names.insert(name);
+      }
+      pos = defines.find("-D", end);
+    }
+    return names;
+  }
+
+  std::vector<CLArgAccess> OpenCLProgram::getKernelArgAccess(
+    const std::string& kernel_name) {
+    std::vector<CLArgAccess> ret;
+    const std::string code = StripComments(code_.get());
+    size_t pos = code.find(kernel_name);
+    while (pos != std::string::npos) {
+      const size_t name_end = pos + kernel_name.length();
+      if ((pos == 0 || !IsIdentifierChar(code[pos - 1])) &&
+          name_end < code.length() && !IsIdentifierChar(code[name_end])) {
+        // The name must be followed by the argument list and preceded by
+        // "__kernel void" (or "kernel void").
+        const size_t open = code.find_first_not_of(" \t\r\n", name_end);
+        size_t word_start = pos;
+        const std::string ret_type = PrevWord(code, word_start);
+        const std::string qualifier = PrevWord(code, word_start);
+        if (open != std::string::npos && code[open] == '(' &&
+            ret_type == "void" &&
+            (qualifier == "__kernel" || qualifier == "kernel")) {
+          size_t close = code.find(')', open);
+          if (close == std::string::npos) {
+            return ret;
+          }
+          std::string args = code.substr(open + 1, close - open - 1);
+          if (args.find_first_not_of(" \t\r\n") == std::string::npos) {
+            return ret;  // No arguments
+          }
+          // Macros (other than type names) and preprocessor directives might
+          // change the arguments, or their number, so give up on the kernel.
+          if (args.find('#') != std::string::npos) {
+            return ret;
+          }
+          const std::set<std::string> macros =
+            OpaqueMacroNames(code, defines_);
+          for (const std::string& token : Tokenize(args)) {
+            if (macros.count(token) > 0) {
+              return ret;
+            }
+          }
+          size_t start = 0;
+          while (true) {
+            const size_t comma = args.find(',', start);
+            ret.push_back(ParseArgAccess(args.substr(start, comma - start)));
+            if (comma == std::string::npos) {
+              break;
+            }
+            start = comma + 1;
+          }
+          return ret;
+        }
+      }
+      pos = code.find(kernel_name, pos + 1);
+    }
+    return ret;
+  }
+
+  std::string OpenCLProgram::buildOptions(const bool strict_float) {
 #if !defined(__APPLE__)
-    const char* options = "-Werror";  // Make warnings into errors"
+    std::string options = "-Werror";  // Make warnings into errors"
 #else
-      // Unfortunately, on Mac OS X, I think there are warnings that don't get
-      // logged, so sometimes kernels wont compile and there's no info to fix it
-      const char* options = nullptr;
+    // Unfortunately, on Mac OS X, I think there are warnings that don't get
+    // logged, so sometimes kernels wont compile and there's no info to fix it
+    std::string options = "";
 #endif
     if (!strict_float) {
 #if !defined(__APPLE__)
@@ -83,12 +369,42 @@ namespace jcl {
                 "-cl-unsafe-math-optimizations";
 #endif
     }
+    return options;
+  }
+
+  void OpenCLProgram::compileProgram(cl::Context& context,
+    std::vector<cl::Device>& devices, const bool strict_float,
+    const std::string& cache_dir) {
+    // The defines are part of the options, and so of the cache key.
+    std::string options = buildOptions(strict_float);
+    if (!defines_.empty()) {
+      options += options.empty() ? defines_ : " " + defines_;
+    }
+    const char* options_c_str = options.empty() ? nullptr : options.c_str();
+
+    if (!cache_dir.empty() &&
+        loadFromCache(context, devices, options, cache_dir)) {
+      loaded_from_cache_ = true;
 #if defined(DEBUG) || defined(_DEBUG)
-    if (options != nullptr) {
-      std::cout << "\t --> With options: " << options << std::endl;
+      std::cout << "\tLoaded cached program binary: " << filename_
+                << std::endl;
+#endif
+      return;
+    }
+
+    cl::Program::Sources source(
+        1, std::make_pair(code_.get(), strlen(code_.get())));
+    cl_int err;
+    program_ = cl::Program(context, source, &err);
+    CHECK_ERROR(err);
+
+#if defined(DEBUG) || defined(_DEBUG)
+    std::cout << "\tBuilding program: " << filename_ << std::endl;
+    if (options_c_str != nullptr) {
+      std::cout << "\t --> With options: " << options_c_str << std::endl;
     }
 #endif
-    err = program_.build(devices, options);
+    err = program_.build(devices, options_c_str);
 #if defined(DEBUG) || defined(_DEBUG)
       std::cout << "\t --> Finished building program" << std::endl;
 #endif
@@ -101,6 +417,167 @@ namespace jcl {
       std::cout << "    Program Info: " << str << std::endl;
       CHECK_ERROR(err);
     }
+
+    if (!cache_dir.empty()) {
+      saveToCache(devices, options, cache_dir);
+    }
+  }
+
+  std::string OpenCLProgram::cacheKey(cl::Device& device,
+    const std::string& options) {
+    // The filename is only a hash of the key, so the full key (including
+    // the full source) is also stored inside the cache file and compared on
+    // load.  An edited kernel (or another device or driver) therefore never
+    // loads a stale binary, even if the filenames collide.
+    cl_int err;
+    std::stringstream key;
+    key << "device:" << device.getInfo<CL_DEVICE_NAME>(&err);
+    CHECK_ERROR(err);
+    key << "|driver:" << device.getInfo<CL_DRIVER_VERSION>(&err);
+    CHECK_ERROR(err);
+    key << "|options:" << options;
+    key << "|source:" << code_.get();
+    return key.str();
+  }
+
+  std::string OpenCLProgram::cacheFilename(const std::string& cache_dir,
+    const std::string& key) {
+    const uint32_t key_hash = data_str::HashString(
+        std::numeric_limits<uint32_t>::max(), key);
+    std::stringstream filename;
+    filename << cache_dir;
+    const char last = cache_dir[cache_dir.length() - 1];
+    if (last != '/' && last != '\\') {
+      filename << "/";
+    }
+    filename << "jcl_program_" << std::hex << key_hash << ".bin";
+    return filename.str();
+  }
+
+  bool OpenCLProgram::loadFromCache(cl::Context& context,
+    std::vector<cl::Device>& devices, const std::string& options,
+    const std::string& cache_dir) {
+    // We need a valid binary for EVERY device in the context, otherwise we
+    // fall back to building from source.
+    std::vector<std::vector<char>> binaries(devices.size());
+    for (uint32_t i = 0; i < devices.size(); i++) {
+      const std::string key = cacheKey(devices[i], options);
+      std::ifstream file(cacheFilename(cache_dir, key).c_str(),
+                         std::ios::in | std::ios::binary);
+      if (!file.is_open()) {
+        return false;
+      }
+      char magic[sizeof(kCacheMagic)];
+      file.read(magic, sizeof(magic));
+      if (!file || memcmp(magic, kCacheMagic, sizeof(magic)) != 0) {
+        return false;
+      }
+      uint32_t key_len = 0;
+      file.read(reinterpret_cast<char*>(&key_len), sizeof(key_len));
+      if (!file || key_len != key.length()) {
+        return false;
+      }
+      std::string file_key(key_len, '\0');
+      file.read(&file_key[0], key_len);
+      if (!file || file_key != key) {
+        return false;  // Stale entry (or filename collision).
+      }
+      uint64_t binary_size = 0;
+      file.read(reinterpret_cast<char*>(&binary_size), sizeof(binary_size));
+      if (!file || binary_size == 0) {
+        return false;
+      }
+      binaries[i].resize(static_cast<size_t>(binary_size));
+      file.read(binaries[i].data(), binaries[i].size());
+      if (!file) {
+        return false;
+      }
+    }
+
+    cl::Program::Binaries sources;
+    for (uint32_t i = 0; i < devices.size(); i++) {
+      sources.push_back(std::make_pair(
+          static_cast<const void*>(binaries[i].data()), binaries[i].size()));
+    }
+    std::vector<cl_int> status(devices.size(), CL_SUCCESS);
+    cl_int err;
+    cl::Program program(context, devices, sources, &status, &err);
+    if (err != CL_SUCCESS) {
+      return false;
+    }
+    for (uint32_t i = 0; i < status.size(); i++) {
+      if (status[i] != CL_SUCCESS) {
+        return false;
+      }
+    }
+    // Binaries still need to be "built" (which is just a link step).
+    err = program.build(devices, options.empty() ? nullptr : options.c_str());
+    if (err != CL_SUCCESS) {
+      return false;
+    }
+    program_ = program;
+    return true;
+  }
+
+  void OpenCLProgram::saveToCache(std::vector<cl::Device>& devices,
+    const std::string& options, const std::string& cache_dir) {
+    const size_t num_devices = devices.size();
+    std::vector<size_t> sizes(num_devices, 0);
+    cl_int err = clGetProgramInfo(program_(), CL_PROGRAM_BINARY_SIZES,
+                                  sizeof(sizes[0]) * num_devices,
+                                  sizes.data(), nullptr);
+    if (err != CL_SUCCESS) {
+      return;
+    }
+    std::vector<std::vector<char>> binaries(num_devices);
+    std::vector<char*> binary_ptrs(num_devices, nullptr);
+    for (size_t i = 0; i < num_devices; i++) {
+      if (sizes[i] == 0) {
+        return;  // The driver doesn't give us binaries (so nothing to cache).
+      }
+      binaries[i].resize(sizes[i]);
+      binary_ptrs[i] = binaries[i].data();
+    }
+    err = clGetProgramInfo(program_(), CL_PROGRAM_BINARIES,
+                           sizeof(binary_ptrs[0]) * num_devices,
+                           binary_ptrs.data(), nullptr);
+    if (err != CL_SUCCESS) {
+      return;
+    }
+
+    for (size_t i = 0; i < num_devices; i++) {
+      const std::string key = cacheKey(devices[i], options);
+      const std::string filename = cacheFilename(cache_dir, key);
+      // Write to a temporary file and rename it so that other processes
+      // never see a partially written cache entry.  The temporary name is
+      // unique per process and per call, so that processes (or threads)
+      // saving the same entry don't write through the same file.
+      const std::string tmp_filename = UniqueTempFilename(filename);
+      std::ofstream file(tmp_filename.c_str(),
+                         std::ios::out | std::ios::binary);
+      if (!file.is_open()) {
+        std::cout << "OpenCLProgram::saveToCache() - WARNING: could not open "
+                  << tmp_filename << " for writing" << std::endl;
+        return;
+      }
+      const uint32_t key_len = static_cast<uint32_t>(key.length());
+      const uint64_t binary_size = static_cast<uint64_t>(sizes[i]);
+      file.write(kCacheMagic, sizeof(kCacheMagic));
+      file.write(reinterpret_cast<const char*>(&key_len), sizeof(key_len));
+      file.write(key.c_str(), key_len);
+      file.write(reinterpret_cast<const char*>(&binary_size),
+                 sizeof(binary_size));
+      file.write(binaries[i].data(), binaries[i].size());
+      file.close();
+      if (!file) {
+        std::remove(tmp_filename.c_str());
+        return;
+      }
+      std::remove(filename.c_str());  // rename() won't overwrite on Windows.
+      if (std::rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+        std::remove(tmp_filename.c_str());
+      }
+    }
   }
 
 }  // namespace jcl
@@ -42,7 +42,8 @@ void CAddTable::forwardProp(std::shared_ptr<TorchData> input) {
            ->isSameSizeAs(*TO_TENSOR_PTR(output.get()))) {
     // Reinitialize the output Tensor
     output.reset(new Tensor<float>(TO_TENSOR_PTR((*in)(0).get())->dim(),
-                                   TO_TENSOR_PTR((*in)(0).get())->size()));
+                                   TO_TENSOR_PTR((*in)(0).get())->size(),
+                                   runtime_, format_));
   }
 
   // TODO: We can probably parallelize these calls across multiple tensors
@@ -10,7 +10,7 @@ using namespace jcl::math;
 namespace jtorch {
 
 Concat::Concat(int dimension) : TorchStage() {
-  output.reset(new Tensor<float>());
+  output.reset(new Tensor<float>(runtime_, format_));
   dimension_ = dimension;
 }
 
@@ -24,13 +24,28 @@ TorchStage* Concat::get(const uint32_t i) { return network_[i].get(); }
 
 uint32_t Concat::size() const { return (uint32_t)network_.size(); }
 
+void Concat::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  for (const auto& stage : network_) {
+    stage->getPrograms(programs);
+  }
+}
+
+void Concat::calibrate(const bool calibrating) {
+  for (const auto& stage : network_) {
+    stage->calibrate(calibrating);
+  }
+}
+
+void Concat::quantize() {
+  for (const auto& stage : network_) {
+    stage->quantize();
+  }
+}
+
 void Concat::forwardProp(std::shared_ptr<TorchData> input) {
   RASSERT(network_.size() > 0);  // Otherwise no work to do.
 
-  // For now we only support the Concat operation along the outer dimension.
-  // In torch indexing this is always 1.
-  RASSERT(this->dimension_ == 1);
-
   // FPROP each sub-module.
   std::vector<Tensor<float>*> outputs;
   for (uint32_t i = 0; i < (uint32_t)network_.size(); i++) {
@@ -43,9 +58,11 @@ void Concat::forwardProp(std::shared_ptr<TorchData> input) {
   }
 
   // Note the dimension from torch is 1-index with dimension 1 being the outer
-  // dimension. This is the opposite from jtorch.
+  // dimension (of a sample, in batch mode). This is the opposite from jtorch.
   const uint32_t dim = outputs[0]->dim();
-  uint32_t concat_dim = dim - static_cast<uint32_t>(this->dimension_);
+  const uint32_t sample_dim = sampleDim(*outputs[0]);
+  RASSERT(this->dimension_ >= 1 && this->dimension_ <= (int)sample_dim);
+  uint32_t concat_dim = sample_dim - static_cast<uint32_t>(this->dimension_);
 
   // Check that all tensors are the same size except across the concat
   // dimension.
@@ -74,11 +91,11 @@ void Concat::forwardProp(std::shared_ptr<TorchData> input) {
   uint32_t f_offset = 0;
   for (uint32_t i = 0; i < (uint32_t)outputs.size(); i++) {
     const uint32_t f_size = outputs[i]->size()[concat_dim];
-    // TODO(tompson): Worry here, this is allocating lots of tensors using
-    // createSubBuffer, which may or may not be slow (driver dependent).
-    // Instead we could pre-allocate these slices.
+    // Note: the slice is just a (strided, unless concat_dim is the outer
+    // dimension) view of out's storage, so this doesn't allocate any device
+    // memory.
     std::shared_ptr<Tensor<float>> oslice =
-        Tensor<float>::narrowOuterDim(*out, f_offset, f_size);
+        Tensor<float>::narrow(*out, concat_dim, f_offset, f_size);
     f_offset += f_size;
     Tensor<float>::copy(*oslice, *(outputs[i]));
   }
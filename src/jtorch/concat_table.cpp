@@ -24,6 +24,25 @@ TorchStage* ConcatTable::get(const uint32_t i) { return network_[i].get(); }
 
 uint32_t ConcatTable::size() const { return (uint32_t)network_.size(); }
 
+void ConcatTable::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  for (const auto& stage : network_) {
+    stage->getPrograms(programs);
+  }
+}
+
+void ConcatTable::calibrate(const bool calibrating) {
+  for (const auto& stage : network_) {
+    stage->calibrate(calibrating);
+  }
+}
+
+void ConcatTable::quantize() {
+  for (const auto& stage : network_) {
+    stage->quantize();
+  }
+}
+
 void ConcatTable::forwardProp(std::shared_ptr<TorchData> input) {
   RASSERT(network_.size() > 0);  // Otherwise no work to do.
 
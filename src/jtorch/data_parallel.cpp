@@ -0,0 +1,183 @@
+#include "jtorch/data_parallel.h"
+
+#include <chrono>
+#include <iostream>
+
+#include "jcl/opencl_context.h"
+#include "jcl/threading/thread_pool.h"
+#include "jtorch/jtorch.h"
+
+using namespace jcl::threading;
+
+namespace jtorch {
+
+DataParallel::DataParallel(const std::string& model_file,
+                           const uint32_t num_devices, Runtime* runtime,
+                           const StorageFormat format) {
+  runtime_ = runtime != nullptr ? runtime : Runtime::Current();
+  RASSERT(runtime_ != nullptr);
+  jcl::OpenCLContext* context = runtime_->context();
+  const uint32_t num_replicas =
+      num_devices > 0 ? num_devices : context->getNumDevices();
+  RASSERT(num_replicas <= context->getNumDevices());
+
+  model_file_ = model_file;
+  format_ = format;
+  next_replica_ = 0;
+  num_requests_ = 0;
+  total_time_ = 0;
+  inputs_ = nullptr;
+  callback_ = nullptr;
+  num_pending_ = 0;
+
+  // The weights are uploaded from each worker thread, so that they end up on
+  // the right device (and on that device's queue).  Load them in parallel.
+  for (uint32_t i = 0; i < num_replicas; i++) {
+    std::unique_ptr<Replica> replica(new Replica());
+    replica->device = i;
+    replica->num_requests = 0;
+    replica->worker.reset(new ThreadPool(1));
+    replicas_.push_back(std::move(replica));
+  }
+  {
+    std::lock_guard<std::mutex> lck(lock_);
+    num_pending_ = num_replicas;
+  }
+  for (uint32_t i = 0; i < num_replicas; i++) {
+    replicas_[i]->worker->addTask(
+        MakeCallableOnce(&DataParallel::loadReplica, this, i));
+  }
+  waitForTasks();
+}
+
+DataParallel::~DataParallel() {
+  for (uint32_t i = 0; i < replicas_.size(); i++) {
+    replicas_[i]->worker->stop();
+  }
+}
+
+void DataParallel::loadReplica(const uint32_t replica) {
+  runtime_->setDeviceid(replicas_[replica]->device);
+  // Note: loadFromFile syncs before returning.
+  replicas_[replica]->model =
+      TorchStage::loadFromFile(model_file_, runtime_, format_);
+  taskFinished();
+}
+
+void DataParallel::prepare(std::shared_ptr<TorchData> sample_input) {
+  replicas_[0]->model->prepare();
+  if (sample_input == nullptr) {
+    return;
+  }
+  // clBLAS builds its kernels per device, so every replica needs its own
+  // warm up pass (on its own worker thread).
+  runtime_->sync();
+  {
+    std::lock_guard<std::mutex> lck(lock_);
+    num_pending_ = (uint32_t)replicas_.size();
+  }
+  for (uint32_t i = 0; i < replicas_.size(); i++) {
+    replicas_[i]->worker->addTask(MakeCallableOnce(
+        &DataParallel::prepareReplica, this, i, sample_input));
+  }
+  waitForTasks();
+}
+
+void DataParallel::prepareReplica(const uint32_t replica,
+                                  std::shared_ptr<TorchData> sample_input) {
+  replicas_[replica]->model->forwardProp(sample_input);
+  runtime_->sync();  // Only waits for this worker's queue.
+  taskFinished();
+}
+
+void DataParallel::forwardProp(
+    const std::vector<std::shared_ptr<TorchData>>& inputs,
+    const OutputCallback& callback) {
+  if (inputs.empty()) {
+    return;
+  }
+  const auto t_start = std::chrono::high_resolution_clock::now();
+
+  // The inputs were (probably) written from this thread, so make sure they
+  // are ready before other threads start reading them.
+  runtime_->sync();
+
+  inputs_ = &inputs;
+  callback_ = &callback;
+  {
+    std::lock_guard<std::mutex> lck(lock_);
+    num_pending_ = (uint32_t)inputs.size();
+  }
+  for (uint32_t i = 0; i < inputs.size(); i++) {
+    const uint32_t replica = next_replica_;
+    next_replica_ = (next_replica_ + 1) % replicas_.size();
+    replicas_[replica]->worker->addTask(
+        MakeCallableOnce(&DataParallel::runRequest, this, replica, i));
+  }
+  waitForTasks();
+  inputs_ = nullptr;
+  callback_ = nullptr;
+
+  const auto t_end = std::chrono::high_resolution_clock::now();
+  total_time_ += std::chrono::duration<double>(t_end - t_start).count();
+  num_requests_ += inputs.size();
+}
+
+void DataParallel::runRequest(const uint32_t replica,
+                              const uint32_t request) {
+  Replica* cur_replica = replicas_[replica].get();
+  cur_replica->model->forwardProp((*inputs_)[request]);
+  runtime_->sync();  // Only waits for this worker's queue.
+  (*callback_)(request, *cur_replica->model->output);
+  cur_replica->num_requests++;
+  taskFinished();
+}
+
+void DataParallel::taskFinished() {
+  std::lock_guard<std::mutex> lck(lock_);
+  num_pending_--;
+  if (num_pending_ == 0) {
+    done_cv_.notify_all();
+  }
+}
+
+void DataParallel::waitForTasks() {
+  std::unique_lock<std::mutex> lck(lock_);
+  while (num_pending_ > 0) {
+    done_cv_.wait(lck);
+  }
+}
+
+uint32_t DataParallel::replicaDevice(const uint32_t replica) const {
+  RASSERT(replica < replicas_.size());
+  return replicas_[replica]->device;
+}
+
+TorchStage* DataParallel::replicaModel(const uint32_t replica) {
+  RASSERT(replica < replicas_.size());
+  return replicas_[replica]->model.get();
+}
+
+uint64_t DataParallel::replicaRequests(const uint32_t replica) const {
+  RASSERT(replica < replicas_.size());
+  return replicas_[replica]->num_requests;
+}
+
+double DataParallel::throughput() const {
+  return total_time_ > 0 ? (double)num_requests_ / total_time_ : 0;
+}
+
+void DataParallel::printStats() const {
+  std::cout << "DataParallel: " << num_requests_ << " requests in "
+            << total_time_ << " seconds (" << throughput()
+            << " requests per second)" << std::endl;
+  for (uint32_t i = 0; i < replicas_.size(); i++) {
+    std::cout << "  replica " << i << " (device " << replicas_[i]->device
+              << ": "
+              << runtime_->context()->getDeviceName(replicas_[i]->device)
+              << "): " << replicas_[i]->num_requests << " requests"
+              << std::endl;
+  }
+}
+
+}  // namespace jtorch
@@ -2,6 +2,7 @@
 
 #include <cstring>
 
+#include "jtorch/jtorch.h"
 #include "jtorch/table.h"
 #include "jtorch/tensor.h"
 
@@ -10,18 +11,20 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-static const char* kJoinTable1DKernel =
+static const char* kJoinTable1DKernel = JTORCH_INDEX_PRELUDE
 "__kernel void JoinTable1D(\n"
-"  const __global  float* input,  /* 0 */\n"
-"  __global  float* output,       /* 1 */\n"
-"  const int output_offset) {     /* 2 */\n"
+"  const __global  STORAGE_T* input,  /* 0 */\n"
+"  __global  STORAGE_T* output,       /* 1 */\n"
+"  const INDEX_T output_offset,       /* 2 */\n"
+"  const INDEX_T input_offset) {      /* 3 */\n"
 "  const int x_in = get_global_id(0);\n"
-"  output[x_in + output_offset] = input[x_in];\n"
+"  STORE(LOAD(input, x_in + input_offset), output, x_in + output_offset);\n"
 "}";
 
 
 JoinTable::JoinTable(const uint32_t dimension) {
   dimension_ = dimension;
+  index64_ = false;
   output = nullptr;
 }
 
@@ -49,8 +52,7 @@ void JoinTable::init(std::shared_ptr<TorchData> input) {
   }
 
   uint32_t dim = TO_TENSOR_PTR((*in)(0).get())->dim();
-  RASSERT(dim > dimension_);  // Otherwise input is smaller than join dimension
-  uint32_t jdim = dim - dimension_ - 1;  // dimension_=0 is the top dim
+  const uint32_t jdim = joinDim(*TO_TENSOR_PTR((*in)(0).get()));
 
   // Make sure the dimensions OTHER than the join dimension are all the same
   for (uint32_t d = 0; d < dim; d++) {
@@ -69,7 +71,7 @@ void JoinTable::init(std::shared_ptr<TorchData> input) {
   }
 
   uint32_t nelems_jdim = 0;
-  for (uint32_t j = 1; j < in->tableSize(); j++) {
+  for (uint32_t j = 0; j < in->tableSize(); j++) {
     nelems_jdim += TO_TENSOR_PTR((*in)(j).get())->size()[jdim];
   }
 
@@ -82,30 +84,78 @@ void JoinTable::init(std::shared_ptr<TorchData> input) {
     std::unique_ptr<uint32_t[]> size(new uint32_t[dim]);
     memcpy(size.get(), TO_TENSOR_PTR((*in)(0).get())->size(),
            sizeof(size[0]) * dim);
-    size[dimension_] = nelems_jdim;
-    output = std::shared_ptr<TorchData>(new Tensor<float>(dim, size.get()));
+    size[jdim] = nelems_jdim;
+    output = std::shared_ptr<TorchData>(
+        new Tensor<float>(dim, size.get(), runtime_, format_));
+  }
+
+  const bool index64 = TO_TENSOR_PTR(output.get())->index64();
+  if (kernel_ == nullptr || index64 != index64_) {
+    kernel_ = context()->getKernelCStr(kJoinTable1DKernel, "JoinTable1D",
+                                       KernelDefines(index64, format_));
+    index64_ = index64;
   }
 }
 
+void JoinTable::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back(
+      {kJoinTable1DKernel, KernelDefines(false, format_), false});
+}
+
+uint32_t JoinTable::joinDim(const Tensor<float>& t) const {
+  // dimension_=0 is the top dim (of a sample, see forwardPropBatch()).
+  const uint32_t sample_dim = sampleDim(t);
+  RASSERT(sample_dim > dimension_);  // Otherwise input is smaller than join dim
+  return sample_dim - dimension_ - 1;
+}
+
 void JoinTable::forwardProp(std::shared_ptr<TorchData> input) {
   init(input);
 
   Table* in = (Table*)input.get();
 
-  // AT THE MOMENT ONLY JOINS ALONG THE TOP DIMENSION ARE SUPPORTED
-  RASSERT(dimension_ == 0);  // Only dimension=0 is supported for now
+  const uint32_t jdim = joinDim(*TO_TENSOR_PTR((*in)(0).get()));
+  if (jdim != TO_TENSOR_PTR(output.get())->dim() - 1) {
+    // Joins along an inner dimension (ie of the samples of a batch) copy each
+    // input into its (strided) slice of the output.
+    Tensor<float>* out = TO_TENSOR_PTR(output.get());
+    uint32_t start = 0;
+    for (uint32_t i = 0; i < in->tableSize(); i++) {
+      Tensor<float>* cur_input = TO_TENSOR_PTR((*in)(i).get());
+      const uint32_t length = cur_input->size()[jdim];
+      Tensor<float>::copy(*Tensor<float>::narrow(*out, jdim, start, length),
+                          *cur_input);
+      start += length;
+    }
+    return;
+  }
 
   // Copy each table element's raw data into the output
-  cl_context->useKernelCStr(kJoinTable1DKernel, "JoinTable1D");
-  int out_offset = 0;
+  // The kernel variant is picked for the output, the inputs can't need more.
+  uint64_t out_offset = TO_TENSOR_PTR(output.get())->offset();
   for (uint32_t i = 0; i < in->tableSize(); i++) {
     Tensor<float>* cur_input = TO_TENSOR_PTR((*in)(i).get());
-    cl_context->setArg(0, cur_input->storage());
-    cl_context->setArg(1, TO_TENSOR_PTR(output.get())->storage());
-    cl_context->setArg(2, out_offset);
-    uint32_t dim = 1;
-    uint32_t nelem = cur_input->nelems();
-    cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+    const uint64_t nelem = cur_input->nelems();
+    if (!cur_input->isContiguous() || cur_input->format() != format_) {
+      // Strided inputs (and inputs in the other storage format) are copied
+      // into their slice of the output instead.
+      Tensor<float>* out = TO_TENSOR_PTR(output.get());
+      const uint32_t outer = out->dim() - 1;
+      const uint64_t start =
+          (out_offset - out->offset()) / out->stride()[outer];
+      std::shared_ptr<Tensor<float>> out_slice = Tensor<float>::narrowOuterDim(
+          *out, (uint32_t)start, cur_input->size()[outer]);
+      Tensor<float>::copy(*out_slice, *cur_input);
+      out_offset += nelem;
+      continue;
+    }
+    RASSERT(index64_ || !cur_input->index64());
+    kernel_->setArg(0, cur_input->storage());
+    kernel_->setArg(1, TO_TENSOR_PTR(output.get())->storage());
+    runtime_->runElementwiseKernel(kernel_.get(), 2,
+                                   {out_offset, cur_input->offset()}, nelem,
+                                   index64_);
 
     out_offset += nelem;
   }
@@ -1,75 +1,119 @@
 #include "jtorch/jtorch.h"
 
-#include "jcl/cl_include.h"  // Must come before clBLAS.h
-#include <clBLAS.h>
-#include <iostream>
+#include <limits>
 #include <mutex>
-#include <sstream>
 
 #include "jcl/opencl_context.h"
+#include "jcl/opencl_kernel.h"
+#include "jtorch/runtime.h"
 
 namespace jtorch {
 
-std::unique_ptr<jcl::OpenCLContext> cl_context = nullptr;
+jcl::OpenCLContext* cl_context = nullptr;
 std::mutex cl_context_lock_;
-uint32_t deviceid;
+// Threads that haven't picked a device use the one requested in InitJTorch.
+static uint32_t default_deviceid = 0;
+thread_local uint32_t deviceid = default_deviceid;
+static const std::vector<jcl::OpenCLDeviceScore> no_device_scores;
 
 void InitJTorch(const bool use_cpu, const uint32_t requested_deviceid,
-                const bool verbose_startup) {
+                const bool verbose_startup,
+                const std::string& program_cache_dir,
+                const bool out_of_order_queue,
+                const bool profile_kernels,
+                const bool select_fastest_device) {
   std::lock_guard<std::mutex> lck(cl_context_lock_);
-  // Check we haven't already called init.
-  RASSERT(cl_context == nullptr);
+  RuntimeOptions options;
+  options.use_cpu = use_cpu;
+  options.requested_deviceid = requested_deviceid;
+  options.verbose_startup = verbose_startup;
+  options.program_cache_dir = program_cache_dir;
+  options.out_of_order_queue = out_of_order_queue;
+  options.profile_kernels = profile_kernels;
+  options.select_fastest_device = select_fastest_device;
+  Runtime::InitDefault(options);
 
-  if (verbose_startup) {
-    std::cout << "Valid OpenCL devices attached:" << std::endl;
-    const uint32_t num_devices = jcl::OpenCLContext::printDevices();
-    static_cast<void>(num_devices);
-  }
+  Runtime* runtime = Runtime::Default();
+  cl_context = runtime->context();
+  default_deviceid = runtime->defaultDeviceid();
+  deviceid = default_deviceid;
+}
 
-  jcl::CLDevice device = use_cpu ? jcl::CLDeviceCPU : jcl::CLDeviceGPU;
-  jcl::CLVendor vendor = jcl::CLVendorAny;
+void ShutdownJTorch() {
+  std::lock_guard<std::mutex> lck(cl_context_lock_);
+  cl_context = nullptr;
+  Runtime::ShutdownDefault();
+}
 
-  const bool device_exists =
-      jcl::OpenCLContext::queryDeviceExists(device, vendor);
-  if (!device_exists) {
-    if (use_cpu) {
-      std::cerr << "No CPU devices attached.";
-    } else {
-      std::cerr << "No GPU devices attached.";
-    }
+void Sync() { Runtime::Default()->sync(); }
+
+const std::vector<jcl::OpenCLDeviceScore>& DeviceScores() {
+  Runtime* runtime = Runtime::Default();
+  return runtime != nullptr ? runtime->deviceScores() : no_device_scores;
+}
+
+bool NeedsIndex64(const uint64_t end) {
+  return end > (uint64_t)std::numeric_limits<int32_t>::max();
+}
+
+const jcl::OpenCLDefines& IndexDefines(const bool index64) {
+  static const jcl::OpenCLDefines defines_32;
+  static const jcl::OpenCLDefines defines_64 = {{"INDEX_T", "long"}};
+  return index64 ? defines_64 : defines_32;
+}
+
+const jcl::OpenCLDefines& KernelDefines(const bool index64,
+                                        const StorageFormat format) {
+  static const jcl::OpenCLDefines defines_half_32 = {{"JTORCH_HALF", "1"}};
+  static const jcl::OpenCLDefines defines_half_64 = {{"INDEX_T", "long"},
+                                                     {"JTORCH_HALF", "1"}};
+  if (format == FLOAT_STORAGE) {
+    return IndexDefines(index64);
   }
-  RASSERT(device_exists);
-
-  // Otherwise, initialize the context.
-  cl_context.reset(new jcl::OpenCLContext());
-  cl_context->init(device, jcl::CLVendorAny, verbose_startup);
-
-  // Make sure the user is requesting a device id that exists.
-  RASSERT(requested_deviceid < cl_context->getNumDevices());
-  deviceid = requested_deviceid;
-
-  std::cout << "Jtorch is using device " << deviceid << ": "
-            << cl_context->getDeviceName(deviceid) << std::endl;
-
-  // Startup clblas.
-  // TODO(tompson): I have NO idea what device ID this will run on.
-  const cl_int blas_ret = clblasSetup();
-  const bool blas_ok = (blas_ret == CL_SUCCESS);
-  if (!blas_ok) {
-    std::cout << "ERROR - InitJTorchInternal: clblasSetup returned error: "
-              << jcl::OpenCLContext::getErrorString(blas_ret);
+  return index64 ? defines_half_64 : defines_half_32;
+}
+
+CachedKernel::CachedKernel(const char* kernel_c_str, const char* kernel_name,
+                           const jcl::OpenCLDefines& defines)
+    : kernel_c_str_(kernel_c_str), kernel_name_(kernel_name) {
+  for (uint32_t i = 0; i < 2; i++) {
+    for (uint32_t f = 0; f < 2; f++) {
+      slots_[i][f] = jcl::OpenCLContext::newKernelSlot();
+      defines_[i][f] = KernelDefines(i != 0, (StorageFormat)f);
+      defines_[i][f].insert(defines.begin(), defines.end());
+    }
   }
-  RASSERT(blas_ok);
 }
 
-void ShutdownJTorch() {
-  std::lock_guard<std::mutex> lck(cl_context_lock_);
-  clblasTeardown();
-  cl_context.reset(nullptr);
+jcl::OpenCLKernel* CachedKernel::get(Runtime* runtime, const bool index64,
+                                     const StorageFormat format) const {
+  const uint32_t i = index64 ? 1 : 0;
+  return runtime->context()->getCachedKernelCStr(
+      slots_[i][format], kernel_c_str_, kernel_name_, defines_[i][format]);
 }
 
-void Sync() {
-  std::lock_guard<std::mutex> lck(cl_context_lock_);
-  cl_context->sync(deviceid);
+void SetIndexArg(jcl::OpenCLKernel* kernel, const uint32_t index,
+                 const uint64_t value, const bool index64) {
+  if (!index64) {
+    RASSERT(!NeedsIndex64(value));
+    kernel->setArg(index, (cl_int)value);
+  } else {
+    kernel->setArg(index, (cl_long)value);
+  }
 }
+
+void SetIndexArg(jcl::OpenCLContext* context, const uint32_t index,
+                 const uint64_t value, const bool index64) {
+  if (!index64) {
+    RASSERT(!NeedsIndex64(value));
+    context->setArg(index, (cl_int)value);
+  } else {
+    context->setArg(index, (cl_long)value);
+  }
+}
+
+void SetUseImages(const bool use) { Runtime::Default()->setUseImages(use); }
+
+bool UseImages() { return Runtime::Default()->useImages(); }
+
 }  // namespace jtorch
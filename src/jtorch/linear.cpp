@@ -2,6 +2,7 @@
 
 #include <cstring>
 
+#include "jtorch/quantization.h"
 #include "jtorch/tensor.h"
 
 using namespace jcl::threading;
@@ -9,22 +10,26 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-static const char* kLinearKernel =
+// X and Y are in the stage's storage format, A is always float (the batch
+// GEMM shares it with clBLAS).
+static const char* kLinearKernel = JTORCH_INDEX_PRELUDE
     "    __kernel void MatVecMultSimple(\n"
     "      /* Y = A * X (matrix-vector mulitply)*/\n"
     "      __global const float* A,  /* 0  --> Size M (rows) x N (cols) stored "
     "column major */\n"
-    "      __global const float* X,  /* 1  --> Size N */\n"
-    "      __global  float* Y,       /* 2  --> Size M */\n"
+    "      __global const STORAGE_T* X,  /* 1  --> Size N */\n"
+    "      __global STORAGE_T* Y,        /* 2  --> Size M */\n"
     "      const int M,              /* 3 */\n"
-    "      const int N) {            /* 4 */\n"
+    "      const int N,              /* 4 */\n"
+    "      const INDEX_T X_offset) { /* 5 */\n"
+    "      X += X_offset;\n"
     "      const int i = get_global_id(0);  /* row index */\n"
     "      float sum = 0;\n"
     "      /* Perform the linear accumulation */\n"
     "      for (int k = 0; k < N; k++) {\n"
-    "        sum += A[i + M * k] * X[k];\n"
+    "        sum += A[i + (INDEX_T)M * k] * LOAD(X, k);\n"
     "      }\n"
-    "      Y[i] = sum;\n"
+    "      STORE(sum, Y, i);\n"
     "    }\n"
     "\n"
     "    #define ROW_DIM 0\n"
@@ -34,16 +39,18 @@ static const char* kLinearKernel =
     "      /* Y = A * X (matrix-vector mulitply) */\n"
     "      __global const float* A,  /* 0  --> Size M (rows) x N (cols) stored "
     "column major */\n"
-    "      __global const float* X,  /* 1  --> Size N */\n"
-    "      __global  float* Y,       /* 2  --> Size M */\n"
-    "      __local float* work,      /* 3  --> Size M by p */\n"
+    "      __global const STORAGE_T* X,  /* 1  --> Size N */\n"
+    "      __global STORAGE_T* Y,        /* 2  --> Size M */\n"
+    "      __local float* work,          /* 3  --> Size M by p */\n"
     "      const int M,              /* 4 */\n"
-    "      const int N) {            /* 5 */\n"
+    "      const int N,              /* 5 */\n"
+    "      const INDEX_T X_offset) { /* 6 */\n"
+    "      X += X_offset;\n"
     "      /* Compute partial dot product */\n"
     "      float sum = 0;\n"
     "      for (int k = get_global_id(COL_DIM); k < N; k += "
     "get_global_size(COL_DIM)) {\n"
-    "        sum += A[get_global_id(ROW_DIM) + M * k] * X[k];\n"
+    "        sum += A[get_global_id(ROW_DIM) + (INDEX_T)M * k] * LOAD(X, k);\n"
     "      }\n"
     "      /* Each thread stores its partial sum in WORK */\n"
     "      int rows = get_local_size(ROW_DIM); /* rows in group */\n"
@@ -64,34 +71,75 @@ static const char* kLinearKernel =
     "      }\n"
     "      /* Write final result in Y */\n"
     "      if ( jj == 0 ) {\n"
-    "        Y[ get_global_id(ROW_DIM) ] = work[ii];\n"
+    "        STORE(work[ii], Y, get_global_id(ROW_DIM));\n"
     "      }\n"
     "    }\n"
     "\n"
     "    __kernel void Accum (\n"
-    "      __global  float* output,          /* 0 */\n"
+    "      __global STORAGE_T* output,       /* 0 */\n"
     "      const __global float* biases) {   /* 1 */\n"
     "      const int x_out = get_global_id(0);\n"
-    "      output[x_out] += biases[x_out];\n"
+    "      STORE(LOAD(output, x_out) + biases[x_out], output, x_out);\n"
     "    }";
 
+// int8 version of MatVecMultSimple with the bias folded in:
+// Y = (A * X) * scales + biases, where the int8 products are accumulated in
+// int32.  A is stored in char4s of 4 consecutive columns, column major (so
+// neighbouring rows, ie work items, read neighbouring char4s), and the
+// columns are padded with zeros to N4 char4s.  Dim 1 of the launch is the
+// sample of a batch (X and Y then hold one column per sample).
+static const char* kLinearInt8Kernel = JTORCH_INDEX_PRELUDE
+    "    __kernel void MatVecMultInt8(\n"
+    "      __global const char4* A,       /* 0  --> Size M x N4 */\n"
+    "      __global const char4* X,       /* 1  --> Size N4 x batch */\n"
+    "      __global STORAGE_T* Y,         /* 2  --> Size M x batch */\n"
+    "      __global const float* scales,  /* 3  --> Size M */\n"
+    "      __global const float* biases,  /* 4  --> Size M */\n"
+    "      const int M,                   /* 5 */\n"
+    "      const int N4) {                /* 6 */\n"
+    "      const int i = get_global_id(0);  /* row index */\n"
+    "      const int b = get_global_id(1);  /* sample index */\n"
+    "      X += (INDEX_T)b * N4;\n"
+    "      int sum = 0;\n"
+    "      for (int k = 0; k < N4; k++) {\n"
+    "        const int4 prod = convert_int4(A[i + (INDEX_T)M * k]) *\n"
+    "                          convert_int4(X[k]);\n"
+    "        sum += prod.x + prod.y + prod.z + prod.w;\n"
+    "      }\n"
+    "      STORE((float)sum * scales[i] + biases[i], Y, (INDEX_T)b * M + i);\n"
+    "    }";
+
+// Defined in spatial_convolution_mm.cpp.
+void THCudaBlas_gemm(void* state, char transa, char transb, size_t m, size_t n,
+                     size_t k, float alpha, Tensor<float>* a, size_t lda,
+                     Tensor<float>* b, size_t ldb, float beta, Tensor<float>* c,
+                     size_t ldc);
+
 Linear::Linear(const uint32_t n_inputs, const uint32_t n_outputs)
     : TorchStage() {
   n_inputs_ = n_inputs;
   n_outputs_ = n_outputs;
+  calibrating_ = false;
+  input_absmax_ = 0;
+  quantized_ = false;
+  input_scale_ = 1;
+  index64_ = false;
 
-  output.reset(new Tensor<float>(1, &n_outputs_));
+  output.reset(new Tensor<float>(1, &n_outputs_, runtime_, format_));
 
   // NOTE: For efficiency we store the weight matrix transposed!
   // (we want the matrix vector multiply to be strided properly)
   uint32_t size_[2] = {n_outputs_, n_inputs_};
-  weights_.reset(new Tensor<float>(2, size_));
-  biases_.reset(new Tensor<float>(1, &n_outputs_));
+  weights_.reset(new Tensor<float>(2, size_, runtime_));
+  weights_->storage()->setTag(jcl::CLBufferTagWeights);
+  biases_.reset(new Tensor<float>(1, &n_outputs_, runtime_));
+  biases_->storage()->setTag(jcl::CLBufferTagWeights);
 }
 
 Linear::~Linear() {}
 
 void Linear::setWeights(const float* weights) {
+  RASSERT(!quantized_);
   weights_->setData(weights);
 }
 
@@ -103,67 +151,262 @@ void Linear::init(std::shared_ptr<TorchData> input) {
   // FloatTensor expected
   RASSERT(input->type() == TorchDataType::TENSOR_DATA);
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
-  static_cast<void>(in);
-  // Check input size
-  RASSERT(in->dim() == 1 && in->size()[0] == n_inputs_);
-}
+  // Check input size (a batch is n_inputs x N, see forwardPropBatch())
+  RASSERT((in->dim() == 1 || in->dim() == 2) && in->size()[0] == n_inputs_);
+  const uint32_t batch_size = in->dim() == 2 ? in->size()[1] : 1;
 
-void Linear::forwardProp(std::shared_ptr<TorchData> input) {
-  init(input);
+  Tensor<float>* out = TO_TENSOR_PTR(output.get());
+  if (out->dim() != in->dim() ||
+      (in->dim() == 2 && out->size()[1] != batch_size)) {
+    const uint32_t out_size[2] = {n_outputs_, batch_size};
+    output.reset(new Tensor<float>(in->dim(), out_size, runtime_, format_));
+  }
+  if (quantized_) {
+    const uint32_t int8_size = Int8Padded(n_inputs_) * batch_size;
+    if (int8_input_ == nullptr || int8_input_->nelems() * 4 != int8_size) {
+      int8_input_ = Int8Tensor(int8_size, runtime_);
+      int8_input_->storage()->setTag(jcl::CLBufferTagScratch);
+    }
+  } else if (in->dim() == 2 &&
+             (ones_ == nullptr || ones_->size()[0] != batch_size)) {
+    // The biases are broadcast over the batch by a GEMM with a row of ones.
+    ones_.reset(new Tensor<float>(1, &batch_size, runtime_));
+    ones_->storage()->setTag(jcl::CLBufferTagScratch);
+    Tensor<float>::fill(*ones_, 1);
+    if (format_ != FLOAT_STORAGE) {
+      // clBLAS only writes float (see forwardPropGemm()).
+      const uint32_t gemm_size[2] = {n_outputs_, batch_size};
+      gemm_output_.reset(new Tensor<float>(2, gemm_size, runtime_));
+      gemm_output_->storage()->setTag(jcl::CLBufferTagScratch);
+    }
+  }
+
+  // The weights are indexed as one block, and so are a batch of inputs (and
+  // the bytes of the quantized inputs).
+  bool index64 = in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (quantized_) {
+    index64 = index64 || int8_weights_->index64() ||
+              NeedsIndex64(int8_input_->nelems() * 4);
+  } else {
+    index64 = index64 || weights_->index64();
+  }
+  if (accum_kernel_ != nullptr && index64 == index64_ &&
+      (!quantized_ || int8_mat_vec_kernel_ != nullptr)) {
+    return;
+  }
+  index64_ = index64;
+  const jcl::OpenCLDefines& defines = KernelDefines(index64, format_);
+  if (quantized_) {
+    quantize_kernel_ =
+        context()->getKernelCStr(kQuantizeKernel, "Quantize", defines);
+    int8_mat_vec_kernel_ = context()->getKernelCStr(
+        kLinearInt8Kernel, "MatVecMultInt8", defines);
+  }
+  accum_kernel_ = context()->getKernelCStr(kLinearKernel, "Accum", defines);
 #ifdef SIMPLE_LINEAR
-  cl_context->useKernelCStr(kLinearKernel, "MatVecMultSimple");
-  cl_context->setArg(0, weights_->storage());
-  cl_context->setArg(1, TO_TENSOR_PTR(input.get())->storage());
-  cl_context->setArg(2, TO_TENSOR_PTR(output.get())->storage());
-  cl_context->setArg(3, (int)n_outputs_);
-  cl_context->setArg(4, (int)n_inputs_);
-  uint32_t dim = 1;
-  cl_context->runKernel(jtorch::deviceid, dim, &n_outputs_, false);
+  mat_vec_kernel_ =
+      context()->getKernelCStr(kLinearKernel, "MatVecMultSimple", defines);
 #else
-  cl_context->useKernelCStr(kLinearKernel, "MatVecMultThreads");
+  mat_vec_kernel_ =
+      context()->getKernelCStr(kLinearKernel, "MatVecMultThreads", defines);
 
-  uint32_t max_worksize =
-      cl_context->queryMaxWorkgroupSizeForCurKernel(jtorch::deviceid);
+  uint32_t max_worksize = mat_vec_kernel_->max_workgroup_size(deviceid());
   // http://www.bealto.com/gpu-gemv_v2.html
-  // Try and find a good local workgroup size allocation (that is legal)
-  // TODO: This is a mess.  Clean it up.
+  // Find a legal local workgroup size allocation.  This is only the starting
+  // point (and the fallback if autotuning is disabled): the local size is
+  // autotuned on the first forwardProp.
   uint32_t max_item_size[3];
   for (uint32_t i = 0; i < 3; i++) {
-    max_item_size[i] = cl_context->getMaxWorkitemSize(jtorch::deviceid, i);
+    max_item_size[i] = context()->getMaxWorkitemSize(deviceid(), i);
   }
 
   uint32_t p =
       std::min<int32_t>(16, std::min<int32_t>(max_item_size[1], max_worksize));
-  uint32_t global_size[2] = {n_outputs_, p};
-  uint32_t local_size[2] = {
+  global_size_[0] = n_outputs_;
+  global_size_[1] = p;
+  local_size_[0] =
       std::min<int>(n_outputs_ / p + 1,
-                    cl_context->getMaxWorkgroupSize(jtorch::deviceid) / p),
-      p};  // Maximum
-  while ((n_outputs_ % local_size[0] != 0 ||
-          local_size[0] * local_size[1] > max_worksize) &&
-         local_size[0] > 1) {
-    local_size[0]--;
-  }
-
-  cl_context->setArg(0, weights_->storage());
-  cl_context->setArg(1, TO_TENSOR_PTR(input.get())->storage());
-  cl_context->setArg(2, TO_TENSOR_PTR(output.get())->storage());
-  float dummy;
-  static_cast<void>(dummy);
-  // setArg with nullptr --> Local memory allocation (per local workgroup)
-  cl_context->setArg(3, sizeof(dummy) * local_size[0] * local_size[1], nullptr);
-  cl_context->setArg(4, (int)n_outputs_);
-  cl_context->setArg(5, (int)n_inputs_);
-  uint32_t dim = 2;
-  cl_context->runKernel(jtorch::deviceid, dim, global_size, local_size, false);
+                    context()->getMaxWorkgroupSize(deviceid()) / p);
+  local_size_[1] = p;  // Maximum
+  while ((n_outputs_ % local_size_[0] != 0 ||
+          local_size_[0] * local_size_[1] > max_worksize) &&
+         local_size_[0] > 1) {
+    local_size_[0]--;
+  }
+#endif
+}
+
+void Linear::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  const jcl::OpenCLDefines& defines = KernelDefines(false, format_);
+  programs->push_back({kLinearKernel, defines, false});
+  if (quantized_) {
+    programs->push_back({kQuantizeKernel, defines, false});
+    programs->push_back({kLinearInt8Kernel, defines, false});
+  }
+}
+
+void Linear::calibrate(const bool calibrating) {
+  calibrating_ = calibrating;
+}
+
+void Linear::quantize() {
+  if (quantized_) {
+    return;
+  }
+  // The input scale comes from calibration (see TorchStage::calibrate()).
+  RASSERT(!calibrating_ && input_absmax_ > 0);
+  const uint32_t n_padded = Int8Padded(n_inputs_);
+  const uint64_t n_weights = (uint64_t)n_outputs_ * n_inputs_;
+
+  // weights_ is column major, QuantizeRows wants one row per output.
+  std::unique_ptr<float[]> weights(new float[n_weights]);
+  weights_->getData(weights.get());
+  std::unique_ptr<float[]> rows(new float[n_weights]);
+  for (uint32_t i = 0; i < n_outputs_; i++) {
+    for (uint32_t k = 0; k < n_inputs_; k++) {
+      rows[(uint64_t)i * n_inputs_ + k] =
+          weights[i + (uint64_t)n_outputs_ * k];
+    }
+  }
+  const uint64_t n_int8 = (uint64_t)n_outputs_ * n_padded;
+  std::unique_ptr<int8_t[]> int8_rows(new int8_t[n_int8]);
+  std::unique_ptr<float[]> scales(new float[n_outputs_]);
+  QuantizeRows(rows.get(), n_outputs_, n_inputs_, n_padded, int8_rows.get(),
+               scales.get());
+
+  // Back to column major, in char4s (see kLinearInt8Kernel).
+  std::unique_ptr<int8_t[]> int8_weights(new int8_t[n_int8]);
+  for (uint32_t i = 0; i < n_outputs_; i++) {
+    for (uint32_t k = 0; k < n_padded; k++) {
+      int8_weights[((uint64_t)(k / 4) * n_outputs_ + i) * 4 + k % 4] =
+          int8_rows[(uint64_t)i * n_padded + k];
+    }
+  }
+  int8_weights_ =
+      Int8Tensor((uint32_t)n_int8, runtime_, int8_weights.get());
+  int8_weights_->storage()->setTag(jcl::CLBufferTagWeights);
+
+  // The int32 dot products are rescaled by both scales at once.
+  input_scale_ = Int8Scale(input_absmax_);
+  for (uint32_t i = 0; i < n_outputs_; i++) {
+    scales[i] *= input_scale_;
+  }
+  int8_scales_.reset(new Tensor<float>(1, &n_outputs_, runtime_));
+  int8_scales_->setData(scales.get());
+  int8_scales_->storage()->setTag(jcl::CLBufferTagWeights);
+
+  // int8_input_ is allocated by init().
+  weights_.reset(nullptr);
+  ones_.reset(nullptr);
+  gemm_output_.reset(nullptr);
+  quantized_ = true;
+}
+
+void Linear::forwardProp(std::shared_ptr<TorchData> input) {
+  if (quantized_) {
+    forwardPropInt8(input);
+    return;
+  }
+  // The mat-vec kernels read either storage format, clBLAS only float.
+  const bool gemm = input->type() == TorchDataType::TENSOR_DATA &&
+                    TO_TENSOR_PTR(input.get())->dim() == 2;
+  input = contiguousInput(input, gemm ? FLOAT_STORAGE : format_);
+  init(input);
+  if (calibrating_) {
+    input_absmax_ =
+        CalibrateAbsMax(*TO_TENSOR_PTR(input.get()), input_absmax_);
+  }
+  if (gemm) {
+    forwardPropGemm(input);
+    return;
+  }
+  uint32_t dim;
+#ifdef SIMPLE_LINEAR
+  mat_vec_kernel_->setArg(0, weights_->storage());
+  mat_vec_kernel_->setArg(1, TO_TENSOR_PTR(input.get())->storage());
+  mat_vec_kernel_->setArg(2, TO_TENSOR_PTR(output.get())->storage());
+  mat_vec_kernel_->setArg(3, (int)n_outputs_);
+  mat_vec_kernel_->setArg(4, (int)n_inputs_);
+  SetIndexArg(mat_vec_kernel_.get(), 5, TO_TENSOR_PTR(input.get())->offset(),
+              index64_);
+  dim = 1;
+  context()->runKernelAutotuned(mat_vec_kernel_.get(), deviceid(), dim,
+                                &n_outputs_, false);
+#else
+  mat_vec_kernel_->setArg(0, weights_->storage());
+  mat_vec_kernel_->setArg(1, TO_TENSOR_PTR(input.get())->storage());
+  mat_vec_kernel_->setArg(2, TO_TENSOR_PTR(output.get())->storage());
+  mat_vec_kernel_->setArg(4, (int)n_outputs_);
+  mat_vec_kernel_->setArg(5, (int)n_inputs_);
+  SetIndexArg(mat_vec_kernel_.get(), 6, TO_TENSOR_PTR(input.get())->offset(),
+              index64_);
+  dim = 2;
+  jcl::OpenCLKernel* mat_vec_kernel = mat_vec_kernel_.get();
+  context()->runKernelAutotuned(
+      mat_vec_kernel, deviceid(), dim, global_size_, false, local_size_,
+      [mat_vec_kernel](const uint32_t* local_size) {
+        // setArg with nullptr --> Local memory allocation (per local
+        // workgroup)
+        mat_vec_kernel->setArg(3, sizeof(float) * local_size[0] * local_size[1],
+                               nullptr);
+      });
 #endif
 
   // Now add in the bias
-  cl_context->useKernelCStr(kLinearKernel, "Accum");
-  cl_context->setArg(0, TO_TENSOR_PTR(output.get())->storage());
-  cl_context->setArg(1, biases_->storage());
+  accum_kernel_->setArg(0, TO_TENSOR_PTR(output.get())->storage());
+  accum_kernel_->setArg(1, biases_->storage());
   dim = 1;
-  cl_context->runKernel(jtorch::deviceid, dim, &n_outputs_, false);
+  context()->runKernel(accum_kernel_.get(), deviceid(), dim,
+                       &n_outputs_, false);
+}
+
+void Linear::forwardPropGemm(std::shared_ptr<TorchData> input) {
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+  Tensor<float>* out = format_ == FLOAT_STORAGE ? TO_TENSOR_PTR(output.get())
+                                                : gemm_output_.get();
+  const uint32_t batch_size = in->size()[1];
+  void* state = nullptr;
+  // All matrices are column major: Y (M x N) = A (M x K) * X (K x N) + the
+  // biases (M x 1) times a row of ones (1 x N).
+  THCudaBlas_gemm(state, 'n', 'n', n_outputs_, batch_size, 1, 1,
+                  biases_.get(), n_outputs_, ones_.get(), 1, 0, out,
+                  n_outputs_);
+  THCudaBlas_gemm(state, 'n', 'n', n_outputs_, batch_size, n_inputs_, 1,
+                  weights_.get(), n_outputs_, in, n_inputs_, 1, out,
+                  n_outputs_);
+  if (out == gemm_output_.get()) {
+    Tensor<float>::copy(*TO_TENSOR_PTR(output.get()), *out);
+  }
+}
+
+void Linear::forwardPropInt8(std::shared_ptr<TorchData> input) {
+  // The quantization reads either storage format.
+  input = contiguousInput(input, format_);
+  init(input);
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+
+  const uint32_t batch_size = in->dim() == 2 ? in->size()[1] : 1;
+  const uint32_t quantize_size[2] = {Int8Padded(n_inputs_), batch_size};
+  quantize_kernel_->setArg(0, in->storage());
+  quantize_kernel_->setArg(1, int8_input_->storage());
+  quantize_kernel_->setArg(2, 1.0f / input_scale_);
+  quantize_kernel_->setArg(3, (int)n_inputs_);
+  SetIndexArg(quantize_kernel_.get(), 4, in->offset(), index64_);
+  uint32_t dim = 2;
+  context()->runKernel(quantize_kernel_.get(), deviceid(), dim, quantize_size,
+                       false);
+
+  int8_mat_vec_kernel_->setArg(0, int8_weights_->storage());
+  int8_mat_vec_kernel_->setArg(1, int8_input_->storage());
+  int8_mat_vec_kernel_->setArg(2, TO_TENSOR_PTR(output.get())->storage());
+  int8_mat_vec_kernel_->setArg(3, int8_scales_->storage());
+  int8_mat_vec_kernel_->setArg(4, biases_->storage());
+  int8_mat_vec_kernel_->setArg(5, (int)n_outputs_);
+  int8_mat_vec_kernel_->setArg(6, (int)(quantize_size[0] / 4));
+  const uint32_t global_size[2] = {n_outputs_, batch_size};
+  context()->runKernelAutotuned(int8_mat_vec_kernel_.get(), deviceid(), dim,
+                                global_size, false);
 }
 
 std::unique_ptr<TorchStage> Linear::loadFromFile(std::ifstream& file) {
@@ -11,17 +11,20 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-static const char* kMulConstantKernel =
-"    __kernel void MulConstant(const __global float* input, const float scalar_constant, __global float* output) {\n"
+static const char* kMulConstantKernel = JTORCH_INDEX_PRELUDE
+"    __kernel void MulConstant(const __global STORAGE_T* input, const float scalar_constant, __global STORAGE_T* output, const INDEX_T input_offset, const INDEX_T output_offset) {\n"
 "\n"
+"      input += input_offset;\n"
+"      output += output_offset;\n"
 "      const int index = get_global_id(0);\n"
 "\n"
-"      output[index] = scalar_constant * input[index];\n"
+"      STORE(scalar_constant * LOAD(input, index), output, index);\n"
 "    }";
 
 
 MulConstant::MulConstant(float scalar_constant) : TorchStage() {
   output = nullptr;
+  index64_ = false;
   scalar_constant_ = scalar_constant;
 }
 
@@ -38,19 +41,35 @@ void MulConstant::init(std::shared_ptr<TorchData> input) {
     }
   }
   if (output == nullptr) {
-    output.reset(new Tensor<float>(in->dim(), in->size()));
+    output.reset(
+        new Tensor<float>(in->dim(), in->size(), runtime_, format_));
   }
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (kernel_ == nullptr || index64 != index64_) {
+    kernel_ = context()->getKernelCStr(kMulConstantKernel, "MulConstant",
+                                       KernelDefines(index64, format_));
+    index64_ = index64;
+  }
+}
+
+void MulConstant::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back(
+      {kMulConstantKernel, KernelDefines(false, format_), false});
 }
 
 void MulConstant::forwardProp(std::shared_ptr<TorchData> input) {
+  input = contiguousInput(input, format_);
   init(input);
-  cl_context->useKernelCStr(kMulConstantKernel, "MulConstant");
-  cl_context->setArg(0, TO_TENSOR_PTR(input.get())->storage());
-  cl_context->setArg(1, scalar_constant_);
-  cl_context->setArg(2, TO_TENSOR_PTR(output.get())->storage());
-  uint32_t dim = 1;
-  uint32_t nelem = TO_TENSOR_PTR(output.get())->nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+  Tensor<float>* out = TO_TENSOR_PTR(output.get());
+  kernel_->setArg(0, in->storage());
+  kernel_->setArg(1, scalar_constant_);
+  kernel_->setArg(2, out->storage());
+  runtime_->runElementwiseKernel(kernel_.get(), 3,
+                                 {in->offset(), out->offset()}, out->nelems(),
+                                 index64_);
 }
 
 std::unique_ptr<TorchStage> MulConstant::loadFromFile(std::ifstream& file) {
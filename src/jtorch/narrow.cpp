@@ -14,6 +14,7 @@ Narrow::Narrow(int dimension, int index, int length) : TorchStage() {
   index_ = index;
   length_ = length;
   src_tensor_ = nullptr;
+  src_batch_ = false;
 }
 
 Narrow::~Narrow() {}
@@ -21,17 +22,20 @@ Narrow::~Narrow() {}
 void Narrow::forwardProp(std::shared_ptr<TorchData> input) {
   RASSERT(input->type() == TorchDataType::TENSOR_DATA);
 
-  // For now we only support the Narrow operation along the outer dimension.
-  // In torch indexing this is always 1.
-  RASSERT(this->dimension_ == 1);
-
-  if (src_tensor_ != input.get()) {
+  if (src_tensor_ != input.get() || src_batch_ != batchMode()) {
     // Only create the tensor slice if the input has changed.
     src_tensor_ = TO_TENSOR_PTR(input.get());
-
-    // Note the index is torch 1-indexed.
-    output = Tensor<float>::narrowOuterDim(*src_tensor_, this->index_ - 1,
-                                           this->length_);
+    src_batch_ = batchMode();
+
+    // Note the dimension and index are torch 1-indexed, with dimension 1
+    // being the outer dimension of a sample (the batch dimension, if any, is
+    // above it).  Narrowing an inner dimension gives a non-contiguous view
+    // (copied only by stages that need a contiguous input).
+    const uint32_t sample_dim = sampleDim(*src_tensor_);
+    RASSERT(this->dimension_ >= 1 && this->dimension_ <= (int)sample_dim);
+    const uint32_t dim = sample_dim - (uint32_t)this->dimension_;
+    output = Tensor<float>::narrow(*src_tensor_, dim, this->index_ - 1,
+                                   this->length_);
   }
 }
 
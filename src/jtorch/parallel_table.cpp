@@ -42,6 +42,25 @@ void ParallelTable::initOutput() {
   }
 }
 
+void ParallelTable::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  for (const auto& stage : network_) {
+    stage->getPrograms(programs);
+  }
+}
+
+void ParallelTable::calibrate(const bool calibrating) {
+  for (const auto& stage : network_) {
+    stage->calibrate(calibrating);
+  }
+}
+
+void ParallelTable::quantize() {
+  for (const auto& stage : network_) {
+    stage->quantize();
+  }
+}
+
 void ParallelTable::forwardProp(std::shared_ptr<TorchData> input) {
   RASSERT(input->type() == TorchDataType::TABLE_DATA);
 
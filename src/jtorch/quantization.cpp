@@ -0,0 +1,51 @@
+#include "jtorch/quantization.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "jtorch/tensor.h"
+
+namespace jtorch {
+
+float Int8Scale(const float absmax) {
+  return absmax > 0 ? absmax / 127.0f : 1.0f;
+}
+
+void QuantizeRows(const float* x, const uint32_t rows, const uint32_t cols,
+                  const uint32_t q_stride, int8_t* q, float* scales) {
+  RASSERT(q_stride >= cols);
+  for (uint32_t r = 0; r < rows; r++) {
+    const float* row = &x[(uint64_t)r * cols];
+    float absmax = 0;
+    for (uint32_t c = 0; c < cols; c++) {
+      absmax = std::max(absmax, std::fabs(row[c]));
+    }
+    scales[r] = Int8Scale(absmax);
+    int8_t* q_row = &q[(uint64_t)r * q_stride];
+    for (uint32_t c = 0; c < cols; c++) {
+      const float v = std::round(row[c] / scales[r]);
+      q_row[c] = (int8_t)std::min(127.0f, std::max(-127.0f, v));
+    }
+    std::fill(q_row + cols, q_row + q_stride, (int8_t)0);
+  }
+}
+
+std::unique_ptr<Tensor<float>> Int8Tensor(const uint32_t n, Runtime* runtime,
+                                          const int8_t* data) {
+  const uint32_t size = Int8Padded(n) / 4;
+  std::unique_ptr<Tensor<float>> ret(new Tensor<float>(1, &size, runtime));
+  if (data != nullptr) {
+    RASSERT(n % 4 == 0);
+    // Just the bytes, the floats are never interpreted as such.
+    ret->setData(reinterpret_cast<const float*>(data));
+  }
+  return ret;
+}
+
+float CalibrateAbsMax(const Tensor<float>& x, const float absmax) {
+  const float x_max = Tensor<float>::max(x);
+  const float x_min = Tensor<float>::min(x);
+  return std::max(absmax, std::max(x_max, -x_min));
+}
+
+}  // namespace jtorch
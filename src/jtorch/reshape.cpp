@@ -33,25 +33,38 @@ void Reshape::init(std::shared_ptr<TorchData> input) {
   RASSERT(input->type() == TorchDataType::TENSOR_DATA);
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
 
-  int32_t nelems = outNElem();
-  static_cast<void>(nelems);
+  // In batch mode (see forwardPropBatch()) each sample is reshaped, and the
+  // batch stays the outer dimension.
+  const uint32_t odim = batchMode() ? odim_ + 1 : odim_;
+  std::unique_ptr<uint32_t[]> osize(new uint32_t[odim]);
+  memcpy(osize.get(), osize_.get(), sizeof(osize[0]) * odim_);
+  if (batchMode()) {
+    RASSERT(in->dim() > 0);
+    osize[odim_] = in->size()[in->dim() - 1];
+  }
   // Check the input size.
-  RASSERT(in->nelems() == static_cast<uint32_t>(nelems));
+  RASSERT(in->nelems() ==
+          (uint64_t)outNElem() * (batchMode() ? osize[odim_] : 1));
 
   if (output != nullptr) {
     Tensor<float>* out = TO_TENSOR_PTR(output.get());
-    if (out->storage() != in->storage()) {
-      // The tensors don't share the same storage! Reinitialize the view.
+    if (out->storage() != in->storage() || out->offset() != in->offset() ||
+        out->dim() != odim || out->nelems() != in->nelems()) {
+      // The tensors don't share the same storage (or the batch size
+      // changed)! Reinitialize the view.
       output = nullptr;
     }
   }
 
   if (output == nullptr) {
-    output = Tensor<float>::view(*in, odim_, osize_.get());
+    output = Tensor<float>::view(*in, odim, osize.get());
   }
 }
 
 void Reshape::forwardProp(std::shared_ptr<TorchData> input) {
+  // The view keeps the input's storage format.
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+  input = contiguousInput(input, in != nullptr ? in->format() : format_);
   init(input);
   // Nothing to do.  init will initialize our tensor view that points to the
   // same storage as the input.
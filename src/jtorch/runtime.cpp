@@ -0,0 +1,215 @@
+#include "jtorch/runtime.h"
+
+#include "jcl/cl_include.h"  // Must come before clBLAS.h
+#include <clBLAS.h>
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+
+#include "jcl/opencl_context.h"
+#include "jcl/opencl_image_data.h"
+#include "jcl/opencl_kernel.h"
+#include "jtorch/jtorch.h"
+#include "jtorch/tensor.h"
+
+namespace jtorch {
+
+namespace {
+
+std::mutex runtimes_lock;
+std::unique_ptr<Runtime> default_runtime;
+uint64_t next_serial = 0;
+// clBLAS is set up once per process (it works with any context's queues), so
+// it is torn down with the last runtime.
+uint32_t num_blas_users = 0;
+
+// The calling thread's innermost Runtime::Scope.
+thread_local Runtime* current_runtime = nullptr;
+// The calling thread's device on each runtime (but the default runtime, see
+// jtorch::deviceid), keyed by serial.
+thread_local std::unordered_map<uint64_t, uint32_t> thread_deviceids;
+
+// Elementwise launches are split into chunks of at most this many elements.
+const uint64_t kMaxElementwiseLaunch = (uint64_t)1 << 30;
+
+}  // namespace
+
+Runtime::Runtime(const RuntimeOptions& options) {
+  use_images_ = false;
+  num_tensors_ = 0;
+
+  if (options.verbose_startup) {
+    std::cout << "Valid OpenCL devices attached:" << std::endl;
+    const uint32_t num_devices = jcl::OpenCLContext::printDevices();
+    static_cast<void>(num_devices);
+  }
+
+  jcl::CLDevice device = options.use_cpu ? jcl::CLDeviceCPU : jcl::CLDeviceGPU;
+  jcl::CLVendor vendor = jcl::CLVendorAny;
+
+  const bool device_exists =
+      jcl::OpenCLContext::queryDeviceExists(device, vendor);
+  if (!device_exists) {
+    if (options.use_cpu) {
+      std::cerr << "No CPU devices attached.";
+    } else {
+      std::cerr << "No GPU devices attached.";
+    }
+  }
+  RASSERT(device_exists);
+
+  // Otherwise, initialize the context.
+  context_.reset(new jcl::OpenCLContext());
+  uint32_t selected_deviceid = options.requested_deviceid;
+  if (options.select_fastest_device) {
+    device_scores_ = jcl::OpenCLContext::scoreDevices(device, vendor);
+    RASSERT(!device_scores_.empty());
+    if (options.verbose_startup) {
+      std::cout << "Device scores:" << std::endl;
+      for (const jcl::OpenCLDeviceScore& score : device_scores_) {
+        std::cout << "  " << score.name << " (" << score.platform_vendor
+                  << "): " << score.compute_units << " CUs @ "
+                  << score.clock_mhz << " MHz, " << score.calibration_gflops
+                  << " GFLOP/s, score " << score.score << std::endl;
+      }
+    }
+    context_->init(device_scores_[0], options.verbose_startup,
+                   options.out_of_order_queue, options.profile_kernels);
+    selected_deviceid = (uint32_t)context_->findDevice(device_scores_[0].id);
+  } else {
+    context_->init(device, vendor, options.verbose_startup,
+                   options.out_of_order_queue, options.profile_kernels);
+  }
+  context_->setProgramCacheDir(options.program_cache_dir);
+  if (!options.program_cache_dir.empty()) {
+    context_->setAutotuneFile(options.program_cache_dir + "/autotune.txt");
+  }
+
+  // Make sure the user is requesting a device id that exists.
+  RASSERT(selected_deviceid < context_->getNumDevices());
+  default_deviceid_ = selected_deviceid;
+
+  std::cout << "Jtorch is using device " << default_deviceid_ << ": "
+            << context_->getDeviceName(default_deviceid_) << std::endl;
+
+  std::lock_guard<std::mutex> lck(runtimes_lock);
+  serial_ = next_serial++;
+  if (num_blas_users == 0) {
+    // Startup clblas.
+    // TODO(tompson): I have NO idea what device ID this will run on.
+    const cl_int blas_ret = clblasSetup();
+    const bool blas_ok = (blas_ret == CL_SUCCESS);
+    if (!blas_ok) {
+      std::cout << "ERROR - Runtime: clblasSetup returned error: "
+                << jcl::OpenCLContext::getErrorString(blas_ret);
+    }
+    RASSERT(blas_ok);
+  }
+  num_blas_users++;
+}
+
+Runtime::~Runtime() {
+  // Note: If the following assertion is breaking, it means that you are not
+  // cleaning up your allocated tensors before shutting down the runtime.
+  RASSERT(num_tensors_ == 0);
+  std::lock_guard<std::mutex> lck(runtimes_lock);
+  num_blas_users--;
+  if (num_blas_users == 0) {
+    clblasTeardown();
+  }
+  context_.reset(nullptr);
+}
+
+Runtime* Runtime::Default() { return default_runtime.get(); }
+
+void Runtime::InitDefault(const RuntimeOptions& options) {
+  // Check we haven't already called init.
+  RASSERT(default_runtime == nullptr);
+  default_runtime.reset(new Runtime(options));
+}
+
+void Runtime::ShutdownDefault() { default_runtime.reset(nullptr); }
+
+Runtime* Runtime::Current() {
+  return current_runtime != nullptr ? current_runtime : default_runtime.get();
+}
+
+Runtime::Scope::Scope(Runtime* runtime) {
+  previous_ = current_runtime;
+  current_runtime = runtime;
+}
+
+Runtime::Scope::~Scope() { current_runtime = previous_; }
+
+uint32_t Runtime::deviceid() const {
+  if (this == default_runtime.get()) {
+    return jtorch::deviceid;
+  }
+  auto it = thread_deviceids.find(serial_);
+  return it != thread_deviceids.end() ? it->second : default_deviceid_;
+}
+
+void Runtime::setDeviceid(const uint32_t deviceid) {
+  RASSERT(deviceid < context_->getNumDevices());
+  if (this == default_runtime.get()) {
+    jtorch::deviceid = deviceid;
+  } else {
+    thread_deviceids[serial_] = deviceid;
+  }
+}
+
+void Runtime::sync() const {
+  // The context is thread-safe and we only wait on the calling thread's
+  // queue.
+  context_->sync(deviceid());
+}
+
+void Runtime::runElementwiseKernel(jcl::OpenCLKernel* kernel,
+                                   const uint32_t first_offset_arg,
+                                   const std::vector<uint64_t>& offsets,
+                                   const uint64_t nelems,
+                                   const bool index64) const {
+  for (uint64_t start = 0; start < nelems; start += kMaxElementwiseLaunch) {
+    for (uint32_t i = 0; i < offsets.size(); i++) {
+      const uint64_t offset = offsets[i] + start;
+      if (kernel != nullptr) {
+        SetIndexArg(kernel, first_offset_arg + i, offset, index64);
+      } else {
+        SetIndexArg(context_.get(), first_offset_arg + i, offset, index64);
+      }
+    }
+    const uint32_t dim = 1;
+    const uint32_t count =
+        (uint32_t)std::min<uint64_t>(nelems - start, kMaxElementwiseLaunch);
+    if (kernel != nullptr) {
+      context_->runKernel(kernel, deviceid(), dim, &count, false);
+    } else {
+      context_->runKernel(deviceid(), dim, &count, false);
+    }
+  }
+}
+
+bool Runtime::inputToImage(const Tensor<float>& input,
+                           std::shared_ptr<jcl::OpenCLImageData>* image) const {
+  // Images are float, so half inputs use the buffers.
+  if (!use_images_ || input.dim() != 3 || input.format() != FLOAT_STORAGE) {
+    return false;
+  }
+  const uint32_t width = input.size()[0];
+  const uint32_t height = input.size()[1];
+  const uint32_t depth = input.size()[2];
+  if (!context_->supportsImage3D(deviceid(), width, height, depth)) {
+    return false;
+  }
+  if (*image == nullptr || (*image)->width() != width ||
+      (*image)->height() != height || (*image)->depth() != depth) {
+    *image = context_->allocateImage(width, height, depth,
+                                     jcl::CLBufferTagScratch, deviceid());
+  }
+  context_->copyBufferToImage(deviceid(), input.storage(), input.offset(),
+                              *image);
+  return true;
+}
+
+}  // namespace jtorch
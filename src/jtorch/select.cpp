@@ -13,6 +13,7 @@ Select::Select(int dimension, int index) : TorchStage() {
   dimension_ = dimension;
   index_ = index;
   src_tensor_ = nullptr;
+  src_batch_ = false;
 }
 
 Select::~Select() {}
@@ -20,16 +21,17 @@ Select::~Select() {}
 void Select::forwardProp(std::shared_ptr<TorchData> input) {
   RASSERT(input->type() == TorchDataType::TENSOR_DATA);
 
-  // For now we only support the Select operation along the outer dimension.
-  // In torch indexing this is always 1.
-  RASSERT(this->dimension_ == 1);
-
-  if (src_tensor_ != input.get()) {
+  if (src_tensor_ != input.get() || src_batch_ != batchMode()) {
     // Only create the tensor slice if the input has changed.
     src_tensor_ = TO_TENSOR_PTR(input.get());
-
-    // Note the index is torch 1-indexed.
-    output = Tensor<float>::selectOuterDim(*src_tensor_, this->index_ - 1);
+    src_batch_ = batchMode();
+
+    // Note the dimension and index are torch 1-indexed, with dimension 1
+    // being the outer dimension (see Narrow).
+    const uint32_t sample_dim = sampleDim(*src_tensor_);
+    RASSERT(this->dimension_ >= 1 && this->dimension_ <= (int)sample_dim);
+    const uint32_t dim = sample_dim - (uint32_t)this->dimension_;
+    output = Tensor<float>::select(*src_tensor_, dim, this->index_ - 1);
   }
 }
 
@@ -1,5 +1,8 @@
 #include "jtorch/sequential.h"
 
+#include "jcl/opencl_capture.h"
+#include "jcl/opencl_context.h"
+#include "jtorch/jtorch.h"
 #include "jtorch/tensor.h"
 
 using namespace jcl::threading;
@@ -7,7 +10,13 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-Sequential::Sequential() { output = nullptr; }
+Sequential::Sequential() {
+  output = nullptr;
+  capture_enabled_ = false;
+  capture_offset_ = 0;
+  capture_format_ = FLOAT_STORAGE;
+  capture_batch_ = false;
+}
 
 Sequential::~Sequential() {}
 
@@ -30,7 +39,99 @@ std::unique_ptr<TorchStage> Sequential::loadFromFile(std::ifstream& file) {
   return std::unique_ptr<TorchStage>(std::move(ret));
 }
 
+void Sequential::setCaptureEnabled(const bool enabled) {
+  capture_enabled_ = enabled;
+  capture_.reset();
+  capture_size_.clear();
+  capture_storage_ = nullptr;
+}
+
+bool Sequential::captured() const {
+  return capture_ != nullptr && capture_->valid();
+}
+
+void Sequential::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  for (const auto& stage : network_) {
+    stage->getPrograms(programs);
+  }
+}
+
+void Sequential::calibrate(const bool calibrating) {
+  // Replays would skip the stages' forwardProp, which records the ranges.
+  setCaptureEnabled(capture_enabled_);
+  for (const auto& stage : network_) {
+    stage->calibrate(calibrating);
+  }
+}
+
+void Sequential::quantize() {
+  // The capture (if any) launches the float kernels.
+  setCaptureEnabled(capture_enabled_);
+  for (const auto& stage : network_) {
+    stage->quantize();
+  }
+}
+
 void Sequential::forwardProp(std::shared_ptr<TorchData> input) {
+  // Nested captures aren't supported (but an enclosing capture records this
+  // model's launches anyway).  Captures are keyed on the input's size, offset
+  // and storage format (and on batch mode) only, so strided views of the
+  // input always run uncaptured.
+  if (!capture_enabled_ || input->type() != TorchDataType::TENSOR_DATA ||
+      !TO_TENSOR_PTR(input.get())->isContiguous() || context()->capturing()) {
+    forwardPropStages(input);
+    return;
+  }
+
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+  const std::vector<uint32_t> size(in->size(), in->size() + in->dim());
+  if (size != capture_size_ || in->offset() != capture_offset_ ||
+      in->format() != capture_format_ || batchMode() != capture_batch_) {
+    // New shape: let the stages (re)allocate, and capture next time.
+    capture_.reset();
+    capture_size_ = size;
+    capture_offset_ = in->offset();
+    capture_format_ = in->format();
+    capture_batch_ = batchMode();
+    capture_storage_ = nullptr;
+    forwardPropStages(input);
+    return;
+  }
+
+  if (capture_ == nullptr) {
+    context()->beginCapture();
+    forwardPropStages(input);
+    capture_ = context()->endCapture();
+    capture_storage_ = in->storage();
+    return;
+  }
+
+  if (!capture_->valid()) {
+    forwardPropStages(input);
+    return;
+  }
+
+  if (in->storage() != capture_storage_) {
+    // If the output is a view of the input (ie the model ends in a Reshape of
+    // its input) it would still point at the old storage, so recapture.
+    if (output->type() == TorchDataType::TENSOR_DATA &&
+        TO_TENSOR_PTR(output.get())->storage() == capture_storage_) {
+      capture_.reset();
+      forwardPropStages(input);
+      return;
+    }
+    // The captured commands only touch the input's elements (the key has
+    // its offset and size), so a smaller storage is fine as long as it
+    // holds them.
+    capture_->rebindBuffer(capture_storage_, in->storage(),
+                           in->offset() + in->nelems());
+    capture_storage_ = in->storage();
+  }
+  context()->replay(capture_.get());
+}
+
+void Sequential::forwardPropStages(std::shared_ptr<TorchData> input) {
   RASSERT(network_.size() > 0);
   network_[0]->forwardProp(input);
   for (uint32_t i = 1; i < network_.size(); i++) {
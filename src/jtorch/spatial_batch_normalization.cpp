@@ -10,56 +10,73 @@ using namespace jcl;
 
 namespace jtorch {
 
-static const char* kSpatialBatchNormalizationKernel =
+static const char* kSpatialBatchNormalizationKernel = JTORCH_INDEX_PRELUDE
 "    __kernel void SpatialBatchNormalizationAffine(\n"
-"      const __global float* input,         /* 0 */\n"
-"      const __global float* running_mean,  /* 1 */\n"
-"      const __global float* running_std,   /* 2 */\n"
-"      __global  float* output,             /* 3 */\n"
-"      const __global float* weights,       /* 4 */\n"
-"      const __global float* biases) {      /* 5 */\n"
+"      const __global STORAGE_T* input,         /* 0 */\n"
+"      const __global STORAGE_T* running_mean,  /* 1 */\n"
+"      const __global STORAGE_T* running_std,   /* 2 */\n"
+"      __global  STORAGE_T* output,             /* 3 */\n"
+"      const __global STORAGE_T* weights,       /* 4 */\n"
+"      const __global STORAGE_T* biases,        /* 5 */\n"
+"      const INDEX_T input_offset,              /* 6 */\n"
+"      const int nfeats) {                      /* 7 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
 "\n"
 "      const int x = get_global_id(0);\n"
 "      const int y = get_global_id(1);\n"
-"      const int f = get_global_id(2);\n"
+"      const int plane = get_global_id(2);  /* feature and sample */\n"
+"      const int f = plane % nfeats;\n"
 "\n"
-"      const int i = x + width * (y + height * f);\n"
+"      const INDEX_T i =\n"
+"        x + width * (y + height * (INDEX_T)plane);\n"
 "\n"
-"      output[i] = (input[i] - running_mean[f]) * running_std[f] * weights[f] +\n"
-"                  biases[f];\n"
+"      const float x = (LOAD(input, i) - LOAD(running_mean, f)) *\n"
+"        LOAD(running_std, f);\n"
+"      STORE(x * LOAD(weights, f) + LOAD(biases, f), output, i);\n"
 "    };\n"
 "\n"
 "    __kernel void SpatialBatchNormalization(\n"
-"      const __global float* input,         /* 0 */\n"
-"      const __global float* running_mean,  /* 1 */\n"
-"      const __global float* running_std,   /* 2 */\n"
-"      __global  float* output) {           /* 3 */\n"
+"      const __global STORAGE_T* input,         /* 0 */\n"
+"      const __global STORAGE_T* running_mean,  /* 1 */\n"
+"      const __global STORAGE_T* running_std,   /* 2 */\n"
+"      __global  STORAGE_T* output,             /* 3 */\n"
+"      const INDEX_T input_offset,              /* 4 */\n"
+"      const int nfeats) {                      /* 5 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
 "\n"
 "      const int x = get_global_id(0);\n"
 "      const int y = get_global_id(1);\n"
-"      const int f = get_global_id(2);\n"
+"      const int plane = get_global_id(2);  /* feature and sample */\n"
+"      const int f = plane % nfeats;\n"
 "\n"
-"      const int i = x + width * (y + height * f);\n"
+"      const INDEX_T i =\n"
+"        x + width * (y + height * (INDEX_T)plane);\n"
 "\n"
-"      output[i] = (input[i] - running_mean[f]) * running_std[f];\n"
+"      STORE((LOAD(input, i) - LOAD(running_mean, f)) * LOAD(running_std, f),\n"
+"            output, i);\n"
 "    };";
 
 SpatialBatchNormalization::SpatialBatchNormalization(const bool affine, 
   const uint32_t nfeats) : TorchStage() {
   affine_ = affine;
   nfeats_ = nfeats;
+  index64_ = false;
   const uint32_t dim = 1;
   const uint32_t size[dim] = {nfeats};
-  weights_.reset(new Tensor<float>(dim, size));
-  biases_.reset(new Tensor<float>(dim, size));
-  running_mean_.reset(new Tensor<float>(dim, size));
-  running_std_.reset(new Tensor<float>(dim, size));
+  weights_.reset(new Tensor<float>(dim, size, runtime_, format_));
+  weights_->storage()->setTag(jcl::CLBufferTagWeights);
+  biases_.reset(new Tensor<float>(dim, size, runtime_, format_));
+  biases_->storage()->setTag(jcl::CLBufferTagWeights);
+  running_mean_.reset(new Tensor<float>(dim, size, runtime_, format_));
+  running_mean_->storage()->setTag(jcl::CLBufferTagWeights);
+  running_std_.reset(new Tensor<float>(dim, size, runtime_, format_));
+  running_std_->storage()->setTag(jcl::CLBufferTagWeights);
 }
 
 SpatialBatchNormalization::~SpatialBatchNormalization() {}
@@ -77,42 +94,64 @@ void SpatialBatchNormalization::init(std::shared_ptr<TorchData> input) {
     output = nullptr;
   }
 
-  // Check that the input and output size are the same.
-  if (output != nullptr) {
-    if (in->size()[0] != out->size()[0] ||
-        in->size()[1] != out->size()[1] ||
-        in->size()[2] != out->size()[2]) {
-      output = nullptr;
-    }
+  // Check that the input and output size are the same (the dimensions above
+  // the features are the samples of a batch, see forwardPropBatch()).
+  if (output != nullptr && !in->isSameSizeAs(*out)) {
+    output = nullptr;
   }
 
   if (output == nullptr) {
-    output.reset(new Tensor<float>(in->dim(), in->size()));
+    output.reset(
+        new Tensor<float>(in->dim(), in->size(), runtime_, format_));
+  }
+
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (kernel_ == nullptr || index64 != index64_) {
+    if (affine_) {
+      kernel_ = context()->getKernelCStr(kSpatialBatchNormalizationKernel,
+                                         "SpatialBatchNormalizationAffine",
+                                         KernelDefines(index64, format_));
+    } else {
+      kernel_ = context()->getKernelCStr(kSpatialBatchNormalizationKernel,
+                                         "SpatialBatchNormalization",
+                                         KernelDefines(index64, format_));
+    }
+    index64_ = index64;
   }
 }
 
+void SpatialBatchNormalization::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back(
+      {kSpatialBatchNormalizationKernel, KernelDefines(false, format_), false});
+}
+
 void SpatialBatchNormalization::forwardProp(std::shared_ptr<TorchData> input) {
+  input = contiguousInput(input, format_);
   init(input);
 
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
   Tensor<float>* out = TO_TENSOR_PTR(output.get());
+  kernel_->setArg(0, in->storage());
+  kernel_->setArg(1, TO_TENSOR_PTR(running_mean_.get())->storage());
+  kernel_->setArg(2, TO_TENSOR_PTR(running_std_.get())->storage());
+  kernel_->setArg(3, out->storage());
   if (affine_) {
-    cl_context->useKernelCStr(kSpatialBatchNormalizationKernel,
-                              "SpatialBatchNormalizationAffine");
+    kernel_->setArg(4, TO_TENSOR_PTR(weights_.get())->storage());
+    kernel_->setArg(5, TO_TENSOR_PTR(biases_.get())->storage());
+    SetIndexArg(kernel_.get(), 6, in->offset(), index64_);
+    kernel_->setArg(7, (int)nfeats_);
   } else {
-    cl_context->useKernelCStr(kSpatialBatchNormalizationKernel,
-                              "SpatialBatchNormalization");
+    SetIndexArg(kernel_.get(), 4, in->offset(), index64_);
+    kernel_->setArg(5, (int)nfeats_);
   }
-  cl_context->setArg(0, in->storage());
-  cl_context->setArg(1, TO_TENSOR_PTR(running_mean_.get())->storage());
-  cl_context->setArg(2, TO_TENSOR_PTR(running_std_.get())->storage());
-  cl_context->setArg(3, out->storage());
-  if (affine_) {
-    cl_context->setArg(4, TO_TENSOR_PTR(weights_.get())->storage());
-    cl_context->setArg(5, TO_TENSOR_PTR(biases_.get())->storage());
+  uint32_t global_size[3] = {out->size()[0], out->size()[1], 1};
+  for (uint32_t i = 2; i < out->dim(); i++) {
+    global_size[2] *= out->size()[i];
   }
-  cl_context->runKernel(jtorch::deviceid, TO_TENSOR_PTR(output.get())->dim(),
-                        TO_TENSOR_PTR(output.get())->size(), false);
+  context()->runKernelAutotuned(kernel_.get(), deviceid(), 3, global_size,
+                                false);
 }
 
 std::unique_ptr<TorchStage> SpatialBatchNormalization::loadFromFile(
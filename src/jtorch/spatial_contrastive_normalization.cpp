@@ -27,7 +27,7 @@ SpatialContrastiveNormalization::SpatialContrastiveNormalization(
   } else {
     uint32_t dim = 1;
     uint32_t size = 7;
-    kernel.reset(new Tensor<float>(dim, &size));
+    kernel.reset(new Tensor<float>(dim, &size, runtime_));
     Tensor<float>::fill(*kernel.get(), 1);
   }
 
@@ -40,6 +40,11 @@ SpatialContrastiveNormalization::SpatialContrastiveNormalization(
 
 SpatialContrastiveNormalization::~SpatialContrastiveNormalization() {}
 
+void SpatialContrastiveNormalization::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  network_->getPrograms(programs);
+}
+
 void SpatialContrastiveNormalization::forwardProp(
     std::shared_ptr<TorchData> input) {
   network_->forwardProp(input);
@@ -1,6 +1,7 @@
 #include "jtorch/spatial_convolution.h"
 
 #include <cstring>
+#include <string>
 
 #include "jcl/threading/callback.h"
 #include "jcl/threading/thread.h"
@@ -14,17 +15,35 @@ using namespace jcl;
 
 namespace jtorch {
 
-static const char* kSpatialConvolutionKernel =
+static const char* kSpatialConvolutionKernel = JTORCH_INDEX_PRELUDE
+"    /* Shape parameters.  Stages compile a specialized program with these */\n"
+"    /* defined as constants (so that the filter loops can be unrolled), */\n"
+"    /* otherwise they fall back to the kernel arguments. */\n"
+"    #ifndef INPUT_NFEATS\n"
+"      #define INPUT_NFEATS input_nfeats\n"
+"    #endif\n"
+"    #ifndef FILT_HEIGHT\n"
+"      #define FILT_HEIGHT filt_height\n"
+"    #endif\n"
+"    #ifndef FILT_WIDTH\n"
+"      #define FILT_WIDTH filt_width\n"
+"    #endif\n"
+"    #ifndef PADDING\n"
+"      #define PADDING padding\n"
+"    #endif\n"
+"\n"
 "    __kernel void SpatialConvolution(\n"
-"      const __global  float* input,  /* 0 */\n"
-"      __global  float* output,       /* 1 */\n"
-"      const __global float* weights, /* 2 */\n"
-"      const __global float* biases,  /* 3 */\n"
-"      const int input_nfeats,        /* 4 */\n"
-"      const int input_height,        /* 5 */\n"
-"      const int input_width,         /* 6 */\n"
-"      const int filt_height,         /* 7 */\n"
-"      const int filt_width) {        /* 8 */\n"
+"      const __global STORAGE_T* input,    /* 0 */\n"
+"      __global STORAGE_T* output,         /* 1 */\n"
+"      const __global STORAGE_T* weights,  /* 2 */\n"
+"      const __global STORAGE_T* biases,   /* 3 */\n"
+"      const int input_nfeats,             /* 4 */\n"
+"      const int input_height,             /* 5 */\n"
+"      const int input_width,              /* 6 */\n"
+"      const int filt_height,              /* 7 */\n"
+"      const int filt_width,               /* 8 */\n"
+"      const INDEX_T input_offset) {       /* 9 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -37,44 +56,48 @@ static const char* kSpatialConvolutionKernel =
 "      const int yInTopLeft = y_out;\n"
 "\n"
 "      /* Initilize the output to the bias */\n"
-"      float sum = biases[f_out];\n"
+"      float sum = LOAD(biases, f_out);\n"
 "\n"
-"      const int filt_size = filt_height * filt_width;\n"
-"      const int filt_size_per_fout = input_nfeats * filt_size;\n"
-"      const int in_size = input_width * input_height;\n"
-"      for (int f = 0; f < input_nfeats; f++) {\n"
+"      const int filt_size = FILT_HEIGHT * FILT_WIDTH;\n"
+"      const int filt_size_per_fout = INPUT_NFEATS * filt_size;\n"
+"      const INDEX_T in_size = input_width * input_height;\n"
+"      for (int f = 0; f < INPUT_NFEATS; f++) {\n"
 "        /* Get a pointer to the current weight matrix and input feature */\n"
 "        /* THIS COULD BE FASTER --> STRIPE WEIGHTS MATRIX FOR BETTER DATA ACCESS! */\n"
-"        const __global  float* pkernel = &weights[f_out * filt_size_per_fout + f * filt_size];\n"
-"        const __global  float* pinput = &input[f * in_size];\n"
+"        const __global STORAGE_T* pkernel =\n"
+"          weights + f_out * filt_size_per_fout + f * filt_size;\n"
+"        const __global STORAGE_T* pinput = input + f * in_size;\n"
 "\n"
 "        /* Perform the convolution on this input feature */\n"
-"        for (int r = 0; r < filt_height; r++) {\n"
-"          const int idxFtmp = r * filt_width;\n"
+"        for (int r = 0; r < FILT_HEIGHT; r++) {\n"
+"          const int idxFtmp = r * FILT_WIDTH;\n"
 "          const int yIn = yInTopLeft + r;\n"
 "          const int idxIntmp = yIn * input_width + xInTopLeft;\n"
-"          for (int c = 0; c < filt_width; c++) {\n"
+"          for (int c = 0; c < FILT_WIDTH; c++) {\n"
 "            const int idxF  = idxFtmp  + c;\n"
 "            const int idxIn = idxIntmp + c;\n"
-"            sum += pkernel[idxF] * pinput[idxIn];\n"
+"            sum += LOAD(pkernel, idxF) * LOAD(pinput, idxIn);\n"
 "          }\n"
 "        }\n"
 "      }\n"
-"      const int iout = x_out + width * (y_out + height * f_out);\n"
-"      output[iout] = sum;\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      STORE(sum, output, iout);\n"
 "    }\n"
 "\n"
 "    __kernel void SpatialConvolutionPadding(\n"
-"      const __global  float* input,   /* 0 */\n"
-"      __global  float* output,        /* 1 */\n"
-"      const __global float* weights,  /* 2 */\n"
-"      const __global float* biases,   /* 3 */\n"
-"      const int input_nfeats,         /* 4 */\n"
-"      const int input_height,         /* 5 */\n"
-"      const int input_width,          /* 6 */\n"
-"      const int filt_height,          /* 7 */\n"
-"      const int filt_width,           /* 8 */\n"
-"      const int padding) {            /* 9 */\n"
+"      const __global STORAGE_T* input,    /* 0 */\n"
+"      __global STORAGE_T* output,         /* 1 */\n"
+"      const __global STORAGE_T* weights,  /* 2 */\n"
+"      const __global STORAGE_T* biases,   /* 3 */\n"
+"      const int input_nfeats,             /* 4 */\n"
+"      const int input_height,             /* 5 */\n"
+"      const int input_width,              /* 6 */\n"
+"      const int filt_height,              /* 7 */\n"
+"      const int filt_width,               /* 8 */\n"
+"      const int padding,                  /* 9 */\n"
+"      const INDEX_T input_offset) {       /* 10 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -86,40 +109,102 @@ static const char* kSpatialConvolutionKernel =
 "      const int xInTopLeft = x_out;\n"
 "      const int yInTopLeft = y_out;\n"
 "\n"
-"      const int pad_left_top = padding;\n"
+"      const int pad_left_top = PADDING;\n"
 "\n"
 "      /* Initilize the output to the bias */\n"
-"      float sum = biases[f_out];\n"
+"      float sum = LOAD(biases, f_out);\n"
 "\n"
-"      const int filt_size = filt_height * filt_width;\n"
-"      const int filt_size_per_fout = input_nfeats * filt_size;\n"
-"      const int in_size = input_width * input_height;\n"
-"      for (int f = 0; f < input_nfeats; f++) {\n"
+"      const int filt_size = FILT_HEIGHT * FILT_WIDTH;\n"
+"      const int filt_size_per_fout = INPUT_NFEATS * filt_size;\n"
+"      const INDEX_T in_size = input_width * input_height;\n"
+"      for (int f = 0; f < INPUT_NFEATS; f++) {\n"
 "        /* Get a pointer to the current weight matrix and input feature */\n"
 "        /* THIS COULD BE FASTER --> STRIPE WEIGHTS MATRIX FOR BETTER DATA ACCESS! */\n"
-"        const __global  float* pkernel = &weights[f_out * filt_size_per_fout + f * filt_size];\n"
-"        const __global  float* pinput = &input[f * in_size];\n"
+"        const __global STORAGE_T* pkernel =\n"
+"          weights + f_out * filt_size_per_fout + f * filt_size;\n"
+"        const __global STORAGE_T* pinput = input + f * in_size;\n"
 "\n"
 "        /* Perform the convolution on this input feature */\n"
-"        for (int r = 0; r < filt_height; r++) {\n"
-"          const int idxFtmp = r * filt_width;\n"
+"        for (int r = 0; r < FILT_HEIGHT; r++) {\n"
+"          const int idxFtmp = r * FILT_WIDTH;\n"
 "          const int yIn = yInTopLeft + r - pad_left_top;\n"
 "          const int idxIntmp = yIn * input_width;\n"
 "\n"
 "          if (yIn >= 0 && yIn < input_height) {\n"
-"            for (int c = 0; c < filt_width; c++) {\n"
+"            for (int c = 0; c < FILT_WIDTH; c++) {\n"
 "              const int idxF  = idxFtmp  + c;\n"
 "              const int xIn = xInTopLeft + c - pad_left_top;\n"
 "              if (xIn >= 0 && xIn < input_width) {\n"
 "                const int idxIn = idxIntmp + xIn;\n"
-"                sum += pkernel[idxF] * pinput[idxIn];\n"
+"                sum += LOAD(pkernel, idxF) * LOAD(pinput, idxIn);\n"
 "              }\n"
 "            }\n"
 "          }\n"
 "        }\n"
 "      }\n"
-"      const int iout = x_out + width * (y_out + height * f_out);\n"
-"      output[iout] = sum;\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      STORE(sum, output, iout);\n"
+"    }";
+
+// Reads the input through an image (see Runtime::inputToImage()).  The clamp
+// sampler returns zero outside of the image, which is the zero padding, so the
+// same kernel handles any padding without bounds checks.  This is a separate
+// program so that devices without image support never compile it.
+static const char* kSpatialConvolutionImageKernel = JTORCH_INDEX_PRELUDE
+"    #ifndef INPUT_NFEATS\n"
+"      #define INPUT_NFEATS input_nfeats\n"
+"    #endif\n"
+"    #ifndef FILT_HEIGHT\n"
+"      #define FILT_HEIGHT filt_height\n"
+"    #endif\n"
+"    #ifndef FILT_WIDTH\n"
+"      #define FILT_WIDTH filt_width\n"
+"    #endif\n"
+"    #ifndef PADDING\n"
+"      #define PADDING padding\n"
+"    #endif\n"
+"\n"
+"    __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |\n"
+"      CLK_ADDRESS_CLAMP | CLK_FILTER_NEAREST;\n"
+"\n"
+"    __kernel void SpatialConvolutionImage(\n"
+"      __read_only image3d_t input,        /* 0 */\n"
+"      __global STORAGE_T* output,         /* 1 */\n"
+"      const __global STORAGE_T* weights,  /* 2 */\n"
+"      const __global STORAGE_T* biases,   /* 3 */\n"
+"      const int input_nfeats,             /* 4 */\n"
+"      const int filt_height,              /* 5 */\n"
+"      const int filt_width,               /* 6 */\n"
+"      const int padding) {                /* 7 */\n"
+"      const int width = get_global_size(0);\n"
+"      const int height = get_global_size(1);\n"
+"\n"
+"      const int x_out = get_global_id(0);\n"
+"      const int y_out = get_global_id(1);\n"
+"      const int f_out = get_global_id(2);\n"
+"      const int xInTopLeft = x_out - PADDING;\n"
+"      const int yInTopLeft = y_out - PADDING;\n"
+"\n"
+"      /* Initilize the output to the bias */\n"
+"      float sum = LOAD(biases, f_out);\n"
+"\n"
+"      const int filt_size = FILT_HEIGHT * FILT_WIDTH;\n"
+"      const int filt_size_per_fout = INPUT_NFEATS * filt_size;\n"
+"      for (int f = 0; f < INPUT_NFEATS; f++) {\n"
+"        const __global STORAGE_T* pkernel =\n"
+"          weights + f_out * filt_size_per_fout + f * filt_size;\n"
+"        for (int r = 0; r < FILT_HEIGHT; r++) {\n"
+"          for (int c = 0; c < FILT_WIDTH; c++) {\n"
+"            const int4 pos = (int4)(xInTopLeft + c, yInTopLeft + r, f, 0);\n"
+"            sum += LOAD(pkernel, r * FILT_WIDTH + c) *\n"
+"                   read_imagef(input, sampler, pos).x;\n"
+"          }\n"
+"        }\n"
+"      }\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      STORE(sum, output, iout);\n"
 "    }";
 
 SpatialConvolution::SpatialConvolution(const uint32_t feats_in,
@@ -133,13 +218,16 @@ SpatialConvolution::SpatialConvolution(const uint32_t feats_in,
   feats_in_ = feats_in;
   feats_out_ = feats_out;
   padding_ = padding;
+  index64_ = false;
 
   output = nullptr;
 
   uint32_t dim = 4;
   uint32_t size[4] = {filt_width_, filt_height_, feats_in_, feats_out_};
-  weights_.reset(new Tensor<float>(dim, size));
-  biases_.reset(new Tensor<float>(1, &feats_out_));
+  weights_.reset(new Tensor<float>(dim, size, runtime_, format_));
+  weights_->storage()->setTag(jcl::CLBufferTagWeights);
+  biases_.reset(new Tensor<float>(1, &feats_out_, runtime_, format_));
+  biases_->storage()->setTag(jcl::CLBufferTagWeights);
 }
 
 SpatialConvolution::~SpatialConvolution() {}
@@ -173,33 +261,91 @@ void SpatialConvolution::init(std::shared_ptr<TorchData> input) {
     out_dim[0] = in->size()[0] - filt_width_ + 1 + 2 * padding_;
     out_dim[1] = in->size()[1] - filt_height_ + 1 + 2 * padding_;
     out_dim[2] = feats_out_;
-    output.reset(new Tensor<float>(3, out_dim));
+    output.reset(new Tensor<float>(3, out_dim, runtime_, format_));
+  }
+
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (kernel_ == nullptr || index64 != index64_) {
+    const jcl::OpenCLDefines defines = programDefines(index64);
+    if (padding_ > 0) {
+      kernel_ = context()->getKernelCStr(kSpatialConvolutionKernel,
+                                         "SpatialConvolutionPadding", defines);
+    } else {
+      kernel_ = context()->getKernelCStr(kSpatialConvolutionKernel,
+                                         "SpatialConvolution", defines);
+    }
+    image_kernel_ = nullptr;
+    index64_ = index64;
+  }
+  if (image_kernel_ == nullptr && runtime_->useImages()) {
+    image_kernel_ = context()->getKernelCStr(kSpatialConvolutionImageKernel,
+                                             "SpatialConvolutionImage",
+                                             programDefines(index64));
+  }
+}
+
+jcl::OpenCLDefines SpatialConvolution::programDefines(
+    const bool index64) const {
+  // The filter shape is fixed, so compile it in.
+  jcl::OpenCLDefines defines = KernelDefines(index64, format_);
+  defines["INPUT_NFEATS"] = std::to_string(feats_in_);
+  defines["FILT_HEIGHT"] = std::to_string(filt_height_);
+  defines["FILT_WIDTH"] = std::to_string(filt_width_);
+  defines["PADDING"] = std::to_string(padding_);
+  return defines;
+}
+
+void SpatialConvolution::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back({kSpatialConvolutionKernel, programDefines(), false});
+  if (UseImages()) {
+    programs->push_back(
+        {kSpatialConvolutionImageKernel, programDefines(), false});
   }
 }
 
 void SpatialConvolution::forwardProp(std::shared_ptr<TorchData> input) {
+  // The samples of a batch are convolved one at a time.
+  if (forwardPropSamples(input, 3)) {
+    return;
+  }
+  input = contiguousInput(input, format_);
   init(input);
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
-  if (padding_ > 0) {
-    cl_context->useKernelCStr(kSpatialConvolutionKernel, "SpatialConvolutionPadding");
-  } else {
-    cl_context->useKernelCStr(kSpatialConvolutionKernel, "SpatialConvolution");
+  if (image_kernel_ != nullptr &&
+      runtime_->inputToImage(*in, &input_image_)) {
+    image_kernel_->setArg(0, input_image_);
+    image_kernel_->setArg(1, TO_TENSOR_PTR(output.get())->storage());
+    image_kernel_->setArg(2, weights_->storage());
+    image_kernel_->setArg(3, biases_->storage());
+    image_kernel_->setArg(4, (int)feats_in_);
+    image_kernel_->setArg(5, (int)filt_height_);
+    image_kernel_->setArg(6, (int)filt_width_);
+    image_kernel_->setArg(7, (int)padding_);
+    context()->runKernelAutotuned(image_kernel_.get(), deviceid(), 3,
+                                  TO_TENSOR_PTR(output.get())->size(),
+                                  false);
+    return;
   }
-  cl_context->setArg(0, in->storage());
-  cl_context->setArg(1, TO_TENSOR_PTR(output.get())->storage());
-  cl_context->setArg(2, weights_->storage());
-  cl_context->setArg(3, biases_->storage());
-  cl_context->setArg(4, (int)in->size()[2]);
-  cl_context->setArg(5, (int)in->size()[1]);
-  cl_context->setArg(6, (int)in->size()[0]);
-  cl_context->setArg(7, (int)filt_height_);
-  cl_context->setArg(8, (int)filt_width_);
+  kernel_->setArg(0, in->storage());
+  kernel_->setArg(1, TO_TENSOR_PTR(output.get())->storage());
+  kernel_->setArg(2, weights_->storage());
+  kernel_->setArg(3, biases_->storage());
+  kernel_->setArg(4, (int)in->size()[2]);
+  kernel_->setArg(5, (int)in->size()[1]);
+  kernel_->setArg(6, (int)in->size()[0]);
+  kernel_->setArg(7, (int)filt_height_);
+  kernel_->setArg(8, (int)filt_width_);
   if (padding_ > 0) {
-    cl_context->setArg(9, (int)padding_);
+    kernel_->setArg(9, (int)padding_);
+    SetIndexArg(kernel_.get(), 10, in->offset(), index64_);
+  } else {
+    SetIndexArg(kernel_.get(), 9, in->offset(), index64_);
   }
   uint32_t dim = 3;
-  cl_context->runKernel(jtorch::deviceid, dim,
-                        TO_TENSOR_PTR(output.get())->size(), false);
+  context()->runKernelAutotuned(kernel_.get(), deviceid(), dim,
+                                TO_TENSOR_PTR(output.get())->size(), false);
 }
 
 std::unique_ptr<TorchStage> SpatialConvolution::loadFromFile(
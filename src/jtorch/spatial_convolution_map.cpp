@@ -67,7 +67,8 @@ void SpatialConvolutionMap::init(std::shared_ptr<TorchData> input) {
     out_dim[0] = in->size()[0] - filt_width_ + 1;
     out_dim[1] = in->size()[1] - filt_height_ + 1;
     out_dim[2] = feats_out_;
-    output.reset(new Tensor<float>(3, out_dim));
+    // Half outputs are converted by setData() (see forwardProp()).
+    output.reset(new Tensor<float>(3, out_dim, runtime_, format_));
     input_cpu_.reset(new float[in->nelems()]);
     output_cpu_.reset(new float[TO_TENSOR_PTR(output.get())->nelems()]);
   }
@@ -84,6 +85,10 @@ void SpatialConvolutionMap::init(std::shared_ptr<TorchData> input) {
 }
 
 void SpatialConvolutionMap::forwardProp(std::shared_ptr<TorchData> input) {
+  // The samples of a batch are convolved one at a time.
+  if (forwardPropSamples(input, 3)) {
+    return;
+  }
   init(input);
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
   Tensor<float>* out = TO_TENSOR_PTR(output.get());
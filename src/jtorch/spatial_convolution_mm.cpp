@@ -2,11 +2,14 @@
 
 #include "jcl/cl_include.h"  // Must come before clBLAS.h
 #include <clBLAS.h>
+#include <algorithm>
 #include <cstring>
 #include <string>
+#include <vector>
 
 #include "jtorch/tensor.h"
 #include "jtorch/jtorch.h"
+#include "jtorch/quantization.h"
 
 using namespace jcl::threading;
 using namespace jcl::math;
@@ -14,58 +17,160 @@ using namespace jcl;
 
 namespace jtorch {
 
-static const char* kSpatialConvolutionMMKernel =
-"#define CUDA_KERNEL_LOOP(i, n)                                        "
-"  for (int i = get_group_id(0) * get_local_size(0) + get_local_id(0); "
-"      i < (n);                                                        "
+static const char* kSpatialConvolutionMMKernel = JTORCH_INDEX_PRELUDE
+"#define CUDA_KERNEL_LOOP(i, n)                                            "
+"  for (INDEX_T i = get_group_id(0) * get_local_size(0) + get_local_id(0); "
+"      i < (n);                                                            "
 "      i += get_local_size(0) * get_num_groups(0))\n\n"
 "\n"
-"/* Kernel for fast unfold+copy */\n"
-"__kernel void im2col_kernel(const int n,                    /* 0 */\n"
-"                            const __global float* data_im,  /* 1 */\n"
-"                            const int height,               /* 2 */\n"
-"                            const int width,                /* 3 */\n"
-"                            const int ksize_h,              /* 4 */\n"
-"                            const int ksize_w,              /* 5 */\n"
-"                            const int pad_h,                /* 6 */\n"
-"                            const int pad_w,                /* 7 */\n"
-"                            const int stride_h,             /* 8 */\n"
-"                            const int stride_w,             /* 9 */\n"
-"                            const int height_col,           /* 10 */\n"
-"                            const int width_col,            /* 11 */\n"
-"                            __global float* data_col) {     /* 12 */\n"
+"/* Kernel for fast unfold+copy.  The columns of the samples of a batch are\n"
+" * side by side: each row holds batch * height_col * width_col values.\n"
+" * The input is in the stage's storage format, the columns are float.\n"
+" * Large inputs take more than one loop iteration per work item. */\n"
+"__kernel void im2col_kernel(const INDEX_T n,                    /* 0 */\n"
+"                            const __global STORAGE_T* data_im,  /* 1 */\n"
+"                            const int height,                   /* 2 */\n"
+"                            const int width,                    /* 3 */\n"
+"                            const int ksize_h,                  /* 4 */\n"
+"                            const int ksize_w,                  /* 5 */\n"
+"                            const int pad_h,                    /* 6 */\n"
+"                            const int pad_w,                    /* 7 */\n"
+"                            const int stride_h,                 /* 8 */\n"
+"                            const int stride_w,                 /* 9 */\n"
+"                            const int height_col,               /* 10 */\n"
+"                            const int width_col,                /* 11 */\n"
+"                            __global float* data_col,           /* 12 */\n"
+"                            const INDEX_T data_im_offset,       /* 13 */\n"
+"                            const int channels,                 /* 14 */\n"
+"                            const int batch) {                  /* 15 */\n"
+"  data_im += data_im_offset;\n"
+"  const INDEX_T col_stride = (INDEX_T)batch * height_col * width_col;\n"
 "  CUDA_KERNEL_LOOP(index, n) {\n"
-"    int w_out = index % width_col;\n"
-"    index /= width_col;\n"
-"    int h_out = index % height_col;\n"
-"    int channel_in = index / height_col;\n"
+"    INDEX_T rest = index;\n"
+"    int w_out = rest % width_col;\n"
+"    rest /= width_col;\n"
+"    int h_out = rest % height_col;\n"
+"    rest /= height_col;\n"
+"    int channel_in = rest % channels;\n"
+"    int sample = rest / channels;\n"
 "    int channel_out = channel_in * ksize_h * ksize_w;\n"
 "    int h_in = h_out * stride_h - pad_h;\n"
 "    int w_in = w_out * stride_w - pad_w;\n"
-"    data_col += (channel_out * height_col + h_out) * width_col + w_out;\n"
-"    data_im += (channel_in * height + h_in) * width + w_in;\n"
+"    __global float* col = data_col +\n"
+"        (((INDEX_T)channel_out * batch + sample) * height_col + h_out) *\n"
+"        width_col + w_out;\n"
+"    const __global STORAGE_T* im = data_im +\n"
+"        (((INDEX_T)sample * channels + channel_in) * height + h_in) *\n"
+"        width + w_in;\n"
 "    for (int i = 0; i < ksize_h; ++i) {\n"
 "      for (int j = 0; j < ksize_w; ++j) {\n"
 "        int h = h_in + i;\n"
 "        int w = w_in + j;\n"
-"        *data_col = (h >= 0 && w >= 0 && h < height && w < width) ?\n"
-"          data_im[i * width + j] : 0;\n"
-"        data_col += height_col * width_col;\n"
+"        *col = (h >= 0 && w >= 0 && h < height && w < width) ?\n"
+"          LOAD(im, i * width + j) : 0;\n"
+"        col += col_stride;\n"
 "      }\n"
 "    }\n"
 "  }\n"
 "}";
 
+// im2col_kernel launches at most this many work items.
+static const uint64_t kMaxIm2colLaunch = (uint64_t)1 << 30;
+
+// The int8 path (see TorchStage::quantize()).  im2col_int8_kernel is
+// im2col_kernel quantizing the columns as it unfolds them (one work item per
+// sample, input channel and output pixel).  The int8 columns are stored in
+// char4s of 4 consecutive rows: element (row, col) is byte
+// ((row / 4) * n + col) * 4 + row % 4, with n = batch * height_col *
+// width_col, and the padding rows (up to a multiple of 4) stay zero.
+// gemm_int8_kernel then computes each column (dim 0, ie sample and output
+// pixel) of each output feature (dim 1) as the int32 dot product of the
+// feature's int8 filter row with the column, rescaled (with the bias folded
+// in).
+static const char* kSpatialConvolutionMMInt8Kernel = JTORCH_INDEX_PRELUDE
+"__kernel void im2col_int8_kernel(const INDEX_T n,                   /* 0 */\n"
+"                                 const __global STORAGE_T* data_im, /* 1 */\n"
+"                                 const int height,                  /* 2 */\n"
+"                                 const int width,                   /* 3 */\n"
+"                                 const int ksize_h,                 /* 4 */\n"
+"                                 const int ksize_w,                 /* 5 */\n"
+"                                 const int pad_h,                   /* 6 */\n"
+"                                 const int pad_w,                   /* 7 */\n"
+"                                 const int stride_h,                /* 8 */\n"
+"                                 const int stride_w,                /* 9 */\n"
+"                                 const int height_col,              /* 10 */\n"
+"                                 const int width_col,               /* 11 */\n"
+"                                 __global char* data_col,           /* 12 */\n"
+"                                 const INDEX_T data_im_offset,      /* 13 */\n"
+"                                 const float inv_scale,             /* 14 */\n"
+"                                 const int channels,                /* 15 */\n"
+"                                 const int batch) {                 /* 16 */\n"
+"  const INDEX_T index = get_global_id(0);\n"
+"  if (index >= n) {\n"
+"    return;\n"
+"  }\n"
+"  const int n_pix = height_col * width_col;\n"
+"  const int w_out = index % width_col;\n"
+"  const int h_out = (index / width_col) % height_col;\n"
+"  const int channel_in = (index / n_pix) % channels;\n"
+"  const int sample = index / (n_pix * channels);\n"
+"  const int row_out = channel_in * ksize_h * ksize_w;\n"
+"  const int col = sample * n_pix + h_out * width_col + w_out;\n"
+"  const int n_col = batch * n_pix;\n"
+"  const int h_in = h_out * stride_h - pad_h;\n"
+"  const int w_in = w_out * stride_w - pad_w;\n"
+"  const INDEX_T im = data_im_offset +\n"
+"      (((INDEX_T)sample * channels + channel_in) * height + h_in) * width +\n"
+"      w_in;\n"
+"  for (int i = 0; i < ksize_h; ++i) {\n"
+"    for (int j = 0; j < ksize_w; ++j) {\n"
+"      const int h = h_in + i;\n"
+"      const int w = w_in + j;\n"
+"      float v = 0.0f;\n"
+"      if (h >= 0 && w >= 0 && h < height && w < width) {\n"
+"        v = LOAD(data_im, im + i * width + j);\n"
+"      }\n"
+"      const int row = row_out + i * ksize_w + j;\n"
+"      data_col[((INDEX_T)(row >> 2) * n_col + col) * 4 + (row & 3)] =\n"
+"          (char)clamp(rint(v * inv_scale), -127.0f, 127.0f);\n"
+"    }\n"
+"  }\n"
+"}\n"
+"\n"
+"__kernel void gemm_int8_kernel(const __global char4* weights,  /* 0 */\n"
+"                               const __global char4* columns,  /* 1 */\n"
+"                               __global STORAGE_T* output,     /* 2 */\n"
+"                               const __global float* scales,   /* 3 */\n"
+"                               const __global float* biases,   /* 4 */\n"
+"                               const int n,                    /* 5 */\n"
+"                               const int k4,                   /* 6 */\n"
+"                               const int n_pix) {              /* 7 */\n"
+"  const int col = get_global_id(0);\n"
+"  const int row = get_global_id(1);\n"
+"  weights += row * k4;\n"
+"  int sum = 0;\n"
+"  for (int k = 0; k < k4; k++) {\n"
+"    const int4 prod = convert_int4(weights[k]) *\n"
+"                      convert_int4(columns[k * n + col]);\n"
+"    sum += prod.x + prod.y + prod.z + prod.w;\n"
+"  }\n"
+"  /* The output is sample major (ie width x height x feats x batch). */\n"
+"  const int sample = col / n_pix;\n"
+"  STORE((float)sum * scales[row] + biases[row], output,\n"
+"        ((INDEX_T)sample * get_global_size(1) + row) * n_pix + col % n_pix);\n"
+"}";
+
 
 // Function signatures from Torch (for easy code reuse)
 void THCudaBlas_gemm(void* state, char transa, char transb, size_t m, size_t n,
                      size_t k, float alpha, Tensor<float>* a, size_t lda,
                      Tensor<float>* b, size_t ldb, float beta, Tensor<float>* c,
                      size_t ldc);
-void im2col(const Tensor<float>* data_im, const int channels, const int height,
-            const int width, const int ksize_h, const int ksize_w,
-            const int pad_h, const int pad_w, const int stride_h,
-            const int stride_w, Tensor<float>* data_col);
+void im2col(jcl::OpenCLKernel* kernel, const Tensor<float>* data_im,
+            const int channels, const int height, const int width,
+            const int ksize_h, const int ksize_w, const int pad_h,
+            const int pad_w, const int stride_h, const int stride_w,
+            const int batch, Tensor<float>* data_col, const bool index64);
 
 SpatialConvolutionMM::SpatialConvolutionMM(const uint32_t feats_in,
                                            const uint32_t feats_out,
@@ -80,6 +185,11 @@ SpatialConvolutionMM::SpatialConvolutionMM(const uint32_t feats_in,
   feats_out_ = feats_out;
   padw_ = padw;
   padh_ = padh;
+  calibrating_ = false;
+  input_absmax_ = 0;
+  quantized_ = false;
+  input_scale_ = 1;
+  index64_ = false;
 
   output = nullptr;
   ones_.reset(nullptr);
@@ -87,13 +197,16 @@ SpatialConvolutionMM::SpatialConvolutionMM(const uint32_t feats_in,
 
   uint32_t dim = 4;
   uint32_t size[4] = {filt_width_, filt_height_, feats_in_, feats_out_};
-  weights_.reset(new Tensor<float>(dim, size));
-  biases_.reset(new Tensor<float>(1, &feats_out_));
+  weights_.reset(new Tensor<float>(dim, size, runtime_));
+  weights_->storage()->setTag(jcl::CLBufferTagWeights);
+  biases_.reset(new Tensor<float>(1, &feats_out_, runtime_));
+  biases_->storage()->setTag(jcl::CLBufferTagWeights);
 }
 
 SpatialConvolutionMM::~SpatialConvolutionMM() {}
 
 void SpatialConvolutionMM::setWeights(const float* weights) {
+  RASSERT(!quantized_);
   weights_->setData(weights);
 }
 
@@ -104,53 +217,158 @@ void SpatialConvolutionMM::setBiases(const float* biases) {
 void SpatialConvolutionMM::init(std::shared_ptr<TorchData> input) {
   RASSERT(input->type() == TorchDataType::TENSOR_DATA);
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
-  RASSERT(in->dim() == 3);
+  // A batch is a 4D input (see forwardPropBatch()).
+  RASSERT(in->dim() == 3 || in->dim() == 4);
   RASSERT(in->size()[2] == feats_in_);
+  const uint32_t outputWidth = in->size()[0] - filt_width_ + 1 + 2 * padw_;
+  const uint32_t outputHeight = in->size()[1] - filt_height_ + 1 + 2 * padh_;
+  const uint32_t batch = in->dim() == 4 ? in->size()[3] : 1;
+  const uint32_t out_dim[4] = {outputWidth, outputHeight, feats_out_, batch};
   if (output != nullptr) {
-    uint32_t owidth = in->size()[0] - filt_width_ + 1 + 2 * padw_;
-    uint32_t oheight = in->size()[1] - filt_height_ + 1 + 2 * padh_;
-    const uint32_t* out_size = TO_TENSOR_PTR(output.get())->size();
-    if (out_size[0] != owidth || out_size[1] != oheight ||
-        out_size[2] != feats_out_) {
+    Tensor<float>* out = TO_TENSOR_PTR(output.get());
+    if (out->dim() != in->dim() ||
+        !std::equal(out_dim, out_dim + in->dim(), out->size())) {
       // Output size changed
       output = nullptr;
       columns_ = nullptr;
       ones_ = nullptr;
+      gemm_output_ = nullptr;
+      int8_columns_ = nullptr;
     }
   }
 
   if (output == nullptr) {
-    const uint32_t inputWidth = in->size()[0];
-    const uint32_t inputHeight = in->size()[1];
-    const uint32_t outputWidth = inputWidth - filt_width_ + 1 + 2 * padw_;
-    const uint32_t outputHeight = inputHeight - filt_height_ + 1 + 2 * padh_;
-
     // Resize output
-    uint32_t out_dim[3];
-    out_dim[0] = outputWidth;
-    out_dim[1] = outputHeight;
-    out_dim[2] = feats_out_;
-    output.reset(new Tensor<float>(3, out_dim));
+    output.reset(new Tensor<float>(in->dim(), out_dim, runtime_, format_));
+  }
 
+  if (quantized_ && int8_columns_ == nullptr) {
+    const uint32_t k_padded =
+        Int8Padded(feats_in_ * filt_width_ * filt_height_);
+    const uint64_t int8_size =
+        (uint64_t)k_padded * outputHeight * outputWidth * batch;
+    RASSERT(int8_size < ((uint64_t)1 << 32));  // See Int8Tensor()
+    int8_columns_ = Int8Tensor((uint32_t)int8_size, runtime_);
+    int8_columns_->storage()->setTag(jcl::CLBufferTagScratch);
+    // im2col_int8_kernel never writes the padding rows.
+    Tensor<float>::zero(*int8_columns_);
+  } else if (!quantized_ && columns_ == nullptr) {
     // Resize temporary columns
     uint32_t columns_dim[2];
-    columns_dim[0] = outputHeight * outputWidth;
+    columns_dim[0] = outputHeight * outputWidth * batch;
     columns_dim[1] = feats_in_ * filt_width_ * filt_height_;
-    columns_.reset(new Tensor<float>(2, columns_dim));
+    columns_.reset(new Tensor<float>(2, columns_dim, runtime_));
+    columns_->storage()->setTag(jcl::CLBufferTagScratch);
 
     // Define a buffer of ones, for bias accumulation
     // Note: this buffer can be shared with other modules, it only ever gets
     // increased,
     // and always contains ones.
-    uint32_t ones_dim[2];
+    uint32_t ones_dim[3];
     ones_dim[0] = outputWidth;
     ones_dim[1] = outputHeight;
-    ones_.reset(new Tensor<float>(2, ones_dim));
+    ones_dim[2] = batch;
+    ones_.reset(new Tensor<float>(3, ones_dim, runtime_));
+    ones_->storage()->setTag(jcl::CLBufferTagScratch);
+    Tensor<float>::fill(*ones_, 1);
+
+    if (batch > 1 || format_ != FLOAT_STORAGE) {
+      // The GEMM output of a batch is pixel x sample x feature, and always
+      // float (see forwardProp()).
+      const uint32_t gemm_dim[3] = {outputHeight * outputWidth, batch,
+                                    feats_out_};
+      gemm_output_.reset(new Tensor<float>(3, gemm_dim, runtime_));
+      gemm_output_->storage()->setTag(jcl::CLBufferTagScratch);
+    }
+  }
+
+  // The columns are indexed as one block (and so are a batch's input and
+  // output).
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64() ||
+      (quantized_ ? NeedsIndex64(int8_columns_->nelems() * 4)
+                  : columns_->index64());
+  if (index64 != index64_) {
+    im2col_kernel_ = nullptr;
+    int8_im2col_kernel_ = nullptr;
+    int8_gemm_kernel_ = nullptr;
+    index64_ = index64;
+  }
+  const jcl::OpenCLDefines& defines = KernelDefines(index64, format_);
+  if (quantized_ && int8_gemm_kernel_ == nullptr) {
+    int8_im2col_kernel_ = context()->getKernelCStr(
+        kSpatialConvolutionMMInt8Kernel, "im2col_int8_kernel", defines);
+    int8_gemm_kernel_ = context()->getKernelCStr(
+        kSpatialConvolutionMMInt8Kernel, "gemm_int8_kernel", defines);
+  } else if (!quantized_ && im2col_kernel_ == nullptr) {
+    im2col_kernel_ = context()->getKernelCStr(kSpatialConvolutionMMKernel,
+                                              "im2col_kernel", defines);
   }
 }
 
+void SpatialConvolutionMM::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back(
+      {kSpatialConvolutionMMKernel, KernelDefines(false, format_), false});
+  if (quantized_) {
+    programs->push_back({kSpatialConvolutionMMInt8Kernel,
+                         KernelDefines(false, format_), false});
+  }
+}
+
+void SpatialConvolutionMM::calibrate(const bool calibrating) {
+  calibrating_ = calibrating;
+}
+
+void SpatialConvolutionMM::quantize() {
+  if (quantized_) {
+    return;
+  }
+  // The input scale comes from calibration (see TorchStage::calibrate()).
+  RASSERT(!calibrating_ && input_absmax_ > 0);
+  // The weights are already one row (in im2col order) per output feature.
+  const uint32_t k = feats_in_ * filt_width_ * filt_height_;
+  const uint32_t k_padded = Int8Padded(k);
+  std::unique_ptr<float[]> weights(new float[(uint64_t)feats_out_ * k]);
+  weights_->getData(weights.get());
+  std::unique_ptr<int8_t[]> int8_weights(
+      new int8_t[(uint64_t)feats_out_ * k_padded]);
+  std::unique_ptr<float[]> scales(new float[feats_out_]);
+  QuantizeRows(weights.get(), feats_out_, k, k_padded, int8_weights.get(),
+               scales.get());
+  int8_weights_ =
+      Int8Tensor(feats_out_ * k_padded, runtime_, int8_weights.get());
+  int8_weights_->storage()->setTag(jcl::CLBufferTagWeights);
+
+  // The int32 dot products are rescaled by both scales at once.
+  input_scale_ = Int8Scale(input_absmax_);
+  for (uint32_t i = 0; i < feats_out_; i++) {
+    scales[i] *= input_scale_;
+  }
+  int8_scales_.reset(new Tensor<float>(1, &feats_out_, runtime_));
+  int8_scales_->setData(scales.get());
+  int8_scales_->storage()->setTag(jcl::CLBufferTagWeights);
+
+  // The float scratch buffers are replaced by int8_columns_ in init().
+  weights_.reset(nullptr);
+  columns_.reset(nullptr);
+  ones_.reset(nullptr);
+  gemm_output_.reset(nullptr);
+  quantized_ = true;
+}
+
 void SpatialConvolutionMM::forwardProp(std::shared_ptr<TorchData> input) {
+  if (quantized_) {
+    forwardPropInt8(input);
+    return;
+  }
+  // im2col reads either storage format.
+  input = contiguousInput(input, format_);
   init(input);
+  if (calibrating_) {
+    input_absmax_ =
+        CalibrateAbsMax(*TO_TENSOR_PTR(input.get()), input_absmax_);
+  }
 
   Tensor<float>* output_n = TO_TENSOR_PTR(output.get());
   Tensor<float>* input_n = TO_TENSOR_PTR(input.get());
@@ -168,22 +386,28 @@ void SpatialConvolutionMM::forwardProp(std::shared_ptr<TorchData> input) {
   const uint32_t padh = padh_;
   const uint32_t dH = 1;
   const uint32_t dW = 1;
+  // The columns of all the samples of a batch are side by side, so the whole
+  // batch is a single (wider) GEMM.  Its output then holds the batch's pixels
+  // feature by feature, rather than sample by sample.  clBLAS only writes
+  // float, so half outputs go through gemm_output_ too.
+  const uint32_t batch = input_n->dim() == 4 ? input_n->size()[3] : 1;
+  const bool direct = batch == 1 && format_ == FLOAT_STORAGE;
+  Tensor<float>* gemm_output = direct ? output_n : gemm_output_.get();
 
   // Do Bias first:
   // M,N,K are dims of matrix A and B
   // (see http://docs.nvidia.com/cuda/cublas/#cublas-lt-t-gt-gemm)
   uint32_t m_ = nOutputPlane;
-  uint32_t n_ = outputHeight * outputWidth;
+  uint32_t n_ = outputHeight * outputWidth * batch;
   uint32_t k_ = 1;
-  Tensor<float>::fill(*ones_, 1);
   // Do GEMM (note: this is a bit confusing because gemm assumes column-major
   // matrices)
   THCudaBlas_gemm(state, 't', 'n', n_, m_, k_, 1, ones_.get(), k_,
-                  biases_.get(), k_, 0, output_n, n_);
+                  biases_.get(), k_, 0, gemm_output, n_);
 
   // Extract columns:
-  im2col(input_n, nInputPlane, inputHeight, inputWidth, kH, kW, padh,
-         padw, dH, dW, columns_.get());
+  im2col(im2col_kernel_.get(), input_n, nInputPlane, inputHeight, inputWidth,
+         kH, kW, padh, padw, dH, dW, batch, columns_.get(), index64_);
 
   // M,N,K are dims of matrix A and B
   // (see http://docs.nvidia.com/cuda/cublas/#cublas-lt-t-gt-gemm)
@@ -198,13 +422,73 @@ void SpatialConvolutionMM::forwardProp(std::shared_ptr<TorchData> input) {
   // long k = weight->size[1];
 
   long m = nOutputPlane;
-  long n = outputHeight * outputWidth;
+  long n = outputHeight * outputWidth * batch;
   long k = nInputPlane * kH * kW;
 
   // Do GEMM (note: this is a bit confusing because gemm assumes column-major
   // matrices)
   THCudaBlas_gemm(state, 'n', 'n', n, m, k, 1, columns_.get(), n,
-                  weights_.get(), k, 1, output_n, n);
+                  weights_.get(), k, 1, gemm_output, n);
+
+  if (!direct) {
+    // pixel x sample x feature --> pixel x feature x sample (ie the output),
+    // converting to the output's format on the way.
+    const uint32_t out_dim[3] = {outputHeight * outputWidth, nOutputPlane,
+                                 batch};
+    Tensor<float>::copy(*Tensor<float>::view(*output_n, 3, out_dim),
+                        *Tensor<float>::transpose(*gemm_output_, 1, 2));
+  }
+}
+
+void SpatialConvolutionMM::forwardPropInt8(
+    std::shared_ptr<TorchData> input) {
+  // The quantization reads either storage format.
+  input = contiguousInput(input, format_);
+  init(input);
+  Tensor<float>* input_n = TO_TENSOR_PTR(input.get());
+  Tensor<float>* output_n = TO_TENSOR_PTR(output.get());
+
+  const int height = (int)input_n->size()[1];
+  const int width = (int)input_n->size()[0];
+  const uint32_t batch = input_n->dim() == 4 ? input_n->size()[3] : 1;
+  const uint32_t n_pix = output_n->size()[0] * output_n->size()[1];
+  const uint32_t n = n_pix * batch;
+  const uint32_t num_kernels = feats_in_ * n;
+  jcl::OpenCLKernel* kernel = int8_im2col_kernel_.get();
+  SetIndexArg(kernel, 0, num_kernels, index64_);
+  kernel->setArg(1, input_n->storage());
+  kernel->setArg(2, height);
+  kernel->setArg(3, width);
+  kernel->setArg(4, (int)filt_height_);
+  kernel->setArg(5, (int)filt_width_);
+  kernel->setArg(6, (int)padh_);
+  kernel->setArg(7, (int)padw_);
+  kernel->setArg(8, 1);
+  kernel->setArg(9, 1);
+  kernel->setArg(10, (int)output_n->size()[1]);
+  kernel->setArg(11, (int)output_n->size()[0]);
+  kernel->setArg(12, int8_columns_->storage());
+  SetIndexArg(kernel, 13, input_n->offset(), index64_);
+  kernel->setArg(14, 1.0f / input_scale_);
+  kernel->setArg(15, (int)feats_in_);
+  kernel->setArg(16, (int)batch);
+  uint32_t dim = 1;
+  context()->runKernelAutotuned(kernel, deviceid(), dim, &num_kernels, false);
+
+  const uint32_t k_padded =
+      Int8Padded(feats_in_ * filt_width_ * filt_height_);
+  kernel = int8_gemm_kernel_.get();
+  kernel->setArg(0, int8_weights_->storage());
+  kernel->setArg(1, int8_columns_->storage());
+  kernel->setArg(2, output_n->storage());
+  kernel->setArg(3, int8_scales_->storage());
+  kernel->setArg(4, biases_->storage());
+  kernel->setArg(5, (int)n);
+  kernel->setArg(6, (int)(k_padded / 4));
+  kernel->setArg(7, (int)n_pix);
+  dim = 2;
+  const uint32_t global_size[2] = {n, feats_out_};
+  context()->runKernelAutotuned(kernel, deviceid(), dim, global_size, false);
 }
 
 std::unique_ptr<TorchStage> SpatialConvolutionMM::loadFromFile(
@@ -328,6 +612,43 @@ std::string getErrorString(cl_int err) {
   }
 }
 
+// Enqueue the gemm on the calling thread's queue for device_index.
+static void EnqueueSgemm(jcl::OpenCLContext* context,
+                         const uint32_t device_index, clblasTranspose opa,
+                         clblasTranspose opb, size_t m, size_t n, size_t k,
+                         float alpha,
+                         const std::shared_ptr<jcl::OpenCLBufferData>& a,
+                         size_t off_a, size_t lda,
+                         const std::shared_ptr<jcl::OpenCLBufferData>& b,
+                         size_t off_b, size_t ldb, float beta,
+                         const std::shared_ptr<jcl::OpenCLBufferData>& c,
+                         size_t off_c, size_t ldc) {
+  clblasOrder order = clblasColumnMajor;  // Not sure what this is
+  cl::CommandQueue* cpp_queue = context->getQueue(device_index);
+  cl_command_queue queue = (*cpp_queue)();
+  // Non-blocking: we never wait on the gemm, so only ask for an event when an
+  // out-of-order queue needs it to order the following commands (or when
+  // profiling).
+  std::vector<jcl::OpenCLBufferData*> inputs = {a.get(), b.get()};
+  std::vector<jcl::OpenCLBufferData*> outputs = {c.get()};
+  std::vector<cl_event> wait_list;
+  context->getWaitList(inputs, outputs, wait_list);
+  // clBLAS may enqueue several kernels, so time the whole span.
+  cl_event start = context->beginProfiledCommand(device_index, wait_list);
+  cl_event event = nullptr;
+  cl_int err = clblasSgemm(order, opa, opb, m, n, k, alpha, a->mem(), off_a,
+                           lda, b->mem(), off_b, ldb, beta, c->mem(), off_c,
+                           ldc, 1, &queue, (cl_uint)wait_list.size(),
+                           wait_list.empty() ? nullptr : wait_list.data(),
+                           context->needsEvents() ? &event : nullptr);
+
+  if (err != CL_SUCCESS) {
+    std::cout << "Error clblasSgemm failed: " << getErrorString(err);
+    RASSERT(false);
+  }
+  context->addEvent(inputs, outputs, event, "clblasSgemm", start);
+}
+
 // For easy reuse of code, just redefine THCudaBlas_gemm from torch
 void THCudaBlas_gemm(void* state, char transa, char transb, size_t m, size_t n,
                      size_t k, float alpha, Tensor<float>* a, size_t lda,
@@ -337,57 +658,69 @@ void THCudaBlas_gemm(void* state, char transa, char transb, size_t m, size_t n,
   clblasTranspose opa = convertTransToCublasOperation(transa);
   clblasTranspose opb = convertTransToCublasOperation(transb);
 
-  clblasOrder order = clblasColumnMajor;  // Not sure what this is
-  cl::CommandQueue* cpp_queue = cl_context->getQueue(jtorch::deviceid);
-  cl_command_queue queue = (*cpp_queue)();
-  cl_event event = nullptr;
-  cl_int err = clblasSgemm(order, opa, opb, m, n, k, alpha, a->storage()->mem(),
-                           0,  // (offA)
-                           lda, b->storage()->mem(),
-                           0,  // (offB)
-                           ldb, beta, c->storage()->mem(),
-                           0,  // (offC)
-                           ldc, 1, &queue, 0, nullptr, &event);
-
-  // Non-blocking: Don't wait for events
-  // err = clWaitForEvents( 1, &event );
-
-  if (err != CL_SUCCESS) {
-    std::cout << "Error clblasSgemm failed: " << getErrorString(err);
-    RASSERT(false);
+  // The gemm runs on the runtime (and device) of the output.
+  jcl::OpenCLContext* context = c->runtime()->context();
+  const uint32_t device_index = c->runtime()->deviceid();
+  std::shared_ptr<jcl::OpenCLBufferData> a_buf = a->storage();
+  std::shared_ptr<jcl::OpenCLBufferData> b_buf = b->storage();
+  std::shared_ptr<jcl::OpenCLBufferData> c_buf = c->storage();
+  const size_t off_a = a->offset();
+  const size_t off_b = b->offset();
+  const size_t off_c = c->offset();
+  EnqueueSgemm(context, device_index, opa, opb, m, n, k, alpha, a_buf, off_a,
+               lda, b_buf, off_b, ldb, beta, c_buf, off_c, ldc);
+  // clBLAS calls aren't kernel launches as far as jcl is concerned, so they
+  // have to be recorded explicitly.  The buffers go through the capture so
+  // that they can be rebound (ie when Linear multiplies a captured model's
+  // input).
+  if (context->capturing()) {
+    context->captureCommand(
+        device_index, {a_buf, b_buf, c_buf},
+        [=](const jcl::OpenCLCapture::Buffers& buffers) {
+          EnqueueSgemm(context, device_index, opa, opb, m, n, k, alpha,
+                       buffers[0], off_a, lda, buffers[1], off_b, ldb, beta,
+                       buffers[2], off_c, ldc);
+        });
   }
 }
 
-void im2col(const Tensor<float>* data_im, const int channels, const int height,
-            const int width, const int ksize_h, const int ksize_w,
-            const int pad_h, const int pad_w, const int stride_h,
-            const int stride_w, Tensor<float>* data_col) {
-  // We are going to launch channels * height_col * width_col kernels, each
-  // kernel responsible for copying a single-channel grid.
+void im2col(jcl::OpenCLKernel* kernel, const Tensor<float>* data_im,
+            const int channels, const int height, const int width,
+            const int ksize_h, const int ksize_w, const int pad_h,
+            const int pad_w, const int stride_h, const int stride_w,
+            const int batch, Tensor<float>* data_col, const bool index64) {
+  // We are going to launch batch * channels * height_col * width_col
+  // kernels, each kernel responsible for copying a single-channel grid.
   int height_col = (height + 2 * pad_h - ksize_h) / stride_h + 1;
   int width_col = (width + 2 * pad_w - ksize_w) / stride_w + 1;
-  int num_kernels = channels * height_col * width_col;
+  const uint64_t num_kernels =
+      (uint64_t)batch * channels * height_col * width_col;
   // Launch
 
-  cl_context->useKernelCStr(kSpatialConvolutionMMKernel, "im2col_kernel");
-
-  cl_context->setArg(0, num_kernels);
-  cl_context->setArg(1, TO_TENSOR_PTR(data_im)->storage());
-  cl_context->setArg(2, height);
-  cl_context->setArg(3, width);
-  cl_context->setArg(4, ksize_h);
-  cl_context->setArg(5, ksize_w);
-  cl_context->setArg(6, pad_h);
-  cl_context->setArg(7, pad_w);
-  cl_context->setArg(8, stride_h);
-  cl_context->setArg(9, stride_w);
-  cl_context->setArg(10, height_col);
-  cl_context->setArg(11, width_col);
-  cl_context->setArg(12, TO_TENSOR_PTR(data_col)->storage());
+  SetIndexArg(kernel, 0, num_kernels, index64);
+  kernel->setArg(1, TO_TENSOR_PTR(data_im)->storage());
+  kernel->setArg(2, height);
+  kernel->setArg(3, width);
+  kernel->setArg(4, ksize_h);
+  kernel->setArg(5, ksize_w);
+  kernel->setArg(6, pad_h);
+  kernel->setArg(7, pad_w);
+  kernel->setArg(8, stride_h);
+  kernel->setArg(9, stride_w);
+  kernel->setArg(10, height_col);
+  kernel->setArg(11, width_col);
+  kernel->setArg(12, TO_TENSOR_PTR(data_col)->storage());
+  SetIndexArg(kernel, 13, data_im->offset(), index64);
+  kernel->setArg(14, channels);
+  kernel->setArg(15, batch);
 
   uint32_t dim = 1;
-  const uint32_t global_size[1] = {TO_TENSOR_PTR(data_col)->nelems()};
-  cl_context->runKernel(jtorch::deviceid, dim, global_size, false);
+  // Each work item loops over the grids beyond the launch.
+  const uint32_t global_size[1] = {
+      (uint32_t)std::min<uint64_t>(num_kernels, kMaxIm2colLaunch)};
+  Runtime* runtime = data_im->runtime();
+  runtime->context()->runKernelAutotuned(kernel, runtime->deviceid(), dim,
+                                         global_size, false);
 }
 
 }  // namespace jtorch
@@ -1,10 +1,12 @@
 #include "jtorch/spatial_divisive_normalization.h"
 
 #include <cstring>
+#include <string>
 
 #include "jcl/threading/callback.h"
 #include "jcl/threading/thread.h"
 #include "jcl/threading/thread_pool.h"
+#include "jtorch/jtorch.h"
 #include "jtorch/tensor.h"
 
 using namespace jcl::threading;
@@ -12,12 +14,27 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-static const char* kSpatialDivisiveNormalizationKernel =
+static const char* kSpatialDivisiveNormalizationKernel = JTORCH_INDEX_PRELUDE
+"    /* Filter radii.  The stage compiles a specialized program with these */\n"
+"    /* defined as constants (so that the filter loops can be unrolled), */\n"
+"    /* otherwise they fall back to the kernel arguments. */\n"
+"    #ifndef FILT_RAD\n"
+"      #define FILT_RAD filt_rad\n"
+"    #endif\n"
+"    #ifndef FILT_RAD_U\n"
+"      #define FILT_RAD_U filt_rad_u\n"
+"    #endif\n"
+"    #ifndef FILT_RAD_V\n"
+"      #define FILT_RAD_V filt_rad_v\n"
+"    #endif\n"
+"\n"
 "    __kernel void SpatialDivisiveNormalizationHoriz(\n"
-"      const __global float* input,       /* 0 */\n"
+"      const __global STORAGE_T* input,   /* 0 */\n"
 "      __global  float* output,           /* 1 */\n"
 "      const __global float* kernel1d,    /* 2 */\n"
-"      const int filt_rad) {              /* 3 */\n"
+"      const int filt_rad,                /* 3 */\n"
+"      const INDEX_T input_offset) {      /* 4 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -29,13 +46,15 @@ static const char* kSpatialDivisiveNormalizationKernel =
 "      /* Initilize the output to zero and accumulate the input values */\n"
 "      float sum = 0;\n"
 "\n"
-"      const int iout = x_out + width * (y_out + height * f_out);\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
 "\n"
 "      int i = 0;\n"
-"      for (int u_offset = -filt_rad; u_offset <= filt_rad; u_offset++, i++) {\n"
+"      for (int u_offset = -FILT_RAD; u_offset <= FILT_RAD; u_offset++, i++) {\n"
 "        int u = x_out + u_offset;\n"
 "        if (u >= 0 && u < width) {\n"
-"          sum += kernel1d[i] * (input[iout + u_offset] * input[iout + u_offset]);  /* Sum sqs */\n"
+"          const float val = LOAD(input, iout + u_offset);\n"
+"          sum += kernel1d[i] * (val * val);  /* Sum sqs */\n"
 "        }\n"
 "      }\n"
 "\n"
@@ -58,10 +77,11 @@ static const char* kSpatialDivisiveNormalizationKernel =
 "      /* Initilize the output to zero and accumulate the input values */\n"
 "      float sum = 0;\n"
 "\n"
-"      const int iout = x_out + width * (y_out + height * f_out);\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
 "\n"
 "      int i = 0;\n"
-"      for (int v_offset = -filt_rad; v_offset <= filt_rad; v_offset++, i++) {\n"
+"      for (int v_offset = -FILT_RAD; v_offset <= FILT_RAD; v_offset++, i++) {\n"
 "        int v = y_out + v_offset;\n"
 "        if (v >= 0 && v < height) {\n"
 "          sum += kernel1d[i] * input[iout + v_offset * width];\n"
@@ -72,11 +92,13 @@ static const char* kSpatialDivisiveNormalizationKernel =
 "    }\n"
 "\n"
 "    __kernel void SpatialDivisiveNormalization2D(\n"
-"      const __global float* input,       /* 0 */\n"
+"      const __global STORAGE_T* input,   /* 0 */\n"
 "      __global  float* output,           /* 1 */\n"
 "      const __global float* kernel2d,    /* 2 */\n"
 "      const int filt_rad_u,              /* 3 */\n"
-"      const int filt_rad_v) {            /* 4 */\n"
+"      const int filt_rad_v,              /* 4 */\n"
+"      const INDEX_T input_offset) {      /* 5 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -88,17 +110,18 @@ static const char* kSpatialDivisiveNormalizationKernel =
 "      /* Initilize the output to zero and accumulate the input values */\n"
 "      float sum = 0;\n"
 "\n"
-"      const int iout = x_out + width * (y_out + height * f_out);\n"
-"      const int filt_size_u = 2 * filt_rad_u + 1;\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      const int filt_size_u = 2 * FILT_RAD_U + 1;\n"
 "\n"
-"      for (int v_offset = -filt_rad_v; v_offset <= filt_rad_v; v_offset++) {\n"
+"      for (int v_offset = -FILT_RAD_V; v_offset <= FILT_RAD_V; v_offset++) {\n"
 "        int v = y_out + v_offset;\n"
-"        int v_filt = v_offset + filt_rad_v;\n"
-"        for (int u_offset = -filt_rad_u; u_offset <= filt_rad_u; u_offset++) {\n"
+"        int v_filt = v_offset + FILT_RAD_V;\n"
+"        for (int u_offset = -FILT_RAD_U; u_offset <= FILT_RAD_U; u_offset++) {\n"
 "          int u = x_out + u_offset;\n"
-"          int u_filt = u_offset + filt_rad_u;\n"
+"          int u_filt = u_offset + FILT_RAD_U;\n"
 "          if (v >= 0 && v < height && u >= 0 && u < width) {\n"
-"            float val = input[iout + v_offset * width + u_offset];\n"
+"            float val = LOAD(input, iout + v_offset * width + u_offset);\n"
 "            sum += kernel2d[v_filt * filt_size_u + u_filt] * (val * val);  /* Sum sqs */\n"
 "          }\n"
 "        }\n"
@@ -126,7 +149,7 @@ static const char* kSpatialDivisiveNormalizationKernel =
 "      float sum = 0;\n"
 "\n"
 "      const int uvout = x_out + width * y_out;  /* index on each input image */\n"
-"      const int im_dim = width * height;\n"
+"      const INDEX_T im_dim = width * height;\n"
 "      for (int f = 0; f < input_nfeats; f++) {\n"
 "        sum += input[f * im_dim + uvout];\n"
 "      }\n"
@@ -136,9 +159,11 @@ static const char* kSpatialDivisiveNormalizationKernel =
 "    }\n"
 "\n"
 "    __kernel void SpatialDivisiveNormalization(\n"
-"      const __global float* input,     /* 0 */\n"
-"      __global float* output,          /* 1 */\n"
-"      const __global float* std) {     /* 2 */\n"
+"      const __global STORAGE_T* input, /* 0 */\n"
+"      __global STORAGE_T* output,      /* 1 */\n"
+"      const __global float* std,       /* 2 */\n"
+"      const INDEX_T input_offset) {    /* 3 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -147,8 +172,9 @@ static const char* kSpatialDivisiveNormalizationKernel =
 "      const int y_out = get_global_id(1);\n"
 "      const int f_out = get_global_id(2);\n"
 "\n"
-"      const int index = x_out + width * (y_out + height * f_out);\n"
-"      output[index] = input[index] / std[y_out * width + x_out];\n"
+"      const INDEX_T index =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      STORE(LOAD(input, index) / std[y_out * width + x_out], output, index);\n"
 "    }";
 
 // kernel1d default is either TorchStage::gaussian1D<float>(n) or just a
@@ -163,6 +189,7 @@ SpatialDivisiveNormalization::SpatialDivisiveNormalization(
          !(kernel->dim() == 2 && kernel->size()[1] % 2 == 0));
 
   kernel_ = Tensor<float>::clone(*kernel);
+  kernel_->storage()->setTag(jcl::CLBufferTagWeights);
   kernel_norm_ = nullptr;  // Normalization is input size dependant
 
   output = nullptr;
@@ -172,6 +199,7 @@ SpatialDivisiveNormalization::SpatialDivisiveNormalization(
   std_ = nullptr;
 
   threshold_ = threshold;
+  index64_ = false;
 }
 
 SpatialDivisiveNormalization::~SpatialDivisiveNormalization() { cleanup(); }
@@ -198,9 +226,14 @@ void SpatialDivisiveNormalization::init(std::shared_ptr<TorchData> input) {
   }
 
   if (output == nullptr) {
-    output.reset(new Tensor<float>(in->dim(), in->size()));
-    std_pass1_.reset(new Tensor<float>(in->dim(), in->size()));
-    std_pass2_.reset(new Tensor<float>(in->dim(), in->size()));
+    // Only the input and output are in format_: the passes hold sums of
+    // squares, which could overflow fp16.
+    output.reset(
+        new Tensor<float>(in->dim(), in->size(), runtime_, format_));
+    std_pass1_.reset(new Tensor<float>(in->dim(), in->size(), runtime_));
+    std_pass1_->storage()->setTag(jcl::CLBufferTagScratch);
+    std_pass2_.reset(new Tensor<float>(in->dim(), in->size(), runtime_));
+    std_pass2_->storage()->setTag(jcl::CLBufferTagScratch);
   }
   if (kernel_norm_ == nullptr) {
     bool onedim_kernel = kernel_->dim() == 1;
@@ -208,7 +241,7 @@ void SpatialDivisiveNormalization::init(std::shared_ptr<TorchData> input) {
 
     // Clone and normalize the input kernel
     kernel_norm_ = Tensor<float>::clone(*kernel_);
-    float sum = Tensor<float>::slowSum(*kernel_norm_);
+    float sum = Tensor<float>::sum(*kernel_norm_);
     float div_val = onedim_kernel ? (sum * sqrtf(n_feats)) : (sum * n_feats);
     Tensor<float>::div(*kernel_norm_, div_val);
   }
@@ -216,7 +249,8 @@ void SpatialDivisiveNormalization::init(std::shared_ptr<TorchData> input) {
     uint32_t std_coeff_size[2];
     std_coeff_size[0] = TO_TENSOR_PTR(output.get())->size()[0];
     std_coeff_size[1] = TO_TENSOR_PTR(output.get())->size()[1];
-    std_coef_.reset(new Tensor<float>(2, std_coeff_size));
+    std_coef_.reset(new Tensor<float>(2, std_coeff_size, runtime_));
+    std_coef_->storage()->setTag(jcl::CLBufferTagScratch);
 
     std::unique_ptr<float[]> std_coef_cpu(new float[std_coef_->nelems()]);
     std::unique_ptr<float[]> kernel_norm_cpu(new float[kernel_norm_->nelems()]);
@@ -281,12 +315,61 @@ void SpatialDivisiveNormalization::init(std::shared_ptr<TorchData> input) {
     uint32_t std_coeff_size[2];
     std_coeff_size[0] = TO_TENSOR_PTR(output.get())->size()[0];
     std_coeff_size[1] = TO_TENSOR_PTR(output.get())->size()[1];
-    std_.reset(new Tensor<float>(2, std_coeff_size));
+    std_.reset(new Tensor<float>(2, std_coeff_size, runtime_));
+    std_->storage()->setTag(jcl::CLBufferTagScratch);
+  }
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (normalize_kernel_ == nullptr || index64 != index64_) {
+    const jcl::OpenCLDefines defines = programDefines(index64);
+    if (kernel_->dim() == 1) {
+      horiz_kernel_ = context()->getKernelCStr(
+          kSpatialDivisiveNormalizationKernel,
+          "SpatialDivisiveNormalizationHoriz", defines);
+      vert_kernel_ = context()->getKernelCStr(
+          kSpatialDivisiveNormalizationKernel,
+          "SpatialDivisiveNormalizationVert", defines);
+    } else {
+      filter_2d_kernel_ = context()->getKernelCStr(
+          kSpatialDivisiveNormalizationKernel,
+          "SpatialDivisiveNormalization2D", defines);
+    }
+    accum_div_kernel_ = context()->getKernelCStr(
+        kSpatialDivisiveNormalizationKernel,
+        "SpatialDivisiveNormalizationAccumDiv", defines);
+    normalize_kernel_ = context()->getKernelCStr(
+        kSpatialDivisiveNormalizationKernel, "SpatialDivisiveNormalization",
+        defines);
+    index64_ = index64;
   }
 }
 
+jcl::OpenCLDefines SpatialDivisiveNormalization::programDefines(
+    const bool index64) const {
+  // The filter size is fixed, so compile it in.
+  jcl::OpenCLDefines defines = KernelDefines(index64, format_);
+  if (kernel_->dim() == 1) {
+    defines["FILT_RAD"] = std::to_string((kernel_->size()[0] - 1) / 2);
+  } else {
+    defines["FILT_RAD_U"] = std::to_string((kernel_->size()[0] - 1) / 2);
+    defines["FILT_RAD_V"] = std::to_string((kernel_->size()[1] - 1) / 2);
+  }
+  return defines;
+}
+
+void SpatialDivisiveNormalization::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back(
+      {kSpatialDivisiveNormalizationKernel, programDefines(), false});
+}
+
 void SpatialDivisiveNormalization::forwardProp(
     std::shared_ptr<TorchData> input) {
+  // Batches are normalized sample by sample.
+  if (forwardPropSamples(input, 3)) {
+    return;
+  }
+  input = contiguousInput(input, format_);
   init(input);
   bool onedim_kernel = kernel_->dim() == 1;
 
@@ -296,57 +379,55 @@ void SpatialDivisiveNormalization::forwardProp(
     int32_t filt_rad = ((int32_t)kernel_norm_->size()[0] - 1) / 2;
 
     // Perform horizontal filter pass
-    cl_context->useKernelCStr(kSpatialDivisiveNormalizationKernel,
-                          "SpatialDivisiveNormalizationHoriz");
-    cl_context->setArg(0, in->storage());
-    cl_context->setArg(1, std_pass1_->storage());
-    cl_context->setArg(2, kernel_norm_->storage());
-    cl_context->setArg(3, filt_rad);
-    cl_context->runKernel(jtorch::deviceid, std_pass1_->dim(),
-                          std_pass1_->size(), false);
+    horiz_kernel_->setArg(0, in->storage());
+    horiz_kernel_->setArg(1, std_pass1_->storage());
+    horiz_kernel_->setArg(2, kernel_norm_->storage());
+    horiz_kernel_->setArg(3, filt_rad);
+    SetIndexArg(horiz_kernel_.get(), 4, in->offset(), index64_);
+    context()->runKernelAutotuned(horiz_kernel_.get(), deviceid(),
+                                  std_pass1_->dim(), std_pass1_->size(),
+                                  false);
 
     // Perform vertical filter pass
-    cl_context->useKernelCStr(kSpatialDivisiveNormalizationKernel,
-                          "SpatialDivisiveNormalizationVert");
-    cl_context->setArg(0, std_pass1_->storage());
-    cl_context->setArg(1, std_pass2_->storage());
-    cl_context->setArg(2, kernel_norm_->storage());
-    cl_context->setArg(3, filt_rad);
-    cl_context->runKernel(jtorch::deviceid, std_pass2_->dim(),
-                          std_pass2_->size(), false);
+    vert_kernel_->setArg(0, std_pass1_->storage());
+    vert_kernel_->setArg(1, std_pass2_->storage());
+    vert_kernel_->setArg(2, kernel_norm_->storage());
+    vert_kernel_->setArg(3, filt_rad);
+    context()->runKernelAutotuned(vert_kernel_.get(), deviceid(),
+                                  std_pass2_->dim(), std_pass2_->size(),
+                                  false);
   } else {
     int32_t filt_rad_u = ((int32_t)kernel_norm_->size()[0] - 1) / 2;
     int32_t filt_rad_v = ((int32_t)kernel_norm_->size()[1] - 1) / 2;
 
     // Perform vertical filter pass
-    cl_context->useKernelCStr(kSpatialDivisiveNormalizationKernel,
-                          "SpatialDivisiveNormalization2D");
-    cl_context->setArg(0, in->storage());
-    cl_context->setArg(1, std_pass2_->storage());
-    cl_context->setArg(2, kernel_norm_->storage());
-    cl_context->setArg(3, filt_rad_u);
-    cl_context->setArg(4, filt_rad_v);
-    cl_context->runKernel(jtorch::deviceid, std_pass2_->dim(),
-                          std_pass2_->size(), false);
+    filter_2d_kernel_->setArg(0, in->storage());
+    filter_2d_kernel_->setArg(1, std_pass2_->storage());
+    filter_2d_kernel_->setArg(2, kernel_norm_->storage());
+    filter_2d_kernel_->setArg(3, filt_rad_u);
+    filter_2d_kernel_->setArg(4, filt_rad_v);
+    SetIndexArg(filter_2d_kernel_.get(), 5, in->offset(), index64_);
+    context()->runKernelAutotuned(filter_2d_kernel_.get(), deviceid(),
+                                  std_pass2_->dim(), std_pass2_->size(),
+                                  false);
   }
 
   // Perform accumulation and division pass
-  cl_context->useKernelCStr(kSpatialDivisiveNormalizationKernel,
-                        "SpatialDivisiveNormalizationAccumDiv");
-  cl_context->setArg(0, std_pass2_->storage());
-  cl_context->setArg(1, std_->storage());
-  cl_context->setArg(2, std_coef_->storage());
-  cl_context->setArg(3, (int)out->size()[2]);
-  cl_context->setArg(4, threshold_);
-  cl_context->runKernel(jtorch::deviceid, std_->dim(), std_->size(), false);
+  accum_div_kernel_->setArg(0, std_pass2_->storage());
+  accum_div_kernel_->setArg(1, std_->storage());
+  accum_div_kernel_->setArg(2, std_coef_->storage());
+  accum_div_kernel_->setArg(3, (int)out->size()[2]);
+  accum_div_kernel_->setArg(4, threshold_);
+  context()->runKernelAutotuned(accum_div_kernel_.get(), deviceid(),
+                                std_->dim(), std_->size(), false);
 
   // Perform normalization pass
-  cl_context->useKernelCStr(kSpatialDivisiveNormalizationKernel,
-                        "SpatialDivisiveNormalization");
-  cl_context->setArg(0, in->storage());
-  cl_context->setArg(1, out->storage());
-  cl_context->setArg(2, std_->storage());
-  cl_context->runKernel(jtorch::deviceid, out->dim(), out->size(), false);
+  normalize_kernel_->setArg(0, in->storage());
+  normalize_kernel_->setArg(1, out->storage());
+  normalize_kernel_->setArg(2, std_->storage());
+  SetIndexArg(normalize_kernel_.get(), 3, in->offset(), index64_);
+  context()->runKernelAutotuned(normalize_kernel_.get(), deviceid(),
+                                out->dim(), out->size(), false);
 }
 
 std::unique_ptr<TorchStage> SpatialDivisiveNormalization::loadFromFile(
@@ -77,7 +77,9 @@ void SpatialLPPooling::init(std::shared_ptr<TorchData> input) {
       out_size[i] = in->size()[i];
     }
 
-    output.reset(new Tensor<float>(in->dim(), out_size.get()));
+    // Half outputs are converted by setData() (see forwardProp()).
+    output.reset(
+        new Tensor<float>(in->dim(), out_size.get(), runtime_, format_));
     input_cpu_.reset(new float[in->nelems()]);
     output_cpu_.reset(new float[TO_TENSOR_PTR(output.get())->nelems()]);
   }
@@ -96,6 +98,10 @@ void SpatialLPPooling::init(std::shared_ptr<TorchData> input) {
 }
 
 void SpatialLPPooling::forwardProp(std::shared_ptr<TorchData> input) {
+  // The samples of a batch are pooled (on the CPU) one at a time.
+  if (forwardPropSamples(input, 3)) {
+    return;
+  }
   init(input);
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
   in->getData(input_cpu_.get());
@@ -1,7 +1,9 @@
 #include "jtorch/spatial_max_pooling.h"
 
 #include <cstring>
+#include <string>
 
+#include "jtorch/jtorch.h"
 #include "jtorch/tensor.h"
 
 using namespace jcl::threading;
@@ -9,17 +11,42 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-static const char* kSpatialMaxPoolingKernel =
-"    __kernel void SpatialMaxPooling(const __global  float* input,  /* 0 */\n"
-"                                    __global  float* output,       /* 1 */\n"
-"                                    const int input_height,        /* 2 */\n"
-"                                    const int input_width,         /* 3 */\n"
-"                                    const int kw,                  /* 4 */\n"
-"                                    const int kh,                  /* 5 */\n"
-"                                    const int dw,                  /* 6 */\n"
-"                                    const int dh,                  /* 7 */\n"
-"                                    const int padw,                /* 8 */\n"
-"                                    const int padh) {              /* 9 */\n"
+static const char* kSpatialMaxPoolingKernel = JTORCH_INDEX_PRELUDE
+"    /* Pooling parameters.  The stage compiles a specialized program */\n"
+"    /* with these defined as constants (so that the pooling loops can */\n"
+"    /* be unrolled), otherwise they fall back to the kernel arguments. */\n"
+"    #ifndef KW\n"
+"      #define KW kw\n"
+"    #endif\n"
+"    #ifndef KH\n"
+"      #define KH kh\n"
+"    #endif\n"
+"    #ifndef DW\n"
+"      #define DW dw\n"
+"    #endif\n"
+"    #ifndef DH\n"
+"      #define DH dh\n"
+"    #endif\n"
+"    #ifndef PADW\n"
+"      #define PADW padw\n"
+"    #endif\n"
+"    #ifndef PADH\n"
+"      #define PADH padh\n"
+"    #endif\n"
+"\n"
+"    __kernel void SpatialMaxPooling(\n"
+"      const __global STORAGE_T* input, /* 0 */\n"
+"      __global STORAGE_T* output,      /* 1 */\n"
+"      const int input_height,          /* 2 */\n"
+"      const int input_width,           /* 3 */\n"
+"      const int kw,                    /* 4 */\n"
+"      const int kh,                    /* 5 */\n"
+"      const int dw,                    /* 6 */\n"
+"      const int dh,                    /* 7 */\n"
+"      const int padw,                  /* 8 */\n"
+"      const int padh,                  /* 9 */\n"
+"      const INDEX_T input_offset) {    /* 10 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -32,39 +59,45 @@ static const char* kSpatialMaxPoolingKernel =
 "      /* Initilize the output to the bias */\n"
 "      float out_val = - INFINITY;\n"
 "\n"
-"      const int vstart = y_out * dh - padh;\n"
-"      const int vend = vstart + kh - 1;  /* inclusive */\n"
-"      const int ustart = x_out * dw - padw;\n"
-"      const int uend = ustart + kw - 1;  /* inclusive */\n"
+"      const int vstart = y_out * DH - PADH;\n"
+"      const int ustart = x_out * DW - PADW;\n"
 "\n"
 "      /* Get a pointer to the current input feature (that corresponds to this */\n"
 "      /* output feature; */\n"
-"      const __global  float* input_f = &input[f_out * input_width * input_height];\n"
+"      const __global  STORAGE_T* input_f =\n"
+"        &input[(INDEX_T)f_out * input_width * input_height];\n"
 "\n"
-"      for (int v = vstart; v <= vend; v++) {\n"
+"      /* Constant trip counts (when specialized) */\n"
+"      for (int i = 0; i < KH; i++) {\n"
+"        const int v = vstart + i;\n"
 "        if (v >= 0 && v < input_height) {\n"
-"          for (int u = ustart; u <= uend; u++) {\n"
+"          for (int j = 0; j < KW; j++) {\n"
+"            const int u = ustart + j;\n"
 "            if (u >= 0 && u < input_width) {\n"
-"              out_val = max(out_val, input_f[v * input_width + u]);\n"
+"              out_val = max(out_val, LOAD(input_f, v * input_width + u));\n"
 "            }\n"
 "          }\n"
 "        }\n"
 "      }\n"
 "\n"
-"      const int index = x_out + width * (y_out + height * f_out);\n"
-"      output[index] = out_val;\n"
+"      const INDEX_T index =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      STORE(out_val, output, index);\n"
 "    }\n"
 "\n"
-"    __kernel void SpatialMaxPooling2D(const __global  float* input,  /* 0 */\n"
-"                                      __global  float* output,       /* 1 */\n"
-"                                      const int input_height,        /* 2 */\n"
-"                                      const int input_width,         /* 3 */\n"
-"                                      const int kw,                  /* 4 */\n"
-"                                      const int kh,                  /* 5 */\n"
-"                                      const int dw,                  /* 6 */\n"
-"                                      const int dh,                  /* 7 */\n"
-"                                      const int padw,                /* 8 */\n"
-"                                      const int padh) {              /* 9 */\n"
+"    __kernel void SpatialMaxPooling2D(\n"
+"      const __global STORAGE_T* input, /* 0 */\n"
+"      __global STORAGE_T* output,      /* 1 */\n"
+"      const int input_height,          /* 2 */\n"
+"      const int input_width,           /* 3 */\n"
+"      const int kw,                    /* 4 */\n"
+"      const int kh,                    /* 5 */\n"
+"      const int dw,                    /* 6 */\n"
+"      const int dh,                    /* 7 */\n"
+"      const int padw,                  /* 8 */\n"
+"      const int padh,                  /* 9 */\n"
+"      const INDEX_T input_offset) {    /* 10 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -75,30 +108,92 @@ static const char* kSpatialMaxPoolingKernel =
 "      /* Initilize the output to the bias */\n"
 "      float out_val = - INFINITY;\n"
 "\n"
-"      const int vstart = y_out * dh - padh;\n"
-"      const int vend = vstart + kh - 1;  /* inclusive */\n"
-"      const int ustart = x_out * dw - padw;\n"
-"      const int uend = ustart + kw - 1;  /* inclusive */\n"
+"      const int vstart = y_out * DH - PADH;\n"
+"      const int ustart = x_out * DW - PADW;\n"
 "\n"
 "      /* Get a pointer to the current input feature (that corresponds to this */\n"
 "      /* output feature; */\n"
-"      const __global  float* input_f = input;\n"
+"      const __global  STORAGE_T* input_f = input;\n"
 "\n"
-"      for (int v = vstart; v <= vend; v++) {\n"
+"      /* Constant trip counts (when specialized) */\n"
+"      for (int i = 0; i < KH; i++) {\n"
+"        const int v = vstart + i;\n"
 "        if (v >= 0 && v < input_height) {\n"
-"          for (int u = ustart; u <= uend; u++) {\n"
+"          for (int j = 0; j < KW; j++) {\n"
+"            const int u = ustart + j;\n"
 "            if (u >= 0 && u < input_width) {\n"
-"              out_val = max(out_val, input_f[v * input_width + u]);\n"
+"              out_val = max(out_val, LOAD(input_f, v * input_width + u));\n"
 "            }\n"
 "          }\n"
 "        }\n"
 "      }\n"
 "\n"
-"      const int index = x_out + width * y_out;\n"
-"      output[index] = out_val;\n"
+"      const INDEX_T index = x_out + (INDEX_T)width * y_out;\n"
+"      STORE(out_val, output, index);\n"
 "    }";
 
 
+// Reads the input through an image (see Runtime::inputToImage()).  The
+// sampler clamps out of bounds reads to the nearest edge texel, and since every
+// pooling window overlaps the input (the padding is at most half the window),
+// that texel is always inside the window: the max is the same as skipping the
+// padding.  This is a separate program so that devices without image support
+// never compile it.
+static const char* kSpatialMaxPoolingImageKernel = JTORCH_INDEX_PRELUDE
+"    #ifndef KW\n"
+"      #define KW kw\n"
+"    #endif\n"
+"    #ifndef KH\n"
+"      #define KH kh\n"
+"    #endif\n"
+"    #ifndef DW\n"
+"      #define DW dw\n"
+"    #endif\n"
+"    #ifndef DH\n"
+"      #define DH dh\n"
+"    #endif\n"
+"    #ifndef PADW\n"
+"      #define PADW padw\n"
+"    #endif\n"
+"    #ifndef PADH\n"
+"      #define PADH padh\n"
+"    #endif\n"
+"\n"
+"    __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |\n"
+"      CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;\n"
+"\n"
+"    __kernel void SpatialMaxPoolingImage(\n"
+"      __read_only image3d_t input,  /* 0 */\n"
+"      __global  STORAGE_T* output,  /* 1 */\n"
+"      const int kw,                 /* 2 */\n"
+"      const int kh,                 /* 3 */\n"
+"      const int dw,                 /* 4 */\n"
+"      const int dh,                 /* 5 */\n"
+"      const int padw,               /* 6 */\n"
+"      const int padh) {             /* 7 */\n"
+"      const int width = get_global_size(0);\n"
+"      const int height = get_global_size(1);\n"
+"\n"
+"      const int x_out = get_global_id(0);\n"
+"      const int y_out = get_global_id(1);\n"
+"      const int f_out = get_global_id(2);\n"
+"\n"
+"      const int vstart = y_out * DH - PADH;\n"
+"      const int ustart = x_out * DW - PADW;\n"
+"\n"
+"      float out_val = - INFINITY;\n"
+"      for (int i = 0; i < KH; i++) {\n"
+"        for (int j = 0; j < KW; j++) {\n"
+"          const int4 pos = (int4)(ustart + j, vstart + i, f_out, 0);\n"
+"          out_val = max(out_val, read_imagef(input, sampler, pos).x);\n"
+"        }\n"
+"      }\n"
+"\n"
+"      const INDEX_T index =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      STORE(out_val, output, index);\n"
+"    }";
+
     SpatialMaxPooling::SpatialMaxPooling(const uint32_t kw, const uint32_t kh, 
       const uint32_t dw, const uint32_t dh, const uint32_t padw,
       const uint32_t padh)
@@ -109,6 +204,7 @@ static const char* kSpatialMaxPoolingKernel =
   dh_ = dh;
   padw_ = padw;
   padh_ = padh;
+  index64_ = false;
   output = nullptr;
 }
 
@@ -117,7 +213,8 @@ SpatialMaxPooling::~SpatialMaxPooling() {}
 void SpatialMaxPooling::init(std::shared_ptr<TorchData> input) {
   RASSERT(input->type() == TorchDataType::TENSOR_DATA);
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
-  RASSERT(in->dim() == 2 || in->dim() == 3);
+  // A batch is a 4D input (see forwardPropBatch()).
+  RASSERT(in->dim() >= 2 && in->dim() <= 4);
 
   // We'll escentially do ceil_mode = false from torch
   const uint32_t iwidth = in->size()[0];
@@ -154,30 +251,95 @@ void SpatialMaxPooling::init(std::shared_ptr<TorchData> input) {
     for (uint32_t i = 2; i < in->dim(); i++) {
       out_size[i] = in->size()[i];
     }
-    output.reset(new Tensor<float>(in->dim(), out_size.get()));
+    output.reset(
+        new Tensor<float>(in->dim(), out_size.get(), runtime_, format_));
+  }
+
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (index64 != index64_) {
+    kernel_ = nullptr;
+    kernel_2d_ = nullptr;
+    image_kernel_ = nullptr;
+    index64_ = index64;
+  }
+  const jcl::OpenCLDefines defines = programDefines(index64);
+  if (in->dim() == 2 && kernel_2d_ == nullptr) {
+    kernel_2d_ = context()->getKernelCStr(kSpatialMaxPoolingKernel,
+                                          "SpatialMaxPooling2D", defines);
+  } else if (in->dim() != 2 && kernel_ == nullptr) {
+    kernel_ = context()->getKernelCStr(kSpatialMaxPoolingKernel,
+                                       "SpatialMaxPooling", defines);
+  }
+  if (in->dim() == 3 && image_kernel_ == nullptr && runtime_->useImages()) {
+    image_kernel_ = context()->getKernelCStr(kSpatialMaxPoolingImageKernel,
+                                             "SpatialMaxPoolingImage",
+                                             defines);
+  }
+}
+
+jcl::OpenCLDefines SpatialMaxPooling::programDefines(
+    const bool index64) const {
+  // The pooling shape is fixed, so compile it in.
+  jcl::OpenCLDefines defines = KernelDefines(index64, format_);
+  defines["KW"] = std::to_string(kw_);
+  defines["KH"] = std::to_string(kh_);
+  defines["DW"] = std::to_string(dw_);
+  defines["DH"] = std::to_string(dh_);
+  defines["PADW"] = std::to_string(padw_);
+  defines["PADH"] = std::to_string(padh_);
+  return defines;
+}
+
+void SpatialMaxPooling::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back({kSpatialMaxPoolingKernel, programDefines(), false});
+  if (UseImages()) {
+    programs->push_back(
+        {kSpatialMaxPoolingImageKernel, programDefines(), false});
   }
 }
 
 void SpatialMaxPooling::forwardProp(std::shared_ptr<TorchData> input) {
+  input = contiguousInput(input, format_);
   init(input);
+  if (image_kernel_ != nullptr &&
+      runtime_->inputToImage(*TO_TENSOR_PTR(input.get()), &input_image_)) {
+    image_kernel_->setArg(0, input_image_);
+    image_kernel_->setArg(1, TO_TENSOR_PTR(output.get())->storage());
+    image_kernel_->setArg(2, (int)kw_);
+    image_kernel_->setArg(3, (int)kh_);
+    image_kernel_->setArg(4, (int)dw_);
+    image_kernel_->setArg(5, (int)dh_);
+    image_kernel_->setArg(6, (int)padw_);
+    image_kernel_->setArg(7, (int)padh_);
+    context()->runKernelAutotuned(image_kernel_.get(), deviceid(), 3,
+                                  TO_TENSOR_PTR(output.get())->size(),
+                                  false);
+    return;
+  }
   bool two_dim = TO_TENSOR_PTR(input.get())->dim() == 2;
-  if (two_dim) {
-    cl_context->useKernelCStr(kSpatialMaxPoolingKernel, "SpatialMaxPooling2D");
-  } else {
-    cl_context->useKernelCStr(kSpatialMaxPoolingKernel, "SpatialMaxPooling");
+  jcl::OpenCLKernel* kernel = two_dim ? kernel_2d_.get() : kernel_.get();
+  kernel->setArg(0, TO_TENSOR_PTR(input.get())->storage());
+  kernel->setArg(1, TO_TENSOR_PTR(output.get())->storage());
+  kernel->setArg(2, (int)TO_TENSOR_PTR(input.get())->size()[1]);
+  kernel->setArg(3, (int)TO_TENSOR_PTR(input.get())->size()[0]);
+  kernel->setArg(4, (int)kw_);
+  kernel->setArg(5, (int)kh_);
+  kernel->setArg(6, (int)dw_);
+  kernel->setArg(7, (int)dh_);
+  kernel->setArg(8, (int)padw_);
+  kernel->setArg(9, (int)padh_);
+  SetIndexArg(kernel, 10, TO_TENSOR_PTR(input.get())->offset(), index64_);
+  // The planes are pooled independently, so the samples of a batch are just
+  // more feature planes.
+  Tensor<float>* out = TO_TENSOR_PTR(output.get());
+  uint32_t global_size[3] = {out->size()[0], out->size()[1], 1};
+  for (uint32_t i = 2; i < out->dim(); i++) {
+    global_size[2] *= out->size()[i];
   }
-  cl_context->setArg(0, TO_TENSOR_PTR(input.get())->storage());
-  cl_context->setArg(1, TO_TENSOR_PTR(output.get())->storage());
-  cl_context->setArg(2, (int)TO_TENSOR_PTR(input.get())->size()[1]);
-  cl_context->setArg(3, (int)TO_TENSOR_PTR(input.get())->size()[0]);
-  cl_context->setArg(4, (int)kw_);
-  cl_context->setArg(5, (int)kh_);
-  cl_context->setArg(6, (int)dw_);
-  cl_context->setArg(7, (int)dh_);
-  cl_context->setArg(8, (int)padw_);
-  cl_context->setArg(9, (int)padh_);
-  cl_context->runKernel(jtorch::deviceid, TO_TENSOR_PTR(output.get())->dim(),
-                        TO_TENSOR_PTR(output.get())->size(), false);
+  context()->runKernelAutotuned(kernel, deviceid(), two_dim ? 2 : 3,
+                                global_size, false);
 }
 
 std::unique_ptr<TorchStage> SpatialMaxPooling::loadFromFile(
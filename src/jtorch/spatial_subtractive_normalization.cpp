@@ -1,7 +1,9 @@
 #include "jtorch/spatial_subtractive_normalization.h"
 
 #include <cstring>
+#include <string>
 
+#include "jtorch/jtorch.h"
 #include "jtorch/tensor.h"
 
 using namespace jcl::threading;
@@ -9,12 +11,27 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-static const char* kSpatialSubtractiveNormalizationKernel =
+static const char* kSpatialSubtractiveNormalizationKernel = JTORCH_INDEX_PRELUDE
+"    /* Filter radii.  The stage compiles a specialized program with these */\n"
+"    /* defined as constants (so that the filter loops can be unrolled), */\n"
+"    /* otherwise they fall back to the kernel arguments. */\n"
+"    #ifndef FILT_RAD\n"
+"      #define FILT_RAD filt_rad\n"
+"    #endif\n"
+"    #ifndef FILT_RAD_U\n"
+"      #define FILT_RAD_U filt_rad_u\n"
+"    #endif\n"
+"    #ifndef FILT_RAD_V\n"
+"      #define FILT_RAD_V filt_rad_v\n"
+"    #endif\n"
+"\n"
 "    __kernel void SpatialSubtractiveNormalizationHoriz(\n"
-"      const __global float* input,     /* 0 */\n"
-"      __global float* output,          /* 1 */\n"
+"      const __global STORAGE_T* input, /* 0 */\n"
+"      __global STORAGE_T* output,      /* 1 */\n"
 "      const __global float* kernel1d,  /* 2 */\n"
-"      const int filt_rad) {            /* 3 */\n"
+"      const int filt_rad,              /* 3 */\n"
+"      const INDEX_T input_offset) {    /* 4 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -26,22 +43,23 @@ static const char* kSpatialSubtractiveNormalizationKernel =
 "      /* Initilize the output to zero and accumulate the input values */\n"
 "      float sum = 0;\n"
 "\n"
-"      const int iout = x_out + width * (y_out + height * f_out);\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
 "\n"
 "      int i = 0;\n"
-"      for (int u_offset = -filt_rad; u_offset <= filt_rad; u_offset++, i++) {\n"
+"      for (int u_offset = -FILT_RAD; u_offset <= FILT_RAD; u_offset++, i++) {\n"
 "        int u = x_out + u_offset;\n"
 "        if (u >= 0 && u < width) {\n"
-"          sum += kernel1d[i] * input[iout + u_offset];\n"
+"          sum += kernel1d[i] * LOAD(input, iout + u_offset);\n"
 "        }\n"
 "      }\n"
 "\n"
-"      output[iout] = sum;\n"
+"      STORE(sum, output, iout);\n"
 "    }\n"
 "\n"
 "    __kernel void SpatialSubtractiveNormalizationVert(\n"
-"      const __global float* input,     /* 0 */\n"
-"      __global  float* output,         /* 1 */\n"
+"      const __global STORAGE_T* input, /* 0 */\n"
+"      __global  STORAGE_T* output,     /* 1 */\n"
 "      const __global float* kernel1d,  /* 2 */\n"
 "      const int filt_rad) {            /* 3 */\n"
 "\n"
@@ -55,25 +73,28 @@ static const char* kSpatialSubtractiveNormalizationKernel =
 "      /* Initilize the output to zero and accumulate the input values */\n"
 "      float sum = 0;\n"
 "\n"
-"      const int iout = x_out + width * (y_out + height * f_out);\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
 "\n"
 "      int i = 0;\n"
-"      for (int v_offset = -filt_rad; v_offset <= filt_rad; v_offset++, i++) {\n"
+"      for (int v_offset = -FILT_RAD; v_offset <= FILT_RAD; v_offset++, i++) {\n"
 "        int v = y_out + v_offset;\n"
 "        if (v >= 0 && v < height) {\n"
-"          sum += kernel1d[i] * input[iout + v_offset * width];\n"
+"          sum += kernel1d[i] * LOAD(input, iout + v_offset * width);\n"
 "        }\n"
 "      }\n"
 "\n"
-"      output[iout] = sum;\n"
+"      STORE(sum, output, iout);\n"
 "    }\n"
 "\n"
 "    __kernel void SpatialSubtractiveNormalization2D(\n"
-"      const __global float* input,     /* 0 */\n"
-"      __global  float* output,         /* 1 */\n"
+"      const __global STORAGE_T* input, /* 0 */\n"
+"      __global  STORAGE_T* output,     /* 1 */\n"
 "      const __global float* kernel2d,  /* 2 */\n"
 "      const int filt_rad_u,            /* 3 */\n"
-"      const int filt_rad_v) {          /* 4 */\n"
+"      const int filt_rad_v,            /* 4 */\n"
+"      const INDEX_T input_offset) {    /* 5 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -85,27 +106,28 @@ static const char* kSpatialSubtractiveNormalizationKernel =
 "      /* Initilize the output to zero and accumulate the input values */\n"
 "      float sum = 0;\n"
 "\n"
-"      const int iout = x_out + width * (y_out + height * f_out);\n"
-"      const int filt_size_u = 2 * filt_rad_u + 1;\n"
+"      const INDEX_T iout =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      const int filt_size_u = 2 * FILT_RAD_U + 1;\n"
 "\n"
-"      for (int v_offset = -filt_rad_v; v_offset <= filt_rad_v; v_offset++) {\n"
+"      for (int v_offset = -FILT_RAD_V; v_offset <= FILT_RAD_V; v_offset++) {\n"
 "        int v = y_out + v_offset;\n"
-"        int v_filt = v_offset + filt_rad_v;\n"
-"        for (int u_offset = -filt_rad_u; u_offset <= filt_rad_u; u_offset++) {\n"
+"        int v_filt = v_offset + FILT_RAD_V;\n"
+"        for (int u_offset = -FILT_RAD_U; u_offset <= FILT_RAD_U; u_offset++) {\n"
 "          int u = x_out + u_offset;\n"
-"          int u_filt = u_offset + filt_rad_u;\n"
+"          int u_filt = u_offset + FILT_RAD_U;\n"
 "          if (v >= 0 && v < height && u >= 0 && u < width) {\n"
 "            sum += kernel2d[v_filt * filt_size_u + u_filt] * \n"
-"              input[iout + v_offset * width + u_offset];\n"
+"              LOAD(input, iout + v_offset * width + u_offset);\n"
 "          }\n"
 "        }\n"
 "      }\n"
 "\n"
-"      output[iout] = sum;\n"
+"      STORE(sum, output, iout);\n"
 "    }\n"
 "\n"
 "    __kernel void SpatialSubtractiveNormalizationAccumDiv(\n"
-"      const __global float* input,       /* 0 */\n"
+"      const __global STORAGE_T* input,   /* 0 */\n"
 "      __global  float* output,           /* 1 */\n"
 "      const __global float* mean_coeff,  /* 2 */\n"
 "      const int input_nfeats) {          /* 3 */\n"
@@ -121,18 +143,20 @@ static const char* kSpatialSubtractiveNormalizationKernel =
 "      float sum = 0;\n"
 "\n"
 "      const int uvout = x_out + width * y_out;  /* index on each input image */\n"
-"      const int im_dim = width * height;\n"
+"      const INDEX_T im_dim = width * height;\n"
 "      for (int f = 0; f < input_nfeats; f++) {\n"
-"        sum += input[f * im_dim + uvout];\n"
+"        sum += LOAD(input, f * im_dim + uvout);\n"
 "      }\n"
 "\n"
 "      output[uvout] = sum / ((float)input_nfeats * (float)input_nfeats * mean_coeff[uvout]);\n"
 "    }\n"
 "\n"
 "    __kernel void SpatialSubtractiveNormalization(\n"
-"      const __global float* input,      /* 0 */\n"
-"      __global float* output,           /* 1 */\n"
-"      const __global float* mean) {     /* 2 */\n"
+"      const __global STORAGE_T* input,  /* 0 */\n"
+"      __global STORAGE_T* output,       /* 1 */\n"
+"      const __global float* mean,       /* 2 */\n"
+"      const INDEX_T input_offset) {     /* 3 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
@@ -141,8 +165,10 @@ static const char* kSpatialSubtractiveNormalizationKernel =
 "      const int y_out = get_global_id(1);\n"
 "      const int f_out = get_global_id(2);\n"
 "\n"
-"      const int index = x_out + width * (y_out + height * f_out);\n"
-"      output[index] = input[index] - mean[y_out * width + x_out];\n"
+"      const INDEX_T index =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
+"      const float x = LOAD(input, index);\n"
+"      STORE(x - mean[y_out * width + x_out], output, index);\n"
 "    }";
 
 
@@ -159,7 +185,8 @@ SpatialSubtractiveNormalization::SpatialSubtractiveNormalization(
 
   // Clone and normalize the input kernel
   kernel_ = Tensor<float>::clone(*kernel.get());
-  float sum = Tensor<float>::slowSum(*kernel_);
+  kernel_->storage()->setTag(jcl::CLBufferTagWeights);
+  float sum = Tensor<float>::sum(*kernel_);
   Tensor<float>::div(*kernel_, sum);
 
   output = nullptr;
@@ -167,6 +194,7 @@ SpatialSubtractiveNormalization::SpatialSubtractiveNormalization(
   mean_pass1_ = nullptr;
   mean_pass2_ = nullptr;
   mean_ = nullptr;
+  index64_ = false;
 }
 
 SpatialSubtractiveNormalization::~SpatialSubtractiveNormalization() {
@@ -195,16 +223,24 @@ void SpatialSubtractiveNormalization::init(std::shared_ptr<TorchData> input) {
   }
 
   if (output == nullptr) {
-    output.reset(new Tensor<float>(in->dim(), in->size()));
-    mean_pass1_.reset(new Tensor<float>(in->dim(), in->size()));
-    mean_pass2_.reset(new Tensor<float>(in->dim(), in->size()));
+    // The full size tensors are in format_ (the 2D ones and the filter stay
+    // float).
+    output.reset(
+        new Tensor<float>(in->dim(), in->size(), runtime_, format_));
+    mean_pass1_.reset(
+        new Tensor<float>(in->dim(), in->size(), runtime_, format_));
+    mean_pass1_->storage()->setTag(jcl::CLBufferTagScratch);
+    mean_pass2_.reset(
+        new Tensor<float>(in->dim(), in->size(), runtime_, format_));
+    mean_pass2_->storage()->setTag(jcl::CLBufferTagScratch);
   }
 
   if (mean_coef_ == nullptr) {
     uint32_t mean_coeff_size[2];
     mean_coeff_size[0] = TO_TENSOR_PTR(output.get())->size()[0];
     mean_coeff_size[1] = TO_TENSOR_PTR(output.get())->size()[1];
-    mean_coef_.reset(new Tensor<float>(2, mean_coeff_size));
+    mean_coef_.reset(new Tensor<float>(2, mean_coeff_size, runtime_));
+    mean_coef_->storage()->setTag(jcl::CLBufferTagScratch);
 
     std::unique_ptr<float[]> mean_coef_cpu(new float[mean_coef_->nelems()]);
     std::unique_ptr<float[]> kernel_cpu(new float[kernel_->nelems()]);
@@ -269,12 +305,61 @@ void SpatialSubtractiveNormalization::init(std::shared_ptr<TorchData> input) {
     uint32_t mean_coeff_size[2];
     mean_coeff_size[0] = TO_TENSOR_PTR(output.get())->size()[0];
     mean_coeff_size[1] = TO_TENSOR_PTR(output.get())->size()[1];
-    mean_.reset(new Tensor<float>(2, mean_coeff_size));
+    mean_.reset(new Tensor<float>(2, mean_coeff_size, runtime_));
+    mean_->storage()->setTag(jcl::CLBufferTagScratch);
+  }
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (normalize_kernel_ == nullptr || index64 != index64_) {
+    const jcl::OpenCLDefines defines = programDefines(index64);
+    if (kernel_->dim() == 1) {
+      horiz_kernel_ = context()->getKernelCStr(
+          kSpatialSubtractiveNormalizationKernel,
+          "SpatialSubtractiveNormalizationHoriz", defines);
+      vert_kernel_ = context()->getKernelCStr(
+          kSpatialSubtractiveNormalizationKernel,
+          "SpatialSubtractiveNormalizationVert", defines);
+    } else {
+      filter_2d_kernel_ = context()->getKernelCStr(
+          kSpatialSubtractiveNormalizationKernel,
+          "SpatialSubtractiveNormalization2D", defines);
+    }
+    accum_div_kernel_ = context()->getKernelCStr(
+        kSpatialSubtractiveNormalizationKernel,
+        "SpatialSubtractiveNormalizationAccumDiv", defines);
+    normalize_kernel_ = context()->getKernelCStr(
+        kSpatialSubtractiveNormalizationKernel,
+        "SpatialSubtractiveNormalization", defines);
+    index64_ = index64;
+  }
+}
+
+jcl::OpenCLDefines SpatialSubtractiveNormalization::programDefines(
+    const bool index64) const {
+  // The filter size is fixed, so compile it in.
+  jcl::OpenCLDefines defines = KernelDefines(index64, format_);
+  if (kernel_->dim() == 1) {
+    defines["FILT_RAD"] = std::to_string((kernel_->size()[0] - 1) / 2);
+  } else {
+    defines["FILT_RAD_U"] = std::to_string((kernel_->size()[0] - 1) / 2);
+    defines["FILT_RAD_V"] = std::to_string((kernel_->size()[1] - 1) / 2);
   }
+  return defines;
+}
+
+void SpatialSubtractiveNormalization::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back(
+      {kSpatialSubtractiveNormalizationKernel, programDefines(), false});
 }
 
 void SpatialSubtractiveNormalization::forwardProp(
     std::shared_ptr<TorchData> input) {
+  // Batches are normalized sample by sample (see forwardPropBatch()).
+  if (forwardPropSamples(input, 3)) {
+    return;
+  }
+  input = contiguousInput(input, format_);
   init(input);
   bool onedim_kernel = kernel_->dim() == 1;
 
@@ -285,56 +370,54 @@ void SpatialSubtractiveNormalization::forwardProp(
     int32_t filt_rad = ((int32_t)kernel_->size()[0] - 1) / 2;
 
     // Perform horizontal filter pass
-    cl_context->useKernelCStr(kSpatialSubtractiveNormalizationKernel,
-                              "SpatialSubtractiveNormalizationHoriz");
-    cl_context->setArg(0, in->storage());
-    cl_context->setArg(1, mean_pass1_->storage());
-    cl_context->setArg(2, kernel_->storage());
-    cl_context->setArg(3, filt_rad);
-    cl_context->runKernel(jtorch::deviceid, mean_pass1_->dim(),
-                          mean_pass1_->size(), false);
+    horiz_kernel_->setArg(0, in->storage());
+    horiz_kernel_->setArg(1, mean_pass1_->storage());
+    horiz_kernel_->setArg(2, kernel_->storage());
+    horiz_kernel_->setArg(3, filt_rad);
+    SetIndexArg(horiz_kernel_.get(), 4, in->offset(), index64_);
+    context()->runKernelAutotuned(horiz_kernel_.get(), deviceid(),
+                                  mean_pass1_->dim(), mean_pass1_->size(),
+                                  false);
 
     // Perform vertical filter pass
-    cl_context->useKernelCStr(kSpatialSubtractiveNormalizationKernel,
-                              "SpatialSubtractiveNormalizationVert");
-    cl_context->setArg(0, mean_pass1_->storage());
-    cl_context->setArg(1, mean_pass2_->storage());
-    cl_context->setArg(2, kernel_->storage());
-    cl_context->setArg(3, filt_rad);
-    cl_context->runKernel(jtorch::deviceid, mean_pass2_->dim(),
-                          mean_pass2_->size(), false);
+    vert_kernel_->setArg(0, mean_pass1_->storage());
+    vert_kernel_->setArg(1, mean_pass2_->storage());
+    vert_kernel_->setArg(2, kernel_->storage());
+    vert_kernel_->setArg(3, filt_rad);
+    context()->runKernelAutotuned(vert_kernel_.get(), deviceid(),
+                                  mean_pass2_->dim(), mean_pass2_->size(),
+                                  false);
   } else {
     int32_t filt_rad_u = ((int32_t)kernel_->size()[0] - 1) / 2;
     int32_t filt_rad_v = ((int32_t)kernel_->size()[1] - 1) / 2;
 
     // Perform horizontal filter pass
-    cl_context->useKernelCStr(kSpatialSubtractiveNormalizationKernel,
-                              "SpatialSubtractiveNormalization2D");
-    cl_context->setArg(0, in->storage());
-    cl_context->setArg(1, mean_pass2_->storage());
-    cl_context->setArg(2, kernel_->storage());
-    cl_context->setArg(3, filt_rad_u);
-    cl_context->setArg(4, filt_rad_v);
-    cl_context->runKernel(jtorch::deviceid, mean_pass2_->dim(),
-                          mean_pass2_->size(), false);
+    filter_2d_kernel_->setArg(0, in->storage());
+    filter_2d_kernel_->setArg(1, mean_pass2_->storage());
+    filter_2d_kernel_->setArg(2, kernel_->storage());
+    filter_2d_kernel_->setArg(3, filt_rad_u);
+    filter_2d_kernel_->setArg(4, filt_rad_v);
+    SetIndexArg(filter_2d_kernel_.get(), 5, in->offset(), index64_);
+    context()->runKernelAutotuned(filter_2d_kernel_.get(), deviceid(),
+                                  mean_pass2_->dim(), mean_pass2_->size(),
+                                  false);
   }
 
   // Perform accumulation and division pass
-  cl_context->useKernelCStr(kSpatialSubtractiveNormalizationKernel,
-                            "SpatialSubtractiveNormalizationAccumDiv");
-  cl_context->setArg(0, mean_pass2_->storage());
-  cl_context->setArg(1, mean_->storage());
-  cl_context->setArg(2, mean_coef_->storage());
-  cl_context->setArg(3, (int)out->size()[2]);
-  cl_context->runKernel(jtorch::deviceid, mean_->dim(), mean_->size(), false);
+  accum_div_kernel_->setArg(0, mean_pass2_->storage());
+  accum_div_kernel_->setArg(1, mean_->storage());
+  accum_div_kernel_->setArg(2, mean_coef_->storage());
+  accum_div_kernel_->setArg(3, (int)out->size()[2]);
+  context()->runKernelAutotuned(accum_div_kernel_.get(), deviceid(),
+                                mean_->dim(), mean_->size(), false);
 
   // Perform normalization pass
-  cl_context->useKernelCStr(kSpatialSubtractiveNormalizationKernel,
-                            "SpatialSubtractiveNormalization");
-  cl_context->setArg(0, in->storage());
-  cl_context->setArg(1, out->storage());
-  cl_context->setArg(2, mean_->storage());
-  cl_context->runKernel(jtorch::deviceid, out->dim(), out->size(), false);
+  normalize_kernel_->setArg(0, in->storage());
+  normalize_kernel_->setArg(1, out->storage());
+  normalize_kernel_->setArg(2, mean_->storage());
+  SetIndexArg(normalize_kernel_.get(), 3, in->offset(), index64_);
+  context()->runKernelAutotuned(normalize_kernel_.get(), deviceid(),
+                                out->dim(), out->size(), false);
 }
 
 std::unique_ptr<TorchStage> SpatialSubtractiveNormalization::loadFromFile(
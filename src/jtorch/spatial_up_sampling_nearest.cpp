@@ -10,11 +10,13 @@ using namespace jcl;
 
 namespace jtorch {
 
-static const char* kSpatialUpSamplingNearest =
+static const char* kSpatialUpSamplingNearest = JTORCH_INDEX_PRELUDE
 "    __kernel void SpatialUpSamplingNearest(\n"
-"      const __global  float* input,  /* 0 */\n"
-"      __global  float* output,       /* 1 */\n"
-"      const int scale) {             /* 2 */\n"
+"      const __global  STORAGE_T* input,  /* 0 */\n"
+"      __global  STORAGE_T* output,       /* 1 */\n"
+"      const int scale,                   /* 2 */\n"
+"      const INDEX_T input_offset) {      /* 3 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width_out = get_global_size(0);\n"
 "      const int height_out = get_global_size(1);\n"
@@ -30,16 +32,20 @@ static const char* kSpatialUpSamplingNearest =
 "      const int y_in = y_out / scale;\n"
 "      const int f_in = f_out;\n"
 "\n"
-"      const int iout = x_out + width_out * (y_out + height_out * f_out);\n"
-"      const int iin = x_in + width_in * (y_in + height_in * f_in);\n"
+"      const INDEX_T iout =\n"
+"        x_out + width_out * (y_out + height_out * (INDEX_T)f_out);\n"
+"      const INDEX_T iin =\n"
+"        x_in + width_in * (y_in + height_in * (INDEX_T)f_in);\n"
 "\n"
-"      output[iout] = input[iin];\n"
+"      STORE(LOAD(input, iin), output, iout);\n"
 "    }\n"
 "\n"
 "    __kernel void SpatialUpSamplingNearest2D(\n"
-"      const __global  float* input,  /* 0 */\n"
-"      __global  float* output,       /* 1 */\n"
-"      const int scale) {             /* 2 */\n"
+"      const __global  STORAGE_T* input,  /* 0 */\n"
+"      __global  STORAGE_T* output,       /* 1 */\n"
+"      const int scale,                   /* 2 */\n"
+"      const INDEX_T input_offset) {      /* 3 */\n"
+"      input += input_offset;\n"
 "\n"
 "      const int width_out = get_global_size(0);\n"
 "      const int height_out = get_global_size(1);\n"
@@ -53,15 +59,39 @@ static const char* kSpatialUpSamplingNearest =
 "      const int x_in = x_out / scale;\n"
 "      const int y_in = y_out / scale;\n"
 "\n"
-"      const int iout = x_out + width_out * (y_out);\n"
-"      const int iin = x_in + width_in * (y_in);\n"
+"      const INDEX_T iout = x_out + (INDEX_T)width_out * y_out;\n"
+"      const INDEX_T iin = x_in + (INDEX_T)width_in * y_in;\n"
 "\n"
-"      output[iout] = input[iin];\n"
+"      STORE(LOAD(input, iin), output, iout);\n"
+"    }";
+
+// Reads the input through an image (see Runtime::inputToImage()).  This is a
+// separate program so that devices without image support never compile it.
+static const char* kSpatialUpSamplingNearestImage = JTORCH_INDEX_PRELUDE
+"    __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE |\n"
+"      CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;\n"
+"\n"
+"    __kernel void SpatialUpSamplingNearestImage(\n"
+"      __read_only image3d_t input,  /* 0 */\n"
+"      __global  STORAGE_T* output,  /* 1 */\n"
+"      const int scale) {            /* 2 */\n"
+"      const int width_out = get_global_size(0);\n"
+"      const int height_out = get_global_size(1);\n"
+"\n"
+"      const int x_out = get_global_id(0);\n"
+"      const int y_out = get_global_id(1);\n"
+"      const int f_out = get_global_id(2);\n"
+"\n"
+"      const int4 pos = (int4)(x_out / scale, y_out / scale, f_out, 0);\n"
+"      const INDEX_T iout =\n"
+"        x_out + width_out * (y_out + height_out * (INDEX_T)f_out);\n"
+"      STORE(read_imagef(input, sampler, pos).x, output, iout);\n"
 "    }";
 
 SpatialUpSamplingNearest::SpatialUpSamplingNearest(const int32_t scale)
     : TorchStage() {
   scale_ = scale;
+  index64_ = false;
   output = nullptr;
   out_size_ = nullptr;
 }
@@ -103,26 +133,72 @@ void SpatialUpSamplingNearest::init(std::shared_ptr<TorchData> input) {
     out_size[0] *= scale_;
     out_size[1] *= scale_;
 
-    output.reset(new Tensor<float>(in->dim(), out_size.get()));
+    output.reset(
+        new Tensor<float>(in->dim(), out_size.get(), runtime_, format_));
+  }
+
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (index64 != index64_) {
+    kernel_ = nullptr;
+    kernel_2d_ = nullptr;
+    image_kernel_ = nullptr;
+    index64_ = index64;
+  }
+  const jcl::OpenCLDefines& defines = KernelDefines(index64, format_);
+  if (in->dim() == 2 && kernel_2d_ == nullptr) {
+    kernel_2d_ = context()->getKernelCStr(kSpatialUpSamplingNearest,
+                                          "SpatialUpSamplingNearest2D",
+                                          defines);
+  } else if (in->dim() != 2 && kernel_ == nullptr) {
+    kernel_ = context()->getKernelCStr(kSpatialUpSamplingNearest,
+                                       "SpatialUpSamplingNearest", defines);
+  }
+  if (in->dim() == 3 && image_kernel_ == nullptr && runtime_->useImages()) {
+    image_kernel_ = context()->getKernelCStr(kSpatialUpSamplingNearestImage,
+                                             "SpatialUpSamplingNearestImage",
+                                             defines);
+  }
+}
+
+void SpatialUpSamplingNearest::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  const jcl::OpenCLDefines& defines = KernelDefines(false, format_);
+  programs->push_back({kSpatialUpSamplingNearest, defines, false});
+  if (UseImages()) {
+    programs->push_back({kSpatialUpSamplingNearestImage, defines, false});
   }
 }
 
 void SpatialUpSamplingNearest::forwardProp(std::shared_ptr<TorchData> input) {
+  input = contiguousInput(input, format_);
   init(input);
 
   Tensor<float>* in = TO_TENSOR_PTR(input.get());
-  if (in->dim() == 2) {
-    cl_context->useKernelCStr(kSpatialUpSamplingNearest,
-                              "SpatialUpSamplingNearest2D");
-  } else {
-    cl_context->useKernelCStr(kSpatialUpSamplingNearest,
-                              "SpatialUpSamplingNearest");
+  if (image_kernel_ != nullptr &&
+      runtime_->inputToImage(*in, &input_image_)) {
+    image_kernel_->setArg(0, input_image_);
+    image_kernel_->setArg(1, TO_TENSOR_PTR(output.get())->storage());
+    image_kernel_->setArg(2, (int)scale_);
+    context()->runKernel(image_kernel_.get(), deviceid(), 3,
+                         TO_TENSOR_PTR(output.get())->size(), false);
+    return;
+  }
+  jcl::OpenCLKernel* kernel =
+      in->dim() == 2 ? kernel_2d_.get() : kernel_.get();
+  kernel->setArg(0, TO_TENSOR_PTR(input.get())->storage());
+  kernel->setArg(1, TO_TENSOR_PTR(output.get())->storage());
+  kernel->setArg(2, (int)scale_);
+  SetIndexArg(kernel, 3, in->offset(), index64_);
+  // The dimensions above the lowest 2 (ie the samples of a batch, see
+  // forwardPropBatch()) are all just more planes.
+  Tensor<float>* out = TO_TENSOR_PTR(output.get());
+  uint32_t global_size[3] = {out->size()[0], out->size()[1], 1};
+  for (uint32_t i = 2; i < out->dim(); i++) {
+    global_size[2] *= out->size()[i];
   }
-  cl_context->setArg(0, TO_TENSOR_PTR(input.get())->storage());
-  cl_context->setArg(1, TO_TENSOR_PTR(output.get())->storage());
-  cl_context->setArg(2, (int)scale_);
-  cl_context->runKernel(jtorch::deviceid, TO_TENSOR_PTR(output.get())->dim(),
-                        TO_TENSOR_PTR(output.get())->size(), false);
+  context()->runKernel(kernel, deviceid(), in->dim() == 2 ? 2 : 3,
+                       global_size, false);
 }
 
 std::unique_ptr<TorchStage> SpatialUpSamplingNearest::loadFromFile(
@@ -10,9 +10,10 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-static const char* kTanhKernel =
-"    __kernel void TanH(const __global float* input, __global float* output) {\n"
+static const char* kTanhKernel = JTORCH_INDEX_PRELUDE
+"    __kernel void TanH(const __global STORAGE_T* input, __global STORAGE_T* output, const INDEX_T input_offset) {\n"
 "\n"
+"      input += input_offset;\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
 "\n"
@@ -20,20 +21,26 @@ static const char* kTanhKernel =
 "      const int y_out = get_global_id(1);\n"
 "      const int f_out = get_global_id(2);\n"
 "\n"
-"      const int index = x_out + width * (y_out + height * f_out);\n"
+"      const INDEX_T index =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
 "\n"
-"      output[index] = tanh(input[index]);\n"
+"      STORE(tanh(LOAD(input, index)), output, index);\n"
 "    }\n"
 "\n"
-"    __kernel void TanH1D(const __global float* input, __global float* output) {\n"
+"    __kernel void TanH1D(const __global STORAGE_T* input, __global STORAGE_T* output, const INDEX_T input_offset, const INDEX_T output_offset) {\n"
 "\n"
+"      input += input_offset;\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
 "\n"
-"      output[x_out] = tanh(input[x_out]);\n"
+"      STORE(tanh(LOAD(input, x_out)), output, x_out);\n"
 "    }";
 
 
-Tanh::Tanh() : TorchStage() { output = nullptr; }
+Tanh::Tanh() : TorchStage() {
+  output = nullptr;
+  index64_ = false;
+}
 
 Tanh::~Tanh() {}
 
@@ -48,18 +55,34 @@ void Tanh::init(std::shared_ptr<TorchData> input) {
     }
   }
   if (output == nullptr) {
-    output.reset(new Tensor<float>(in->dim(), in->size()));
+    output.reset(
+        new Tensor<float>(in->dim(), in->size(), runtime_, format_));
+  }
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (kernel_ == nullptr || index64 != index64_) {
+    kernel_ = context()->getKernelCStr(kTanhKernel, "TanH1D",
+                                       KernelDefines(index64, format_));
+    index64_ = index64;
   }
 }
 
+void Tanh::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back(
+      {kTanhKernel, KernelDefines(false, format_), false});
+}
+
 void Tanh::forwardProp(std::shared_ptr<TorchData> input) {
+  input = contiguousInput(input, format_);
   init(input);
-  cl_context->useKernelCStr(kTanhKernel, "TanH1D");
-  cl_context->setArg(0, TO_TENSOR_PTR(input.get())->storage());
-  cl_context->setArg(1, TO_TENSOR_PTR(output.get())->storage());
-  uint32_t dim = 1;
-  uint32_t nelem = TO_TENSOR_PTR(output.get())->nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+  Tensor<float>* out = TO_TENSOR_PTR(output.get());
+  kernel_->setArg(0, in->storage());
+  kernel_->setArg(1, out->storage());
+  runtime_->runElementwiseKernel(kernel_.get(), 2,
+                                 {in->offset(), out->offset()}, out->nelems(),
+                                 index64_);
 }
 
 std::unique_ptr<TorchStage> Tanh::loadFromFile(std::ifstream& file) {
@@ -10,13 +10,15 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-static const char* kThresholdKernel =
+static const char* kThresholdKernel = JTORCH_INDEX_PRELUDE
 "    __kernel void Threshold(\n"
-"      const __global  float* input, \n"
-"      __global float* output,\n"
+"      const __global STORAGE_T* input,\n"
+"      __global STORAGE_T* output,\n"
 "      const float threshold, \n"
-"      const float val) {\n"
+"      const float val,\n"
+"      const INDEX_T input_offset) {\n"
 "\n"
+"      input += input_offset;\n"
 "      const int width = get_global_size(0);\n"
 "      const int height = get_global_size(1);\n"
 "\n"
@@ -24,30 +26,39 @@ static const char* kThresholdKernel =
 "      const int y_out = get_global_id(1);\n"
 "      const int f_out = get_global_id(2);\n"
 "\n"
-"      const int index = x_out + width * (y_out + height * f_out);\n"
+"      const INDEX_T index =\n"
+"        x_out + width * (y_out + height * (INDEX_T)f_out);\n"
 "\n"
-"      output[index] = input[index] > threshold ? input[index] : val;\n"
+"      const float x = LOAD(input, index);\n"
+"      STORE(x > threshold ? x : val, output, index);\n"
 "    }\n"
 "\n"
 "    __kernel void Threshold1D(\n"
-"      const __global  float* input, \n"
-"      __global float* output,\n"
+"      const __global STORAGE_T* input,\n"
+"      __global STORAGE_T* output,\n"
 "      const float threshold, \n"
-"      const float val) {\n"
+"      const float val,\n"
+"      const INDEX_T input_offset,\n"
+"      const INDEX_T output_offset) {\n"
 "\n"
+"      input += input_offset;\n"
+"      output += output_offset;\n"
 "      const int x_out = get_global_id(0);\n"
 "\n"
-"      output[x_out] = input[x_out] > threshold ? input[x_out] : val;\n"
+"      const float x = LOAD(input, x_out);\n"
+"      STORE(x > threshold ? x : val, output, x_out);\n"
 "    }";
 
 Threshold::Threshold(const float threshold, const float val) : TorchStage() {
   output = nullptr;
+  index64_ = false;
   threshold_ = threshold;
   val_ = val;
 }
 
 Threshold::Threshold() : TorchStage() {
   output = nullptr;
+  index64_ = false;
   threshold_ = 1e-6f;
   val_ = 0;
 }
@@ -64,20 +75,36 @@ void Threshold::init(std::shared_ptr<TorchData> input) {
     }
   }
   if (output == nullptr) {
-    output.reset(new Tensor<float>(in->dim(), in->size()));
+    output.reset(
+        new Tensor<float>(in->dim(), in->size(), runtime_, format_));
   }
+  const bool index64 =
+      in->index64() || TO_TENSOR_PTR(output.get())->index64();
+  if (kernel_ == nullptr || index64 != index64_) {
+    kernel_ = context()->getKernelCStr(kThresholdKernel, "Threshold1D",
+                                       KernelDefines(index64, format_));
+    index64_ = index64;
+  }
+}
+
+void Threshold::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {
+  programs->push_back(
+      {kThresholdKernel, KernelDefines(false, format_), false});
 }
 
 void Threshold::forwardProp(std::shared_ptr<TorchData> input) {
+  input = contiguousInput(input, format_);
   init(input);
-  cl_context->useKernelCStr(kThresholdKernel, "Threshold1D");
-  cl_context->setArg(0, TO_TENSOR_PTR(input.get())->storage());
-  cl_context->setArg(1, TO_TENSOR_PTR(output.get())->storage());
-  cl_context->setArg(2, threshold_);
-  cl_context->setArg(3, val_);
-  uint32_t dim = 1;
-  uint32_t nelem = TO_TENSOR_PTR(output.get())->nelems();
-  cl_context->runKernel(jtorch::deviceid, dim, &nelem, false);
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+  Tensor<float>* out = TO_TENSOR_PTR(output.get());
+  kernel_->setArg(0, in->storage());
+  kernel_->setArg(1, out->storage());
+  kernel_->setArg(2, threshold_);
+  kernel_->setArg(3, val_);
+  runtime_->runElementwiseKernel(kernel_.get(), 4,
+                                 {in->offset(), out->offset()}, out->nelems(),
+                                 index64_);
 }
 
 std::unique_ptr<TorchStage> Threshold::loadFromFile(std::ifstream& file) {
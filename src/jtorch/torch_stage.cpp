@@ -1,9 +1,11 @@
 #include "jtorch/torch_stage.h"
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
+#include <vector>
 
 #include "jcl/opencl_context.h"
 #include "jtorch/c_add_table.h"
@@ -11,6 +13,7 @@
 #include "jtorch/concat_table.h"
 #include "jtorch/identity.h"
 #include "jtorch/join_table.h"
+#include "jtorch/jtorch.h"
 #include "jtorch/linear.h"
 #include "jtorch/mul_constant.h"
 #include "jtorch/narrow.h"
@@ -31,24 +34,165 @@
 #include "jtorch/spatial_subtractive_normalization.h"
 #include "jtorch/spatial_up_sampling_nearest.h"
 #include "jtorch/tanh.h"
+#include "jtorch/tensor.h"
 #include "jtorch/threshold.h"
 #include "jtorch/transpose.h"
 #include "jtorch/view.h"
 
 namespace jtorch {
 
-TorchStage::TorchStage() { output = nullptr; }
+namespace {
+
+// The format of the stages created by the calling thread (see
+// TorchStage::loadFromFile()).
+thread_local StorageFormat load_format = FLOAT_STORAGE;
+
+// Whether the calling thread is in TorchStage::forwardPropBatch().
+thread_local bool batch_mode = false;
+
+// Sets one of the flags above for the lifetime of the scope, and then
+// restores its previous value (also when the scope is left by an exception).
+template <typename T>
+class ScopedFlag {
+ public:
+  ScopedFlag(T& flag, const T value) : flag_(flag), previous_(flag) {
+    flag_ = value;
+  }
+  ~ScopedFlag() { flag_ = previous_; }
+
+ private:
+  T& flag_;
+  const T previous_;
+
+  // Non-copyable, non-assignable.
+  ScopedFlag(const ScopedFlag&) = delete;
+  ScopedFlag& operator=(const ScopedFlag&) = delete;
+};
+
+}  // namespace
+
+TorchStage::TorchStage() {
+  runtime_ = Runtime::Current();
+  RASSERT(runtime_ != nullptr);
+  format_ = load_format;
+  output = nullptr;
+}
 
 TorchStage::~TorchStage() {}
 
-std::unique_ptr<TorchStage> TorchStage::loadFromFile(const std::string& file) {
+void TorchStage::getPrograms(
+    std::vector<jcl::OpenCLProgramSource>* programs) const {}
+
+void TorchStage::forwardPropBatch(std::shared_ptr<TorchData> input) {
+  // Nested calls (ie from a container's children) are just forwardProps.
+  ScopedFlag<bool> scoped_batch_mode(batch_mode, true);
+  forwardProp(input);
+}
+
+bool TorchStage::batchMode() { return batch_mode; }
+
+uint32_t TorchStage::sampleDim(const Tensor<float>& t) {
+  if (!batch_mode) {
+    return t.dim();
+  }
+  RASSERT(t.dim() > 0);
+  return t.dim() - 1;
+}
+
+bool TorchStage::forwardPropSamples(std::shared_ptr<TorchData> input,
+                                    const uint32_t sample_dim) {
+  if (batch_output_ != nullptr && output.get() == batch_output_.get()) {
+    // Back from a batch: the stage keeps using its own output.
+    output = sample_output_;
+  }
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+  if (in == nullptr || in->dim() != sample_dim + 1) {
+    return false;
+  }
+  const uint32_t batch_size = in->size()[sample_dim];
+  for (uint32_t b = 0; b < batch_size; b++) {
+    forwardProp(Tensor<float>::selectOuterDim(*in, b));
+    Tensor<float>* out = TO_TENSOR_PTR(output.get());
+    RASSERT(out != nullptr);
+    if (b == 0) {
+      std::vector<uint32_t> size(out->size(), out->size() + out->dim());
+      size.push_back(batch_size);
+      if (batch_output_ == nullptr || batch_output_->dim() != size.size() ||
+          !std::equal(size.begin(), size.end(), batch_output_->size()) ||
+          batch_output_->format() != out->format()) {
+        batch_output_.reset(new Tensor<float>(
+            (uint32_t)size.size(), size.data(), runtime_, out->format()));
+      }
+    }
+    Tensor<float>::copy(*Tensor<float>::selectOuterDim(*batch_output_, b),
+                        *out);
+  }
+  sample_output_ = output;
+  output = batch_output_;
+  return true;
+}
+
+void TorchStage::calibrate(const bool calibrating) {}
+
+void TorchStage::quantize() {}
+
+std::shared_ptr<TorchData> TorchStage::contiguousInput(
+    std::shared_ptr<TorchData> input, const StorageFormat format) {
+  Tensor<float>* in = TO_TENSOR_PTR(input.get());
+  if (in == nullptr || (in->isContiguous() && in->format() == format)) {
+    return input;
+  }
+  if (contiguous_input_ == nullptr || contiguous_input_->format() != format) {
+    contiguous_input_.reset(new Tensor<float>(runtime_, format));
+  }
+  contiguous_input_->resizeAs(*in);
+  Tensor<float>::copy(*contiguous_input_, *in);
+  return contiguous_input_;
+}
+
+void TorchStage::prepare(std::shared_ptr<TorchData> sample_input,
+                         const uint32_t num_threads) {
+  // Stages also use the Tensor kernels (ie for copies and fills).
+  const char* tensor_kernels[] = {
+      kFillKernel,    kAccumulateKernel, kAddKernel,    kSubKernel,
+      kAbsKernel,     kCopyKernel,       kMulKernel,    kAddScalarKernel,
+      kStridedKernel, kReduceKernel,     kConvertKernel};
+  std::vector<jcl::OpenCLProgramSource> programs;
+  for (const char* kernel : tensor_kernels) {
+    programs.push_back({kernel, jcl::OpenCLDefines(), false});
+    if (format_ != FLOAT_STORAGE) {
+      programs.push_back({kernel, KernelDefines(false, format_), false});
+    }
+  }
+  getPrograms(&programs);
+  context()->buildProgramsCStr(programs, num_threads);
+
+  if (sample_input != nullptr) {
+    forwardProp(sample_input);
+    runtime_->sync();
+  }
+}
+
+std::unique_ptr<TorchStage> TorchStage::loadFromFile(
+    const std::string& file, Runtime* runtime, const StorageFormat format) {
+  if (runtime == nullptr) {
+    runtime = Runtime::Current();
+  }
   std::unique_ptr<TorchStage> ret;
   std::ifstream ifile(file.c_str(), std::ios::in | std::ios::binary);
   if (ifile.is_open()) {
     ifile.seekg(0, std::ios::beg);
-    // Now recursively load the network
-    ret = TorchStage::loadFromFile(ifile);
+    // Now recursively load the network (every stage and tensor created along
+    // the way picks up runtime, and every stage picks up format).
+    {
+      Runtime::Scope scope(runtime);
+      ScopedFlag<StorageFormat> scoped_format(load_format, format);
+      ret = TorchStage::loadFromFile(ifile);
+    }
     ifile.close();
+    // The weights were uploaded on this thread's queue.  Make sure they have
+    // landed in case the model is then used from another thread.
+    runtime->sync();
   } else {
     std::cout << "TorchStage::loadFromFile() - ERROR: Could not open modelfile";
     std::cout << " file " << file << std::endl;
@@ -8,21 +8,48 @@ using namespace jcl::math;
 
 namespace jtorch {
 
-Transpose::Transpose() { output = nullptr; }
+Transpose::Transpose(
+    const std::vector<std::pair<int32_t, int32_t>>& permutations)
+    : TorchStage() {
+  permutations_ = permutations;
+  src_tensor_ = nullptr;
+  src_batch_ = false;
+  output = nullptr;
+}
 
 Transpose::~Transpose() {}
 
 std::unique_ptr<TorchStage> Transpose::loadFromFile(std::ifstream& file) {
   int32_t num_permutations;
   file.read((char*)(&num_permutations), sizeof(num_permutations));
-  std::unique_ptr<int32_t[]> perms(new int32_t[num_permutations * 2]);
-  file.read((char*)(perms.get()), sizeof(perms[0]) * num_permutations * 2);
-  // But we don't really use it...
-  return std::unique_ptr<TorchStage>(new Transpose());
+  std::vector<std::pair<int32_t, int32_t>> permutations(num_permutations);
+  for (int32_t i = 0; i < num_permutations; i++) {
+    file.read((char*)(&permutations[i].first), sizeof(int32_t));
+    file.read((char*)(&permutations[i].second), sizeof(int32_t));
+  }
+  return std::unique_ptr<TorchStage>(new Transpose(permutations));
 }
 
 void Transpose::forwardProp(std::shared_ptr<TorchData> input) {
-  output = input;
+  RASSERT(input->type() == TorchDataType::TENSOR_DATA);
+
+  if (src_tensor_ != input.get() || src_batch_ != batchMode()) {
+    // Only create the view if the input has changed.
+    src_tensor_ = TO_TENSOR_PTR(input.get());
+    src_batch_ = batchMode();
+
+    // Note torch dimensions are 1-indexed, with dimension 1 being the outer
+    // dimension of a sample.
+    const int32_t dim = (int32_t)sampleDim(*src_tensor_);
+    output = input;
+    for (const auto& perm : permutations_) {
+      RASSERT(perm.first >= 1 && perm.first <= dim);
+      RASSERT(perm.second >= 1 && perm.second <= dim);
+      output = Tensor<float>::transpose(*TO_TENSOR_PTR(output.get()),
+                                        (uint32_t)(dim - perm.first),
+                                        (uint32_t)(dim - perm.second));
+    }
+  }
 }
 
 }  // namespace jtorch
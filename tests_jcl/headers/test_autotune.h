@@ -0,0 +1,125 @@
+//
+//  test_autotune.h
+//
+//  Tests for the local work size autotuner.
+//  Note: kCopyKernel and FillBuffer() are defined in test_memory.h.
+
+#include <cstdio>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include "jcl/opencl_context.h"
+
+// The keys of the autotune file, in order (one per line).
+std::vector<std::string> ReadAutotuneKeys(const std::string& filename) {
+  std::vector<std::string> keys;
+  std::ifstream file(filename.c_str());
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream ss(line);
+    uint32_t local_size[3];
+    std::string key;
+    ss >> local_size[0] >> local_size[1] >> local_size[2];
+    ss.get();
+    std::getline(ss, key);
+    keys.push_back(key);
+  }
+  return keys;
+}
+
+TEST(OpenCLTests, TestAutotune) {
+  const uint32_t nelems = 4096;
+  const std::string autotune_file = "./jcl_autotune_test.txt";
+  std::remove(autotune_file.c_str());
+
+  // The first context tunes the kernel once per device, and the second must
+  // then pick the results up from the file.
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+    const bool verbose_startup = false;
+    context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+    context->setAutotuneFile(autotune_file);
+    EXPECT_TRUE(context->autotuneEnabled());
+
+    jcl::KernelHandle copy = context->getKernelCStr(kCopyKernel, "Copy");
+    for (uint32_t dev_id = 0; dev_id < context->getNumDevices(); dev_id++) {
+      std::shared_ptr<jcl::OpenCLBufferData> a =
+          context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+      std::shared_ptr<jcl::OpenCLBufferData> b =
+          context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+      const float value = static_cast<float>(dev_id + pass) + 0.5f;
+      FillBuffer(context.get(), dev_id, value, a);
+      copy->setArg(0, a);
+      copy->setArg(1, b);
+      uint32_t dim = 1;
+      for (uint32_t i = 0; i < 2; i++) {
+        context->runKernelAutotuned(copy.get(), dev_id, dim, &nelems, false);
+      }
+
+      std::unique_ptr<float[]> b_cpu(new float[nelems]);
+      context->readFromBuffer(b_cpu.get(), nelems, dev_id, b, true);
+      for (uint32_t i = 0; i < nelems; i++) {
+        EXPECT_EQ(b_cpu[i], value);
+      }
+    }
+    EXPECT_EQ(context->getNumAutotuneRuns(),
+              pass == 0 ? context->getNumDevices() : 0);
+  }
+
+  // The file holds one line per key, also when it was loaded with repeats
+  // (ie from older versions, which appended to it).
+  std::vector<std::string> keys = ReadAutotuneKeys(autotune_file);
+  EXPECT_GT(keys.size(), 0);
+  EXPECT_EQ(std::set<std::string>(keys.begin(), keys.end()).size(),
+            keys.size());
+  {
+    std::ifstream in(autotune_file.c_str());
+    std::string first_line;
+    std::getline(in, first_line);
+    in.close();
+    std::ofstream out(autotune_file.c_str(), std::ios::app);
+    out << first_line << "\n";
+  }
+  EXPECT_EQ(ReadAutotuneKeys(autotune_file).size(), keys.size() + 1);
+  {
+    std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+    const bool verbose_startup = false;
+    context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+    context->setAutotuneFile(autotune_file);
+    // A new global size is a new key, so the file is rewritten.
+    const uint32_t half = nelems / 2;
+    std::shared_ptr<jcl::OpenCLBufferData> a =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, half);
+    std::shared_ptr<jcl::OpenCLBufferData> b =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, half);
+    FillBuffer(context.get(), 0, 1.0f, a);
+    jcl::KernelHandle copy = context->getKernelCStr(kCopyKernel, "Copy");
+    copy->setArg(0, a);
+    copy->setArg(1, b);
+    uint32_t dim = 1;
+    context->runKernelAutotuned(copy.get(), 0, dim, &half, true);
+    EXPECT_EQ(context->getNumAutotuneRuns(), 1);
+  }
+  keys = ReadAutotuneKeys(autotune_file);
+  EXPECT_EQ(std::set<std::string>(keys.begin(), keys.end()).size(),
+            keys.size());
+
+  // With autotuning disabled the default local size is used as is.
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+  context->setAutotuneEnabled(false);
+  std::shared_ptr<jcl::OpenCLBufferData> buffer =
+      context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+  FillBuffer(context.get(), 0, 1.0f, buffer);
+  jcl::KernelHandle copy = context->getKernelCStr(kCopyKernel, "Copy");
+  copy->setArg(0, buffer);
+  copy->setArg(1, buffer);
+  uint32_t dim = 1;
+  const uint32_t local_size = 1;
+  context->runKernelAutotuned(copy.get(), 0, dim, &nelems, true, &local_size);
+  EXPECT_EQ(context->getNumAutotuneRuns(), 0);
+
+  std::remove(autotune_file.c_str());
+}
@@ -0,0 +1,53 @@
+//
+//  test_device_score.h
+//
+//  Tests for device scoring and selection.
+//  Note: FillBuffer() is defined in test_memory.h.
+
+#include "jcl/opencl_context.h"
+
+TEST(OpenCLTests, TestScoreDevices) {
+  const std::vector<jcl::OpenCLDeviceScore> scores =
+      jcl::OpenCLContext::scoreDevices(jcl::CLDeviceAll, jcl::CLVendorAny);
+  EXPECT_TRUE(!scores.empty());
+  for (uint32_t i = 0; i < scores.size(); i++) {
+    EXPECT_GT(scores[i].compute_units, 0);
+    EXPECT_GT(scores[i].global_mem_bytes, 0);
+    EXPECT_GE(scores[i].score, 0);
+    // Best first.
+    if (i > 0) {
+      EXPECT_GE(scores[i - 1].score, scores[i].score);
+    }
+  }
+  // Every device can run the calibration kernel.
+  EXPECT_GT(scores[0].calibration_gflops, 0);
+
+  // Without calibration the score comes from the device info alone.
+  const std::vector<jcl::OpenCLDeviceScore> static_scores =
+      jcl::OpenCLContext::scoreDevices(jcl::CLDeviceAll, jcl::CLVendorAny,
+                                       false);
+  EXPECT_EQ(static_scores.size(), scores.size());
+  for (uint32_t i = 0; i < static_scores.size(); i++) {
+    EXPECT_EQ(static_scores[i].calibration_gflops, 0);
+    EXPECT_GT(static_scores[i].score, 0);
+  }
+
+  // The context opened on the best device contains it.
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(scores[0], verbose_startup);
+  const int32_t dev_id = context->findDevice(scores[0].id);
+  EXPECT_GE(dev_id, 0);
+  EXPECT_EQ(context->getDeviceName(dev_id), scores[0].name);
+  EXPECT_EQ(context->getDeviceType(dev_id), scores[0].type);
+
+  const uint32_t nelems = 1024;
+  std::shared_ptr<jcl::OpenCLBufferData> buffer =
+      context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+  FillBuffer(context.get(), dev_id, 2.5f, buffer);
+  std::unique_ptr<float[]> buffer_cpu(new float[nelems]);
+  context->readFromBuffer(buffer_cpu.get(), nelems, dev_id, buffer, true);
+  for (uint32_t i = 0; i < nelems; i++) {
+    EXPECT_EQ(buffer_cpu[i], 2.5f);
+  }
+}
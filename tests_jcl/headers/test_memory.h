@@ -7,6 +7,10 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "jcl/math/math_types.h"
 #include "jcl/math/math_base.h"
@@ -22,6 +26,36 @@ static const char* kFillKernel =
     "      output[x_out] = value;\n"
     "    }";
 
+static const char* kCopyKernel =
+    "    __kernel void Copy(\n"
+    "      const __global float* input,  /* 0 */\n"
+    "      __global float* output) {     /* 1 */\n"
+    "      const int x_out = get_global_id(0);\n"
+    "      output[x_out] = input[x_out];\n"
+    "    }";
+
+// The spellings getKernelArgAccess() should (and shouldn't) understand.
+static const char* kArgAccessKernel =
+    "    typedef __global float* FloatPtr;\n"
+    "    #define OPAQUE_ARGS __global const float* a, __global float* b\n"
+    "    #define REAL float\n"
+    "    __kernel void Access(\n"
+    "      const __global float* restrict a,  /* 0 */\n"
+    "      __global const REAL* b,            /* 1 */\n"
+    "      __global float* const c,           /* 2 */\n"
+    "      FloatPtr d,                        /* 3 */\n"
+    "      __constant float* e,               /* 4 */\n"
+    "      __local float* f,                  /* 5 */\n"
+    "      const int g) {                     /* 6 */\n"
+    "      f[0] = a[0] + b[0] + e[0] + (float)g;\n"
+    "      barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "      c[0] = f[0];\n"
+    "      d[0] = f[0];\n"
+    "    }\n"
+    "    __kernel void Opaque(OPAQUE_ARGS) {\n"
+    "      b[0] = a[0];\n"
+    "    }";
+
 void FillBuffer(jcl::OpenCLContext* cl_context, const uint32_t dev_id,
                 const float fill_value,
                 std::shared_ptr<jcl::OpenCLBufferData> buffer) {
@@ -89,3 +123,556 @@ TEST(OpenCLTests, TestSubBuffer) {
     }
   }
 }
+
+TEST(OpenCLTests, TestKernelHandle) {
+  const uint32_t nelems = 63;
+
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+
+  for (uint32_t dev_id = 0; dev_id < context->getNumDevices(); dev_id++) {
+    // Two handles to the same kernel must keep their own argument bindings.
+    jcl::KernelHandle fill_a = context->getKernelCStr(kFillKernel, "Fill");
+    jcl::KernelHandle fill_b = context->getKernelCStr(kFillKernel, "Fill");
+    EXPECT_GT(fill_a->max_workgroup_size(dev_id), 0);
+
+    std::shared_ptr<jcl::OpenCLBufferData> buffer_a =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    std::shared_ptr<jcl::OpenCLBufferData> buffer_b =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    fill_a->setArg(0, buffer_a);
+    fill_a->setArg(1, 1.0f);
+    fill_b->setArg(0, buffer_b);
+    fill_b->setArg(1, 2.0f);
+
+    uint32_t dim = 1;
+    context->runKernel(fill_a.get(), dev_id, dim, &nelems, false);
+    context->runKernel(fill_b.get(), dev_id, dim, &nelems, false);
+
+    std::unique_ptr<float[]> a_cpu(new float[nelems]);
+    std::unique_ptr<float[]> b_cpu(new float[nelems]);
+    context->readFromBuffer(a_cpu.get(), nelems, dev_id, buffer_a, true);
+    context->readFromBuffer(b_cpu.get(), nelems, dev_id, buffer_b, true);
+    for (uint32_t i = 0; i < nelems; i++) {
+      EXPECT_EQ(a_cpu[i], 1.0f);
+      EXPECT_EQ(b_cpu[i], 2.0f);
+    }
+  }
+}
+
+TEST(OpenCLTests, TestCachedKernel) {
+  const uint32_t nelems = 63;
+
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+  const uint32_t slot = jcl::OpenCLContext::newKernelSlot();
+  EXPECT_NEQ(jcl::OpenCLContext::newKernelSlot(), slot);
+
+  // The kernel is resolved once per thread.
+  jcl::OpenCLKernel* fill = context->getCachedKernelCStr(
+      slot, kFillKernel, "Fill", jcl::OpenCLDefines());
+  const uint32_t num_programs = context->getNumPrograms();
+  EXPECT_EQ(context->getCachedKernelCStr(slot, kFillKernel, "Fill",
+                                         jcl::OpenCLDefines()),
+            fill);
+  EXPECT_EQ(context->getNumPrograms(), num_programs);
+  jcl::OpenCLKernel* thread_fill = nullptr;
+  std::thread thread([&context, &thread_fill, slot]() {
+    thread_fill = context->getCachedKernelCStr(slot, kFillKernel, "Fill",
+                                               jcl::OpenCLDefines());
+  });
+  thread.join();
+  EXPECT_TRUE(thread_fill != nullptr && thread_fill != fill);
+
+  for (uint32_t dev_id = 0; dev_id < context->getNumDevices(); dev_id++) {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    fill->setArg(0, buffer);
+    fill->setArg(1, (float)dev_id);
+    uint32_t dim = 1;
+    context->runKernel(fill, dev_id, dim, &nelems, false);
+
+    std::unique_ptr<float[]> cpu(new float[nelems]);
+    context->readFromBuffer(cpu.get(), nelems, dev_id, buffer, true);
+    for (uint32_t i = 0; i < nelems; i++) {
+      EXPECT_EQ(cpu[i], (float)dev_id);
+    }
+  }
+}
+
+TEST(OpenCLTests, TestMultiThreadStreams) {
+  const uint32_t nelems = 1027;
+  const uint32_t num_threads = 4;
+  const uint32_t num_iters = 16;
+
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+
+  for (uint32_t dev_id = 0; dev_id < context->getNumDevices(); dev_id++) {
+    // Each thread interleaves the legacy useKernel() path (which has per
+    // thread "current kernel" state) with its own kernel handle.  If the
+    // threads shared state, the argument bindings would get clobbered.
+    std::vector<std::unique_ptr<float[]>> results(num_threads);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < num_threads; t++) {
+      results[t].reset(new float[2 * nelems]);
+      threads.push_back(std::thread([&context, &results, dev_id, t]() {
+        jcl::KernelHandle fill = context->getKernelCStr(kFillKernel, "Fill");
+        std::shared_ptr<jcl::OpenCLBufferData> buffer_a =
+            context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+        std::shared_ptr<jcl::OpenCLBufferData> buffer_b =
+            context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+        for (uint32_t i = 0; i < num_iters; i++) {
+          FillBuffer(context.get(), dev_id, (float)(t + i), buffer_a);
+          fill->setArg(0, buffer_b);
+          fill->setArg(1, (float)(t * i));
+          uint32_t dim = 1;
+          uint32_t nelem = nelems;
+          context->runKernel(fill.get(), dev_id, dim, &nelem, false);
+        }
+        context->sync(dev_id);
+        context->readFromBuffer(results[t].get(), nelems, dev_id, buffer_a,
+                                false);
+        context->readFromBuffer(&results[t][nelems], nelems, dev_id,
+                                buffer_b, true);
+      }));
+    }
+    for (uint32_t t = 0; t < num_threads; t++) {
+      threads[t].join();
+    }
+
+    for (uint32_t t = 0; t < num_threads; t++) {
+      for (uint32_t i = 0; i < nelems; i++) {
+        EXPECT_EQ(results[t][i], (float)(t + num_iters - 1));
+        EXPECT_EQ(results[t][nelems + i], (float)(t * (num_iters - 1)));
+      }
+    }
+  }
+  // The worker threads' streams were released when they exited, which leaves
+  // the main thread's (from init()).
+  EXPECT_EQ(context->getNumStreams(), 1);
+}
+
+TEST(OpenCLTests, TestStreamLifetime) {
+  const uint32_t nelems = 64;
+  const bool verbose_startup = false;
+  std::unique_ptr<jcl::OpenCLContext> contexts[2];
+  for (uint32_t c = 0; c < 2; c++) {
+    contexts[c].reset(new jcl::OpenCLContext());
+    contexts[c]->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+  }
+
+  // A thread that alternates between two contexts has a stream in each, and
+  // keeps using the same one.
+  bool same_queues = true;
+  uint32_t num_streams[2];
+  std::unique_ptr<float[]> results[2];
+  std::thread worker([&]() {
+    std::shared_ptr<jcl::OpenCLBufferData> buffers[2];
+    cl::CommandQueue* queues[2];
+    for (uint32_t c = 0; c < 2; c++) {
+      buffers[c] =
+          contexts[c]->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+      queues[c] = contexts[c]->getQueue(0);
+    }
+    for (uint32_t i = 0; i < 4; i++) {
+      for (uint32_t c = 0; c < 2; c++) {
+        FillBuffer(contexts[c].get(), 0, (float)(i + c), buffers[c]);
+        same_queues = same_queues && contexts[c]->getQueue(0) == queues[c];
+      }
+    }
+    for (uint32_t c = 0; c < 2; c++) {
+      num_streams[c] = contexts[c]->getNumStreams();
+      results[c].reset(new float[nelems]);
+      contexts[c]->readFromBuffer(results[c].get(), nelems, 0, buffers[c],
+                                  true);
+    }
+  });
+  worker.join();
+  EXPECT_TRUE(same_queues);
+  for (uint32_t c = 0; c < 2; c++) {
+    EXPECT_EQ(num_streams[c], 2);
+    for (uint32_t i = 0; i < nelems; i++) {
+      EXPECT_EQ(results[c][i], (float)(3 + c));
+    }
+    EXPECT_EQ(contexts[c]->getNumStreams(), 1);
+  }
+
+  // A thread that outlives a context it used.
+  std::mutex lock;
+  std::condition_variable cv;
+  bool context_destroyed = false;
+  std::thread survivor([&]() {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        contexts[0]->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    FillBuffer(contexts[0].get(), 0, 1.0f, buffer);
+    contexts[0]->sync(0);
+    buffer.reset();
+    std::unique_lock<std::mutex> ul(lock);
+    cv.wait(ul, [&context_destroyed]() { return context_destroyed; });
+  });
+  while (contexts[0]->getNumStreams() < 2) {
+    std::this_thread::yield();
+  }
+  contexts[0].reset();
+  {
+    std::lock_guard<std::mutex> lg(lock);
+    context_destroyed = true;
+  }
+  cv.notify_one();
+  survivor.join();
+  EXPECT_EQ(contexts[1]->getNumStreams(), 1);
+}
+
+TEST(OpenCLTests, TestBufferPool) {
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+
+  EXPECT_EQ(jcl::OpenCLBufferPool::sizeClass(1), 64);
+  EXPECT_EQ(jcl::OpenCLBufferPool::sizeClass(1024), 1024);
+  EXPECT_EQ(jcl::OpenCLBufferPool::sizeClass(1025), 1280);
+  EXPECT_EQ(jcl::OpenCLBufferPool::sizeClass(1281), 1536);
+  // Size classes keep going past 32 bits.
+  const uint64_t four_gig = (uint64_t)1 << 32;
+  EXPECT_EQ(jcl::OpenCLBufferPool::sizeClass(four_gig), four_gig);
+  EXPECT_EQ(jcl::OpenCLBufferPool::sizeClass(four_gig + 1),
+            four_gig + (four_gig >> 2));
+
+  // Released storage is recycled for any request in the same size class.
+  cl_mem mem;
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, 1100);
+    EXPECT_EQ(buffer->nelems(), 1100);
+    EXPECT_EQ(buffer->capacity(), 1280);
+    mem = buffer->mem();
+  }
+  jcl::OpenCLBufferPoolStats stats = context->getBufferPoolStats();
+  EXPECT_EQ(stats.num_allocations, 1);
+  EXPECT_EQ(stats.num_cached, 1);
+  EXPECT_EQ(stats.bytes_cached, 1280 * sizeof(cl_float));
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, 1200);
+    EXPECT_EQ(buffer->mem(), mem);
+    FillBuffer(context.get(), 0, 1.0f, buffer);
+    context->sync(0);
+  }
+  stats = context->getBufferPoolStats();
+  EXPECT_EQ(stats.num_allocations, 1);
+  EXPECT_EQ(stats.num_reuses, 1);
+
+  // A sub-buffer keeps its parent's storage out of the pool.
+  std::shared_ptr<jcl::OpenCLBufferData> sub_buffer;
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, 1100);
+    sub_buffer = buffer->createSubBuffer(16, 0);
+  }
+  EXPECT_EQ(context->getBufferPoolStats().num_cached, 0);
+  sub_buffer = nullptr;
+  EXPECT_EQ(context->getBufferPoolStats().num_cached, 1);
+
+  context->trimBufferPool();
+  stats = context->getBufferPoolStats();
+  EXPECT_EQ(stats.num_cached, 0);
+  EXPECT_EQ(stats.bytes_cached, 0);
+  EXPECT_EQ(stats.bytes_allocated, 0);
+
+  // With the pool disabled buffers are exactly sized and never cached.
+  context->setBufferPoolEnabled(false);
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, 1100);
+    EXPECT_EQ(buffer->capacity(), 1100);
+  }
+  EXPECT_EQ(context->getBufferPoolStats().num_cached, 0);
+}
+
+TEST(OpenCLTests, TestBufferPoolThreads) {
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+  const uint32_t nelems = 1100;
+
+  // A buffer released by a live thread is only reused by that thread, for
+  // the same device.
+  cl_mem mem;
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    mem = buffer->mem();
+  }
+  bool reused = true;
+  std::thread other([&context, &reused, mem]() {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    reused = buffer->mem() == mem;
+  });
+  other.join();
+  EXPECT_FALSE(reused);
+  if (context->getNumDevices() > 1) {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer = context->allocateBuffer(
+        jcl::CLBufferTypeReadWrite, nelems, false, jcl::CLBufferTagOther, 1);
+    EXPECT_NEQ(buffer->mem(), mem);
+  }
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    EXPECT_EQ(buffer->mem(), mem);
+  }
+
+  // The buffers of a thread that exited can be reused by any thread (and
+  // aren't stuck in its free list).
+  context->trimBufferPool();
+  std::thread worker([&context, &mem]() {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    FillBuffer(context.get(), 0, 1.0f, buffer);
+    mem = buffer->mem();
+  });
+  worker.join();
+  EXPECT_EQ(context->getNumStreams(), 1);
+  const jcl::OpenCLBufferPoolStats stats = context->getBufferPoolStats();
+  EXPECT_EQ(stats.num_cached, 1);
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    EXPECT_EQ(buffer->mem(), mem);
+  }
+  EXPECT_EQ(context->getBufferPoolStats().num_reuses, stats.num_reuses + 1);
+}
+
+TEST(OpenCLTests, TestMemoryStats) {
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+
+  // The counters belong to the context, so a fresh one starts from zero.
+  const uint64_t bytes = 1280 * sizeof(cl_float);  // Pooled capacity
+  const jcl::OpenCLMemoryStats before = context->getMemoryStats(0);
+  EXPECT_EQ(before.live_bytes, 0);
+  EXPECT_EQ(before.num_live, 0);
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer = context->allocateBuffer(
+        jcl::CLBufferTypeReadWrite, 1100, false, jcl::CLBufferTagScratch);
+    jcl::OpenCLMemoryStats stats = context->getMemoryStats(0);
+    EXPECT_EQ(stats.live_bytes, bytes);
+    EXPECT_EQ(stats.num_live, 1);
+    EXPECT_EQ(stats.num_allocations, 1);
+    EXPECT_EQ(stats.tag_live_bytes[jcl::CLBufferTagScratch], bytes);
+
+    // Sub-buffers alias their parent, so they don't count.
+    std::shared_ptr<jcl::OpenCLBufferData> sub_buffer =
+        buffer->createSubBuffer(16, 0);
+    EXPECT_EQ(context->getMemoryStats(0).live_bytes, stats.live_bytes);
+
+    buffer->setTag(jcl::CLBufferTagWeights);
+    stats = context->getMemoryStats(0);
+    EXPECT_EQ(stats.live_bytes, bytes);
+    EXPECT_EQ(stats.tag_live_bytes[jcl::CLBufferTagScratch], 0);
+    EXPECT_EQ(stats.tag_live_bytes[jcl::CLBufferTagWeights], bytes);
+
+    // Buffers of another context don't show up in this one.
+    std::unique_ptr<jcl::OpenCLContext> other(new jcl::OpenCLContext());
+    other->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+    std::shared_ptr<jcl::OpenCLBufferData> other_buffer =
+        other->allocateBuffer(jcl::CLBufferTypeReadWrite, 1100);
+    EXPECT_EQ(other->getMemoryStats(0).live_bytes, bytes);
+    EXPECT_EQ(context->getMemoryStats(0).live_bytes, bytes);
+    other_buffer = nullptr;
+  }
+  // Released (into the pool), but the peak remembers it.
+  const jcl::OpenCLMemoryStats after = context->getMemoryStats(0);
+  EXPECT_EQ(after.live_bytes, 0);
+  EXPECT_EQ(after.num_live, 0);
+  EXPECT_EQ(after.peak_bytes, bytes);
+  EXPECT_EQ(after.tag_peak_bytes[jcl::CLBufferTagWeights], bytes);
+  context->printMemoryStats(0);
+  context->resetPeakMemory(0);
+  EXPECT_EQ(context->getMemoryStats(0).peak_bytes, 0);
+
+  // Every device has its own counters.
+  const uint32_t last = context->getNumDevices() - 1;
+  const jcl::OpenCLMemoryStats last_before = context->getMemoryStats(last);
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer = context->allocateBuffer(
+        jcl::CLBufferTypeReadWrite, 1100, false, jcl::CLBufferTagOther, last);
+    EXPECT_EQ(context->getMemoryStats(last).live_bytes,
+              last_before.live_bytes + bytes);
+    if (last != 0) {
+      EXPECT_EQ(context->getMemoryStats(0).live_bytes, 0);
+    }
+  }
+  EXPECT_EQ(context->getMemoryStats(last).live_bytes, last_before.live_bytes);
+}
+
+TEST(OpenCLTests, TestMapBuffer) {
+  const uint32_t nelems = 1031;
+
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+
+  for (uint32_t dev_id = 0; dev_id < context->getNumDevices(); dev_id++) {
+    std::shared_ptr<jcl::OpenCLBufferData> staging =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems, true);
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    EXPECT_TRUE(staging->host_visible());
+    EXPECT_FALSE(buffer->host_visible());
+
+    float* data = (float*)context->mapBuffer(dev_id, staging, true, nelems);
+    EXPECT_EQ(staging->mapped_ptr(), data);
+    for (uint32_t i = 0; i < nelems; i++) {
+      data[i] = (float)i;
+    }
+    context->unmapBuffer(dev_id, staging);
+    EXPECT_TRUE(staging->mapped_ptr() == nullptr);
+
+    // Round trip through device memory.
+    context->copyBuffer(dev_id, staging, buffer, nelems);
+    FillBuffer(context.get(), dev_id, -1.0f, staging);
+    context->copyBuffer(dev_id, buffer, staging, nelems);
+    const float* result =
+        (const float*)context->mapBuffer(dev_id, staging, false, nelems);
+    for (uint32_t i = 0; i < nelems; i++) {
+      EXPECT_EQ(result[i], (float)i);
+    }
+    context->unmapBuffer(dev_id, staging);
+  }
+
+  // Pinned and device buffers never share pooled storage.
+  context->trimBufferPool();
+  cl_mem mem;
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> staging =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems, true);
+    mem = staging->mem();
+  }
+  {
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    EXPECT_NEQ(buffer->mem(), mem);
+    std::shared_ptr<jcl::OpenCLBufferData> staging =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems, true);
+    EXPECT_EQ(staging->mem(), mem);
+  }
+}
+
+TEST(OpenCLTests, TestKernelProfile) {
+  const uint32_t nelems = 4099;
+  const uint32_t num_launches = 10;
+
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  const bool out_of_order = false;
+  const bool profiling = true;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup,
+                out_of_order, profiling);
+  EXPECT_TRUE(context->profilingEnabled());
+  EXPECT_TRUE(context->needsEvents());
+
+  std::shared_ptr<jcl::OpenCLBufferData> a =
+      context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+  std::shared_ptr<jcl::OpenCLBufferData> b =
+      context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+  jcl::KernelHandle copy = context->getKernelCStr(kCopyKernel, "Copy");
+  copy->setArg(0, a);
+  copy->setArg(1, b);
+  uint32_t dim = 1;
+  for (uint32_t i = 0; i < num_launches; i++) {
+    FillBuffer(context.get(), 0, (float)i, a);
+    context->runKernel(copy.get(), 0, dim, &nelems, false);
+  }
+  context->sync(0);
+
+  std::vector<jcl::OpenCLKernelProfile> profile = context->getKernelProfile();
+  EXPECT_EQ(profile.size(), 2);
+  for (uint32_t i = 0; i < profile.size(); i++) {
+    EXPECT_TRUE(profile[i].name == "Fill" || profile[i].name == "Copy");
+    EXPECT_EQ(profile[i].count, num_launches);
+    EXPECT_LE(profile[i].min, profile[i].p99);
+    EXPECT_LE(profile[i].p99, profile[i].max);
+    EXPECT_LE(profile[i].max, profile[i].total);
+  }
+  if (profile.size() == 2) {
+    EXPECT_GE(profile[0].total, profile[1].total);
+  }
+
+  context->resetKernelProfile();
+  EXPECT_EQ(context->getKernelProfile().size(), 0);
+}
+
+TEST(OpenCLTests, TestOutOfOrderQueue) {
+  const uint32_t nelems = 4099;
+
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  const bool out_of_order = true;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup,
+                out_of_order);
+
+  // The argument access is parsed from the kernel signature.
+  jcl::KernelHandle copy = context->getKernelCStr(kCopyKernel, "Copy");
+  EXPECT_EQ(copy->arg_access(0), jcl::CLArgAccessRead);
+  EXPECT_EQ(copy->arg_access(1), jcl::CLArgAccessReadWrite);
+  jcl::KernelHandle fill = context->getKernelCStr(kFillKernel, "Fill");
+  EXPECT_EQ(fill->arg_access(0), jcl::CLArgAccessReadWrite);
+  EXPECT_EQ(fill->arg_access(1), jcl::CLArgAccessNone);
+
+  // Nothing below is ordered by the queue itself (if the device supports
+  // out-of-order queues), so this only passes if the read-after-write and
+  // write-after-read dependencies are honored.
+  for (uint32_t dev_id = 0; dev_id < context->getNumDevices(); dev_id++) {
+    std::shared_ptr<jcl::OpenCLBufferData> a =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    std::shared_ptr<jcl::OpenCLBufferData> b =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    std::shared_ptr<jcl::OpenCLBufferData> c =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    uint32_t dim = 1;
+    FillBuffer(context.get(), dev_id, 1.0f, a);
+    copy->setArg(0, a);
+    copy->setArg(1, b);
+    context->runKernel(copy.get(), dev_id, dim, &nelems, false);
+    FillBuffer(context.get(), dev_id, 2.0f, a);
+    copy->setArg(1, c);
+    context->runKernel(copy.get(), dev_id, dim, &nelems, false);
+
+    std::unique_ptr<float[]> b_cpu(new float[nelems]);
+    std::unique_ptr<float[]> c_cpu(new float[nelems]);
+    context->readFromBuffer(b_cpu.get(), nelems, dev_id, b, true);
+    context->readFromBuffer(c_cpu.get(), nelems, dev_id, c, true);
+    for (uint32_t i = 0; i < nelems; i++) {
+      EXPECT_EQ(b_cpu[i], 1.0f);
+      EXPECT_EQ(c_cpu[i], 2.0f);
+    }
+  }
+}
+
+TEST(OpenCLTests, TestKernelArgAccess) {
+  std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+  const bool verbose_startup = false;
+  context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+
+  jcl::KernelHandle access =
+      context->getKernelCStr(kArgAccessKernel, "Access");
+  EXPECT_EQ(access->arg_access(0), jcl::CLArgAccessRead);
+  EXPECT_EQ(access->arg_access(1), jcl::CLArgAccessRead);  // Type macro
+  EXPECT_EQ(access->arg_access(2), jcl::CLArgAccessReadWrite);
+  EXPECT_EQ(access->arg_access(3), jcl::CLArgAccessReadWrite);  // Typedef
+  EXPECT_EQ(access->arg_access(4), jcl::CLArgAccessRead);
+  EXPECT_EQ(access->arg_access(5), jcl::CLArgAccessNone);
+  EXPECT_EQ(access->arg_access(6), jcl::CLArgAccessNone);
+
+  // A macro that expands to arguments hides them all: assume they're written.
+  jcl::KernelHandle opaque =
+      context->getKernelCStr(kArgAccessKernel, "Opaque");
+  EXPECT_EQ(opaque->arg_access(0), jcl::CLArgAccessReadWrite);
+  EXPECT_EQ(opaque->arg_access(1), jcl::CLArgAccessReadWrite);
+}
@@ -0,0 +1,233 @@
+//
+//  test_program_cache.h
+//
+//  Tests for the on-disk OpenCL program binary cache.
+//  Note: FillBuffer() is defined in test_memory.h.
+
+#if defined(WIN32) || defined(_WIN32)
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "jcl/opencl_context.h"
+
+namespace {
+
+// A new, empty directory for the cache of one test (so that entries left by
+// previous runs or by other tests can't be hit).  It is removed, along with
+// the files in it, when the object goes out of scope.
+class TempCacheDir {
+ public:
+  TempCacheDir() {
+#if defined(WIN32) || defined(_WIN32)
+    char tmp_path[MAX_PATH];
+    char tmp_file[MAX_PATH];
+    RASSERT(GetTempPathA(MAX_PATH, tmp_path) != 0);
+    // GetTempFileName creates a unique file, which we replace by a directory.
+    RASSERT(GetTempFileNameA(tmp_path, "jcl", 0, tmp_file) != 0);
+    RASSERT(DeleteFileA(tmp_file));
+    RASSERT(_mkdir(tmp_file) == 0);
+    path_ = tmp_file;
+#else
+    const char* tmp_dir = getenv("TMPDIR");
+    std::string pattern = (tmp_dir != nullptr && tmp_dir[0] != '\0')
+                              ? std::string(tmp_dir)
+                              : std::string("/tmp");
+    pattern += "/jcl_program_cache_XXXXXX";
+    std::vector<char> buf(pattern.begin(), pattern.end());
+    buf.push_back('\0');
+    RASSERT(mkdtemp(buf.data()) != nullptr);
+    path_ = buf.data();
+#endif
+  }
+
+  ~TempCacheDir() {
+    for (const std::string& file : files()) {
+      std::remove(file.c_str());
+    }
+#if defined(WIN32) || defined(_WIN32)
+    _rmdir(path_.c_str());
+#else
+    rmdir(path_.c_str());
+#endif
+  }
+
+  const std::string& path() const { return path_; }
+
+  // The full paths of the files in the directory.
+  std::vector<std::string> files() const {
+    std::vector<std::string> files;
+#if defined(WIN32) || defined(_WIN32)
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileA((path_ + "\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE) {
+      return files;
+    }
+    do {
+      if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+        files.push_back(path_ + "\\" + data.cFileName);
+      }
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+#else
+    DIR* dir = opendir(path_.c_str());
+    if (dir == nullptr) {
+      return files;
+    }
+    while (struct dirent* entry = readdir(dir)) {
+      const std::string name = entry->d_name;
+      if (name != "." && name != "..") {
+        files.push_back(path_ + "/" + name);
+      }
+    }
+    closedir(dir);
+#endif
+    return files;
+  }
+
+ private:
+  std::string path_;
+
+  // Non-copyable, non-assignable.
+  TempCacheDir(const TempCacheDir&) = delete;
+  TempCacheDir& operator=(const TempCacheDir&) = delete;
+};
+
+}  // unnamed namespace
+
+TEST(OpenCLTests, TestProgramCache) {
+  const uint32_t nelems = 127;
+  TempCacheDir cache_dir;
+
+  // The first context populates the (empty) cache and the second context must
+  // then load the program from it.
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+    const bool verbose_startup = false;
+    context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+    context->setProgramCacheDir(cache_dir.path());
+
+    for (uint32_t dev_id = 0; dev_id < context->getNumDevices(); dev_id++) {
+      std::shared_ptr<jcl::OpenCLBufferData> buffer =
+          context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+      const float value = static_cast<float>(dev_id + pass) + 0.5f;
+      FillBuffer(context.get(), dev_id, value, buffer);
+
+      std::unique_ptr<float[]> buffer_cpu(new float[nelems]);
+      context->readFromBuffer(buffer_cpu.get(), nelems, dev_id, buffer, true);
+      for (uint32_t i = 0; i < nelems; i++) {
+        EXPECT_EQ(buffer_cpu[i], value);
+      }
+    }
+
+    EXPECT_EQ(context->getNumProgramCacheHits(), pass);
+    if (pass == 0) {
+      EXPECT_FALSE(cache_dir.files().empty());
+    }
+  }
+}
+
+static const char* kScaleKernel =
+"    #ifndef SCALE\n"
+"      #define SCALE 1\n"
+"    #endif\n"
+"    __kernel void Scale(__global float* output) {  /* 0 */\n"
+"      output[get_global_id(0)] = SCALE;\n"
+"    }";
+
+TEST(OpenCLTests, TestProgramDefines) {
+  const uint32_t nelems = 64;
+  TempCacheDir cache_dir;
+
+  // Every set of defines is a different program (which must also have its own
+  // cache entry).
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+    const bool verbose_startup = false;
+    context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+    context->setProgramCacheDir(cache_dir.path());
+
+    for (int32_t scale = 1; scale <= 3; scale++) {
+      jcl::OpenCLDefines defines;
+      if (scale > 1) {
+        defines["SCALE"] = std::to_string(scale);
+      }
+      jcl::KernelHandle kernel =
+          context->getKernelCStr(kScaleKernel, "Scale", defines);
+      std::shared_ptr<jcl::OpenCLBufferData> buffer =
+          context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+      kernel->setArg(0, buffer);
+      uint32_t dim = 1;
+      context->runKernel(kernel.get(), 0, dim, &nelems, false);
+
+      std::unique_ptr<float[]> buffer_cpu(new float[nelems]);
+      context->readFromBuffer(buffer_cpu.get(), nelems, 0, buffer, true);
+      for (uint32_t i = 0; i < nelems; i++) {
+        EXPECT_EQ(buffer_cpu[i], static_cast<float>(scale));
+      }
+    }
+
+    EXPECT_EQ(context->getNumProgramCacheHits(), pass == 1 ? 3 : 0);
+  }
+
+  EXPECT_EQ(jcl::OpenCLContext::definesString(jcl::OpenCLDefines()), "");
+  jcl::OpenCLDefines defines;
+  defines["B"] = "2";
+  defines["A"] = "";
+  EXPECT_EQ(jcl::OpenCLContext::definesString(defines), "-D A -D B=2");
+}
+
+TEST(OpenCLTests, TestProgramCacheCorrupt) {
+  const uint32_t nelems = 64;
+  TempCacheDir cache_dir;
+
+  // Pass 0 populates the cache.  Its entries are then truncated (to nothing
+  // after pass 0, and to half their size after pass 1), so passes 1 and 2
+  // must rebuild the program from source (which also rewrites the entries),
+  // and pass 3 loads it from the rewritten cache.
+  for (uint32_t pass = 0; pass < 4; pass++) {
+    if (pass == 1 || pass == 2) {
+      const std::vector<std::string> files = cache_dir.files();
+      EXPECT_FALSE(files.empty());
+      for (const std::string& file : files) {
+        std::vector<char> data;
+        {
+          std::ifstream in(file.c_str(), std::ios::in | std::ios::binary);
+          data.assign(std::istreambuf_iterator<char>(in),
+                      std::istreambuf_iterator<char>());
+        }
+        std::ofstream out(file.c_str(), std::ios::out | std::ios::binary |
+                                            std::ios::trunc);
+        out.write(data.data(), pass == 1 ? 0 : data.size() / 2);
+      }
+    }
+
+    std::unique_ptr<jcl::OpenCLContext> context(new jcl::OpenCLContext());
+    const bool verbose_startup = false;
+    context->init(jcl::CLDeviceAll, jcl::CLVendorAny, verbose_startup);
+    context->setProgramCacheDir(cache_dir.path());
+
+    jcl::KernelHandle kernel = context->getKernelCStr(kScaleKernel, "Scale");
+    std::shared_ptr<jcl::OpenCLBufferData> buffer =
+        context->allocateBuffer(jcl::CLBufferTypeReadWrite, nelems);
+    kernel->setArg(0, buffer);
+    uint32_t dim = 1;
+    context->runKernel(kernel.get(), 0, dim, &nelems, false);
+
+    std::unique_ptr<float[]> buffer_cpu(new float[nelems]);
+    context->readFromBuffer(buffer_cpu.get(), nelems, 0, buffer, true);
+    for (uint32_t i = 0; i < nelems; i++) {
+      EXPECT_EQ(buffer_cpu[i], 1.0f);
+    }
+
+    EXPECT_EQ(context->getNumProgramCacheHits(), pass == 3 ? 1 : 0);
+  }
+}
@@ -22,6 +22,15 @@
 // Test some basic memory handling.
 #include "test_memory.h"
 
+// Test the on-disk program binary cache.
+#include "test_program_cache.h"
+
+// Test the local work size autotuner.
+#include "test_autotune.h"
+
+// Test device scoring and selection.
+#include "test_device_score.h"
+
 // Test a OpenCL kernel on CPU and GPU.
 #include "test_convolution.h"
 
@@ -1,11 +1,13 @@
 // THE CPP FUNCTIONALITY HERE IS TO BE TESTED AGAINST "jtorch_test.lua" SCRIPT
 
 #include <stdlib.h>
+#include <algorithm>
 #include <cmath>
 #include <cstring>
 #include <thread>
 #include <iostream>
 #include <limits>
+#include <vector>
 
 #include "jtorch/torch_stage.h"
 #include "jtorch/jtorch.h"
@@ -31,6 +33,7 @@
 #include "jtorch/join_table.h"
 #include "jtorch/select_table.h"
 #include "jtorch/c_add_table.h"
+#include "jtorch/data_parallel.h"
 #include "jcl/threading/thread_pool.h"
 #include "debug_util.h"
 #include "file_io.h"
@@ -376,6 +379,45 @@ TEST(Modules, CAddTable) {
   }
 }
 
+TEST(Modules, JoinTable) {
+  Tester tester(test_path);
+
+  // Join {4, 3, f} tensors with f = 1, 2, 3 along the top dimension.
+  const uint32_t table_size = 3;
+  const uint32_t plane = 4 * 3;
+  std::shared_ptr<jtorch::TorchData> input(new jtorch::Table());
+  jtorch::Table* table_input = (jtorch::Table*)input.get();
+  std::vector<float> gt;
+  for (uint32_t i = 0; i < table_size; i++) {
+    const uint32_t size[3] = {4, 3, i + 1};
+    std::vector<float> data(plane * size[2]);
+    for (uint32_t j = 0; j < data.size(); j++) {
+      data[j] = (float)(100 * i + j);
+    }
+    std::shared_ptr<jtorch::Tensor<float>> tensor(
+        new jtorch::Tensor<float>(3, size));
+    tensor->setData(data.data());
+    table_input->add(tensor);
+    gt.insert(gt.end(), data.begin(), data.end());
+  }
+
+  std::unique_ptr<jtorch::JoinTable> module(new jtorch::JoinTable(0));
+  module->forwardProp(input);
+  jtorch::Tensor<float>* out = TO_TENSOR_PTR(module->output.get());
+  // The output spans all the inputs (including the first one) along the
+  // join dimension, and only along it.
+  EXPECT_EQ(out->dim(), 3);
+  EXPECT_EQ(out->size()[0], 4);
+  EXPECT_EQ(out->size()[1], 3);
+  EXPECT_EQ(out->size()[2], 6);
+  std::vector<float> result(out->nelems());
+  out->getData(result.data());
+  EXPECT_EQ(result.size(), gt.size());
+  for (uint32_t i = 0; i < result.size() && i < gt.size(); i++) {
+    EXPECT_EQ(result[i], gt[i]);
+  }
+}
+
 TEST(Modules, CompoundModel) {
   Tester tester(test_path);
 
@@ -405,6 +447,362 @@ TEST(Modules, CompoundModel) {
   EXPECT_TRUE(tester.testJTorchValue(model->output, "test_model_res.bin"));
 }
 
+TEST(Modules, HalfStorage) {
+  Tester tester(test_path);
+
+  std::unique_ptr<jtorch::TorchStage> model = jtorch::TorchStage::loadFromFile(
+      test_path + "test_model.bin", nullptr, jtorch::HALF_STORAGE);
+  jtorch::Sequential* seq = (jtorch::Sequential*)model.get();
+  EXPECT_EQ(seq->get(1)->format(), jtorch::HALF_STORAGE);
+  model->forwardProp(tester.data_in);
+
+  // Every stage, including the convolutions and Linear, outputs fp16.
+  for (uint32_t i = 0; i < seq->size(); i++) {
+    EXPECT_EQ(TO_TENSOR_PTR(seq->get(i)->output.get())->format(),
+              jtorch::HALF_STORAGE);
+  }
+  EXPECT_TRUE(
+      tester.testJTorchValue(model->output, "test_model_res.bin", 2e-2f));
+
+  // Stages created directly are float.
+  jtorch::Tanh tanh_stage;
+  EXPECT_EQ(tanh_stage.format(), jtorch::FLOAT_STORAGE);
+}
+
+TEST(Modules, Int8Quantization) {
+  Tester tester(test_path);
+
+  // test_model.bin has a SpatialConvolutionMM and a Linear stage.
+  std::unique_ptr<jtorch::TorchStage> model =
+      jtorch::TorchStage::loadFromFile(test_path + "test_model.bin");
+  jtorch::Sequential* seq = (jtorch::Sequential*)model.get();
+  model->calibrate(true);
+  model->forwardProp(tester.data_in);
+  model->calibrate(false);
+  std::shared_ptr<jtorch::Tensor<float>> expected =
+      jtorch::Tensor<float>::clone(*TO_TENSOR_PTR(model->output.get()));
+
+  model->quantize();
+  EXPECT_TRUE(((jtorch::Linear*)seq->get(6))->weights() == nullptr);
+  model->forwardProp(tester.data_in);
+  jtorch::Tensor<float>* out = TO_TENSOR_PTR(model->output.get());
+
+  // The error should be within a few int8 steps of the output range.
+  const float range = std::max(jtorch::Tensor<float>::max(*expected),
+                               -jtorch::Tensor<float>::min(*expected));
+  jtorch::Tensor<float> error(out->dim(), out->size());
+  jtorch::Tensor<float>::sub(error, *out, *expected);
+  jtorch::Tensor<float>::abs(error);
+  EXPECT_TRUE(jtorch::Tensor<float>::max(error) <= 0.05f * range);
+}
+
+TEST(Modules, BatchForwardProp) {
+  Tester tester(test_path);
+
+  // test_model.bin has per sample (SpatialConvolution), planar
+  // (SpatialMaxPooling), GEMM (SpatialConvolutionMM and Linear) and view
+  // (Reshape) stages.
+  std::unique_ptr<jtorch::TorchStage> model =
+      jtorch::TorchStage::loadFromFile(test_path + "test_model.bin");
+  const uint32_t batch_size = 3;
+  std::vector<uint32_t> size(tester.data_in->size(),
+                             tester.data_in->size() + tester.data_in->dim());
+  size.push_back(batch_size);
+  std::shared_ptr<jtorch::Tensor<float>> batch(
+      new jtorch::Tensor<float>((uint32_t)size.size(), size.data()));
+
+  // Scaled copies of the input (so that mixed up samples show), and their
+  // single sample outputs.
+  std::vector<std::shared_ptr<jtorch::Tensor<float>>> expected;
+  for (uint32_t b = 0; b < batch_size; b++) {
+    std::shared_ptr<jtorch::Tensor<float>> sample =
+        jtorch::Tensor<float>::selectOuterDim(*batch, b);
+    jtorch::Tensor<float>::copy(*sample, *tester.data_in);
+    jtorch::Tensor<float>::mul(*sample, 1.0f - 0.25f * b);
+    model->forwardProp(jtorch::Tensor<float>::clone(*sample));
+    expected.push_back(
+        jtorch::Tensor<float>::clone(*TO_TENSOR_PTR(model->output.get())));
+  }
+
+  model->forwardPropBatch(batch);
+  jtorch::Tensor<float>* out = TO_TENSOR_PTR(model->output.get());
+  EXPECT_EQ(out->dim(), expected[0]->dim() + 1);
+  EXPECT_EQ(out->size()[out->dim() - 1], batch_size);
+  EXPECT_TRUE(tester.testJTorchValue(
+      jtorch::Tensor<float>::selectOuterDim(*out, 0), "test_model_res.bin"));
+  for (uint32_t b = 0; b < batch_size; b++) {
+    jtorch::Tensor<float> error(expected[b]->dim(), expected[b]->size());
+    jtorch::Tensor<float>::sub(
+        error, *jtorch::Tensor<float>::selectOuterDim(*out, b), *expected[b]);
+    jtorch::Tensor<float>::abs(error);
+    EXPECT_TRUE(jtorch::Tensor<float>::max(error) <= JTORCH_FLOAT_PRECISION);
+  }
+
+  // Back to single samples.
+  model->forwardProp(tester.data_in);
+  EXPECT_TRUE(tester.testJTorchValue(model->output, "test_model_res.bin"));
+}
+
+TEST(Modules, SequentialCapture) {
+  Tester tester(test_path);
+
+  std::unique_ptr<jtorch::TorchStage> model =
+      jtorch::TorchStage::loadFromFile(test_path + "test_model.bin");
+  EXPECT_EQ(model->type(), jtorch::SEQUENTIAL_STAGE);
+  jtorch::Sequential* seq = (jtorch::Sequential*)model.get();
+  seq->setCaptureEnabled(true);
+
+  // Warm-up, capture and then replays.
+  for (uint32_t i = 0; i < 4; i++) {
+    EXPECT_EQ(seq->captured(), i >= 2);
+    seq->forwardProp(tester.data_in);
+    EXPECT_TRUE(tester.testJTorchValue(seq->output, "test_model_res.bin"));
+  }
+
+  // Same shape in a different buffer: the capture is rebound, not redone.
+  std::shared_ptr<jtorch::Tensor<float>> input =
+      jtorch::Tensor<float>::clone(*TO_TENSOR_PTR(tester.data_in.get()));
+  seq->forwardProp(input);
+  EXPECT_TRUE(seq->captured());
+  EXPECT_TRUE(tester.testJTorchValue(seq->output, "test_model_res.bin"));
+
+  seq->setCaptureEnabled(false);
+  EXPECT_FALSE(seq->captured());
+  seq->forwardProp(tester.data_in);
+  EXPECT_TRUE(tester.testJTorchValue(seq->output, "test_model_res.bin"));
+}
+
+TEST(Modules, SequentialCaptureSmallerStorage) {
+  Tester tester(test_path);
+
+  std::unique_ptr<jtorch::TorchStage> model =
+      jtorch::TorchStage::loadFromFile(test_path + "test_model.bin");
+  jtorch::Sequential* seq = (jtorch::Sequential*)model.get();
+  seq->setCaptureEnabled(true);
+
+  // Capture with the first sample of a batch (a view of a larger storage).
+  const jtorch::Tensor<float>& data_in = *TO_TENSOR_PTR(tester.data_in.get());
+  std::vector<uint32_t> batch_size(data_in.size(),
+                                   data_in.size() + data_in.dim());
+  batch_size.push_back(2);
+  std::shared_ptr<jtorch::Tensor<float>> batch(new jtorch::Tensor<float>(
+      (uint32_t)batch_size.size(), batch_size.data()));
+  for (uint32_t b = 0; b < 2; b++) {
+    jtorch::Tensor<float>::copy(
+        *jtorch::Tensor<float>::selectOuterDim(*batch, b), data_in);
+  }
+  std::shared_ptr<jtorch::Tensor<float>> sample =
+      jtorch::Tensor<float>::selectOuterDim(*batch, 0);
+  for (uint32_t i = 0; i < 3; i++) {
+    seq->forwardProp(sample);
+  }
+  EXPECT_TRUE(seq->captured());
+
+  // A standalone input of the same shape has a smaller storage, but it
+  // holds everything the capture reads.
+  std::shared_ptr<jtorch::Tensor<float>> input =
+      jtorch::Tensor<float>::clone(data_in);
+  EXPECT_LT(input->storage()->nelems(), batch->storage()->nelems());
+  seq->forwardProp(input);
+  EXPECT_TRUE(seq->captured());
+  EXPECT_TRUE(tester.testJTorchValue(seq->output, "test_model_res.bin"));
+}
+
+TEST(Modules, SequentialCaptureGemm) {
+  Tester tester(test_path);
+
+  // A batched Linear feeds the model's input straight to clBLAS, so a
+  // rebound replay must hand the GEMM the new input as well.
+  const uint32_t n_inputs = 16;
+  const uint32_t n_outputs = 8;
+  const uint32_t batch_size = 4;
+  std::unique_ptr<jtorch::Linear> linear(
+      new jtorch::Linear(n_inputs, n_outputs));
+  std::vector<float> weights(n_inputs * n_outputs);  // Column major
+  for (uint32_t i = 0; i < weights.size(); i++) {
+    weights[i] = (float)(i % 7) * 0.125f - 0.375f;
+  }
+  std::vector<float> biases(n_outputs, 0.5f);
+  linear->setWeights(weights.data());
+  linear->setBiases(biases.data());
+  jtorch::Sequential seq;
+  seq.add(std::move(linear));
+  seq.setCaptureEnabled(true);
+
+  const uint32_t size[2] = {n_inputs, batch_size};
+  std::vector<float> data(n_inputs * batch_size);
+  std::vector<float> result(n_outputs * batch_size);
+  for (uint32_t iter = 0; iter < 4; iter++) {
+    // Every input lives in its own buffer and holds different values.
+    for (uint32_t i = 0; i < data.size(); i++) {
+      data[i] = (float)((i + iter) % 5) - 2.0f;
+    }
+    std::shared_ptr<jtorch::Tensor<float>> input(
+        new jtorch::Tensor<float>(2, size));
+    input->setData(data.data());
+    EXPECT_EQ(seq.captured(), iter >= 2);
+    seq.forwardPropBatch(input);
+    TO_TENSOR_PTR(seq.output.get())->getData(result.data());
+    for (uint32_t b = 0; b < batch_size; b++) {
+      for (uint32_t o = 0; o < n_outputs; o++) {
+        float expected = biases[o];
+        for (uint32_t i = 0; i < n_inputs; i++) {
+          expected += weights[i * n_outputs + o] * data[b * n_inputs + i];
+        }
+        EXPECT_APPROX_EQ(result[b * n_outputs + o], expected,
+                         JTORCH_FLOAT_PRECISION);
+      }
+    }
+  }
+}
+
+TEST(Modules, Prepare) {
+  Tester tester(test_path);
+
+  std::unique_ptr<jtorch::TorchStage> model =
+      jtorch::TorchStage::loadFromFile(test_path + "test_model.bin");
+  model->prepare();
+  const uint32_t num_programs = jtorch::cl_context->getNumPrograms();
+
+  // Everything the forward pass needs was built up front.
+  model->forwardProp(tester.data_in);
+  EXPECT_EQ(jtorch::cl_context->getNumPrograms(), num_programs);
+  EXPECT_TRUE(tester.testJTorchValue(model->output, "test_model_res.bin"));
+
+  // With a sample input the warm up pass runs too.
+  std::unique_ptr<jtorch::TorchStage> model2 =
+      jtorch::TorchStage::loadFromFile(test_path + "test_model.bin");
+  model2->prepare(tester.data_in);
+  EXPECT_EQ(jtorch::cl_context->getNumPrograms(), num_programs);
+  model2->forwardProp(tester.data_in);
+  EXPECT_TRUE(tester.testJTorchValue(model2->output, "test_model_res.bin"));
+}
+
+TEST(Modules, ImageInputs) {
+  Tester tester(test_path);
+
+  // The image input path must match the buffer path (on devices without
+  // image support this just runs the buffer path again).
+  jtorch::SetUseImages(true);
+
+  std::unique_ptr<jtorch::TorchStage> conv = jtorch::TorchStage::loadFromFile(
+      test_path + "spatial_convolution_model.bin");
+  conv->forwardProp(tester.data_in);
+  EXPECT_TRUE(
+      tester.testJTorchValue(conv->output, "spatial_convolution_res.bin"));
+
+  // Padded pooling windows read the clamped edge texels.
+  jtorch::SpatialMaxPooling pool(4, 5, 1, 3, 2, 0);
+  pool.forwardProp(tester.data_in);
+  EXPECT_TRUE(tester.testJTorchValue(pool.output,
+                                     "spatial_max_pooling_stride_res.bin"));
+
+  jtorch::SpatialUpSamplingNearest up(4);
+  up.forwardProp(tester.data_in);
+  EXPECT_TRUE(
+      tester.testJTorchValue(up.output, "spatial_up_sampling_nearest_res.bin"));
+
+  jtorch::SetUseImages(false);
+}
+
+TEST(Modules, DataParallel) {
+  Tester tester(test_path);
+
+  jtorch::DataParallel model(test_path + "test_model.bin");
+  EXPECT_EQ(model.numReplicas(), jtorch::cl_context->getNumDevices());
+
+  const uint32_t num_requests = 2 * model.numReplicas() + 1;
+  std::vector<std::shared_ptr<jtorch::TorchData>> inputs(num_requests,
+                                                         tester.data_in);
+  // The callbacks run on the worker threads, so just record the results.
+  std::vector<char> correct(num_requests, 0);
+  model.forwardProp(inputs, [&](const uint32_t request,
+                                jtorch::TorchData& output) {
+    std::shared_ptr<jtorch::TorchData> out(&output,
+                                           [](jtorch::TorchData*) {});
+    correct[request] = tester.testJTorchValue(out, "test_model_res.bin");
+  });
+  for (uint32_t i = 0; i < num_requests; i++) {
+    EXPECT_TRUE(correct[i] != 0);
+  }
+
+  // Round-robin: every replica got its share.
+  for (uint32_t i = 0; i < model.numReplicas(); i++) {
+    EXPECT_GE(model.replicaRequests(i), 2);
+  }
+  EXPECT_EQ(model.numRequests(), num_requests);
+  EXPECT_GT(model.throughput(), 0);
+  model.printStats();
+}
+
+TEST(Modules, DataParallelOutOfOrder) {
+  Tester tester(test_path);
+
+  // With out-of-order queues every launch tracks events on its buffers, and
+  // all of the replicas read the same input (from their worker threads).
+  jtorch::RuntimeOptions options;
+  options.verbose_startup = false;
+  options.out_of_order_queue = true;
+  std::unique_ptr<jtorch::Runtime> runtime(new jtorch::Runtime(options));
+  {
+    jtorch::DataParallel model(test_path + "test_model.bin", 0,
+                               runtime.get());
+    const jtorch::Tensor<float>& data_in = *tester.data_in;
+    std::shared_ptr<jtorch::Tensor<float>> in(new jtorch::Tensor<float>(
+        data_in.dim(), data_in.size(), runtime.get()));
+    std::unique_ptr<float[]> data(new float[data_in.nelems()]);
+    data_in.getData(data.get());
+    in->setData(data.get());
+
+    const uint32_t num_requests = 4 * model.numReplicas();
+    std::vector<std::shared_ptr<jtorch::TorchData>> inputs(num_requests, in);
+    std::vector<char> correct(num_requests, 0);
+    model.forwardProp(inputs, [&](const uint32_t request,
+                                  jtorch::TorchData& output) {
+      std::shared_ptr<jtorch::TorchData> out(&output,
+                                             [](jtorch::TorchData*) {});
+      correct[request] = tester.testJTorchValue(out, "test_model_res.bin");
+    });
+    for (uint32_t i = 0; i < num_requests; i++) {
+      EXPECT_TRUE(correct[i] != 0);
+    }
+  }
+  runtime.reset(nullptr);
+}
+
+TEST(Modules, Runtime) {
+  Tester tester(test_path);
+
+  // A second runtime, independent of the default one.
+  jtorch::RuntimeOptions options;
+  options.verbose_startup = false;
+  std::unique_ptr<jtorch::Runtime> runtime(new jtorch::Runtime(options));
+  EXPECT_TRUE(runtime->context() != jtorch::cl_context);
+  {
+    std::unique_ptr<jtorch::TorchStage> model =
+        jtorch::TorchStage::loadFromFile(test_path + "test_model.bin",
+                                         runtime.get());
+    EXPECT_TRUE(model->runtime() == runtime.get());
+
+    // The input has to live on the model's runtime too.
+    const jtorch::Tensor<float>& data_in = *tester.data_in;
+    std::shared_ptr<jtorch::Tensor<float>> in(new jtorch::Tensor<float>(
+        data_in.dim(), data_in.size(), runtime.get()));
+    std::unique_ptr<float[]> data(new float[data_in.nelems()]);
+    data_in.getData(data.get());
+    in->setData(data.get());
+
+    model->forwardProp(in);
+    EXPECT_TRUE(TO_TENSOR_PTR(model->output.get())->runtime() ==
+                runtime.get());
+    EXPECT_TRUE(tester.testJTorchValue(model->output, "test_model_res.bin"));
+  }
+  // The runtime's tensors must be gone before it is.
+  runtime.reset(nullptr);
+
+  EXPECT_TRUE(tester.data_in->runtime() == jtorch::Runtime::Default());
+}
+
 TEST(Modules, ProfileConvolution) {
   const uint32_t fin = 128, fout = 512, kw = 11, kh = 11, pad = 5, imw = 90,
                  imh = 60;
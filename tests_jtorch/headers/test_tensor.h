@@ -2,7 +2,9 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <limits>
 
+#include "jtorch/tensor_expr.h"
 #include "tester.h"
 
 #define JTORCH_TENSOR_PRECISION 1e-6f
@@ -78,14 +80,65 @@ TEST(Tensor, RandSumMaxMin) {
   float mean = sum / rand->nelems();
   EXPECT_LT(fabsf(mean - 0.5f), 10.0f * JTORCH_FLOAT_PRECISION);
 
-  EXPECT_LT(fabsf(sum - jtorch::Tensor<float>::slowSum(*rand)),
-            JTORCH_FLOAT_PRECISION);
-  EXPECT_EQ(max, jtorch::Tensor<float>::slowMax(*rand));
-  EXPECT_EQ(min, jtorch::Tensor<float>::slowMin(*rand));
-  EXPECT_LT(fabsf(mean - jtorch::Tensor<float>::slowMean(*rand)),
+  // The device sums in a different order, so allow for float rounding.
+  EXPECT_LT(fabsf(sum - jtorch::Tensor<float>::sum(*rand)),
+            JTORCH_FLOAT_PRECISION * sum);
+  EXPECT_EQ(max, jtorch::Tensor<float>::max(*rand));
+  EXPECT_EQ(min, jtorch::Tensor<float>::min(*rand));
+  EXPECT_LT(fabsf(mean - jtorch::Tensor<float>::mean(*rand)),
             JTORCH_FLOAT_PRECISION);
 }
 
+TEST(Tensor, ReduceDim) {
+  const uint32_t dim = 3;
+  const uint32_t size[dim] = {7, 300, 3};
+  std::shared_ptr<jtorch::Tensor<float>> a =
+      jtorch::Tensor<float>::slowRand(dim, size);
+  std::unique_ptr<float[]> a_cpu(new float[a->nelems()]);
+  a->getData(a_cpu.get());
+
+  std::shared_ptr<jtorch::Tensor<float>> res(new jtorch::Tensor<float>());
+  for (uint32_t d = 0; d < dim; d++) {
+    uint32_t res_size[dim] = {size[0], size[1], size[2]};
+    res_size[d] = 1;
+    jtorch::Tensor<float>::reduce(*res, *a,
+                                  jtorch::Tensor<float>::REDUCE_SUM, d);
+    EXPECT_EQ(res->dim(), dim);
+    EXPECT_EQ(res->size()[d], 1u);
+    std::unique_ptr<float[]> sum_cpu(new float[res->nelems()]);
+    res->getData(sum_cpu.get());
+    jtorch::Tensor<float>::reduce(*res, *a,
+                                  jtorch::Tensor<float>::REDUCE_MAX, d);
+    std::unique_ptr<float[]> max_cpu(new float[res->nelems()]);
+    res->getData(max_cpu.get());
+
+    for (uint32_t f = 0; f < res_size[2]; f++) {
+      for (uint32_t v = 0; v < res_size[1]; v++) {
+        for (uint32_t u = 0; u < res_size[0]; u++) {
+          float sum = 0;
+          float max = -std::numeric_limits<float>::infinity();
+          for (uint32_t i = 0; i < size[d]; i++) {
+            uint32_t coord[dim] = {u, v, f};
+            coord[d] = i;
+            const float val =
+                a_cpu[(coord[2] * size[1] + coord[1]) * size[0] + coord[0]];
+            sum += val;
+            max = std::max<float>(max, val);
+          }
+          const uint32_t index = (f * res_size[1] + v) * res_size[0] + u;
+          EXPECT_LT(fabsf(sum - sum_cpu[index]), JTORCH_FLOAT_PRECISION * sum);
+          EXPECT_EQ(max, max_cpu[index]);
+        }
+      }
+    }
+  }
+
+  // Reductions of strided views materialize them first.
+  std::shared_ptr<jtorch::Tensor<float>> a_t =
+      jtorch::Tensor<float>::transpose(*a, 0, 1);
+  EXPECT_EQ(jtorch::Tensor<float>::max(*a_t), jtorch::Tensor<float>::max(*a));
+}
+
 TEST(Tensor, CopyResizeAs) {
   const uint32_t dim = 4;
   const uint32_t size[dim] = {101, 11, 12, 2};
@@ -208,6 +261,39 @@ TEST(Tensor, Clone) {
   }
 }
 
+TEST(Tensor, MapUnmap) {
+  const uint32_t dim = 2;
+  const uint32_t size[dim] = {17, 13};
+
+  std::shared_ptr<jtorch::Tensor<float>> a(
+      new jtorch::Tensor<float>(dim, size));
+  const uint32_t nelems = a->nelems();
+  float* a_map = a->mapForWrite();
+  for (uint32_t i = 0; i < nelems; i++) {
+    a_map[i] = (float)i;
+  }
+  a->unmap();
+
+  // Run a kernel on the mapped data, then read it back both ways.
+  jtorch::Tensor<float>::mul(*a, 2.0f);
+  std::unique_ptr<float[]> a_cpu(new float[nelems]);
+  a->getData(a_cpu.get());
+  const float* a_read = a->mapForRead();
+  for (uint32_t i = 0; i < nelems; i++) {
+    EXPECT_EQ(a_cpu[i], 2.0f * (float)i);
+    EXPECT_EQ(a_read[i], 2.0f * (float)i);
+  }
+  a->unmap();
+
+  // setData must also be visible through a mapping.
+  a->setData(a_cpu.get());
+  a_read = a->mapForRead();
+  for (uint32_t i = 0; i < nelems; i++) {
+    EXPECT_EQ(a_read[i], a_cpu[i]);
+  }
+  a->unmap();
+}
+
 TEST(Tensor, Mul) {
   const uint32_t dim = 4;
   const uint32_t size[dim] = {2, 3, 5, 7};
@@ -310,3 +396,426 @@ TEST(Tensor, NarrowOuter) {
     }
   }
 }
+
+TEST(Tensor, ViewOffset) {
+  const uint32_t dim = 3;
+  const uint32_t size[dim] = {3, 5, 7};
+
+  std::shared_ptr<jtorch::Tensor<float>> a =
+      jtorch::Tensor<float>::slowRand(dim, size);
+  std::shared_ptr<jtorch::Tensor<float>> a_copy =
+      jtorch::Tensor<float>::clone(*a);
+
+  // Views share the parent's storage (at an unaligned offset) rather than
+  // allocating a sub-buffer.
+  const uint32_t f = 3;
+  std::shared_ptr<jtorch::Tensor<float>> a_f =
+      jtorch::Tensor<float>::selectOuterDim(*a, f);
+  const uint32_t im_size = size[0] * size[1];
+  EXPECT_TRUE(a_f->storage() == a->storage());
+  EXPECT_EQ(a_f->offset(), f * im_size);
+
+  // Host transfers through the view only touch its slice.
+  std::unique_ptr<float[]> slice(new float[im_size]);
+  for (uint32_t i = 0; i < im_size; i++) {
+    slice[i] = static_cast<float>(i);
+  }
+  a_f->setData(slice.get());
+  std::unique_ptr<float[]> slice_out(new float[im_size]);
+  a_f->getData(slice_out.get());
+
+  const uint32_t nelems = a->nelems();
+  std::unique_ptr<float[]> a_cpu(new float[nelems]);
+  a->getData(a_cpu.get());
+  std::unique_ptr<float[]> a_copy_cpu(new float[nelems]);
+  a_copy->getData(a_copy_cpu.get());
+
+  for (uint32_t i = 0; i < im_size; i++) {
+    EXPECT_EQ(slice_out[i], slice[i]);
+  }
+  for (uint32_t i = 0; i < nelems; i++) {
+    if (i >= f * im_size && i < (f + 1) * im_size) {
+      EXPECT_EQ(a_cpu[i], slice[i - f * im_size]);
+    } else {
+      EXPECT_EQ(a_cpu[i], a_copy_cpu[i]);
+    }
+  }
+}
+
+TEST(Tensor, Strided) {
+  const uint32_t dim = 3;
+  const uint32_t size[dim] = {4, 5, 6};
+
+  std::shared_ptr<jtorch::Tensor<float>> a =
+      jtorch::Tensor<float>::slowRand(dim, size);
+  const uint32_t nelems = a->nelems();
+  std::unique_ptr<float[]> a_cpu(new float[nelems]);
+  a->getData(a_cpu.get());
+  auto a_at = [&](uint32_t u, uint32_t v, uint32_t f) {
+    return a_cpu[(f * size[1] + v) * size[0] + u];
+  };
+
+  // Narrow the inner dimension: a non-contiguous view of a's storage.
+  const uint32_t u_start = 1;
+  const uint32_t u_len = 2;
+  std::shared_ptr<jtorch::Tensor<float>> a_n =
+      jtorch::Tensor<float>::narrow(*a, 0, u_start, u_len);
+  EXPECT_TRUE(a_n->storage() == a->storage());
+  EXPECT_FALSE(a_n->isContiguous());
+  EXPECT_TRUE(jtorch::Tensor<float>::narrowOuterDim(*a, 1, 2)->isContiguous());
+  std::unique_ptr<float[]> a_n_cpu(new float[a_n->nelems()]);
+  a_n->getData(a_n_cpu.get());
+  for (uint32_t f = 0; f < size[2]; f++) {
+    for (uint32_t v = 0; v < size[1]; v++) {
+      for (uint32_t u = 0; u < u_len; u++) {
+        EXPECT_EQ(a_n_cpu[(f * size[1] + v) * u_len + u],
+                  a_at(u + u_start, v, f));
+      }
+    }
+  }
+
+  // Transpose the inner and outer dimensions, then select a middle row.
+  std::shared_ptr<jtorch::Tensor<float>> a_t =
+      jtorch::Tensor<float>::transpose(*a, 0, 2);
+  EXPECT_EQ(a_t->size()[0], size[2]);
+  EXPECT_EQ(a_t->size()[2], size[0]);
+  const uint32_t v_sel = 3;
+  std::shared_ptr<jtorch::Tensor<float>> a_ts =
+      jtorch::Tensor<float>::select(*a_t, 1, v_sel);
+  std::shared_ptr<jtorch::Tensor<float>> a_ts_copy =
+      jtorch::Tensor<float>::contiguous(*a_ts);
+  EXPECT_TRUE(a_ts_copy->isContiguous());
+  EXPECT_FALSE(a_ts_copy->storage() == a->storage());
+  std::unique_ptr<float[]> a_ts_cpu(new float[a_ts->nelems()]);
+  a_ts_copy->getData(a_ts_cpu.get());
+  for (uint32_t u = 0; u < size[0]; u++) {
+    for (uint32_t f = 0; f < size[2]; f++) {
+      EXPECT_EQ(a_ts_cpu[u * size[2] + f], a_at(u, v_sel, f));
+    }
+  }
+
+  // Elementwise ops through the strided view only touch its elements.
+  jtorch::Tensor<float>::mul(*a_n, 0.5f);
+  jtorch::Tensor<float>::add(*a_n, 1.0f);
+  std::unique_ptr<float[]> a_new_cpu(new float[nelems]);
+  a->getData(a_new_cpu.get());
+  for (uint32_t f = 0; f < size[2]; f++) {
+    for (uint32_t v = 0; v < size[1]; v++) {
+      for (uint32_t u = 0; u < size[0]; u++) {
+        const float expected = (u >= u_start && u < u_start + u_len)
+                                   ? a_at(u, v, f) * 0.5f + 1.0f
+                                   : a_at(u, v, f);
+        EXPECT_APPROX_EQ(a_new_cpu[(f * size[1] + v) * size[0] + u],
+                         expected, JTORCH_TENSOR_PRECISION);
+      }
+    }
+  }
+}
+
+TEST(Tensor, StridedManyDims) {
+  // Narrowing every dimension leaves none that merge, so the view has more
+  // dimensions than the strided kernel.
+  const uint32_t dim = 6;
+  const uint32_t size[dim] = {3, 3, 3, 3, 3, 3};
+  std::shared_ptr<jtorch::Tensor<float>> a =
+      jtorch::Tensor<float>::slowRand(dim, size);
+  const uint32_t nelems = a->nelems();
+  std::unique_ptr<float[]> a_cpu(new float[nelems]);
+  a->getData(a_cpu.get());
+  std::shared_ptr<jtorch::Tensor<float>> a_n = a;
+  for (uint32_t d = 0; d < dim; d++) {
+    a_n = jtorch::Tensor<float>::narrow(*a_n, d, 1, 2);
+  }
+  EXPECT_FALSE(a_n->isContiguous());
+
+  // Element i of a is in the view if every coordinate is 1 or 2.
+  auto in_view = [&](uint32_t i) {
+    for (uint32_t d = 0; d < dim; d++) {
+      if (i % size[d] == 0) {
+        return false;
+      }
+      i /= size[d];
+    }
+    return true;
+  };
+
+  std::shared_ptr<jtorch::Tensor<float>> a_n_copy =
+      jtorch::Tensor<float>::contiguous(*a_n);
+  std::unique_ptr<float[]> a_n_cpu(new float[a_n->nelems()]);
+  a_n_copy->getData(a_n_cpu.get());
+  uint32_t j = 0;
+  for (uint32_t i = 0; i < nelems; i++) {
+    if (in_view(i)) {
+      EXPECT_EQ(a_n_cpu[j++], a_cpu[i]);
+    }
+  }
+  EXPECT_EQ(j, a_n->nelems());
+
+  jtorch::Tensor<float>::add(*a_n, 1.0f);
+  std::unique_ptr<float[]> a_new_cpu(new float[nelems]);
+  a->getData(a_new_cpu.get());
+  for (uint32_t i = 0; i < nelems; i++) {
+    const float expected = in_view(i) ? a_cpu[i] + 1.0f : a_cpu[i];
+    EXPECT_APPROX_EQ(a_new_cpu[i], expected, JTORCH_TENSOR_PRECISION);
+  }
+}
+
+TEST(Tensor, Index64) {
+  const uint64_t int32_max = std::numeric_limits<int32_t>::max();
+  EXPECT_FALSE(jtorch::NeedsIndex64(int32_max));
+  EXPECT_TRUE(jtorch::NeedsIndex64(int32_max + 1));
+  EXPECT_TRUE(jtorch::IndexDefines(false).empty());
+  EXPECT_EQ(jtorch::IndexDefines(true).at("INDEX_T"), "long");
+
+  const uint32_t dim = 3;
+  const uint32_t size[dim] = {5, 4, 3};
+  std::shared_ptr<jtorch::Tensor<float>> a =
+      jtorch::Tensor<float>::slowRand(dim, size);
+  EXPECT_FALSE(a->index64());
+
+  // Small tensors don't need it, but the 64-bit variant (and the chunked
+  // launch) must still give the same answer.
+  static const char* kCopy = JTORCH_INDEX_PRELUDE
+  "    __kernel void Copy(const __global float* input,    /* 0 */\n"
+  "                       __global float* output,         /* 1 */\n"
+  "                       const INDEX_T input_offset,     /* 2 */\n"
+  "                       const INDEX_T output_offset) {  /* 3 */\n"
+  "      const INDEX_T x = get_global_id(0);\n"
+  "      output[output_offset + x] = input[input_offset + x];\n"
+  "    }";
+  std::shared_ptr<jtorch::Tensor<float>> b(
+      new jtorch::Tensor<float>(dim, size));
+  std::shared_ptr<jtorch::Tensor<float>> a_f =
+      jtorch::Tensor<float>::selectOuterDim(*a, 1);
+  std::shared_ptr<jtorch::Tensor<float>> b_f =
+      jtorch::Tensor<float>::selectOuterDim(*b, 2);
+  jtorch::cl_context->useKernelCStr(kCopy, "Copy", jtorch::IndexDefines(true));
+  jtorch::cl_context->setArg(0, a_f->storage());
+  jtorch::cl_context->setArg(1, b_f->storage());
+  a->runtime()->runElementwiseKernel(
+      nullptr, 2, {a_f->offset(), b_f->offset()}, a_f->nelems(), true);
+
+  const uint32_t im_size = size[0] * size[1];
+  std::unique_ptr<float[]> a_cpu(new float[im_size]);
+  std::unique_ptr<float[]> b_cpu(new float[im_size]);
+  a_f->getData(a_cpu.get());
+  b_f->getData(b_cpu.get());
+  for (uint32_t i = 0; i < im_size; i++) {
+    EXPECT_EQ(a_cpu[i], b_cpu[i]);
+  }
+}
+
+TEST(Tensor, HalfStorage) {
+  const uint32_t dim = 3;
+  const uint32_t size[dim] = {5, 7, 3};  // An odd number of elements.
+
+  std::shared_ptr<jtorch::Tensor<float>> a(new jtorch::Tensor<float>(
+      dim, size, nullptr, jtorch::HALF_STORAGE));
+  EXPECT_EQ(a->format(), jtorch::HALF_STORAGE);
+  const uint32_t nelems = a->nelems();
+  EXPECT_EQ(a->storage()->nelems(), (nelems + 1) / 2);
+
+  // Small multiples of 1/4 are exact in fp16.
+  std::unique_ptr<float[]> a_cpu(new float[nelems]);
+  for (uint32_t i = 0; i < nelems; i++) {
+    a_cpu[i] = 0.25f * (float)i - 8.0f;
+  }
+  a->setData(a_cpu.get());
+  std::unique_ptr<float[]> res_cpu(new float[nelems]);
+  a->getData(res_cpu.get());
+  for (uint32_t i = 0; i < nelems; i++) {
+    EXPECT_EQ(res_cpu[i], a_cpu[i]);
+  }
+
+  // Ops with float operands convert them, and compute in float.
+  std::shared_ptr<jtorch::Tensor<float>> b =
+      jtorch::Tensor<float>::slowRand(dim, size);
+  std::unique_ptr<float[]> b_cpu(new float[nelems]);
+  b->getData(b_cpu.get());
+  std::shared_ptr<jtorch::Tensor<float>> c(new jtorch::Tensor<float>(
+      dim, size, nullptr, jtorch::HALF_STORAGE));
+  jtorch::Tensor<float>::add(*c, *a, *b);
+  jtorch::Tensor<float>::mul(*c, 0.5f);
+  c->getData(res_cpu.get());
+  for (uint32_t i = 0; i < nelems; i++) {
+    const float expected = 0.5f * (a_cpu[i] + b_cpu[i]);
+    EXPECT_LT(fabsf(res_cpu[i] - expected), 1e-3f * (fabsf(expected) + 1.0f));
+  }
+
+  // Strided views and reductions of half tensors.
+  std::shared_ptr<jtorch::Tensor<float>> a_t =
+      jtorch::Tensor<float>::transpose(*a, 0, 2);
+  std::shared_ptr<jtorch::Tensor<float>> a_t_copy =
+      jtorch::Tensor<float>::contiguous(*a_t);
+  EXPECT_EQ(a_t_copy->format(), jtorch::HALF_STORAGE);
+  a_t_copy->getData(res_cpu.get());
+  for (uint32_t u = 0; u < size[0]; u++) {
+    for (uint32_t f = 0; f < size[2]; f++) {
+      EXPECT_EQ(res_cpu[u * size[2] + f], a_cpu[f * size[1] * size[0] + u]);
+    }
+  }
+  float sum = 0;
+  for (uint32_t i = 0; i < nelems; i++) {
+    sum += a_cpu[i];
+  }
+  EXPECT_EQ(jtorch::Tensor<float>::sum(*a), sum);
+  EXPECT_EQ(jtorch::Tensor<float>::max(*a_t), a_cpu[nelems - 1]);
+
+  // Converting back to float is exact.
+  std::shared_ptr<jtorch::Tensor<float>> a_float =
+      jtorch::Tensor<float>::toFormat(*a, jtorch::FLOAT_STORAGE);
+  EXPECT_EQ(a_float->format(), jtorch::FLOAT_STORAGE);
+  a_float->getData(res_cpu.get());
+  for (uint32_t i = 0; i < nelems; i++) {
+    EXPECT_EQ(res_cpu[i], a_cpu[i]);
+  }
+}
+
+TEST(Tensor, Expressions) {
+  const uint32_t dim = 2;
+  const uint32_t size[dim] = {11, 11};
+
+  std::shared_ptr<jtorch::Tensor<float>> x =
+      jtorch::Tensor<float>::slowRand(dim, size);
+  std::shared_ptr<jtorch::Tensor<float>> y =
+      jtorch::Tensor<float>::slowRand(dim, size);
+  jtorch::Tensor<float>::add(*y, -0.25f);  // slowRand always has the same seed
+  jtorch::Tensor<float> dst(dim, size);
+
+  const uint32_t nelems = x->nelems();
+  std::unique_ptr<float[]> x_cpu(new float[nelems]);
+  x->getData(x_cpu.get());
+  std::unique_ptr<float[]> y_cpu(new float[nelems]);
+  y->getData(y_cpu.get());
+  std::unique_ptr<float[]> res_cpu(new float[nelems]);
+
+  jtorch::Tensor<float>::eval(dst, abs((*x - *y) * 0.5f));
+  dst.getData(res_cpu.get());
+  for (uint32_t i = 0; i < nelems; i++) {
+    EXPECT_APPROX_EQ(res_cpu[i], fabsf((x_cpu[i] - y_cpu[i]) * 0.5f),
+                     JTORCH_TENSOR_PRECISION);
+  }
+
+  // Scalars on either side, unary minus, repeated operands and functions.
+  jtorch::Tensor<float>::eval(dst, fmax(2.0f - *x * *x, -*y) / 4);
+  dst.getData(res_cpu.get());
+  for (uint32_t i = 0; i < nelems; i++) {
+    const float expected =
+        fmaxf(2.0f - x_cpu[i] * x_cpu[i], -y_cpu[i]) / 4.0f;
+    EXPECT_APPROX_EQ(res_cpu[i], expected, JTORCH_TENSOR_PRECISION);
+  }
+
+  // In place, with a strided operand (which is copied before x changes).
+  std::shared_ptr<jtorch::Tensor<float>> x_t =
+      jtorch::Tensor<float>::transpose(*x, 0, 1);
+  jtorch::Tensor<float>::eval(*x, *x + *x_t);
+  x->getData(res_cpu.get());
+  for (uint32_t v = 0; v < size[1]; v++) {
+    for (uint32_t u = 0; u < size[0]; u++) {
+      EXPECT_APPROX_EQ(res_cpu[v * size[0] + u],
+                       x_cpu[v * size[0] + u] + x_cpu[u * size[0] + v],
+                       JTORCH_TENSOR_PRECISION);
+    }
+  }
+
+  // Into a half tensor, with float operands.
+  jtorch::Tensor<float> dst_half(dim, size, nullptr, jtorch::HALF_STORAGE);
+  jtorch::Tensor<float>::eval(dst_half, sqrt(abs(*y)) + 1);
+  dst_half.getData(res_cpu.get());
+  for (uint32_t i = 0; i < nelems; i++) {
+    const float expected = sqrtf(fabsf(y_cpu[i])) + 1.0f;
+    EXPECT_APPROX_EQ(res_cpu[i], expected, 1e-3f * expected);
+  }
+}
+
+// Host reference for the uniform value n of Tensor::rand() (word n & 3 of
+// the Philox4x32-10 block n >> 2, see kRandKernel).
+static float PhiloxUniform(const uint64_t seed, const uint64_t n) {
+  const uint64_t block = n >> 2;
+  uint32_t ctr[4] = {(uint32_t)block, (uint32_t)(block >> 32), 0, 0};
+  uint32_t key[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+  for (int r = 0; r < 10; r++) {
+    if (r > 0) {
+      key[0] += 0x9E3779B9u;
+      key[1] += 0xBB67AE85u;
+    }
+    const uint64_t p0 = (uint64_t)0xD2511F53u * ctr[0];
+    const uint64_t p1 = (uint64_t)0xCD9E8D57u * ctr[2];
+    const uint32_t next[4] = {(uint32_t)(p1 >> 32) ^ ctr[1] ^ key[0],
+                              (uint32_t)p1,
+                              (uint32_t)(p0 >> 32) ^ ctr[3] ^ key[1],
+                              (uint32_t)p0};
+    memcpy(ctr, next, sizeof(ctr));
+  }
+  return (float)(ctr[n & 3] >> 8) / 16777216.0f;
+}
+
+TEST(Tensor, DeviceRand) {
+  // Known answer (from Random123): the block of counter 0 and key 0 starts
+  // with 0x6627e8d5.
+  EXPECT_EQ(PhiloxUniform(0, 0), (float)(0x6627e8d5u >> 8) / 16777216.0f);
+
+  const uint32_t dim = 3;
+  const uint32_t size[dim] = {33, 17, 5};
+  const uint64_t seed = 0x0123456789abcdefull;
+  const uint64_t counter = (1ull << 32) - 100;  // Crosses into the high word
+  jtorch::Tensor<float> x(dim, size);
+  jtorch::Tensor<float>::rand(x, seed, counter);
+  const uint64_t nelems = x.nelems();
+  std::unique_ptr<float[]> x_cpu(new float[nelems]);
+  x.getData(x_cpu.get());
+  for (uint64_t i = 0; i < nelems; i++) {
+    EXPECT_EQ(x_cpu[i], PhiloxUniform(seed, counter + i));
+  }
+
+  // Slices filled with matching counters get the same values (the planes
+  // don't start on a block boundary).
+  jtorch::Tensor<float> y(dim, size);
+  const uint64_t plane = size[0] * size[1];
+  for (uint32_t f = 0; f < size[2]; f++) {
+    jtorch::Tensor<float>::rand(*jtorch::Tensor<float>::selectOuterDim(y, f),
+                                seed, counter + f * plane);
+  }
+  std::unique_ptr<float[]> y_cpu(new float[nelems]);
+  y.getData(y_cpu.get());
+  EXPECT_EQ(memcmp(x_cpu.get(), y_cpu.get(), sizeof(float) * nelems), 0);
+
+  // Strided tensors are filled in their (logical) element order.
+  jtorch::Tensor<float>::rand(*jtorch::Tensor<float>::transpose(y, 0, 1),
+                              seed);
+  y.getData(y_cpu.get());
+  for (uint32_t f = 0; f < size[2]; f++) {
+    for (uint32_t v = 0; v < size[1]; v++) {
+      for (uint32_t u = 0; u < size[0]; u++) {
+        EXPECT_EQ(y_cpu[f * plane + v * size[0] + u],
+                  PhiloxUniform(seed, f * plane + u * size[1] + v));
+      }
+    }
+  }
+
+  // The normal values should have the right moments.
+  const uint32_t n = 1 << 20;
+  jtorch::Tensor<float> z(1, &n);
+  jtorch::Tensor<float>::randn(z, seed);
+  jtorch::Tensor<float> z2(1, &n);
+  jtorch::Tensor<float>::eval(z2, z * z);
+  EXPECT_LT(fabsf(jtorch::Tensor<float>::mean(z)), 5e-3f);
+  EXPECT_LT(fabsf(jtorch::Tensor<float>::mean(z2) - 1.0f), 1e-2f);
+
+  // Normal values come in (cos, sin) pairs, which a fill starting halfway
+  // through a block must pick up from the same place.
+  const uint32_t skip = 3;
+  const uint32_t m = 1001;
+  const uint32_t m_skip = m - skip;
+  jtorch::Tensor<float> w(1, &m);
+  jtorch::Tensor<float>::randn(w, seed);
+  jtorch::Tensor<float> w_skip(1, &m_skip);
+  jtorch::Tensor<float>::randn(w_skip, seed, skip);
+  std::unique_ptr<float[]> w_cpu(new float[m]);
+  w.getData(w_cpu.get());
+  std::unique_ptr<float[]> w_skip_cpu(new float[m_skip]);
+  w_skip.getData(w_skip_cpu.get());
+  EXPECT_EQ(memcmp(w_cpu.get() + skip, w_skip_cpu.get(),
+                   sizeof(float) * m_skip),
+            0);
+}